@@ -1,12 +1,24 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stdbool.h>
+
 #include "logger.h"
 #include "screencast_common.h"
 
 struct config_screencast {
 	char *output_name;
+	char *region;
 	double max_fps;
+	double idle_fps;
+	int idle_frames;
+	bool damage_detection;
+	bool shm_hugepages;
+	int frames_in_flight;
+	bool simulcast;
+	bool convert_formats;
+	char *downscale;
+	bool apply_transform;
 	char *exec_before;
 	char *exec_after;
 	char *chooser_cmd;
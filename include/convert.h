@@ -0,0 +1,59 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define XDPW_CONVERT_MAX_PLANES 3
+
+struct xdpw_convert_plane {
+	uint8_t *data;
+	uint32_t stride;
+};
+
+// plane layout of a converted frame, all planes share one allocation
+struct xdpw_convert_layout {
+	uint32_t plane_count;
+	uint32_t stride[XDPW_CONVERT_MAX_PLANES];
+	uint32_t offset[XDPW_CONVERT_MAX_PLANES];
+	uint32_t size;
+};
+
+/*
+ * Returns true if frames of the 32 bit RGB format src_format (DRM fourcc) can
+ * be converted to dst_format. Supported targets are DRM_FORMAT_NV12 and
+ * DRM_FORMAT_YUV420 (I420), in BT.709 limited range.
+ */
+bool xdpw_convert_supported(uint32_t src_format, uint32_t dst_format);
+
+// also covers the 32 bit RGB formats with up to 10 bits per channel, as a single plane
+bool xdpw_convert_get_layout(uint32_t dst_format, uint32_t width, uint32_t height,
+	uint32_t align, struct xdpw_convert_layout *layout);
+
+/*
+ * Converts the rows y0 to y1 (exclusive) of a frame, extended to whole chroma
+ * rows. A negative src_stride reads the source bottom-up.
+ */
+bool xdpw_convert(uint32_t dst_format, const struct xdpw_convert_plane *planes,
+	uint32_t src_format, const uint8_t *src, ptrdiff_t src_stride,
+	uint32_t width, uint32_t height, uint32_t y0, uint32_t y1);
+
+/*
+ * Packs the rectangle at x, y of a frame with 10 or 16 bits per channel to
+ * the same position of dst, in the 8 bit format with the same channel order
+ * (see xdpw_format_info::pack_format).
+ */
+bool xdpw_convert_pack(uint32_t src_format, const uint8_t *src, uint32_t src_stride,
+	uint8_t *dst, uint32_t dst_stride, uint32_t x, uint32_t y,
+	uint32_t width, uint32_t height);
+
+/*
+ * The scalar kernels are the reference for the vectorized ones, which are
+ * picked at runtime if the cpu supports them. Disabling simd pins the scalar
+ * kernels.
+ */
+void xdpw_convert_set_simd(bool enabled);
+const char *xdpw_convert_impl_name(void);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef COPY_WORKER_H
+#define COPY_WORKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// a power of two, more jobs than instances are never in flight
+#define XDPW_COPY_QUEUE_SIZE 32
+
+struct xdpw_copy_job;
+
+typedef void (*xdpw_copy_job_func_t)(struct xdpw_copy_job *job);
+
+struct xdpw_copy_job {
+	xdpw_copy_job_func_t func; // runs on the worker thread
+	void *data;
+	atomic_bool busy; // the worker owns whatever the job touches
+	bool pending; // submitted, its completion wasn't handled yet
+};
+
+// single producer, single consumer ring
+struct xdpw_copy_queue {
+	struct xdpw_copy_job *jobs[XDPW_COPY_QUEUE_SIZE];
+	atomic_uint head; // advanced by the consumer
+	atomic_uint tail; // advanced by the producer
+};
+
+/*
+ * Runs the cpu copies of frames off the main thread. Jobs are passed through
+ * lock-free queues, eventfds wake up the worker and the main loop.
+ */
+struct xdpw_copy_worker {
+	pthread_t thread;
+	bool running;
+	atomic_bool quit;
+	int submit_fd;
+	int done_fd; // readable once jobs finished
+	struct xdpw_copy_queue submit;
+	struct xdpw_copy_queue done;
+	uint32_t in_flight; // main thread only
+
+	// only for waiting on a single job
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+bool xdpw_copy_worker_init(struct xdpw_copy_worker *worker);
+void xdpw_copy_worker_finish(struct xdpw_copy_worker *worker);
+
+// false if the job has to run synchronously
+bool xdpw_copy_worker_submit(struct xdpw_copy_worker *worker, struct xdpw_copy_job *job);
+// the next finished job, NULL once there are none. Read done_fd before popping.
+struct xdpw_copy_job *xdpw_copy_worker_pop_done(struct xdpw_copy_worker *worker);
+// blocks until the worker let go of the job
+void xdpw_copy_worker_wait(struct xdpw_copy_worker *worker, struct xdpw_copy_job *job);
+// waits for the job, then drops its completion
+void xdpw_copy_worker_cancel(struct xdpw_copy_worker *worker, struct xdpw_copy_job *job);
+
+#endif
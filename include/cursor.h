@@ -0,0 +1,36 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// larger differences are treated as content changes instead of a cursor
+#define XDPW_CURSOR_MAX_SIZE 256
+
+struct xdpw_cursor {
+	bool visible;
+	// top left corner of the bitmap in frame coordinates
+	int32_t x;
+	int32_t y;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format; // DRM fourcc with an alpha channel
+	uint8_t *bitmap; // tightly packed, 4 bytes per pixel
+	uint64_t hash; // identifies the bitmap content
+};
+
+void xdpw_cursor_finish(struct xdpw_cursor *cursor);
+
+/*
+ * Locates the cursor by comparing a frame captured with the cursor composited
+ * against the same frame captured without it. The pixels that differ become
+ * the opaque part of the cursor bitmap. If y_invert is set, both frames are
+ * stored bottom-up and the cursor is reported upright.
+ * Returns true if the cursor changed, false if it didn't or couldn't be
+ * determined, in which case the previous cursor is kept.
+ */
+bool xdpw_cursor_extract(struct xdpw_cursor *cursor, const uint8_t *with_cursor,
+	const uint8_t *without_cursor, uint32_t width, uint32_t height,
+	uint32_t stride, uint32_t format, bool y_invert);
+
+#endif
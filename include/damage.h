@@ -0,0 +1,28 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define XDPW_DAMAGE_RECTS_MAX 16
+
+struct xdpw_frame_damage {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct xdpw_damage {
+	struct xdpw_frame_damage rects[XDPW_DAMAGE_RECTS_MAX];
+	uint32_t count;
+};
+
+void xdpw_damage_clear(struct xdpw_damage *damage);
+bool xdpw_damage_is_empty(const struct xdpw_damage *damage);
+void xdpw_damage_set_full(struct xdpw_damage *damage, uint32_t width, uint32_t height);
+void xdpw_damage_add(struct xdpw_damage *damage, const struct xdpw_frame_damage *rect);
+void xdpw_damage_add_damage(struct xdpw_damage *damage, const struct xdpw_damage *other);
+void xdpw_damage_reduce(struct xdpw_damage *damage, uint32_t max_rects);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define XDPW_EVENT_LOOP_MAX_SOURCES 8
+
+/*
+ * Sources are dispatched in this order on every iteration, so the frame path
+ * never waits behind a burst of control plane work.
+ */
+enum xdpw_event_priority {
+	XDPW_EVENT_PRIORITY_FRAME, // wayland and pipewire, they feed the streams
+	XDPW_EVENT_PRIORITY_TIMER, // frame clocks and timeouts
+	XDPW_EVENT_PRIORITY_CONTROL, // dbus and signals
+	XDPW_EVENT_PRIORITY_COUNT,
+};
+
+struct xdpw_event_loop;
+struct xdpw_event_source;
+
+/*
+ * Dispatches one bounded batch of events. Returns a negative errno on
+ * failure, 0 once the source is drained and a positive value if events are
+ * left, which gets the source dispatched again on the next iteration.
+ */
+typedef int (*xdpw_event_dispatch_func_t)(struct xdpw_event_loop *loop,
+	struct xdpw_event_source *source);
+
+struct xdpw_event_source {
+	const char *name;
+	int fd;
+	enum xdpw_event_priority priority;
+	xdpw_event_dispatch_func_t dispatch;
+	void *data;
+	bool pending;
+
+	// dispatch time accounting
+	uint64_t dispatches;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+struct xdpw_event_loop {
+	int epoll_fd;
+	struct xdpw_event_source sources[XDPW_EVENT_LOOP_MAX_SOURCES];
+	uint32_t source_count;
+	bool quit;
+
+	// called before waiting, to flush what the dispatched events queued
+	void (*flush)(void *data);
+	void *flush_data;
+};
+
+int xdpw_event_loop_init(struct xdpw_event_loop *loop);
+void xdpw_event_loop_finish(struct xdpw_event_loop *loop);
+
+struct xdpw_event_source *xdpw_event_loop_add_fd(struct xdpw_event_loop *loop,
+	const char *name, int fd, enum xdpw_event_priority priority,
+	xdpw_event_dispatch_func_t dispatch, void *data);
+
+// returns 0 once quit is set or a source hung up, a negative errno on errors
+int xdpw_event_loop_run(struct xdpw_event_loop *loop);
+
+void xdpw_event_loop_log_stats(struct xdpw_event_loop *loop);
+
+/*
+ * The loop takes SIGINT and SIGTERM through a signalfd, forked children have
+ * to unblock them again before exec. This also undoes how the subprocesses
+ * handle SIGCHLD and SIGPIPE.
+ */
+int xdpw_event_loop_block_signals(void);
+void xdpw_event_loop_restore_signals(void);
+
+#endif
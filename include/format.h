@@ -0,0 +1,30 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+#include <spa/param/video/raw.h>
+#include <wayland-client-protocol.h>
+
+struct xdpw_format_info {
+	uint32_t drm_format; // DRM fourcc
+	enum spa_video_format pw_format; // SPA_VIDEO_FORMAT_UNKNOWN if pipewire has no equivalent
+	enum spa_video_format pw_opaque_format; // without alpha, UNKNOWN if there's no alpha
+	uint32_t bpp; // 0 for planar formats
+	uint32_t depth; // bits per color channel
+	// the 8 bit format with the same channel order, frames are packed to it
+	// for consumers which can't take deeper channels
+	uint32_t pack_format;
+};
+
+// NULL for formats we don't know, they are never offered to consumers
+const struct xdpw_format_info *xdpw_format_info_from_drm_fourcc(uint32_t format);
+
+uint32_t xdpw_bpp_from_drm_fourcc(uint32_t format);
+enum wl_shm_format xdpw_format_wl_shm_from_drm_fourcc(uint32_t format);
+uint32_t xdpw_format_drm_fourcc_from_wl_shm(enum wl_shm_format format);
+// SPA_VIDEO_FORMAT_UNKNOWN for formats pipewire can't carry
+enum spa_video_format xdpw_format_pw_from_drm_fourcc(uint32_t format);
+enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format);
+uint32_t xdpw_format_drm_fourcc_from_pw_yuv(enum spa_video_format format);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef FOURCC_H
+#define FOURCC_H
+
+// libdrm ships the fourcc codes, builds without it use the kernel's copy
+#ifdef HAVE_LIBDRM
+#include <drm_fourcc.h>
+#else
+#include <drm/drm_fourcc.h>
+#endif
+
+#endif
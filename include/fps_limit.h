@@ -1,6 +1,7 @@
 #ifndef FPS_LIMIT_H
 #define FPS_LIMIT_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -11,8 +12,27 @@ struct fps_limit_state {
 	uint64_t fps_frame_count;
 };
 
-void fps_limit_measure_start(struct fps_limit_state *state, double max_fps);
+struct fps_idle_state {
+	bool idle;
+	uint32_t undamaged_frames;
+};
+
+struct fps_decimate_state {
+	int64_t next_pts; // 0 before the first frame
+};
+
+void fps_limit_frame_start(struct fps_limit_state *state);
+
+// time until the next frame may start
+uint64_t fps_limit_frame_delay(struct fps_limit_state *state, double max_fps);
+
+double fps_idle_framerate(const struct fps_idle_state *state,
+	double max_fps, double idle_fps);
+
+double fps_idle_update(struct fps_idle_state *state, bool damaged,
+	double max_fps, double idle_fps, uint32_t idle_frames);
 
-uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps);
+// whether a frame captured at pts (ns) is sent to a consumer of max_fps
+bool fps_decimate(struct fps_decimate_state *state, int64_t pts, double max_fps);
 
 #endif
@@ -6,10 +6,21 @@
 #define XDPW_PWR_BUFFERS 4
 #define XDPW_PWR_ALIGN 16
 
+#define XDPW_CURSOR_META_SIZE(width, height) \
+	(sizeof(struct spa_meta_cursor) + sizeof(struct spa_meta_bitmap) + (width) * (height) * 4)
+
 void xdpw_pwr_trigger_process(struct xdpw_screencast_instance *cast);
 bool xdpw_pwr_is_driving(struct xdpw_screencast_instance *cast);
-void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast);
-void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast);
+void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast,
+	struct xdpw_frame *frame);
+void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast,
+	struct xdpw_frame *frame);
+void xdpw_pwr_copy_cancel(struct xdpw_screencast_instance *cast);
+void xdpw_pwr_skip_frame(struct xdpw_screencast_instance *cast,
+	struct xdpw_frame *frame);
+// keeps the buffer of a frame which isn't sent for the next capture
+void xdpw_pwr_hold_buffer(struct xdpw_screencast_instance *cast,
+	struct pw_buffer *buffer);
 void pwr_update_stream_param(struct xdpw_screencast_instance *cast);
 void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast);
 void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast);
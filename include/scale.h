@@ -0,0 +1,40 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// scratch space of a scaler, reused as long as the widths don't change
+struct xdpw_scale_state {
+	uint32_t src_width;
+	uint32_t dst_width;
+	uint32_t *x_spans; // first and last + 1 source column of every destination column
+	uint32_t *acc; // channel sums of one destination row
+};
+
+void xdpw_scale_finish(struct xdpw_scale_state *state);
+
+/*
+ * Scales a 32 bit image by averaging the source pixels that fall into every
+ * destination pixel. A negative src_stride reads the source bottom-up.
+ * Returns false if the scratch space couldn't be allocated.
+ */
+bool xdpw_scale_box(struct xdpw_scale_state *state,
+	const uint8_t *src, ptrdiff_t src_stride, uint32_t src_width, uint32_t src_height,
+	uint8_t *dst, uint32_t dst_stride, uint32_t dst_width, uint32_t dst_height);
+
+// scales only the destination rows y0 to y1 (exclusive)
+bool xdpw_scale_box_rows(struct xdpw_scale_state *state,
+	const uint8_t *src, ptrdiff_t src_stride, uint32_t src_width, uint32_t src_height,
+	uint8_t *dst, uint32_t dst_stride, uint32_t dst_width, uint32_t dst_height,
+	uint32_t y0, uint32_t y1);
+
+/*
+ * Halving both dimensions has a vectorized kernel, picked at runtime like the
+ * ones of xdpw_convert(). It computes the same result as the scalar one.
+ */
+void xdpw_scale_set_simd(bool enabled);
+const char *xdpw_scale_impl_name(void);
+
+#endif
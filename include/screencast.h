@@ -3,6 +3,28 @@
 
 #include "screencast_common.h"
 
+// Start calls are answered with an error if the stream doesn't appear in time
+#define XDPW_START_TIMEOUT_NS (5 * 1000 * 1000 * 1000ull)
+#define XDPW_START_TIMEOUT_SLACK_NS (100 * 1000 * 1000ull)
+
+struct xdpw_session;
+
+// shares a matching instance with the session or creates one
+bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *sess,
+	struct xdpw_wlr_output *out, struct xdpw_toplevel *toplevel,
+	struct xdpw_region *region, enum cursor_modes cursor_mode);
+void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
+	struct xdpw_screencast_instance *cast, struct xdpw_wlr_output *out,
+	struct xdpw_toplevel *toplevel, struct xdpw_region *region,
+	enum cursor_modes cursor_mode);
 void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast);
+/*
+ * Stops capturing and closes the sessions sharing the instance, which
+ * destroys it. Safe to call from Wayland and PipeWire callbacks, the sessions
+ * are closed from the event loop.
+ */
+void xdpw_screencast_instance_end(struct xdpw_screencast_instance *cast);
+// replies to the Start calls waiting for a node id of the instance
+void xdpw_screencast_streams_ready(struct xdpw_screencast_instance *cast);
 
 #endif
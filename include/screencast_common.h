@@ -5,12 +5,41 @@
 #include <spa/param/video/format-utils.h>
 #include <wayland-client-protocol.h>
 
+#include "copy_worker.h"
+#include "cursor.h"
+#include "damage.h"
+#include "format.h"
 #include "fps_limit.h"
+#include "scale.h"
+#include "shm_pool.h"
+#include "tile_hash.h"
+#include "timer.h"
+#include "transform.h"
+#include "udmabuf.h"
+
+struct gbm_bo;
+struct gbm_device;
 
 // this seems to be right based on
 // https://github.com/flatpak/xdg-desktop-portal/blob/309a1fc0cf2fb32cceb91dbc666d20cf0a3202c2/src/screen-cast.c#L955
 #define XDP_CAST_PROTO_VER 2
 
+#define XDPW_MAX_FRAMES_IN_FLIGHT 4
+// buffers are only dequeued with none held, so the frames in flight and the
+// one at the copy worker are all that can be held
+#define XDPW_MAX_HELD_BUFFERS (XDPW_MAX_FRAMES_IN_FLIGHT + 1)
+
+// row alignment of converted frames, suits the vectorized encoders
+#define XDPW_CONVERT_ALIGN 32
+
+// captures failing in a row are retried after a doubling delay, then given up
+#define XDPW_CAPTURE_MAX_FAILURES 10
+#define XDPW_CAPTURE_BACKOFF_NS (10 * 1000 * 1000ull)
+#define XDPW_CAPTURE_BACKOFF_MAX_NS (1000 * 1000 * 1000ull)
+
+// frame clocks of several instances may share a wakeup this close together
+#define XDPW_FRAME_TIMER_SLACK_NS (500 * 1000ull)
+
 enum cursor_modes {
   HIDDEN = 1,
   EMBEDDED = 2,
@@ -29,6 +58,11 @@ enum xdpw_chooser_types {
   XDPW_CHOOSER_DMENU,
 };
 
+enum buffer_type {
+  WL_SHM = 0,
+  DMABUF = 1,
+};
+
 enum xdpw_frame_state {
   XDPW_FRAME_STATE_NONE,
   XDPW_FRAME_STATE_RENEG,
@@ -41,30 +75,76 @@ struct xdpw_output_chooser {
 	char *cmd;
 };
 
-struct xdpw_frame_damage {
-	uint32_t x;
-	uint32_t y;
+// a rectangle in logical coordinates, an empty one stands for the whole output
+struct xdpw_region {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+struct xdpw_screencopy_frame_info {
 	uint32_t width;
 	uint32_t height;
+	uint32_t size;
+	uint32_t stride;
+	uint32_t format; // DRM fourcc
 };
 
 struct xdpw_frame {
-	uint32_t size;
-	uint32_t stride;
+	struct xdpw_screencast_instance *cast;
+	struct zwlr_screencopy_frame_v1 *wlr_frame;
+	struct ext_image_copy_capture_frame_v1 *ext_frame; // instead of wlr_frame
+	bool ext_captured; // the buffer is attached, capture was requested
+	enum xdpw_frame_state state;
 	bool y_invert;
+	bool unchanged;
+	bool cursor_changed;
 	uint64_t tv_sec;
 	uint32_t tv_nsec;
-	struct xdpw_frame_damage damage;
-	struct wl_buffer *buffer;
-	struct pw_buffer *current_pw_buffer;
+	int64_t pts; // CLOCK_MONOTONIC in ns, -1 if unknown
+	struct xdpw_damage damage;
+	struct xdpw_buffer *xdpw_buffer;
+	struct pw_buffer *pw_buffer;
+
+	// second capture with the cursor composited, see xdpw_cursor_extract()
+	struct zwlr_screencopy_frame_v1 *cursor_frame;
+	enum xdpw_frame_state cursor_state;
+	struct xdpw_screencopy_frame_info cursor_frame_info;
+	struct xdpw_buffer *cursor_buffer; // kept across frames
+
+	// capture target while only simulcast streams consume, kept across frames
+	struct xdpw_buffer *capture_buffer;
 };
 
-struct xdpw_screencopy_frame {
+struct xdpw_buffer {
+	struct wl_list link; // xdpw_screencast_instance::buffer_list
+	enum buffer_type buffer_type;
+
 	uint32_t width;
 	uint32_t height;
-	uint32_t size;
-	uint32_t stride;
-	enum wl_shm_format format;
+	uint32_t format; // DRM fourcc
+	uint64_t modifier;
+	int plane_count;
+
+	int fd[4];
+	uint32_t size[4];
+	uint32_t stride[4];
+	uint32_t offset[4];
+
+	struct gbm_bo *bo;
+	struct xdpw_shm_slot *shm_slot;
+	void *data; // mapping of shm buffers
+
+	struct wl_buffer *buffer;
+
+	// everything that changed since this buffer last held a frame
+	struct xdpw_damage damage;
+};
+
+struct xdpw_format_modifier_pair {
+	uint32_t fourcc;
+	uint64_t modifier;
 };
 
 struct xdpw_screencast_context {
@@ -80,11 +160,34 @@ struct xdpw_screencast_context {
 	struct wl_list output_list;
 	struct wl_registry *registry;
 	struct zwlr_screencopy_manager_v1 *screencopy_manager;
+	// preferred over screencopy if the compositor has both, see xdpw_wlr_ext_capture()
+	struct ext_image_copy_capture_manager_v1 *ext_copy_manager;
+	struct ext_output_image_capture_source_manager_v1 *ext_output_source_manager;
+	// windows, captured via ext-image-copy-capture only
+	struct ext_foreign_toplevel_list_v1 *foreign_toplevel_list;
+	struct ext_foreign_toplevel_image_capture_source_manager_v1 *ext_toplevel_source_manager;
+	struct wl_list toplevel_list; // struct xdpw_toplevel::link
 	struct zxdg_output_manager_v1 *xdg_output_manager;
 	struct wl_shm *shm;
+	struct xdpw_shm_pool shm_pool;
+	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+	struct wl_array format_modifier_pairs; // struct xdpw_format_modifier_pair
+
+	// dmabuf allocation
+	struct gbm_device *gbm;
+	int udmabuf_fd;
+
+	// copies frames on the cpu, off the main loop
+	struct xdpw_copy_worker copy_worker;
 
 	// sessions
 	struct wl_list screencast_instances;
+
+	// latency of Start calls until their reply
+	uint64_t start_count;
+	uint64_t start_timeouts; // replied with an error
+	uint64_t start_total_ns;
+	uint64_t start_max_ns;
 };
 
 struct xdpw_screencast_instance {
@@ -94,31 +197,92 @@ struct xdpw_screencast_instance {
 	// xdpw
 	uint32_t refcount;
 	struct xdpw_screencast_context *ctx;
+	enum source_types source_type;
 	bool initialized;
-	struct xdpw_frame current_frame;
-	enum xdpw_frame_state frame_state;
 
 	// pipewire
 	struct pw_stream *stream;
 	struct spa_hook stream_listener;
 	struct spa_video_info_raw pwr_format;
 	uint32_t seq;
+	int64_t last_pts;
+	struct spa_io_position *position; // set while the stream has a graph position
 	uint32_t node_id;
 	bool pwr_stream_state;
 	uint32_t framerate;
+	enum buffer_type buffer_type;
+	bool avoid_dmabufs;
+	uint32_t convert_format; // DRM fourcc the frames are converted to, 0 if they aren't
+	uint32_t pack_format; // 8 bit DRM fourcc deeper frames are packed to, 0 if they aren't
+	struct xdpw_buffer *pack_buffer; // packed frame, before it's turned, scaled or converted
+	bool downscaling; // frames are scaled down to pwr_format.size
+	struct xdpw_scale_state scale;
+	struct xdpw_buffer *scale_buffer; // downscaled frame, before it's converted
+	bool apply_transform; // the output transform is applied on the cpu
+	enum xdpw_transform sent_transform; // frames were last sent turned by it
+	struct xdpw_buffer *transform_buffer; // upright frame, before it's scaled or converted
+	// a frame at the copy worker, it's sent once the copy is done
+	struct xdpw_copy_job copy_job;
+	struct xdpw_frame copy_frame;
+	enum xdpw_transform copy_transform;
+	bool copy_ok;
+	struct wl_list buffer_list; // struct xdpw_buffer::link
 
 	// wlroots
-	struct zwlr_screencopy_frame_v1 *frame_callback;
+	// for windows the first output, it only gives the frame rate
 	struct xdpw_wlr_output *target_output;
+	struct xdpw_toplevel *target_toplevel; // the captured window, NULL once it's closed
+	struct xdpw_region region; // relative to target_output
+	// see xdpw_stream_size(), a factor of 0 disables downscaling
+	bool downscale_logical;
+	double downscale_factor;
 	uint32_t max_framerate;
-	struct zwlr_screencopy_frame_v1 *wlr_frame;
-	struct xdpw_screencopy_frame screencopy_frame;
-	bool with_cursor;
+	struct xdpw_screencopy_frame_info screencopy_frame_info[2];
+	enum cursor_modes cursor_mode;
 	int err;
 	bool quit;
+	// the capture can't go on, see xdpw_screencast_instance_end()
+	bool ended;
+	struct xdpw_timer end_timer;
+
+	// ext-image-copy-capture session, kept for the whole capture
+	bool ext_capture;
+	struct ext_image_capture_source_v1 *ext_source;
+	struct ext_image_copy_capture_session_v1 *ext_session;
+	bool ext_constraints_done; // screencopy_frame_info holds the session's constraints
+
+	// frames in capture order, the oldest one is frames[frame_head]
+	struct xdpw_frame frames[XDPW_MAX_FRAMES_IN_FLIGHT];
+	uint32_t frame_head;
+	uint32_t frame_count;
+	uint32_t frame_depth; // frames allowed in flight
+	// buffers of unchanged frames, captured into again before dequeuing
+	struct pw_buffer *held_buffers[XDPW_MAX_HELD_BUFFERS];
+	uint32_t held_count;
+	struct xdpw_timer frame_timer; // starts the next capture
+	bool buffer_stalled; // capturing waits for a pipewire buffer
+	uint64_t buffer_stalls;
+	uint32_t capture_failures; // in a row, see XDPW_CAPTURE_MAX_FAILURES
+	uint64_t failed_frames;
+
+	// the last frame sent intact, repeated when a capture fails
+	struct pw_buffer *last_buffer;
+	bool last_y_invert;
 
 	// fps limit
 	struct fps_limit_state fps_limit;
+	struct fps_idle_state fps_idle;
+	struct fps_decimate_state decimate; // while simulcast streams capture faster
+
+	// additional streams of the same capture
+	struct wl_list simulcast_streams; // struct xdpw_simulcast_stream::link
+
+	// software damage detection
+	struct xdpw_tile_hash_state tile_hash;
+
+	// cursor metadata
+	struct xdpw_cursor cursor;
+	bool cursor_bitmap_dirty; // the consumer doesn't have the current bitmap
 };
 
 struct xdpw_wlr_output {
@@ -129,17 +293,57 @@ struct xdpw_wlr_output {
 	char *make;
 	char *model;
 	char *name;
+	// logical position and size in the global compositor space
+	int x;
+	int y;
 	int width;
 	int height;
 	float framerate;
+	enum wl_output_transform transform;
+};
+
+struct xdpw_toplevel {
+	struct wl_list link;
+	struct xdpw_screencast_context *ctx;
+	struct ext_foreign_toplevel_handle_v1 *handle;
+	char *title;
+	char *app_id;
+	char *identifier;
+	char *label; // the line dmenu choosers show
 };
 
 void randname(char *buf);
 int anonymous_shm_open(void);
-struct wl_buffer *import_wl_shm_buffer(struct xdpw_screencast_instance *cast, int fd,
-	enum wl_shm_format fmt, int width, int height, int stride);
-enum spa_video_format xdpw_format_pw_from_wl_shm(enum wl_shm_format format);
-enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format);
+
+// NULL if no render node is usable or gbm support isn't built in
+struct gbm_device *xdpw_gbm_device_create(void);
+void xdpw_gbm_device_destroy(struct gbm_device *gbm);
+bool xdpw_dmabuf_available(struct xdpw_screencast_context *ctx);
+bool xdpw_query_dmabuf_modifiers(struct xdpw_screencast_context *ctx, uint32_t drm_format,
+	uint32_t *num_modifiers, uint64_t **modifiers);
+bool xdpw_fixate_dmabuf_modifier(struct xdpw_screencast_context *ctx, uint32_t drm_format,
+	uint32_t width, uint32_t height, const uint64_t *modifiers, uint32_t num_modifiers,
+	uint64_t *modifier);
+int xdpw_dmabuf_plane_count(struct xdpw_screencast_context *ctx, uint32_t drm_format,
+	uint64_t modifier);
+
+struct xdpw_buffer *xdpw_buffer_create(struct xdpw_screencast_instance *cast,
+	enum buffer_type buffer_type, struct xdpw_screencopy_frame_info *frame_info);
+struct xdpw_buffer *xdpw_buffer_create_converted(uint32_t width, uint32_t height,
+	uint32_t format);
+void xdpw_buffer_destroy(struct xdpw_buffer *buffer);
+
+bool xdpw_copies_frames(struct xdpw_screencast_instance *cast);
+uint32_t xdpw_copy_format(struct xdpw_screencast_instance *cast, uint32_t capture_format);
+enum xdpw_transform xdpw_source_transform(struct xdpw_screencast_instance *cast);
+void xdpw_upright_size(struct xdpw_screencast_instance *cast,
+	const struct xdpw_screencopy_frame_info *frame_info, uint32_t *width, uint32_t *height);
+void xdpw_stream_size(struct xdpw_screencast_instance *cast,
+	const struct xdpw_screencopy_frame_info *frame_info, uint32_t *width, uint32_t *height);
+
+bool xdpw_region_parse(const char *str, struct xdpw_region *region);
+bool xdpw_region_is_empty(const struct xdpw_region *region);
+bool xdpw_region_equal(const struct xdpw_region *a, const struct xdpw_region *b);
 
 enum xdpw_chooser_types get_chooser_type(const char *chooser_type);
 const char *chooser_type_str(enum xdpw_chooser_types chooser_type);
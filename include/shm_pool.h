@@ -0,0 +1,59 @@
+#ifndef SHM_POOL_H
+#define SHM_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client-protocol.h>
+
+// frames of at least 3840x2160 in 32 bit may use huge pages
+#define XDPW_SHM_HUGETLB_MIN_SIZE (3840 * 2160 * 4)
+
+struct xdpw_shm_pool;
+
+struct xdpw_shm_slot {
+	struct wl_list link; // xdpw_shm_pool::slots, ordered by offset
+	struct xdpw_shm_pool *pool;
+	size_t offset;
+	size_t size;
+	bool used;
+
+	// kept while the slot is free, so an identical buffer can reuse them
+	void *data;
+	struct wl_buffer *buffer;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format; // DRM fourcc
+};
+
+/*
+ * All shm buffers are sub-allocated from a single sealed memfd, which backs a
+ * single wl_shm_pool. Released slots keep their mapping and wl_buffer, so a
+ * renegotiation with an unchanged frame size doesn't allocate anything.
+ */
+struct xdpw_shm_pool {
+	struct wl_shm *shm;
+	bool hugepages; // allowed by the config
+	bool hugetlb; // the memfd uses huge pages
+	int fd;
+	size_t align;
+	size_t size;
+	struct wl_shm_pool *wl_pool;
+	struct wl_list slots; // struct xdpw_shm_slot::link
+};
+
+void xdpw_shm_pool_init(struct xdpw_shm_pool *pool, struct wl_shm *shm, bool hugepages);
+void xdpw_shm_pool_finish(struct xdpw_shm_pool *pool);
+
+struct xdpw_shm_slot *xdpw_shm_pool_alloc(struct xdpw_shm_pool *pool,
+	uint32_t width, uint32_t height, uint32_t stride, uint32_t format);
+void xdpw_shm_slot_release(struct xdpw_shm_slot *slot);
+
+/*
+ * Returns the memory of free slots to the system. The pool is destroyed once
+ * no slot is in use anymore.
+ */
+void xdpw_shm_pool_trim(struct xdpw_shm_pool *pool);
+
+#endif
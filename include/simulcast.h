@@ -0,0 +1,46 @@
+#ifndef SIMULCAST_H
+#define SIMULCAST_H
+
+#include "screencast_common.h"
+#include "scale.h"
+
+#define XDPW_SIMULCAST_MIN_SIZE 16
+
+struct xdpw_session;
+
+/*
+ * An additional pipewire stream fed from the capture of an instance. Every
+ * simulcast stream negotiates its own size and framerate, frames are scaled
+ * on the cpu and dropped down to the negotiated rate.
+ */
+struct xdpw_simulcast_stream {
+	struct wl_list link; // xdpw_screencast_instance::simulcast_streams
+	struct xdpw_screencast_instance *cast;
+	struct xdpw_session *sess;
+
+	struct pw_stream *stream;
+	struct spa_hook stream_listener;
+	uint32_t node_id;
+	bool streaming;
+	struct spa_video_info_raw format;
+	uint32_t framerate;
+	uint32_t seq;
+
+	struct fps_decimate_state decimate;
+	struct xdpw_scale_state scale;
+	struct xdpw_buffer *pack_buffer; // deeper frames packed to 8 bit, before they are scaled
+};
+
+bool xdpw_simulcast_enabled(struct xdpw_screencast_instance *cast);
+struct xdpw_simulcast_stream *xdpw_simulcast_stream_create(
+	struct xdpw_screencast_instance *cast, struct xdpw_session *sess);
+void xdpw_simulcast_stream_destroy(struct xdpw_simulcast_stream *sc);
+
+bool xdpw_simulcast_is_streaming(struct xdpw_screencast_instance *cast);
+// the highest framerate negotiated by a streaming simulcast stream, 0 if none
+uint32_t xdpw_simulcast_max_framerate(struct xdpw_screencast_instance *cast);
+void xdpw_simulcast_update_params(struct xdpw_screencast_instance *cast);
+void xdpw_simulcast_export(struct xdpw_screencast_instance *cast,
+	struct xdpw_frame *frame);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SUBPROCESS_H
+#define SUBPROCESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <wayland-util.h>
+
+#include "timer.h"
+
+// more output of a child is dropped
+#define XDPW_SUBPROCESS_MAX_OUTPUT (64 * 1024)
+
+struct xdpw_state;
+struct xdpw_subprocess;
+
+// called once the child exited, the subprocess is freed afterwards
+typedef void (*xdpw_subprocess_func_t)(struct xdpw_subprocess *proc, void *data);
+
+struct xdpw_subprocess_options {
+	// stdin gets the input and stdout is collected, otherwise both are inherited
+	bool pipe_stdio;
+	const char *input;
+	size_t input_len;
+	// 0 for none, the child is sent SIGTERM after it and SIGKILL if it
+	// doesn't exit shortly after
+	uint64_t timeout_ns;
+};
+
+/*
+ * A shell command running in its own process group. Its exit and its pipes
+ * are polled on the event loop, the exit through a pidfd or through SIGCHLD
+ * on kernels without pidfds.
+ */
+struct xdpw_subprocess {
+	struct xdpw_state *state;
+	struct wl_list link; // xdpw_state::subprocesses
+	pid_t pid;
+	int pidfd;
+	int stdin_fd;
+	int stdout_fd;
+
+	char *input;
+	size_t input_len;
+	size_t input_written;
+	char *output; // NUL-terminated, NULL if nothing was read
+	size_t output_len;
+
+	struct xdpw_timer timeout;
+	bool timed_out;
+	bool cancelled; // func isn't called
+	int exit_code; // -1 if the child was killed or lost
+
+	xdpw_subprocess_func_t func;
+	void *data;
+};
+
+int xdpw_subprocess_init(struct xdpw_state *state);
+void xdpw_subprocess_finish(struct xdpw_state *state);
+
+// runs command with /bin/sh -c, func may be NULL
+struct xdpw_subprocess *xdpw_subprocess_spawn(struct xdpw_state *state,
+	const char *command, const struct xdpw_subprocess_options *options,
+	xdpw_subprocess_func_t func, void *data);
+// stops the child, func isn't called anymore
+void xdpw_subprocess_cancel(struct xdpw_subprocess *proc);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef TILE_HASH_H
+#define TILE_HASH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "damage.h"
+
+#define XDPW_TILE_SIZE 64
+
+struct xdpw_tile_hash_state {
+	uint32_t width;
+	uint32_t height;
+	uint32_t tiles_x;
+	uint32_t tiles_y;
+	uint64_t *hashes;
+};
+
+void xdpw_tile_hash_finish(struct xdpw_tile_hash_state *state);
+void xdpw_tile_hash_reset(struct xdpw_tile_hash_state *state);
+
+uint64_t xdpw_tile_hash(const uint8_t *data, uint32_t stride,
+	uint32_t row_bytes, uint32_t rows);
+uint64_t xdpw_tile_hash_scalar(const uint8_t *data, uint32_t stride,
+	uint32_t row_bytes, uint32_t rows);
+
+/*
+ * Hashes all tiles of a frame and adds the tiles that differ from the
+ * previous frame to damage. The first frame, or a frame with a new size,
+ * is fully damaged. Returns false if the state couldn't be allocated.
+ */
+bool xdpw_tile_hash_damage(struct xdpw_tile_hash_state *state, const uint8_t *data,
+	uint32_t width, uint32_t height, uint32_t stride, uint32_t bpp,
+	struct xdpw_damage *damage);
+
+#endif
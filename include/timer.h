@@ -0,0 +1,38 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct xdpw_state;
+
+typedef void (*xdpw_event_loop_timer_func_t)(void *data);
+
+/*
+ * Timers are embedded in their owners. Armed ones sit in a binary min-heap by
+ * deadline, so arming, re-arming and disarming never allocate. A zeroed timer
+ * is disarmed.
+ */
+struct xdpw_timer {
+	struct xdpw_state *state;
+	xdpw_event_loop_timer_func_t func;
+	void *user_data;
+	uint64_t deadline_ns; // CLOCK_MONOTONIC
+	uint64_t slack_ns; // it may fire this late to share a wakeup with other timers
+	uint32_t heap_index; // 1-based position in xdpw_state::timer_heap, 0 while disarmed
+};
+
+/*
+ * (Re-)arms the timer to fire once, between delay_ns and delay_ns + slack_ns
+ * from now. It's disarmed again before func is called.
+ */
+bool xdpw_arm_timer(struct xdpw_state *state, struct xdpw_timer *timer,
+	uint64_t delay_ns, uint64_t slack_ns, xdpw_event_loop_timer_func_t func, void *data);
+void xdpw_disarm_timer(struct xdpw_timer *timer);
+bool xdpw_timer_is_armed(const struct xdpw_timer *timer);
+
+// fires all expired timers, called once the timerfd is readable
+void xdpw_timers_dispatch(struct xdpw_state *state);
+void xdpw_timers_finish(struct xdpw_state *state);
+
+#endif
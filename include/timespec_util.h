@@ -15,4 +15,6 @@ bool timespec_is_zero(struct timespec *t);
 
 int64_t timespec_diff_ns(struct timespec *t1, struct timespec *t2);
 
+int64_t timespec_to_ns(struct timespec *t);
+
 #endif
@@ -0,0 +1,50 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "damage.h"
+
+void xdpw_flip_y(void *data, uint32_t stride, uint32_t height);
+void xdpw_damage_scale(struct xdpw_damage *damage, uint32_t src_width, uint32_t src_height,
+	uint32_t dst_width, uint32_t dst_height);
+
+/*
+ * Shares its values with enum wl_output_transform and
+ * enum spa_meta_videotransform_value. Flipped transforms mirror around the
+ * vertical axis first, rotations are counter-clockwise.
+ */
+enum xdpw_transform {
+	XDPW_TRANSFORM_NORMAL = 0,
+	XDPW_TRANSFORM_90 = 1,
+	XDPW_TRANSFORM_180 = 2,
+	XDPW_TRANSFORM_270 = 3,
+	XDPW_TRANSFORM_FLIPPED = 4,
+	XDPW_TRANSFORM_FLIPPED_90 = 5,
+	XDPW_TRANSFORM_FLIPPED_180 = 6,
+	XDPW_TRANSFORM_FLIPPED_270 = 7,
+};
+
+// the transform applying first and then second
+enum xdpw_transform xdpw_transform_compose(enum xdpw_transform first,
+	enum xdpw_transform second);
+enum xdpw_transform xdpw_transform_invert(enum xdpw_transform transform);
+bool xdpw_transform_swaps(enum xdpw_transform transform);
+
+// width and height are the size of the image before the transform
+void xdpw_transform_rect(struct xdpw_frame_damage *rect, enum xdpw_transform transform,
+	uint32_t width, uint32_t height);
+void xdpw_damage_transform(struct xdpw_damage *damage, enum xdpw_transform transform,
+	uint32_t width, uint32_t height);
+
+/*
+ * Writes the pixels of rect of a 32 bit image to where the transform puts
+ * them in dst. Rotations are done in tiles, so neither image leaves the cache
+ * while a tile is copied.
+ */
+void xdpw_transform_image(enum xdpw_transform transform,
+	const uint8_t *src, uint32_t src_stride, uint32_t src_width, uint32_t src_height,
+	const struct xdpw_frame_damage *rect, uint8_t *dst, uint32_t dst_stride);
+
+#endif
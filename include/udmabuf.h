@@ -0,0 +1,15 @@
+#ifndef UDMABUF_H
+#define UDMABUF_H
+
+#include <stddef.h>
+
+// -1 if udmabuf isn't supported by the build or the kernel
+int xdpw_udmabuf_open(void);
+
+/*
+ * Creates a dmabuf of size bytes backed by a sealed memfd. size must be a
+ * multiple of the page size. Returns the dmabuf fd or -1.
+ */
+int xdpw_udmabuf_create(int udmabuf_fd, size_t size);
+
+#endif
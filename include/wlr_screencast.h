@@ -12,7 +12,26 @@
 
 #define XDG_OUTPUT_MANAGER_VERSION 3
 
+#define LINUX_DMABUF_VERSION 3
+
+#define EXT_COPY_MANAGER_VERSION 1
+#define EXT_OUTPUT_SOURCE_MANAGER_VERSION 1
+#define EXT_TOPLEVEL_SOURCE_MANAGER_VERSION 1
+#define FOREIGN_TOPLEVEL_LIST_VERSION 1
+
+// the user is given this long to pick an output
+#define XDPW_CHOOSER_TIMEOUT_NS (120 * 1000 * 1000 * 1000ull)
+
 struct xdpw_state;
+struct xdpw_wlr_chooser;
+
+/*
+ * Called once with the choice. output is NULL with toplevel set if a window
+ * was chosen, both are NULL if the choice was cancelled.
+ */
+typedef void (*xdpw_wlr_chooser_func_t)(struct xdpw_screencast_context *ctx,
+	struct xdpw_wlr_output *output, struct xdpw_toplevel *toplevel,
+	struct xdpw_region *region, void *data);
 
 int xdpw_wlr_screencopy_init(struct xdpw_state *state);
 void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx);
@@ -22,10 +41,20 @@ struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct wl_list *output_list
 struct xdpw_wlr_output *xdpw_wlr_output_first(struct wl_list *output_list);
 struct xdpw_wlr_output *xdpw_wlr_output_find(struct xdpw_screencast_context *ctx,
 	struct wl_output *out, uint32_t id);
-struct xdpw_wlr_output *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx);
+struct xdpw_wlr_output *xdpw_wlr_output_find_by_region(struct wl_list *output_list,
+	struct xdpw_region *region);
+// returns NULL if func was called already, the chooser is pending otherwise
+struct xdpw_wlr_chooser *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx,
+	uint32_t source_types, xdpw_wlr_chooser_func_t func, void *data);
+// func isn't called anymore
+void xdpw_wlr_chooser_cancel(struct xdpw_wlr_chooser *chooser);
 
-void xdpw_wlr_frame_finish(struct xdpw_screencast_instance *cast);
 void xdpw_wlr_frame_start(struct xdpw_screencast_instance *cast);
-void xdpw_wlr_register_cb(struct xdpw_screencast_instance *cast);
+void xdpw_wlr_frames_destroy(struct xdpw_screencast_instance *cast);
+// sends the frames held back while a frame was at the copy worker
+void xdpw_wlr_frames_resume(struct xdpw_screencast_instance *cast);
+bool xdpw_wlr_ext_capture(struct xdpw_screencast_context *ctx,
+	enum cursor_modes cursor_mode, const struct xdpw_region *region);
+void xdpw_wlr_session_destroy(struct xdpw_screencast_instance *cast);
 
 #endif
@@ -12,8 +12,13 @@
 
 #include "screencast_common.h"
 #include "config.h"
+#include "timer.h"
+
+struct xdpw_event_loop;
+struct xdpw_wlr_chooser;
 
 struct xdpw_state {
+	struct xdpw_event_loop *event_loop;
 	struct wl_list xdpw_sessions;
 	sd_bus *bus;
 	struct wl_display *wl_display;
@@ -24,8 +29,14 @@ struct xdpw_state {
 	uint32_t screencast_version;
 	struct xdpw_config *config;
 	int timer_poll_fd;
-	struct wl_list timers;
-	struct xdpw_timer *next_timer;
+	struct xdpw_timer **timer_heap; // armed timers, see timer.h
+	uint32_t timer_count;
+	uint32_t timer_capacity;
+	uint64_t timer_wakeup_ns; // the timerfd expiry, 0 while it's disarmed
+	bool timers_dispatching;
+	int subprocess_epoll_fd; // pidfds and pipes of the children
+	int subprocess_sigchld_fd; // without pidfds
+	struct wl_list subprocesses;
 };
 
 struct xdpw_request {
@@ -37,16 +48,17 @@ struct xdpw_session {
 	sd_bus_slot *slot;
 	char *session_handle;
 	struct xdpw_screencast_instance *screencast_instance;
-};
+	struct xdpw_simulcast_stream *simulcast_stream;
 
-typedef void (*xdpw_event_loop_timer_func_t)(void *data);
+	// a SelectSources call waiting for the output chooser
+	sd_bus_message *select_msg;
+	struct xdpw_wlr_chooser *chooser;
+	enum cursor_modes select_cursor_mode;
 
-struct xdpw_timer {
-	struct xdpw_state *state;
-	xdpw_event_loop_timer_func_t func;
-	void *user_data;
-	struct timespec at;
-	struct wl_list link; // xdpw_state::timers
+	// a Start call waiting for the node id of its stream
+	sd_bus_message *start_msg;
+	struct xdpw_timer start_timer;
+	struct timespec start_time;
 };
 
 enum {
@@ -63,10 +75,6 @@ void xdpw_request_destroy(struct xdpw_request *req);
 
 struct xdpw_session *xdpw_session_create(struct xdpw_state *state, sd_bus *bus, char *object_path);
 void xdpw_session_destroy(struct xdpw_session *req);
-
-struct xdpw_timer *xdpw_add_timer(struct xdpw_state *state,
-	uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data);
-
-void xdpw_destroy_timer(struct xdpw_timer *timer);
+void xdpw_session_close(struct xdpw_session *sess);
 
 #endif
@@ -11,7 +11,17 @@
 
 void print_config(enum LOGLEVEL loglevel, struct xdpw_config *config) {
 	logprint(loglevel, "config: outputname:  %s", config->screencast_conf.output_name);
+	logprint(loglevel, "config: region:  %s", config->screencast_conf.region);
 	logprint(loglevel, "config: max_fps:  %f", config->screencast_conf.max_fps);
+	logprint(loglevel, "config: idle_fps:  %f", config->screencast_conf.idle_fps);
+	logprint(loglevel, "config: idle_frames:  %d", config->screencast_conf.idle_frames);
+	logprint(loglevel, "config: damage_detection:  %d", config->screencast_conf.damage_detection);
+	logprint(loglevel, "config: shm_hugepages:  %d", config->screencast_conf.shm_hugepages);
+	logprint(loglevel, "config: frames_in_flight:  %d", config->screencast_conf.frames_in_flight);
+	logprint(loglevel, "config: simulcast:  %d", config->screencast_conf.simulcast);
+	logprint(loglevel, "config: convert_formats:  %d", config->screencast_conf.convert_formats);
+	logprint(loglevel, "config: downscale:  %s", config->screencast_conf.downscale);
+	logprint(loglevel, "config: apply_transform:  %d", config->screencast_conf.apply_transform);
 	logprint(loglevel, "config: exec_before:  %s", config->screencast_conf.exec_before);
 	logprint(loglevel, "config: exec_after:  %s", config->screencast_conf.exec_after);
 	logprint(loglevel, "config: chooser_cmd: %s", config->screencast_conf.chooser_cmd);
@@ -25,6 +35,8 @@ void finish_config(struct xdpw_config *config) {
 
 	// screencast
 	free(config->screencast_conf.output_name);
+	free(config->screencast_conf.region);
+	free(config->screencast_conf.downscale);
 	free(config->screencast_conf.exec_before);
 	free(config->screencast_conf.exec_after);
 	free(config->screencast_conf.chooser_cmd);
@@ -47,11 +59,53 @@ static void parse_double(double *dest, const char* value) {
 	*dest = strtod(value, (char**)NULL);
 }
 
+static void parse_int(int *dest, const char* value) {
+	if (value == NULL || *value == '\0') {
+		logprint(TRACE, "config: skipping empty value in config file");
+		return;
+	}
+	*dest = strtol(value, (char**)NULL, 10);
+}
+
+static void parse_bool(bool *dest, const char* value) {
+	if (value == NULL || *value == '\0') {
+		logprint(TRACE, "config: skipping empty value in config file");
+		return;
+	}
+	if (strcmp(value, "1") == 0 || strcmp(value, "true") == 0 || strcmp(value, "yes") == 0) {
+		*dest = true;
+	} else if (strcmp(value, "0") == 0 || strcmp(value, "false") == 0 || strcmp(value, "no") == 0) {
+		*dest = false;
+	} else {
+		logprint(ERROR, "config: invalid boolean value %s", value);
+	}
+}
+
 static int handle_ini_screencast(struct config_screencast *screencast_conf, const char *key, const char *value) {
 	if (strcmp(key, "output_name") == 0) {
 		parse_string(&screencast_conf->output_name, value);
+	} else if (strcmp(key, "region") == 0) {
+		parse_string(&screencast_conf->region, value);
 	} else if (strcmp(key, "max_fps") == 0) {
 		parse_double(&screencast_conf->max_fps, value);
+	} else if (strcmp(key, "idle_fps") == 0) {
+		parse_double(&screencast_conf->idle_fps, value);
+	} else if (strcmp(key, "idle_frames") == 0) {
+		parse_int(&screencast_conf->idle_frames, value);
+	} else if (strcmp(key, "damage_detection") == 0) {
+		parse_bool(&screencast_conf->damage_detection, value);
+	} else if (strcmp(key, "shm_hugepages") == 0) {
+		parse_bool(&screencast_conf->shm_hugepages, value);
+	} else if (strcmp(key, "frames_in_flight") == 0) {
+		parse_int(&screencast_conf->frames_in_flight, value);
+	} else if (strcmp(key, "simulcast") == 0) {
+		parse_bool(&screencast_conf->simulcast, value);
+	} else if (strcmp(key, "convert_formats") == 0) {
+		parse_bool(&screencast_conf->convert_formats, value);
+	} else if (strcmp(key, "downscale") == 0) {
+		parse_string(&screencast_conf->downscale, value);
+	} else if (strcmp(key, "apply_transform") == 0) {
+		parse_bool(&screencast_conf->apply_transform, value);
 	} else if (strcmp(key, "exec_before") == 0) {
 		parse_string(&screencast_conf->exec_before, value);
 	} else if (strcmp(key, "exec_after") == 0) {
@@ -84,6 +138,9 @@ static int handle_ini_config(void *data, const char* section, const char *key, c
 
 static void default_config(struct xdpw_config *config) {
 	config->screencast_conf.max_fps = 0;
+	config->screencast_conf.idle_fps = 0;
+	config->screencast_conf.idle_frames = 30;
+	config->screencast_conf.frames_in_flight = 1;
 	config->screencast_conf.chooser_type = XDPW_CHOOSER_DEFAULT;
 }
 
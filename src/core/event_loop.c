@@ -0,0 +1,191 @@
+#include "event_loop.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "timespec_util.h"
+
+#define EVENT_LOOP_MAX_EVENTS XDPW_EVENT_LOOP_MAX_SOURCES
+
+// dispatches slower than this stall the frame path, they are logged
+#define EVENT_LOOP_SLOW_DISPATCH_NS (4 * 1000 * 1000)
+
+int xdpw_event_loop_init(struct xdpw_event_loop *loop) {
+	*loop = (struct xdpw_event_loop){0};
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		logprint(ERROR, "event-loop: failed to create epoll instance: %s", strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+void xdpw_event_loop_finish(struct xdpw_event_loop *loop) {
+	if (loop->epoll_fd >= 0) {
+		close(loop->epoll_fd);
+		loop->epoll_fd = -1;
+	}
+}
+
+struct xdpw_event_source *xdpw_event_loop_add_fd(struct xdpw_event_loop *loop,
+		const char *name, int fd, enum xdpw_event_priority priority,
+		xdpw_event_dispatch_func_t dispatch, void *data) {
+	if (loop->source_count >= XDPW_EVENT_LOOP_MAX_SOURCES) {
+		logprint(ERROR, "event-loop: too many sources, can't add %s", name);
+		return NULL;
+	}
+	if (fd < 0) {
+		logprint(ERROR, "event-loop: invalid fd for %s", name);
+		return NULL;
+	}
+
+	struct xdpw_event_source *source = &loop->sources[loop->source_count];
+	*source = (struct xdpw_event_source){
+		.name = name,
+		.fd = fd,
+		.priority = priority,
+		.dispatch = dispatch,
+		.data = data,
+	};
+
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = source,
+	};
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		logprint(ERROR, "event-loop: failed to add %s: %s", name, strerror(errno));
+		return NULL;
+	}
+
+	loop->source_count++;
+	return source;
+}
+
+static int dispatch_source(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int ret = source->dispatch(loop, source);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t elapsed = timespec_diff_ns(&end, &start);
+	source->dispatches++;
+	source->total_ns += elapsed;
+	if (elapsed > source->max_ns) {
+		source->max_ns = elapsed;
+	}
+	if (elapsed > EVENT_LOOP_SLOW_DISPATCH_NS) {
+		logprint(DEBUG, "event-loop: dispatching %s took %"PRIu64" us",
+			source->name, elapsed / 1000);
+	}
+
+	source->pending = ret > 0;
+	return ret;
+}
+
+static bool loop_has_pending(struct xdpw_event_loop *loop) {
+	for (uint32_t i = 0; i < loop->source_count; i++) {
+		if (loop->sources[i].pending) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int xdpw_event_loop_run(struct xdpw_event_loop *loop) {
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+	while (!loop->quit) {
+		if (loop->flush) {
+			loop->flush(loop->flush_data);
+		}
+
+		// sources with events left after their batch must not wait for the fd
+		int timeout = loop_has_pending(loop) ? 0 : -1;
+		int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			logprint(ERROR, "event-loop: epoll_wait failed: %s", strerror(errno));
+			return -errno;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct xdpw_event_source *source = events[i].data.ptr;
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+				logprint(INFO, "event-loop: disconnected from %s", source->name);
+				return 0;
+			}
+			logprint(TRACE, "event-loop: got %s event", source->name);
+			source->pending = true;
+		}
+
+		for (int prio = 0; prio < XDPW_EVENT_PRIORITY_COUNT && !loop->quit; prio++) {
+			for (uint32_t i = 0; i < loop->source_count; i++) {
+				struct xdpw_event_source *source = &loop->sources[i];
+				if (source->priority != (enum xdpw_event_priority)prio || !source->pending) {
+					continue;
+				}
+				int ret = dispatch_source(loop, source);
+				if (ret < 0) {
+					logprint(ERROR, "event-loop: failed to dispatch %s: %s",
+						source->name, strerror(-ret));
+					return ret;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+void xdpw_event_loop_log_stats(struct xdpw_event_loop *loop) {
+	for (uint32_t i = 0; i < loop->source_count; i++) {
+		struct xdpw_event_source *source = &loop->sources[i];
+		uint64_t avg_ns = source->dispatches ? source->total_ns / source->dispatches : 0;
+		logprint(DEBUG, "event-loop: %s: %"PRIu64" dispatches, %"PRIu64" ms total, "
+			"%"PRIu64" us avg, %"PRIu64" us max", source->name, source->dispatches,
+			source->total_ns / 1000000, avg_ns / 1000, source->max_ns / 1000);
+	}
+}
+
+static void get_signal_mask(sigset_t *mask) {
+	sigemptyset(mask);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+}
+
+int xdpw_event_loop_block_signals(void) {
+	sigset_t mask;
+	get_signal_mask(&mask);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		logprint(ERROR, "event-loop: failed to block signals: %s", strerror(errno));
+		return -errno;
+	}
+
+	int fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (fd < 0) {
+		logprint(ERROR, "event-loop: failed to create signalfd: %s", strerror(errno));
+		int ret = -errno;
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		return ret;
+	}
+	return fd;
+}
+
+void xdpw_event_loop_restore_signals(void) {
+	sigset_t mask;
+	get_signal_mask(&mask);
+	// taken by the subprocesses, see subprocess.c
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	signal(SIGPIPE, SIG_DFL);
+}
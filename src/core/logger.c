@@ -63,13 +63,16 @@ void logprint(enum LOGLEVEL level, char *msg, ...) {
 
 	char timestr[200];
 	time_t t = time(NULL);
-	struct tm *tmp = localtime(&t);
+	struct tm tm;
+	localtime_r(&t, &tm);
 
-	if (strftime(timestr, sizeof(timestr), "%Y/%m/%d %H:%M:%S", tmp) == 0) {
+	if (strftime(timestr, sizeof(timestr), "%Y/%m/%d %H:%M:%S", &tm) == 0) {
 		fprintf(stderr, "strftime returned 0");
 		abort();
 	}
 
+	// the copy worker logs too, keep lines whole
+	flockfile(logprops.dst);
 	fprintf(logprops.dst, "%s", timestr);
 	fprintf(logprops.dst, " ");
 	fprintf(logprops.dst, "[%s]", print_loglevel(level));
@@ -82,4 +85,5 @@ void logprint(enum LOGLEVEL level, char *msg, ...) {
 
 	fprintf(logprops.dst, "\n");
 	fflush(logprops.dst);
+	funlockfile(logprops.dst);
 }
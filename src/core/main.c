@@ -1,22 +1,20 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <getopt.h>
-#include <poll.h>
 #include <pipewire/pipewire.h>
 #include <spa/utils/result.h>
 #include <unistd.h>
 
 #include "xdpw.h"
+#include "event_loop.h"
 #include "logger.h"
+#include "subprocess.h"
 
-enum event_loop_fd {
-	EVENT_LOOP_DBUS,
-	EVENT_LOOP_WAYLAND,
-	EVENT_LOOP_PIPEWIRE,
-	EVENT_LOOP_TIMER,
-};
+// dbus messages handled before the frame path gets polled again
+#define DBUS_BATCH_SIZE 16
 
 static const char service_name[] = "org.freedesktop.impl.portal.desktop.wlr";
 
@@ -42,6 +40,66 @@ static int handle_name_lost(sd_bus_message *m, void *userdata, sd_bus_error *ret
 	return 1;
 }
 
+static int dispatch_dbus(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct xdpw_state *state = source->data;
+	for (int i = 0; i < DBUS_BATCH_SIZE; i++) {
+		int ret = sd_bus_process(state->bus, NULL);
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+	return 1;
+}
+
+static int dispatch_wayland(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct xdpw_state *state = source->data;
+	if (wl_display_dispatch(state->wl_display) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int dispatch_pipewire(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct xdpw_state *state = source->data;
+	int ret = pw_loop_iterate(state->pw_loop, 0);
+	return ret < 0 ? ret : 0;
+}
+
+static int dispatch_timer(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct xdpw_state *state = source->data;
+	uint64_t expirations;
+	ssize_t n = read(source->fd, &expirations, sizeof(expirations));
+	if (n < 0 && errno != EAGAIN) {
+		return -errno;
+	}
+
+	// also when the timerfd was rearmed since it was polled, nothing is due then
+	xdpw_timers_dispatch(state);
+	return 0;
+}
+
+static int dispatch_signal(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct signalfd_siginfo info;
+	ssize_t n = read(source->fd, &info, sizeof(info));
+	if (n < 0) {
+		return errno == EAGAIN ? 0 : -errno;
+	}
+	logprint(INFO, "event-loop: got signal %u, exiting", info.ssi_signo);
+	loop->quit = true;
+	return 0;
+}
+
+static void flush_state(void *data) {
+	struct xdpw_state *state = data;
+	int ret;
+	do {
+		ret = wl_display_dispatch_pending(state->wl_display);
+		wl_display_flush(state->wl_display);
+	} while (ret > 0);
+
+	sd_bus_flush(state->bus);
+}
+
 int main(int argc, char *argv[]) {
 	struct xdpw_config config = {0};
 	char *configfile = NULL;
@@ -112,17 +170,58 @@ int main(int argc, char *argv[]) {
 	}
 	logprint(DEBUG, "pipewire: pw_loop created");
 
+	// sources are added by the modules too, see xdpw_state::event_loop
+	struct xdpw_event_loop loop = { .epoll_fd = -1 };
+	int signal_fd = -1;
 	struct xdpw_state state = {
 		.bus = bus,
 		.wl_display = wl_display,
 		.pw_loop = pw_loop,
 		.screencast_source_types = MONITOR,
-		.screencast_cursor_modes = HIDDEN | EMBEDDED,
+		.screencast_cursor_modes = HIDDEN | EMBEDDED | METADATA,
 		.screencast_version = XDP_CAST_PROTO_VER,
 		.config = &config,
+		.subprocess_epoll_fd = -1,
+		.subprocess_sigchld_fd = -1,
 	};
 
 	wl_list_init(&state.xdpw_sessions);
+	wl_list_init(&state.subprocesses);
+
+	state.timer_poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (state.timer_poll_fd < 0) {
+		logprint(ERROR, "event-loop: failed to create timer: %s", strerror(errno));
+		goto error;
+	}
+
+	signal_fd = xdpw_event_loop_block_signals();
+	if (signal_fd < 0) {
+		goto error;
+	}
+
+	if (xdpw_event_loop_init(&loop) < 0) {
+		goto error;
+	}
+	loop.flush = flush_state;
+	loop.flush_data = &state;
+	state.event_loop = &loop;
+
+	if (!xdpw_event_loop_add_fd(&loop, "wayland", wl_display_get_fd(state.wl_display),
+				XDPW_EVENT_PRIORITY_FRAME, dispatch_wayland, &state) ||
+			!xdpw_event_loop_add_fd(&loop, "pipewire", pw_loop_get_fd(state.pw_loop),
+				XDPW_EVENT_PRIORITY_FRAME, dispatch_pipewire, &state) ||
+			!xdpw_event_loop_add_fd(&loop, "timer", state.timer_poll_fd,
+				XDPW_EVENT_PRIORITY_TIMER, dispatch_timer, &state) ||
+			!xdpw_event_loop_add_fd(&loop, "dbus", sd_bus_get_fd(state.bus),
+				XDPW_EVENT_PRIORITY_CONTROL, dispatch_dbus, &state) ||
+			!xdpw_event_loop_add_fd(&loop, "signal", signal_fd,
+				XDPW_EVENT_PRIORITY_CONTROL, dispatch_signal, &state)) {
+		goto error;
+	}
+
+	if (xdpw_subprocess_init(&state) < 0) {
+		goto error;
+	}
 
 	xdpw_screenshot_init(&state);
 	ret = xdpw_screencast_init(&state);
@@ -166,114 +265,36 @@ int main(int argc, char *argv[]) {
 		goto error;
 	}
 
-	wl_list_init(&state.timers);
-
-	struct pollfd pollfds[] = {
-		[EVENT_LOOP_DBUS] = {
-			.fd = sd_bus_get_fd(state.bus),
-			.events = POLLIN,
-		},
-		[EVENT_LOOP_WAYLAND] = {
-			.fd = wl_display_get_fd(state.wl_display),
-			.events = POLLIN,
-		},
-		[EVENT_LOOP_PIPEWIRE] = {
-			.fd = pw_loop_get_fd(state.pw_loop),
-			.events = POLLIN,
-		},
-		[EVENT_LOOP_TIMER] = {
-			.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC),
-			.events = POLLIN,
-		}
-	};
-
-	state.timer_poll_fd = pollfds[EVENT_LOOP_TIMER].fd;
-
-	while (1) {
-		ret = poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), -1);
-		if (ret < 0) {
-			logprint(ERROR, "poll failed: %s", strerror(errno));
-			goto error;
-		}
-
-		if (pollfds[EVENT_LOOP_DBUS].revents & POLLHUP) {
-			logprint(INFO, "event-loop: disconnected from dbus");
-			break;
-		}
-		if (pollfds[EVENT_LOOP_WAYLAND].revents & POLLHUP) {
-			logprint(INFO, "event-loop: disconnected from wayland");
-			break;
-		}
-		if (pollfds[EVENT_LOOP_PIPEWIRE].revents & POLLHUP) {
-			logprint(INFO, "event-loop: disconnected from pipewire");
-			break;
-		}
-
-		if (pollfds[EVENT_LOOP_DBUS].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got dbus event");
-			do {
-				ret = sd_bus_process(state.bus, NULL);
-			} while (ret > 0);
-			if (ret < 0) {
-				logprint(ERROR, "sd_bus_process failed: %s", strerror(-ret));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_WAYLAND].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got wayland event");
-			ret = wl_display_dispatch(state.wl_display);
-			if (ret < 0) {
-				logprint(ERROR, "wl_display_dispatch failed: %s", strerror(errno));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_PIPEWIRE].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got pipewire event");
-			ret = pw_loop_iterate(state.pw_loop, 0);
-			if (ret < 0) {
-				logprint(ERROR, "pw_loop_iterate failed: %s", spa_strerror(ret));
-				goto error;
-			}
-		}
-
-		if (pollfds[EVENT_LOOP_TIMER].revents & POLLIN) {
-			logprint(TRACE, "event-loop: got a timer event");
-
-			int timer_fd = pollfds[EVENT_LOOP_TIMER].fd;
-			uint64_t expirations;
-			ssize_t n = read(timer_fd, &expirations, sizeof(expirations));
-			if (n < 0) {
-				logprint(ERROR, "failed to read from timer FD\n");
-				goto error;
-			}
-
-			struct xdpw_timer *timer = state.next_timer;
-			if (timer != NULL) {
-				xdpw_event_loop_timer_func_t func = timer->func;
-				void *user_data = timer->user_data;
-				xdpw_destroy_timer(timer);
-
-				func(user_data);
-			}
-		}
-
-		do {
-			ret = wl_display_dispatch_pending(state.wl_display);
-			wl_display_flush(state.wl_display);
-		} while (ret > 0);
-
-		sd_bus_flush(state.bus);
+	ret = xdpw_event_loop_run(&loop);
+	xdpw_event_loop_log_stats(&loop);
+	if (ret < 0) {
+		goto error;
 	}
 
 	// TODO: cleanup
+	xdpw_subprocess_finish(&state);
+	xdpw_timers_finish(&state);
+	xdpw_event_loop_finish(&loop);
+	close(signal_fd);
+	close(state.timer_poll_fd);
 	finish_config(&config);
 	free(configfile);
 
 	return EXIT_SUCCESS;
 
 error:
+	// children are killed and hooks released like on a normal exit
+	xdpw_subprocess_finish(&state);
+	xdpw_timers_finish(&state);
+	xdpw_event_loop_finish(&loop);
+	if (signal_fd >= 0) {
+		close(signal_fd);
+	}
+	if (state.timer_poll_fd >= 0) {
+		close(state.timer_poll_fd);
+	}
+	finish_config(&config);
+	free(configfile);
 	sd_bus_unref(bus);
 	pw_loop_leave(state.pw_loop);
 	pw_loop_destroy(state.pw_loop);
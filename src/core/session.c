@@ -5,6 +5,8 @@
 #include <assert.h>
 #include "xdpw.h"
 #include "screencast.h"
+#include "wlr_screencast.h"
+#include "simulcast.h"
 #include "logger.h"
 
 static const char interface_name[] = "org.freedesktop.impl.portal.Session";
@@ -36,6 +38,7 @@ static int method_close(sd_bus_message *msg, void *data,
 static const sd_bus_vtable session_vtable[] = {
 	SD_BUS_VTABLE_START(0),
 	SD_BUS_METHOD("Close", "", "", method_close, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_SIGNAL("Closed", "", 0),
 	SD_BUS_VTABLE_END
 };
 
@@ -61,6 +64,21 @@ void xdpw_session_destroy(struct xdpw_session *sess) {
 	if (!sess) {
 		return;
 	}
+	if (sess->chooser) {
+		xdpw_wlr_chooser_cancel(sess->chooser);
+	}
+	if (sess->select_msg) {
+		sd_bus_message_unref(sess->select_msg);
+	}
+	if (sess->start_msg) {
+		// the portal gave up on the Start call
+		sd_bus_message_unref(sess->start_msg);
+	}
+	xdpw_disarm_timer(&sess->start_timer);
+	if (sess->simulcast_stream) {
+		xdpw_simulcast_stream_destroy(sess->simulcast_stream);
+	}
+
 	struct xdpw_screencast_instance *cast = sess->screencast_instance;
 	if (cast) {
 		assert(cast->refcount > 0);
@@ -68,7 +86,8 @@ void xdpw_session_destroy(struct xdpw_session *sess) {
 		logprint(DEBUG, "xdpw: screencast instance %p now has %d references",
 			cast, cast->refcount);
 		if (cast->refcount < 1) {
-			cast->quit = true;
+			// frames might never complete, e.g. with the stream paused
+			xdpw_screencast_instance_end(cast);
 		}
 	}
 
@@ -77,3 +96,14 @@ void xdpw_session_destroy(struct xdpw_session *sess) {
 	free(sess->session_handle);
 	free(sess);
 }
+
+// ends the session from our side, the portal is told with the Closed signal
+void xdpw_session_close(struct xdpw_session *sess) {
+	logprint(INFO, "dbus: closing session %s", sess->session_handle);
+	int ret = sd_bus_emit_signal(sd_bus_slot_get_bus(sess->slot), sess->session_handle,
+		interface_name, "Closed", NULL);
+	if (ret < 0) {
+		logprint(ERROR, "dbus: failed to emit Closed: %s", strerror(-ret));
+	}
+	xdpw_session_destroy(sess);
+}
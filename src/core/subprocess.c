@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include "subprocess.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "xdpw.h"
+#include "event_loop.h"
+#include "logger.h"
+
+#define SUBPROCESS_MAX_EVENTS 16
+#define SUBPROCESS_TIMEOUT_SLACK_NS (100 * 1000 * 1000ull)
+// time a stopped child gets before it's killed
+#define SUBPROCESS_KILL_GRACE_NS (2 * 1000 * 1000 * 1000ull)
+
+static int subprocess_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void subprocess_watch(struct xdpw_state *state, int fd, uint32_t events) {
+	struct epoll_event event = {
+		.events = events,
+		.data.fd = fd,
+	};
+	if (epoll_ctl(state->subprocess_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		logprint(ERROR, "subprocess: failed to poll fd %d: %s", fd, strerror(errno));
+	}
+}
+
+static void subprocess_close_fd(struct xdpw_subprocess *proc, int *fd) {
+	if (*fd < 0) {
+		return;
+	}
+	epoll_ctl(proc->state->subprocess_epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+	close(*fd);
+	*fd = -1;
+}
+
+static void subprocess_kill(struct xdpw_subprocess *proc, int sig) {
+	if (kill(-proc->pid, sig) < 0) {
+		kill(proc->pid, sig);
+	}
+}
+
+static void subprocess_destroy(struct xdpw_subprocess *proc) {
+	xdpw_disarm_timer(&proc->timeout);
+	subprocess_close_fd(proc, &proc->pidfd);
+	subprocess_close_fd(proc, &proc->stdin_fd);
+	subprocess_close_fd(proc, &proc->stdout_fd);
+	wl_list_remove(&proc->link);
+	free(proc->input);
+	free(proc->output);
+	free(proc);
+}
+
+static void subprocess_write_input(struct xdpw_subprocess *proc) {
+	while (proc->input_written < proc->input_len) {
+		ssize_t n = write(proc->stdin_fd, proc->input + proc->input_written,
+			proc->input_len - proc->input_written);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				// the rest is written once the pipe is writable
+				return;
+			}
+			logprint(DEBUG, "subprocess: failed to write to %d: %s",
+				proc->pid, strerror(errno));
+			break;
+		}
+		proc->input_written += n;
+	}
+	// the child sees the end of its input
+	subprocess_close_fd(proc, &proc->stdin_fd);
+}
+
+static void subprocess_read_output(struct xdpw_subprocess *proc) {
+	char buf[4096];
+	while (true) {
+		ssize_t n = read(proc->stdout_fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return;
+			}
+			logprint(DEBUG, "subprocess: failed to read from %d: %s",
+				proc->pid, strerror(errno));
+			break;
+		} else if (n == 0) {
+			break;
+		}
+
+		size_t len = MIN((size_t)n, XDPW_SUBPROCESS_MAX_OUTPUT - proc->output_len);
+		if (len == 0) {
+			continue;
+		}
+		char *output = realloc(proc->output, proc->output_len + len + 1);
+		if (output == NULL) {
+			logprint(ERROR, "subprocess: output allocation failed");
+			continue;
+		}
+		memcpy(output + proc->output_len, buf, len);
+		proc->output = output;
+		proc->output_len += len;
+		proc->output[proc->output_len] = '\0';
+	}
+	subprocess_close_fd(proc, &proc->stdout_fd);
+}
+
+static void subprocess_poll(struct xdpw_subprocess *proc) {
+	if (proc->stdin_fd >= 0) {
+		subprocess_write_input(proc);
+	}
+	if (proc->stdout_fd >= 0) {
+		subprocess_read_output(proc);
+	}
+
+	int status;
+	pid_t ret = waitpid(proc->pid, &status, WNOHANG);
+	if (ret == 0) {
+		return;
+	} else if (ret < 0) {
+		logprint(ERROR, "subprocess: failed to wait for %d: %s", proc->pid, strerror(errno));
+		proc->exit_code = -1;
+	} else {
+		proc->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+	logprint(DEBUG, "subprocess: %d exited with %d", proc->pid, proc->exit_code);
+
+	// what it wrote before exiting is in the pipe already, don't wait for
+	// children it left behind
+	if (proc->stdout_fd >= 0) {
+		subprocess_read_output(proc);
+	}
+
+	if (proc->func && !proc->cancelled) {
+		proc->func(proc, proc->data);
+	}
+	subprocess_destroy(proc);
+}
+
+static int dispatch_subprocesses(struct xdpw_event_loop *loop, struct xdpw_event_source *source) {
+	struct xdpw_state *state = source->data;
+	struct epoll_event events[SUBPROCESS_MAX_EVENTS];
+	int n = epoll_wait(state->subprocess_epoll_fd, events, SUBPROCESS_MAX_EVENTS, 0);
+	if (n < 0) {
+		return errno == EINTR ? 1 : -errno;
+	}
+
+	if (state->subprocess_sigchld_fd >= 0) {
+		struct signalfd_siginfo info;
+		while (read(state->subprocess_sigchld_fd, &info, sizeof(info)) > 0) {
+			// SIGCHLDs coalesce, all children are checked anyway
+		}
+	}
+
+	// there are only a few children, polling all of them is cheaper than
+	// telling apart which fd woke up which one
+	struct xdpw_subprocess *proc, *tmp;
+	wl_list_for_each_safe(proc, tmp, &state->subprocesses, link) {
+		subprocess_poll(proc);
+	}
+	return 0;
+}
+
+static void subprocess_handle_grace(void *data) {
+	struct xdpw_subprocess *proc = data;
+	logprint(ERROR, "subprocess: %d ignored SIGTERM, killing it", proc->pid);
+	subprocess_kill(proc, SIGKILL);
+}
+
+// sends SIGTERM, and SIGKILL if the child is still around after a grace period
+static void subprocess_stop(struct xdpw_subprocess *proc) {
+	subprocess_kill(proc, SIGTERM);
+	xdpw_arm_timer(proc->state, &proc->timeout, SUBPROCESS_KILL_GRACE_NS,
+		SUBPROCESS_TIMEOUT_SLACK_NS, subprocess_handle_grace, proc);
+}
+
+static void subprocess_handle_timeout(void *data) {
+	struct xdpw_subprocess *proc = data;
+	logprint(ERROR, "subprocess: %d timed out, stopping it", proc->pid);
+	proc->timed_out = true;
+	subprocess_stop(proc);
+}
+
+struct xdpw_subprocess *xdpw_subprocess_spawn(struct xdpw_state *state,
+		const char *command, const struct xdpw_subprocess_options *options,
+		xdpw_subprocess_func_t func, void *data) {
+	struct xdpw_subprocess *proc = calloc(1, sizeof(*proc));
+	if (proc == NULL) {
+		logprint(ERROR, "subprocess: allocation failed");
+		return NULL;
+	}
+	proc->state = state;
+	proc->pidfd = -1;
+	proc->stdin_fd = -1;
+	proc->stdout_fd = -1;
+	proc->func = func;
+	proc->data = data;
+
+	int in[2] = {-1, -1}; // parent -> child
+	int out[2] = {-1, -1}; // child -> parent
+	if (options->pipe_stdio) {
+		if (options->input_len > 0) {
+			proc->input = malloc(options->input_len);
+			if (proc->input == NULL) {
+				logprint(ERROR, "subprocess: allocation failed");
+				goto error;
+			}
+			memcpy(proc->input, options->input, options->input_len);
+			proc->input_len = options->input_len;
+		}
+		if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0) {
+			logprint(ERROR, "subprocess: failed to create pipe: %s", strerror(errno));
+			goto error;
+		}
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		logprint(ERROR, "subprocess: failed to fork: %s", strerror(errno));
+		goto error;
+	} else if (pid == 0) {
+		xdpw_event_loop_restore_signals();
+		// a timeout also stops whatever the shell started
+		setpgid(0, 0);
+		if (options->pipe_stdio) {
+			dup2(in[0], STDIN_FILENO);
+			dup2(out[1], STDOUT_FILENO);
+		}
+
+		execl("/bin/sh", "/bin/sh", "-c", command, NULL);
+
+		perror("execl");
+		_exit(127);
+	}
+	setpgid(pid, pid);
+	proc->pid = pid;
+	logprint(DEBUG, "subprocess: started %s as %d", command, pid);
+
+	// the child isn't reaped yet, so the pid can't be reused meanwhile
+	proc->pidfd = subprocess_pidfd_open(pid);
+	if (proc->pidfd >= 0) {
+		subprocess_watch(state, proc->pidfd, EPOLLIN);
+	} else if (state->subprocess_sigchld_fd < 0) {
+		logprint(ERROR, "subprocess: failed to open pidfd: %s", strerror(errno));
+	}
+
+	if (options->pipe_stdio) {
+		close(in[0]);
+		close(out[1]);
+		proc->stdin_fd = in[1];
+		proc->stdout_fd = out[0];
+		fcntl(proc->stdin_fd, F_SETFL, O_NONBLOCK);
+		fcntl(proc->stdout_fd, F_SETFL, O_NONBLOCK);
+		subprocess_watch(state, proc->stdin_fd, EPOLLOUT);
+		subprocess_watch(state, proc->stdout_fd, EPOLLIN);
+	}
+
+	wl_list_insert(&state->subprocesses, &proc->link);
+	if (options->timeout_ns > 0) {
+		xdpw_arm_timer(state, &proc->timeout, options->timeout_ns,
+			SUBPROCESS_TIMEOUT_SLACK_NS, subprocess_handle_timeout, proc);
+	}
+	if (proc->stdin_fd >= 0) {
+		subprocess_write_input(proc);
+	}
+	return proc;
+
+error:
+	for (int i = 0; i < 2; i++) {
+		if (in[i] >= 0) {
+			close(in[i]);
+		}
+		if (out[i] >= 0) {
+			close(out[i]);
+		}
+	}
+	free(proc->input);
+	free(proc);
+	return NULL;
+}
+
+void xdpw_subprocess_cancel(struct xdpw_subprocess *proc) {
+	logprint(DEBUG, "subprocess: cancelling %d", proc->pid);
+	// it's kept until it's reaped
+	proc->cancelled = true;
+	subprocess_close_fd(proc, &proc->stdin_fd);
+	subprocess_close_fd(proc, &proc->stdout_fd);
+	subprocess_stop(proc);
+}
+
+int xdpw_subprocess_init(struct xdpw_state *state) {
+	wl_list_init(&state->subprocesses);
+	state->subprocess_sigchld_fd = -1;
+	state->subprocess_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (state->subprocess_epoll_fd < 0) {
+		logprint(ERROR, "subprocess: failed to create epoll instance: %s", strerror(errno));
+		return -errno;
+	}
+
+	// writing to a child which quit fails with EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+
+	int pidfd = subprocess_pidfd_open(getpid());
+	if (pidfd >= 0) {
+		close(pidfd);
+	} else {
+		logprint(INFO, "subprocess: pidfds unavailable, falling back to SIGCHLD");
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+		state->subprocess_sigchld_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+		if (state->subprocess_sigchld_fd < 0) {
+			logprint(ERROR, "subprocess: failed to create signalfd: %s", strerror(errno));
+			int ret = -errno;
+			close(state->subprocess_epoll_fd);
+			state->subprocess_epoll_fd = -1;
+			return ret;
+		}
+		subprocess_watch(state, state->subprocess_sigchld_fd, EPOLLIN);
+	}
+
+	if (!xdpw_event_loop_add_fd(state->event_loop, "subprocess", state->subprocess_epoll_fd,
+			XDPW_EVENT_PRIORITY_CONTROL, dispatch_subprocesses, state)) {
+		xdpw_subprocess_finish(state);
+		return -1;
+	}
+	return 0;
+}
+
+void xdpw_subprocess_finish(struct xdpw_state *state) {
+	struct xdpw_subprocess *proc, *tmp;
+	wl_list_for_each_safe(proc, tmp, &state->subprocesses, link) {
+		// nobody would wait for them anymore, and there's no time for a
+		// grace period
+		logprint(DEBUG, "subprocess: killing %d", proc->pid);
+		subprocess_kill(proc, SIGKILL);
+		while (waitpid(proc->pid, NULL, 0) < 0 && errno == EINTR) {
+		}
+		subprocess_destroy(proc);
+	}
+	if (state->subprocess_sigchld_fd >= 0) {
+		close(state->subprocess_sigchld_fd);
+		state->subprocess_sigchld_fd = -1;
+	}
+	if (state->subprocess_epoll_fd >= 0) {
+		close(state->subprocess_epoll_fd);
+		state->subprocess_epoll_fd = -1;
+	}
+}
@@ -1,69 +1,196 @@
-#include <poll.h>
-#include <wayland-util.h>
+#include "timer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
 #include <sys/timerfd.h>
+#include <time.h>
 
 #include "xdpw.h"
 #include "logger.h"
 #include "timespec_util.h"
 
-static void update_timer(struct xdpw_state *state) {
+static uint64_t timer_now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_ns(&now);
+}
+
+static void heap_set(struct xdpw_state *state, uint32_t i, struct xdpw_timer *timer) {
+	state->timer_heap[i] = timer;
+	timer->heap_index = i + 1;
+}
+
+static void heap_sift_up(struct xdpw_state *state, uint32_t i) {
+	struct xdpw_timer *timer = state->timer_heap[i];
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+		if (state->timer_heap[parent]->deadline_ns <= timer->deadline_ns) {
+			break;
+		}
+		heap_set(state, i, state->timer_heap[parent]);
+		i = parent;
+	}
+	heap_set(state, i, timer);
+}
+
+static void heap_sift_down(struct xdpw_state *state, uint32_t i) {
+	struct xdpw_timer *timer = state->timer_heap[i];
+	while (true) {
+		uint32_t child = 2 * i + 1;
+		if (child >= state->timer_count) {
+			break;
+		}
+		if (child + 1 < state->timer_count &&
+				state->timer_heap[child + 1]->deadline_ns < state->timer_heap[child]->deadline_ns) {
+			child++;
+		}
+		if (timer->deadline_ns <= state->timer_heap[child]->deadline_ns) {
+			break;
+		}
+		heap_set(state, i, state->timer_heap[child]);
+		i = child;
+	}
+	heap_set(state, i, timer);
+}
+
+static void heap_remove(struct xdpw_state *state, struct xdpw_timer *timer) {
+	uint32_t i = timer->heap_index - 1;
+	timer->heap_index = 0;
+
+	struct xdpw_timer *last = state->timer_heap[--state->timer_count];
+	if (i == state->timer_count) {
+		return;
+	}
+	heap_set(state, i, last);
+	heap_sift_down(state, i);
+	heap_sift_up(state, last->heap_index - 1);
+}
+
+/*
+ * The latest wakeup which still fires every timer in its slack. Only timers
+ * due before the wakeup can pull it earlier, so subtrees starting after it
+ * are skipped.
+ */
+static uint64_t timers_wakeup(struct xdpw_state *state, uint32_t i, uint64_t wakeup) {
+	if (i >= state->timer_count) {
+		return wakeup;
+	}
+	struct xdpw_timer *timer = state->timer_heap[i];
+	if (timer->deadline_ns >= wakeup) {
+		return wakeup;
+	}
+	wakeup = MIN(wakeup, timer->deadline_ns + timer->slack_ns);
+	wakeup = timers_wakeup(state, 2 * i + 1, wakeup);
+	return timers_wakeup(state, 2 * i + 2, wakeup);
+}
+
+static void timers_update(struct xdpw_state *state) {
 	int timer_fd = state->timer_poll_fd;
-	if (timer_fd < 0) {
+	if (timer_fd < 0 || state->timers_dispatching) {
 		return;
 	}
 
-	bool updated = false;
-	struct xdpw_timer *timer;
-	wl_list_for_each(timer, &state->timers, link) {
-		if (state->next_timer == NULL ||
-				timespec_less(&timer->at, &state->next_timer->at)) {
-			state->next_timer = timer;
-			updated = true;
-		}
+	uint64_t wakeup = 0;
+	if (state->timer_count > 0) {
+		struct xdpw_timer *first = state->timer_heap[0];
+		wakeup = timers_wakeup(state, 0, first->deadline_ns + first->slack_ns);
 	}
+	if (wakeup == state->timer_wakeup_ns) {
+		return;
+	}
+	state->timer_wakeup_ns = wakeup;
 
-	if (updated) {
-		struct itimerspec delay = { .it_value = state->next_timer->at };
-		errno = 0;
-		int ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &delay, NULL);
-		if (ret < 0) {
-			fprintf(stderr, "failed to timerfd_settime(): %s\n",
-				strerror(errno));
-		}
+	// a zero expiry disarms the timerfd
+	struct itimerspec delay = {
+		.it_value = {
+			.tv_sec = wakeup / TIMESPEC_NSEC_PER_SEC,
+			.tv_nsec = wakeup % TIMESPEC_NSEC_PER_SEC,
+		},
+	};
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &delay, NULL) < 0) {
+		logprint(ERROR, "timer: failed to timerfd_settime(): %s", strerror(errno));
 	}
 }
 
-struct xdpw_timer *xdpw_add_timer(struct xdpw_state *state,
-		uint64_t delay_ns, xdpw_event_loop_timer_func_t func, void *data) {
-	struct xdpw_timer *timer = calloc(1, sizeof(struct xdpw_timer));
-	if (timer == NULL) {
-		logprint(ERROR, "Timer allocation failed");
-		return NULL;
+bool xdpw_arm_timer(struct xdpw_state *state, struct xdpw_timer *timer,
+		uint64_t delay_ns, uint64_t slack_ns, xdpw_event_loop_timer_func_t func, void *data) {
+	if (!xdpw_timer_is_armed(timer) && state->timer_count == state->timer_capacity) {
+		uint32_t capacity = state->timer_capacity ? state->timer_capacity * 2 : 16;
+		struct xdpw_timer **heap = realloc(state->timer_heap, capacity * sizeof(*heap));
+		if (heap == NULL) {
+			logprint(ERROR, "timer: heap allocation failed");
+			return false;
+		}
+		state->timer_heap = heap;
+		state->timer_capacity = capacity;
 	}
+
 	timer->state = state;
 	timer->func = func;
 	timer->user_data = data;
-	wl_list_insert(&state->timers, &timer->link);
-
-	clock_gettime(CLOCK_MONOTONIC, &timer->at);
-	timespec_add(&timer->at, delay_ns);
+	timer->slack_ns = slack_ns;
+	uint64_t deadline_ns = timer_now_ns() + delay_ns;
+	if (xdpw_timer_is_armed(timer)) {
+		bool earlier = deadline_ns < timer->deadline_ns;
+		timer->deadline_ns = deadline_ns;
+		if (earlier) {
+			heap_sift_up(state, timer->heap_index - 1);
+		} else {
+			heap_sift_down(state, timer->heap_index - 1);
+		}
+	} else {
+		timer->deadline_ns = deadline_ns;
+		heap_set(state, state->timer_count++, timer);
+		heap_sift_up(state, timer->heap_index - 1);
+	}
 
-	update_timer(state);
-	return timer;
+	timers_update(state);
+	return true;
 }
 
-void xdpw_destroy_timer(struct xdpw_timer *timer) {
-	if (timer == NULL) {
+void xdpw_disarm_timer(struct xdpw_timer *timer) {
+	if (!xdpw_timer_is_armed(timer)) {
 		return;
 	}
 	struct xdpw_state *state = timer->state;
+	heap_remove(state, timer);
+	timers_update(state);
+}
+
+bool xdpw_timer_is_armed(const struct xdpw_timer *timer) {
+	return timer->heap_index > 0;
+}
+
+void xdpw_timers_dispatch(struct xdpw_state *state) {
+	uint64_t now = timer_now_ns();
+	uint32_t fired = 0;
+
+	// handlers may arm and disarm timers, the timerfd is set once afterwards
+	state->timers_dispatching = true;
+	while (state->timer_count > 0 && state->timer_heap[0]->deadline_ns <= now) {
+		struct xdpw_timer *timer = state->timer_heap[0];
+		heap_remove(state, timer);
+		fired++;
 
-	if (state->next_timer == timer) {
-		state->next_timer = NULL;
+		// the owner may be gone after this
+		timer->func(timer->user_data);
 	}
+	state->timers_dispatching = false;
 
-	wl_list_remove(&timer->link);
-	free(timer);
+	// the timerfd expired, so it's disarmed
+	state->timer_wakeup_ns = 0;
+	timers_update(state);
+	logprint(TRACE, "timer: fired %u timers", fired);
+}
 
-	update_timer(state);
+void xdpw_timers_finish(struct xdpw_state *state) {
+	for (uint32_t i = 0; i < state->timer_count; i++) {
+		state->timer_heap[i]->heap_index = 0;
+	}
+	free(state->timer_heap);
+	state->timer_heap = NULL;
+	state->timer_count = 0;
+	state->timer_capacity = 0;
 }
@@ -31,3 +31,7 @@ int64_t timespec_diff_ns(struct timespec *t1, struct timespec *t2) {
 
 	return s * TIMESPEC_NSEC_PER_SEC + ns;
 }
+
+int64_t timespec_to_ns(struct timespec *t) {
+	return (int64_t)t->tv_sec * TIMESPEC_NSEC_PER_SEC + t->tv_nsec;
+}
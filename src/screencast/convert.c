@@ -0,0 +1,460 @@
+#include "convert.h"
+
+#include "fourcc.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CONVERT_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define CONVERT_BPP 4
+#define CONVERT_SHIFT 15
+#define CONVERT_ROUND (1 << (CONVERT_SHIFT - 1))
+
+// BT.709 limited range in 1.15 fixed point, in the order r, g, b
+static const int16_t coef_y[3] = { 5983, 20127, 2032 };
+static const int16_t coef_u[3] = { -3298, -11094, 14392 };
+static const int16_t coef_v[3] = { 14392, -13072, -1320 };
+
+// coefficients for the bytes of one source pixel, 0 for the unused byte
+struct convert_coefs {
+	int16_t y[CONVERT_BPP];
+	int16_t u[CONVERT_BPP];
+	int16_t v[CONVERT_BPP];
+};
+
+// bit layouts of the formats with deeper channels, see xdpw_convert_pack()
+enum pack_layout {
+	PACK_NONE,
+	PACK_2101010,
+	PACK_1010102,
+	PACK_16161616,
+	PACK_LAYOUT_COUNT,
+};
+
+struct convert_kernels {
+	const char *name;
+	// return the number of pixels or chroma samples they converted
+	uint32_t (*y_row)(const struct convert_coefs *coefs, const uint8_t *src,
+		uint8_t *dst, uint32_t width);
+	uint32_t (*uv_row)(const struct convert_coefs *coefs, const uint8_t *src0,
+		const uint8_t *src1, uint8_t *u, uint8_t *v, uint32_t step, uint32_t width);
+	uint32_t (*pack_row[PACK_LAYOUT_COUNT])(const uint8_t *src, uint8_t *dst,
+		uint32_t width);
+};
+
+// memory offsets of the r, g and b bytes
+static bool rgb_offsets(uint32_t format, uint32_t offsets[static 3]) {
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+		offsets[0] = 2, offsets[1] = 1, offsets[2] = 0;
+		return true;
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_XBGR8888:
+		offsets[0] = 0, offsets[1] = 1, offsets[2] = 2;
+		return true;
+	case DRM_FORMAT_RGBA8888:
+	case DRM_FORMAT_RGBX8888:
+		offsets[0] = 3, offsets[1] = 2, offsets[2] = 1;
+		return true;
+	case DRM_FORMAT_BGRA8888:
+	case DRM_FORMAT_BGRX8888:
+		offsets[0] = 1, offsets[1] = 2, offsets[2] = 3;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static enum pack_layout pack_layout(uint32_t format) {
+	switch (format) {
+	case DRM_FORMAT_ARGB2101010:
+	case DRM_FORMAT_XRGB2101010:
+	case DRM_FORMAT_ABGR2101010:
+	case DRM_FORMAT_XBGR2101010:
+		return PACK_2101010;
+	case DRM_FORMAT_RGBA1010102:
+	case DRM_FORMAT_RGBX1010102:
+	case DRM_FORMAT_BGRA1010102:
+	case DRM_FORMAT_BGRX1010102:
+		return PACK_1010102;
+	case DRM_FORMAT_ARGB16161616:
+	case DRM_FORMAT_XRGB16161616:
+	case DRM_FORMAT_ABGR16161616:
+	case DRM_FORMAT_XBGR16161616:
+		return PACK_16161616;
+	default:
+		return PACK_NONE;
+	}
+}
+
+static void convert_coefs_init(struct convert_coefs *coefs, const uint32_t offsets[static 3]) {
+	*coefs = (struct convert_coefs) {0};
+	for (int c = 0; c < 3; c++) {
+		coefs->y[offsets[c]] = coef_y[c];
+		coefs->u[offsets[c]] = coef_u[c];
+		coefs->v[offsets[c]] = coef_v[c];
+	}
+}
+
+static inline uint8_t dot_scalar(const int16_t coef[static CONVERT_BPP],
+		const uint8_t *p, int32_t offset) {
+	int32_t sum = coef[0] * p[0] + coef[1] * p[1] + coef[2] * p[2] + coef[3] * p[3];
+	return (sum + (offset << CONVERT_SHIFT) + CONVERT_ROUND) >> CONVERT_SHIFT;
+}
+
+static inline uint8_t avg_scalar(uint8_t a, uint8_t b) {
+	return (a + b + 1) >> 1;
+}
+
+static uint32_t y_row_scalar(const struct convert_coefs *coefs, const uint8_t *src,
+		uint8_t *dst, uint32_t width) {
+	for (uint32_t x = 0; x < width; x++) {
+		dst[x] = dot_scalar(coefs->y, src + CONVERT_BPP * x, 16);
+	}
+	return width;
+}
+
+/*
+ * Every chroma sample is taken from the average of a 2x2 block, the vertical
+ * pairs are averaged first. The last column and row of odd sizes pair with
+ * themselves.
+ */
+static uint32_t uv_row_scalar(const struct convert_coefs *coefs, const uint8_t *src0,
+		const uint8_t *src1, uint8_t *u, uint8_t *v, uint32_t step, uint32_t width) {
+	uint32_t chroma_width = (width + 1) / 2;
+	for (uint32_t cx = 0; cx < chroma_width; cx++) {
+		uint32_t x0 = 2 * cx;
+		uint32_t x1 = x0 + 1 < width ? x0 + 1 : x0;
+		uint8_t block[CONVERT_BPP];
+		for (int c = 0; c < CONVERT_BPP; c++) {
+			uint8_t left = avg_scalar(src0[CONVERT_BPP * x0 + c], src1[CONVERT_BPP * x0 + c]);
+			uint8_t right = avg_scalar(src0[CONVERT_BPP * x1 + c], src1[CONVERT_BPP * x1 + c]);
+			block[c] = avg_scalar(left, right);
+		}
+		u[step * cx] = dot_scalar(coefs->u, block, 128);
+		v[step * cx] = dot_scalar(coefs->v, block, 128);
+	}
+	return chroma_width;
+}
+
+/*
+ * Every channel keeps its 8 most significant bits, 2 bit alpha is spread over
+ * the whole byte.
+ */
+static uint32_t pack_2101010_row_scalar(const uint8_t *src, uint8_t *dst, uint32_t width) {
+	const uint32_t *in = (const uint32_t *)src;
+	uint32_t *out = (uint32_t *)dst;
+	for (uint32_t x = 0; x < width; x++) {
+		uint32_t p = in[x];
+		out[x] = ((p >> 2) & 0xff) | ((p >> 4) & 0xff00) | ((p >> 6) & 0xff0000) |
+			((p >> 30) * 0x55) << 24;
+	}
+	return width;
+}
+
+static uint32_t pack_1010102_row_scalar(const uint8_t *src, uint8_t *dst, uint32_t width) {
+	const uint32_t *in = (const uint32_t *)src;
+	uint32_t *out = (uint32_t *)dst;
+	for (uint32_t x = 0; x < width; x++) {
+		uint32_t p = in[x];
+		out[x] = (p & 0xff000000) | ((p << 2) & 0xff0000) | ((p << 4) & 0xff00) |
+			(p & 0x3) * 0x55;
+	}
+	return width;
+}
+
+// the high byte of every little endian channel
+static uint32_t pack_16161616_row_scalar(const uint8_t *src, uint8_t *dst, uint32_t width) {
+	for (uint32_t x = 0; x < 4 * width; x++) {
+		dst[x] = src[2 * x + 1];
+	}
+	return width;
+}
+
+static const struct convert_kernels kernels_scalar = {
+	.name = "scalar",
+	.y_row = y_row_scalar,
+	.uv_row = uv_row_scalar,
+	.pack_row = {
+		[PACK_2101010] = pack_2101010_row_scalar,
+		[PACK_1010102] = pack_1010102_row_scalar,
+		[PACK_16161616] = pack_16161616_row_scalar,
+	},
+};
+
+#ifdef CONVERT_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i coefs_avx2(const int16_t coef[static CONVERT_BPP]) {
+	return _mm256_setr_epi16(coef[0], coef[1], coef[2], coef[3],
+		coef[0], coef[1], coef[2], coef[3], coef[0], coef[1], coef[2], coef[3],
+		coef[0], coef[1], coef[2], coef[3]);
+}
+
+// the weighted sums of 8 pixels, in pixel order
+__attribute__((target("avx2")))
+static inline __m256i dot_avx2(__m256i pixels, __m256i coef, __m256i bias) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coef);
+	__m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coef);
+	__m256i sum = _mm256_hadd_epi32(lo, hi);
+	return _mm256_srai_epi32(_mm256_add_epi32(sum, bias), CONVERT_SHIFT);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i pack_avx2(__m256i v) {
+	return _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static uint32_t y_row_avx2(const struct convert_coefs *coefs, const uint8_t *src,
+		uint8_t *dst, uint32_t width) {
+	__m256i coef = coefs_avx2(coefs->y);
+	__m256i bias = _mm256_set1_epi32((16 << CONVERT_SHIFT) + CONVERT_ROUND);
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		const uint8_t *p = src + CONVERT_BPP * x;
+		__m256i a = dot_avx2(_mm256_loadu_si256((const __m256i *)p), coef, bias);
+		__m256i b = dot_avx2(_mm256_loadu_si256((const __m256i *)(p + 32)), coef, bias);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(pack_avx2(a), pack_avx2(b)));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static uint32_t uv_row_avx2(const struct convert_coefs *coefs, const uint8_t *src0,
+		const uint8_t *src1, uint8_t *u, uint8_t *v, uint32_t step, uint32_t width) {
+	__m256i coef_u = coefs_avx2(coefs->u);
+	__m256i coef_v = coefs_avx2(coefs->v);
+	__m256i bias = _mm256_set1_epi32((128 << CONVERT_SHIFT) + CONVERT_ROUND);
+	__m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+	uint32_t cx = 0;
+	for (; 2 * cx + 16 <= width; cx += 8) {
+		const uint8_t *p0 = src0 + CONVERT_BPP * 2 * cx;
+		const uint8_t *p1 = src1 + CONVERT_BPP * 2 * cx;
+		__m256i a = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)p0),
+			_mm256_loadu_si256((const __m256i *)p1));
+		__m256i b = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(p0 + 32)),
+			_mm256_loadu_si256((const __m256i *)(p1 + 32)));
+		__m256 even = _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b),
+			_MM_SHUFFLE(2, 0, 2, 0));
+		__m256 odd = _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b),
+			_MM_SHUFFLE(3, 1, 3, 1));
+		// the shuffles interleave the lanes, restore the pixel order
+		__m256i block = _mm256_permutevar8x32_epi32(
+			_mm256_avg_epu8(_mm256_castps_si256(even), _mm256_castps_si256(odd)), order);
+
+		__m256i cu = dot_avx2(block, coef_u, bias);
+		__m256i cv = dot_avx2(block, coef_v, bias);
+		if (step == 2) {
+			__m256i uv = _mm256_or_si256(cu, _mm256_slli_epi32(cv, 8));
+			_mm_storeu_si128((__m128i *)(u + 2 * cx), pack_avx2(uv));
+		} else {
+			__m128i pu = pack_avx2(cu);
+			__m128i pv = pack_avx2(cv);
+			_mm_storel_epi64((__m128i *)(u + cx), _mm_packus_epi16(pu, pu));
+			_mm_storel_epi64((__m128i *)(v + cx), _mm_packus_epi16(pv, pv));
+		}
+	}
+	return cx;
+}
+
+// alpha times 0x55, spread over the top byte
+__attribute__((target("avx2")))
+static inline __m256i spread_alpha_avx2(__m256i alpha) {
+	__m256i a = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 2));
+	return _mm256_or_si256(a, _mm256_slli_epi32(a, 4));
+}
+
+__attribute__((target("avx2")))
+static uint32_t pack_2101010_row_avx2(const uint8_t *src, uint8_t *dst, uint32_t width) {
+	__m256i mask_b = _mm256_set1_epi32(0xff);
+	__m256i mask_g = _mm256_set1_epi32(0xff00);
+	__m256i mask_r = _mm256_set1_epi32(0xff0000);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + 4 * x));
+		__m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 2), mask_b);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 4), mask_g);
+		__m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 6), mask_r);
+		__m256i a = spread_alpha_avx2(_mm256_slli_epi32(_mm256_srli_epi32(p, 30), 24));
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x),
+			_mm256_or_si256(_mm256_or_si256(b, g), _mm256_or_si256(r, a)));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static uint32_t pack_1010102_row_avx2(const uint8_t *src, uint8_t *dst, uint32_t width) {
+	__m256i mask_a = _mm256_set1_epi32(0x3);
+	__m256i mask_b = _mm256_set1_epi32(0xff00);
+	__m256i mask_g = _mm256_set1_epi32(0xff0000);
+	__m256i mask_r = _mm256_set1_epi32((int32_t)0xff000000);
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + 4 * x));
+		__m256i b = _mm256_and_si256(_mm256_slli_epi32(p, 4), mask_b);
+		__m256i g = _mm256_and_si256(_mm256_slli_epi32(p, 2), mask_g);
+		__m256i r = _mm256_and_si256(p, mask_r);
+		__m256i a = spread_alpha_avx2(_mm256_and_si256(p, mask_a));
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x),
+			_mm256_or_si256(_mm256_or_si256(b, g), _mm256_or_si256(r, a)));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static uint32_t pack_16161616_row_avx2(const uint8_t *src, uint8_t *dst, uint32_t width) {
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const uint8_t *p = src + 8 * x;
+		__m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)p), 8);
+		__m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(p + 32)), 8);
+		// packing works per lane, restore the pixel order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(dst + 4 * x), packed);
+	}
+	return x;
+}
+
+static const struct convert_kernels kernels_avx2 = {
+	.name = "avx2",
+	.y_row = y_row_avx2,
+	.uv_row = uv_row_avx2,
+	.pack_row = {
+		[PACK_2101010] = pack_2101010_row_avx2,
+		[PACK_1010102] = pack_1010102_row_avx2,
+		[PACK_16161616] = pack_16161616_row_avx2,
+	},
+};
+#endif
+
+static const struct convert_kernels *kernels = NULL;
+
+static const struct convert_kernels *convert_kernels(void) {
+	if (kernels) {
+		return kernels;
+	}
+	kernels = &kernels_scalar;
+#ifdef CONVERT_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels = &kernels_avx2;
+	}
+#endif
+	return kernels;
+}
+
+void xdpw_convert_set_simd(bool enabled) {
+	kernels = enabled ? NULL : &kernels_scalar;
+}
+
+const char *xdpw_convert_impl_name(void) {
+	return convert_kernels()->name;
+}
+
+bool xdpw_convert_supported(uint32_t src_format, uint32_t dst_format) {
+	uint32_t offsets[3];
+	return rgb_offsets(src_format, offsets) &&
+		(dst_format == DRM_FORMAT_NV12 || dst_format == DRM_FORMAT_YUV420);
+}
+
+static uint32_t align_up(uint32_t value, uint32_t align) {
+	return (value + align - 1) / align * align;
+}
+
+bool xdpw_convert_get_layout(uint32_t dst_format, uint32_t width, uint32_t height,
+		uint32_t align, struct xdpw_convert_layout *layout) {
+	uint32_t chroma_width = (width + 1) / 2;
+	uint32_t chroma_height = (height + 1) / 2;
+
+	*layout = (struct xdpw_convert_layout) {0};
+	uint32_t offsets[3];
+	enum pack_layout pack = pack_layout(dst_format);
+	if (rgb_offsets(dst_format, offsets) || pack == PACK_2101010 || pack == PACK_1010102) {
+		// downscaled or turned frames keep their RGB format
+		layout->plane_count = 1;
+		layout->stride[0] = align_up(CONVERT_BPP * width, align);
+		layout->size = layout->stride[0] * height;
+		return true;
+	}
+
+	layout->stride[0] = align_up(width, align);
+	switch (dst_format) {
+	case DRM_FORMAT_NV12:
+		layout->plane_count = 2;
+		layout->stride[1] = align_up(2 * chroma_width, align);
+		layout->offset[1] = layout->stride[0] * height;
+		layout->size = layout->offset[1] + layout->stride[1] * chroma_height;
+		return true;
+	case DRM_FORMAT_YUV420:
+		layout->plane_count = 3;
+		layout->stride[1] = align_up(chroma_width, align);
+		layout->stride[2] = layout->stride[1];
+		layout->offset[1] = layout->stride[0] * height;
+		layout->offset[2] = layout->offset[1] + layout->stride[1] * chroma_height;
+		layout->size = layout->offset[2] + layout->stride[2] * chroma_height;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool xdpw_convert(uint32_t dst_format, const struct xdpw_convert_plane *planes,
+		uint32_t src_format, const uint8_t *src, ptrdiff_t src_stride,
+		uint32_t width, uint32_t height, uint32_t y0, uint32_t y1) {
+	uint32_t offsets[3];
+	if (!xdpw_convert_supported(src_format, dst_format) || !rgb_offsets(src_format, offsets)) {
+		return false;
+	}
+	struct convert_coefs coefs;
+	convert_coefs_init(&coefs, offsets);
+
+	const struct convert_kernels *k = convert_kernels();
+	uint32_t step = dst_format == DRM_FORMAT_NV12 ? 2 : 1;
+	uint32_t chroma_end = (y1 < height ? y1 : height) + 1;
+	for (uint32_t cy = y0 / 2; cy < chroma_end / 2; cy++) {
+		uint32_t rows[2] = { 2 * cy, 2 * cy + 1 < height ? 2 * cy + 1 : 2 * cy };
+		const uint8_t *row[2];
+		for (int i = 0; i < 2; i++) {
+			row[i] = src + (ptrdiff_t)rows[i] * src_stride;
+			uint8_t *dst = planes[0].data + (size_t)rows[i] * planes[0].stride;
+			uint32_t done = k->y_row(&coefs, row[i], dst, width);
+			y_row_scalar(&coefs, row[i] + CONVERT_BPP * done, dst + done, width - done);
+		}
+
+		uint8_t *u, *v;
+		if (step == 2) {
+			u = planes[1].data + (size_t)cy * planes[1].stride;
+			v = u + 1;
+		} else {
+			u = planes[1].data + (size_t)cy * planes[1].stride;
+			v = planes[2].data + (size_t)cy * planes[2].stride;
+		}
+		uint32_t done = k->uv_row(&coefs, row[0], row[1], u, v, step, width);
+		uv_row_scalar(&coefs, row[0] + CONVERT_BPP * 2 * done, row[1] + CONVERT_BPP * 2 * done,
+			u + step * done, v + step * done, step, width - 2 * done);
+	}
+	return true;
+}
+
+bool xdpw_convert_pack(uint32_t src_format, const uint8_t *src, uint32_t src_stride,
+		uint8_t *dst, uint32_t dst_stride, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height) {
+	enum pack_layout layout = pack_layout(src_format);
+	if (layout == PACK_NONE) {
+		return false;
+	}
+	uint32_t src_bpp = layout == PACK_16161616 ? 8 : 4;
+
+	const struct convert_kernels *k = convert_kernels();
+	for (uint32_t row = y; row < y + height; row++) {
+		const uint8_t *in = src + (size_t)row * src_stride + (size_t)src_bpp * x;
+		uint8_t *out = dst + (size_t)row * dst_stride + (size_t)CONVERT_BPP * x;
+		uint32_t done = k->pack_row[layout](in, out, width);
+		kernels_scalar.pack_row[layout](in + src_bpp * done, out + CONVERT_BPP * done,
+			width - done);
+	}
+	return true;
+}
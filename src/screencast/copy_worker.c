@@ -0,0 +1,190 @@
+#include "copy_worker.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+static bool queue_push(struct xdpw_copy_queue *queue, struct xdpw_copy_job *job) {
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail - head >= XDPW_COPY_QUEUE_SIZE) {
+		return false;
+	}
+	queue->jobs[tail % XDPW_COPY_QUEUE_SIZE] = job;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+// cancelled entries are popped as NULL
+static bool queue_pop(struct xdpw_copy_queue *queue, struct xdpw_copy_job **job) {
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	*job = queue->jobs[head % XDPW_COPY_QUEUE_SIZE];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return true;
+}
+
+static void notify(int fd) {
+	uint64_t one = 1;
+	while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+		// retry
+	}
+}
+
+void xdpw_copy_worker_wait(struct xdpw_copy_worker *worker, struct xdpw_copy_job *job) {
+	if (!worker->running) {
+		return;
+	}
+	pthread_mutex_lock(&worker->lock);
+	while (atomic_load_explicit(&job->busy, memory_order_acquire)) {
+		pthread_cond_wait(&worker->cond, &worker->lock);
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+static void *worker_run(void *data) {
+	struct xdpw_copy_worker *worker = data;
+
+	// signals are for the main loop
+	sigset_t mask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (!atomic_load(&worker->quit)) {
+		uint64_t count;
+		if (read(worker->submit_fd, &count, sizeof(count)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			logprint(ERROR, "copy: failed to wait for jobs: %s", strerror(errno));
+			break;
+		}
+
+		struct xdpw_copy_job *job;
+		while (queue_pop(&worker->submit, &job)) {
+			job->func(job);
+			// can't be full, the main thread limits the jobs in flight
+			queue_push(&worker->done, job);
+
+			// the job may be gone once it isn't busy anymore
+			pthread_mutex_lock(&worker->lock);
+			atomic_store_explicit(&job->busy, false, memory_order_release);
+			pthread_cond_broadcast(&worker->cond);
+			pthread_mutex_unlock(&worker->lock);
+			notify(worker->done_fd);
+		}
+	}
+	return NULL;
+}
+
+bool xdpw_copy_worker_init(struct xdpw_copy_worker *worker) {
+	*worker = (struct xdpw_copy_worker){
+		.submit_fd = -1,
+		.done_fd = -1,
+	};
+
+	worker->submit_fd = eventfd(0, EFD_CLOEXEC);
+	worker->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (worker->submit_fd < 0 || worker->done_fd < 0) {
+		logprint(ERROR, "copy: failed to create eventfd: %s", strerror(errno));
+		goto error;
+	}
+
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	int ret = pthread_create(&worker->thread, NULL, worker_run, worker);
+	if (ret != 0) {
+		logprint(ERROR, "copy: failed to start thread: %s", strerror(ret));
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->lock);
+		goto error;
+	}
+	worker->running = true;
+	logprint(DEBUG, "copy: worker thread started");
+	return true;
+
+error:
+	if (worker->submit_fd >= 0) {
+		close(worker->submit_fd);
+	}
+	if (worker->done_fd >= 0) {
+		close(worker->done_fd);
+	}
+	worker->submit_fd = -1;
+	worker->done_fd = -1;
+	return false;
+}
+
+void xdpw_copy_worker_finish(struct xdpw_copy_worker *worker) {
+	if (!worker->running) {
+		return;
+	}
+
+	atomic_store(&worker->quit, true);
+	notify(worker->submit_fd);
+	pthread_join(worker->thread, NULL);
+	worker->running = false;
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	close(worker->submit_fd);
+	close(worker->done_fd);
+	worker->submit_fd = -1;
+	worker->done_fd = -1;
+}
+
+bool xdpw_copy_worker_submit(struct xdpw_copy_worker *worker, struct xdpw_copy_job *job) {
+	if (!worker->running || worker->in_flight >= XDPW_COPY_QUEUE_SIZE) {
+		return false;
+	}
+
+	// the completion can be handled before the worker let go of the job
+	xdpw_copy_worker_wait(worker, job);
+	atomic_store_explicit(&job->busy, true, memory_order_relaxed);
+	if (!queue_push(&worker->submit, job)) {
+		atomic_store_explicit(&job->busy, false, memory_order_relaxed);
+		return false;
+	}
+	job->pending = true;
+	worker->in_flight++;
+	notify(worker->submit_fd);
+	return true;
+}
+
+struct xdpw_copy_job *xdpw_copy_worker_pop_done(struct xdpw_copy_worker *worker) {
+	struct xdpw_copy_job *job;
+	while (queue_pop(&worker->done, &job)) {
+		worker->in_flight--;
+		if (job) {
+			job->pending = false;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+void xdpw_copy_worker_cancel(struct xdpw_copy_worker *worker, struct xdpw_copy_job *job) {
+	// also after its completion was popped, the worker may still hold it
+	xdpw_copy_worker_wait(worker, job);
+	if (!job->pending) {
+		return;
+	}
+
+	// the finished job waits in the done queue, which the main thread owns
+	unsigned int head = atomic_load_explicit(&worker->done.head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&worker->done.tail, memory_order_acquire);
+	for (unsigned int i = head; i != tail; i++) {
+		if (worker->done.jobs[i % XDPW_COPY_QUEUE_SIZE] == job) {
+			worker->done.jobs[i % XDPW_COPY_QUEUE_SIZE] = NULL;
+		}
+	}
+	job->pending = false;
+}
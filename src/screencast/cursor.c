@@ -0,0 +1,196 @@
+#include "cursor.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tile_hash.h"
+#include "fourcc.h"
+
+#define CURSOR_BPP 4
+
+struct cursor_bounds {
+	uint32_t x0, y0;
+	uint32_t x1, y1; // exclusive
+};
+
+static bool cursor_format(uint32_t format, uint32_t *cursor_format, uint32_t *alpha_byte) {
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+		*cursor_format = DRM_FORMAT_ARGB8888;
+		*alpha_byte = 3;
+		return true;
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_XBGR8888:
+		*cursor_format = DRM_FORMAT_ABGR8888;
+		*alpha_byte = 3;
+		return true;
+	case DRM_FORMAT_RGBA8888:
+	case DRM_FORMAT_RGBX8888:
+		*cursor_format = DRM_FORMAT_RGBA8888;
+		*alpha_byte = 0;
+		return true;
+	case DRM_FORMAT_BGRA8888:
+	case DRM_FORMAT_BGRX8888:
+		*cursor_format = DRM_FORMAT_BGRA8888;
+		*alpha_byte = 0;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline bool pixel_differs(const uint8_t *a, const uint8_t *b, uint32_t x) {
+	return memcmp(a + x * CURSOR_BPP, b + x * CURSOR_BPP, CURSOR_BPP) != 0;
+}
+
+/*
+ * Computes the bounding box of all differing pixels inside the window. Equal
+ * rows are skipped with memcmp, a differing row is only scanned from the
+ * outside in until it can't widen the box anymore.
+ */
+static bool diff_bounds(const uint8_t *with_cursor, const uint8_t *without_cursor,
+		uint32_t stride, const struct cursor_bounds *window, struct cursor_bounds *bounds) {
+	uint32_t min_x = window->x1, max_x = window->x0;
+	uint32_t min_y = window->y1, max_y = window->y0;
+
+	for (uint32_t y = window->y0; y < window->y1; y++) {
+		const uint8_t *a = with_cursor + (size_t)y * stride;
+		const uint8_t *b = without_cursor + (size_t)y * stride;
+		if (memcmp(a + window->x0 * CURSOR_BPP, b + window->x0 * CURSOR_BPP,
+				(window->x1 - window->x0) * CURSOR_BPP) == 0) {
+			continue;
+		}
+
+		for (uint32_t x = window->x0; x < min_x; x++) {
+			if (pixel_differs(a, b, x)) {
+				min_x = x;
+				break;
+			}
+		}
+		for (uint32_t x = window->x1; x > max_x; x--) {
+			if (pixel_differs(a, b, x - 1)) {
+				max_x = x;
+				break;
+			}
+		}
+		if (y < min_y) {
+			min_y = y;
+		}
+		max_y = y + 1;
+	}
+
+	if (min_y >= max_y) {
+		return false;
+	}
+	*bounds = (struct cursor_bounds) {
+		.x0 = min_x, .y0 = min_y,
+		.x1 = max_x, .y1 = max_y,
+	};
+	return true;
+}
+
+static void window_around(const struct xdpw_cursor *cursor, uint32_t width,
+		uint32_t height, bool y_invert, struct cursor_bounds *window) {
+	int64_t y = y_invert ?
+		(int64_t)height - cursor->y - cursor->height : cursor->y;
+	int64_t x0 = (int64_t)cursor->x - XDPW_CURSOR_MAX_SIZE;
+	int64_t y0 = y - XDPW_CURSOR_MAX_SIZE;
+	int64_t x1 = (int64_t)cursor->x + cursor->width + XDPW_CURSOR_MAX_SIZE;
+	int64_t y1 = y + cursor->height + XDPW_CURSOR_MAX_SIZE;
+
+	window->x0 = x0 < 0 ? 0 : x0;
+	window->y0 = y0 < 0 ? 0 : y0;
+	window->x1 = x1 > width ? width : x1;
+	window->y1 = y1 > height ? height : y1;
+}
+
+static bool touches_window_edge(const struct cursor_bounds *bounds,
+		const struct cursor_bounds *window, uint32_t width, uint32_t height) {
+	return (bounds->x0 == window->x0 && window->x0 > 0) ||
+		(bounds->y0 == window->y0 && window->y0 > 0) ||
+		(bounds->x1 == window->x1 && window->x1 < width) ||
+		(bounds->y1 == window->y1 && window->y1 < height);
+}
+
+void xdpw_cursor_finish(struct xdpw_cursor *cursor) {
+	free(cursor->bitmap);
+	*cursor = (struct xdpw_cursor) {0};
+}
+
+bool xdpw_cursor_extract(struct xdpw_cursor *cursor, const uint8_t *with_cursor,
+		const uint8_t *without_cursor, uint32_t width, uint32_t height,
+		uint32_t stride, uint32_t format, bool y_invert) {
+	uint32_t bitmap_format, alpha_byte;
+	if (width == 0 || height == 0 || !cursor_format(format, &bitmap_format, &alpha_byte)) {
+		return false;
+	}
+
+	struct cursor_bounds frame = { 0, 0, width, height };
+	struct cursor_bounds window, bounds;
+	bool found;
+	if (cursor->visible) {
+		// the cursor most likely didn't move far since the last frame
+		window_around(cursor, width, height, y_invert, &window);
+		found = diff_bounds(with_cursor, without_cursor, stride, &window, &bounds);
+		if (!found || touches_window_edge(&bounds, &window, width, height)) {
+			found = diff_bounds(with_cursor, without_cursor, stride, &frame, &bounds);
+		}
+	} else {
+		found = diff_bounds(with_cursor, without_cursor, stride, &frame, &bounds);
+	}
+
+	if (!found) {
+		if (!cursor->visible) {
+			return false;
+		}
+		cursor->visible = false;
+		return true;
+	}
+
+	uint32_t cursor_width = bounds.x1 - bounds.x0;
+	uint32_t cursor_height = bounds.y1 - bounds.y0;
+	if (cursor_width > XDPW_CURSOR_MAX_SIZE || cursor_height > XDPW_CURSOR_MAX_SIZE) {
+		return false;
+	}
+
+	if (!cursor->bitmap) {
+		cursor->bitmap = malloc(XDPW_CURSOR_MAX_SIZE * XDPW_CURSOR_MAX_SIZE * CURSOR_BPP);
+		if (!cursor->bitmap) {
+			return false;
+		}
+	}
+
+	uint32_t bitmap_stride = cursor_width * CURSOR_BPP;
+	for (uint32_t y = 0; y < cursor_height; y++) {
+		size_t offset = (size_t)(bounds.y0 + y) * stride + bounds.x0 * CURSOR_BPP;
+		const uint8_t *a = with_cursor + offset;
+		const uint8_t *b = without_cursor + offset;
+		uint8_t *dst = cursor->bitmap +
+			(y_invert ? cursor_height - 1 - y : y) * bitmap_stride;
+		for (uint32_t x = 0; x < cursor_width; x++, dst += CURSOR_BPP) {
+			if (pixel_differs(a, b, x)) {
+				memcpy(dst, a + x * CURSOR_BPP, CURSOR_BPP);
+				dst[alpha_byte] = 0xff;
+			} else {
+				memset(dst, 0, CURSOR_BPP);
+			}
+		}
+	}
+
+	uint64_t hash = xdpw_tile_hash(cursor->bitmap, bitmap_stride, bitmap_stride, cursor_height) ^
+		((uint64_t)cursor_width << 32 | cursor_height) ^ bitmap_format;
+	int32_t x = bounds.x0;
+	int32_t y = y_invert ? height - bounds.y1 : bounds.y0;
+
+	bool changed = !cursor->visible || cursor->x != x || cursor->y != y ||
+		cursor->hash != hash;
+	cursor->visible = true;
+	cursor->x = x;
+	cursor->y = y;
+	cursor->width = cursor_width;
+	cursor->height = cursor_height;
+	cursor->format = bitmap_format;
+	cursor->hash = hash;
+	return changed;
+}
@@ -0,0 +1,125 @@
+#include "damage.h"
+
+#include <assert.h>
+
+static uint64_t rect_area(const struct xdpw_frame_damage *rect) {
+	return (uint64_t)rect->width * rect->height;
+}
+
+static bool rect_contains(const struct xdpw_frame_damage *outer,
+		const struct xdpw_frame_damage *inner) {
+	return inner->x >= outer->x && inner->y >= outer->y &&
+		inner->x + inner->width <= outer->x + outer->width &&
+		inner->y + inner->height <= outer->y + outer->height;
+}
+
+static struct xdpw_frame_damage rect_union(const struct xdpw_frame_damage *a,
+		const struct xdpw_frame_damage *b) {
+	uint32_t x0 = a->x < b->x ? a->x : b->x;
+	uint32_t y0 = a->y < b->y ? a->y : b->y;
+	uint32_t x1 = a->x + a->width > b->x + b->width ?
+		a->x + a->width : b->x + b->width;
+	uint32_t y1 = a->y + a->height > b->y + b->height ?
+		a->y + a->height : b->y + b->height;
+
+	return (struct xdpw_frame_damage) {
+		.x = x0,
+		.y = y0,
+		.width = x1 - x0,
+		.height = y1 - y0,
+	};
+}
+
+static void remove_rect(struct xdpw_damage *damage, uint32_t index) {
+	assert(index < damage->count);
+	damage->rects[index] = damage->rects[damage->count - 1];
+	damage->count--;
+}
+
+/*
+ * Merge the pair of rectangles whose bounding box adds the least area that
+ * wasn't damaged before.
+ */
+static void merge_cheapest_pair(struct xdpw_damage *damage) {
+	assert(damage->count >= 2);
+
+	uint32_t best_i = 0, best_j = 1;
+	uint64_t best_cost = UINT64_MAX;
+	for (uint32_t i = 0; i < damage->count; i++) {
+		for (uint32_t j = i + 1; j < damage->count; j++) {
+			struct xdpw_frame_damage merged =
+				rect_union(&damage->rects[i], &damage->rects[j]);
+			uint64_t area = rect_area(&damage->rects[i]) + rect_area(&damage->rects[j]);
+			uint64_t merged_area = rect_area(&merged);
+			uint64_t cost = merged_area > area ? merged_area - area : 0;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_i = i;
+				best_j = j;
+			}
+		}
+	}
+
+	damage->rects[best_i] = rect_union(&damage->rects[best_i], &damage->rects[best_j]);
+	remove_rect(damage, best_j);
+}
+
+void xdpw_damage_clear(struct xdpw_damage *damage) {
+	damage->count = 0;
+}
+
+bool xdpw_damage_is_empty(const struct xdpw_damage *damage) {
+	return damage->count == 0;
+}
+
+void xdpw_damage_set_full(struct xdpw_damage *damage, uint32_t width, uint32_t height) {
+	damage->count = 0;
+	damage->rects[damage->count++] = (struct xdpw_frame_damage) {
+		.x = 0,
+		.y = 0,
+		.width = width,
+		.height = height,
+	};
+}
+
+void xdpw_damage_add(struct xdpw_damage *damage, const struct xdpw_frame_damage *rect) {
+	if (rect->width == 0 || rect->height == 0) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < damage->count; i++) {
+		if (rect_contains(&damage->rects[i], rect)) {
+			return;
+		}
+	}
+
+	// drop everything the new rectangle covers
+	uint32_t i = 0;
+	while (i < damage->count) {
+		if (rect_contains(rect, &damage->rects[i])) {
+			remove_rect(damage, i);
+		} else {
+			i++;
+		}
+	}
+
+	if (damage->count == XDPW_DAMAGE_RECTS_MAX) {
+		merge_cheapest_pair(damage);
+	}
+	damage->rects[damage->count++] = *rect;
+}
+
+void xdpw_damage_add_damage(struct xdpw_damage *damage, const struct xdpw_damage *other) {
+	for (uint32_t i = 0; i < other->count; i++) {
+		xdpw_damage_add(damage, &other->rects[i]);
+	}
+}
+
+void xdpw_damage_reduce(struct xdpw_damage *damage, uint32_t max_rects) {
+	if (max_rects == 0) {
+		max_rects = 1;
+	}
+	while (damage->count > max_rects) {
+		merge_cheapest_pair(damage);
+	}
+}
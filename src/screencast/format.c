@@ -0,0 +1,107 @@
+#include "format.h"
+
+#include <stddef.h>
+
+#include "fourcc.h"
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+/*
+ * All formats we capture or convert to. SPA names formats by their byte order
+ * in memory, DRM by the channel order of a little endian word.
+ */
+static const struct xdpw_format_info formats[] = {
+	{ DRM_FORMAT_ARGB8888, SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_BGRx, 4, 8, DRM_FORMAT_ARGB8888 },
+	{ DRM_FORMAT_XRGB8888, SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_UNKNOWN, 4, 8, DRM_FORMAT_XRGB8888 },
+	{ DRM_FORMAT_RGBA8888, SPA_VIDEO_FORMAT_ABGR, SPA_VIDEO_FORMAT_xBGR, 4, 8, DRM_FORMAT_RGBA8888 },
+	{ DRM_FORMAT_RGBX8888, SPA_VIDEO_FORMAT_xBGR, SPA_VIDEO_FORMAT_UNKNOWN, 4, 8, DRM_FORMAT_RGBX8888 },
+	{ DRM_FORMAT_ABGR8888, SPA_VIDEO_FORMAT_RGBA, SPA_VIDEO_FORMAT_RGBx, 4, 8, DRM_FORMAT_ABGR8888 },
+	{ DRM_FORMAT_XBGR8888, SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_UNKNOWN, 4, 8, DRM_FORMAT_XBGR8888 },
+	{ DRM_FORMAT_BGRA8888, SPA_VIDEO_FORMAT_ARGB, SPA_VIDEO_FORMAT_xRGB, 4, 8, DRM_FORMAT_BGRA8888 },
+	{ DRM_FORMAT_BGRX8888, SPA_VIDEO_FORMAT_xRGB, SPA_VIDEO_FORMAT_UNKNOWN, 4, 8, DRM_FORMAT_BGRX8888 },
+
+	// the 10 bit formats are named by their little endian words on both sides
+	{ DRM_FORMAT_ARGB2101010, SPA_VIDEO_FORMAT_ARGB_210LE, SPA_VIDEO_FORMAT_xRGB_210LE, 4, 10, DRM_FORMAT_ARGB8888 },
+	{ DRM_FORMAT_XRGB2101010, SPA_VIDEO_FORMAT_xRGB_210LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, 10, DRM_FORMAT_XRGB8888 },
+	{ DRM_FORMAT_ABGR2101010, SPA_VIDEO_FORMAT_ABGR_210LE, SPA_VIDEO_FORMAT_xBGR_210LE, 4, 10, DRM_FORMAT_ABGR8888 },
+	{ DRM_FORMAT_XBGR2101010, SPA_VIDEO_FORMAT_xBGR_210LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, 10, DRM_FORMAT_XBGR8888 },
+	{ DRM_FORMAT_RGBA1010102, SPA_VIDEO_FORMAT_RGBA_102LE, SPA_VIDEO_FORMAT_RGBx_102LE, 4, 10, DRM_FORMAT_RGBA8888 },
+	{ DRM_FORMAT_RGBX1010102, SPA_VIDEO_FORMAT_RGBx_102LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, 10, DRM_FORMAT_RGBX8888 },
+	{ DRM_FORMAT_BGRA1010102, SPA_VIDEO_FORMAT_BGRA_102LE, SPA_VIDEO_FORMAT_BGRx_102LE, 4, 10, DRM_FORMAT_BGRA8888 },
+	{ DRM_FORMAT_BGRX1010102, SPA_VIDEO_FORMAT_BGRx_102LE, SPA_VIDEO_FORMAT_UNKNOWN, 4, 10, DRM_FORMAT_BGRX8888 },
+
+	// pipewire has no 16 bit RGB formats, these are always packed
+	{ DRM_FORMAT_ARGB16161616, SPA_VIDEO_FORMAT_UNKNOWN, SPA_VIDEO_FORMAT_UNKNOWN, 8, 16, DRM_FORMAT_ARGB8888 },
+	{ DRM_FORMAT_XRGB16161616, SPA_VIDEO_FORMAT_UNKNOWN, SPA_VIDEO_FORMAT_UNKNOWN, 8, 16, DRM_FORMAT_XRGB8888 },
+	{ DRM_FORMAT_ABGR16161616, SPA_VIDEO_FORMAT_UNKNOWN, SPA_VIDEO_FORMAT_UNKNOWN, 8, 16, DRM_FORMAT_ABGR8888 },
+	{ DRM_FORMAT_XBGR16161616, SPA_VIDEO_FORMAT_UNKNOWN, SPA_VIDEO_FORMAT_UNKNOWN, 8, 16, DRM_FORMAT_XBGR8888 },
+
+	// the formats frames can be converted to, see xdpw_convert()
+	{ DRM_FORMAT_NV12, SPA_VIDEO_FORMAT_NV12, SPA_VIDEO_FORMAT_UNKNOWN, 0, 8, 0 },
+	{ DRM_FORMAT_YUV420, SPA_VIDEO_FORMAT_I420, SPA_VIDEO_FORMAT_UNKNOWN, 0, 8, 0 },
+};
+
+static const struct xdpw_format_info *format_info_from_pw(enum spa_video_format format) {
+	if (format == SPA_VIDEO_FORMAT_UNKNOWN) {
+		return NULL;
+	}
+	for (size_t i = 0; i < FORMAT_COUNT; i++) {
+		if (formats[i].pw_format == format) {
+			return &formats[i];
+		}
+	}
+	return NULL;
+}
+
+const struct xdpw_format_info *xdpw_format_info_from_drm_fourcc(uint32_t format) {
+	for (size_t i = 0; i < FORMAT_COUNT; i++) {
+		if (formats[i].drm_format == format) {
+			return &formats[i];
+		}
+	}
+	return NULL;
+}
+
+uint32_t xdpw_bpp_from_drm_fourcc(uint32_t format) {
+	const struct xdpw_format_info *info = xdpw_format_info_from_drm_fourcc(format);
+	return info ? info->bpp : 0;
+}
+
+// wl_shm uses DRM fourccs, except for the two formats every compositor supports
+enum wl_shm_format xdpw_format_wl_shm_from_drm_fourcc(uint32_t format) {
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+		return WL_SHM_FORMAT_ARGB8888;
+	case DRM_FORMAT_XRGB8888:
+		return WL_SHM_FORMAT_XRGB8888;
+	default:
+		return (enum wl_shm_format)format;
+	}
+}
+
+uint32_t xdpw_format_drm_fourcc_from_wl_shm(enum wl_shm_format format) {
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+		return DRM_FORMAT_ARGB8888;
+	case WL_SHM_FORMAT_XRGB8888:
+		return DRM_FORMAT_XRGB8888;
+	default:
+		return (uint32_t)format;
+	}
+}
+
+enum spa_video_format xdpw_format_pw_from_drm_fourcc(uint32_t format) {
+	const struct xdpw_format_info *info = xdpw_format_info_from_drm_fourcc(format);
+	return info ? info->pw_format : SPA_VIDEO_FORMAT_UNKNOWN;
+}
+
+enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format) {
+	const struct xdpw_format_info *info = format_info_from_pw(format);
+	return info ? info->pw_opaque_format : SPA_VIDEO_FORMAT_UNKNOWN;
+}
+
+// the formats frames can be converted to, see xdpw_convert()
+uint32_t xdpw_format_drm_fourcc_from_pw_yuv(enum spa_video_format format) {
+	const struct xdpw_format_info *info = format_info_from_pw(format);
+	return info && info->bpp == 0 ? info->drm_format : 0;
+}
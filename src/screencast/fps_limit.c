@@ -10,41 +10,93 @@
 
 void measure_fps(struct fps_limit_state *state, struct timespec *now);
 
-void fps_limit_measure_start(struct fps_limit_state *state, double max_fps) {
-	if (max_fps <= 0.0) {
-		return;
-	}
-
+void fps_limit_frame_start(struct fps_limit_state *state) {
 	clock_gettime(CLOCK_MONOTONIC, &state->frame_last_time);
+
+	measure_fps(state, &state->frame_last_time);
 }
 
-uint64_t fps_limit_measure_end(struct fps_limit_state *state, double max_fps) {
-	if (max_fps <= 0.0) {
+uint64_t fps_limit_frame_delay(struct fps_limit_state *state, double max_fps) {
+	if (max_fps <= 0.0 || timespec_is_zero(&state->frame_last_time)) {
 		return 0;
 	}
 
-	// `fps_limit_measure_start` was not called?
-	assert(!timespec_is_zero(&state->frame_last_time));
-
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
 	int64_t elapsed_ns = timespec_diff_ns(&now, &state->frame_last_time);
 
-	measure_fps(state, &now);
-
 	int64_t target_ns = (1.0 / max_fps) * TIMESPEC_NSEC_PER_SEC;
 	int64_t delay_ns = target_ns - elapsed_ns;
 	if (delay_ns > 0) {
-		logprint(TRACE, "fps_limit: elapsed time since the last measurement: %u, "
+		logprint(TRACE, "fps_limit: elapsed time since the last frame start: %u, "
 			"target %u, should delay for %u (ns)", elapsed_ns, target_ns, delay_ns);
 		return delay_ns;
 	} else {
-		logprint(TRACE, "fps_limit: elapsed time since the last measurement: %u, "
+		logprint(TRACE, "fps_limit: elapsed time since the last frame start: %u, "
 			"target %u, target not met (ns)", elapsed_ns, target_ns);
 		return 0;
 	}
 }
 
+static bool fps_idle_enabled(double max_fps, double idle_fps) {
+	return idle_fps > 0.0 && (max_fps <= 0.0 || idle_fps < max_fps);
+}
+
+double fps_idle_framerate(const struct fps_idle_state *state,
+		double max_fps, double idle_fps) {
+	return state->idle && fps_idle_enabled(max_fps, idle_fps) ? idle_fps : max_fps;
+}
+
+double fps_idle_update(struct fps_idle_state *state, bool damaged,
+		double max_fps, double idle_fps, uint32_t idle_frames) {
+	if (!fps_idle_enabled(max_fps, idle_fps)) {
+		return max_fps;
+	}
+
+	if (damaged) {
+		if (state->idle) {
+			logprint(DEBUG, "fps_limit: damage after %u idle frames, back to %0.2f FPS",
+				state->undamaged_frames, max_fps);
+		}
+		state->idle = false;
+		state->undamaged_frames = 0;
+		return max_fps;
+	}
+
+	state->undamaged_frames++;
+	if (!state->idle && state->undamaged_frames >= idle_frames) {
+		logprint(DEBUG, "fps_limit: no damage for %u frames, lowering capture rate to %0.2f FPS",
+			state->undamaged_frames, idle_fps);
+		state->idle = true;
+	}
+
+	return state->idle ? idle_fps : max_fps;
+}
+
+/*
+ * Frames are dropped until the next frame interval of the consumer starts. A
+ * quarter interval of capture jitter is tolerated, otherwise a consumer
+ * running at the capture rate would lose frames.
+ */
+bool fps_decimate(struct fps_decimate_state *state, int64_t pts, double max_fps) {
+	if (max_fps <= 0.0 || pts < 0) {
+		return true;
+	}
+
+	int64_t interval_ns = (1.0 / max_fps) * TIMESPEC_NSEC_PER_SEC;
+	if (state->next_pts != 0 && pts < state->next_pts - interval_ns / 4) {
+		return false;
+	}
+
+	if (state->next_pts != 0 && pts - state->next_pts < interval_ns) {
+		state->next_pts += interval_ns;
+	} else {
+		// first frame or too far behind, restart the cadence
+		state->next_pts = pts + interval_ns;
+	}
+	return true;
+}
+
 void measure_fps(struct fps_limit_state *state, struct timespec *now) {
 	if (timespec_is_zero(&state->fps_last_time)) {
 		state->fps_last_time = *now;
@@ -6,16 +6,28 @@
 #include <spa/param/format-utils.h>
 #include <spa/param/video/format-utils.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <assert.h>
-
+#include <errno.h>
+#include <inttypes.h>
+
+#include "convert.h"
+#include "fourcc.h"
+#include "event_loop.h"
+#include "screencast.h"
+#include "transform.h"
 #include "wlr_screencast.h"
 #include "xdpw.h"
 #include "logger.h"
 
+// dmabuf, captured, packed and converted formats
+#define FORMAT_PARAMS_MAX 4
+
 static struct spa_pod *build_format(struct spa_pod_builder *b, enum spa_video_format format,
-		uint32_t width, uint32_t height, uint32_t framerate) {
-	struct spa_pod_frame f[1];
+		uint32_t width, uint32_t height, uint32_t framerate,
+		const uint64_t *modifiers, uint32_t modifier_count) {
+	struct spa_pod_frame f[2];
 
 	enum spa_video_format format_without_alpha = xdpw_format_pw_strip_alpha(format);
 
@@ -29,6 +41,44 @@ static struct spa_pod *build_format(struct spa_pod_builder *b, enum spa_video_fo
 		spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format,
 				SPA_POD_CHOICE_ENUM_Id(3, format, format, format_without_alpha), 0);
 	}
+	/* modifiers */
+	if (modifier_count > 0) {
+		// the consumer picks a subset, we fixate the modifier on our side
+		spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_modifier,
+			SPA_POD_PROP_FLAG_MANDATORY | SPA_POD_PROP_FLAG_DONT_FIXATE);
+		spa_pod_builder_push_choice(b, &f[1], SPA_CHOICE_Enum, 0);
+		// the first value is the default
+		spa_pod_builder_long(b, modifiers[0]);
+		for (uint32_t i = 0; i < modifier_count; i++) {
+			spa_pod_builder_long(b, modifiers[i]);
+		}
+		spa_pod_builder_pop(b, &f[1]);
+	}
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_size,
+		SPA_POD_Rectangle(&SPA_RECTANGLE(width, height)),
+		0);
+	// variable framerate
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_framerate,
+		SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_maxFramerate,
+		SPA_POD_CHOICE_RANGE_Fraction(
+			&SPA_FRACTION(framerate, 1),
+			&SPA_FRACTION(1, 1),
+			&SPA_FRACTION(framerate, 1)),
+		0);
+	return spa_pod_builder_pop(b, &f[0]);
+}
+
+static struct spa_pod *fixate_format(struct spa_pod_builder *b, enum spa_video_format format,
+		uint32_t width, uint32_t height, uint32_t framerate, uint64_t modifier) {
+	struct spa_pod_frame f[1];
+
+	spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format, SPA_POD_Id(format), 0);
+	spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY);
+	spa_pod_builder_long(b, modifier);
 	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_size,
 		SPA_POD_Rectangle(&SPA_RECTANGLE(width, height)),
 		0);
@@ -44,6 +94,105 @@ static struct spa_pod *build_format(struct spa_pod_builder *b, enum spa_video_fo
 	return spa_pod_builder_pop(b, &f[0]);
 }
 
+// formats we convert the frames to on the cpu, see xdpw_convert()
+static struct spa_pod *build_converted_format(struct spa_pod_builder *b,
+		uint32_t width, uint32_t height, uint32_t framerate) {
+	struct spa_pod_frame f;
+
+	spa_pod_builder_push_object(b, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format,
+		SPA_POD_CHOICE_ENUM_Id(3, SPA_VIDEO_FORMAT_NV12,
+			SPA_VIDEO_FORMAT_NV12, SPA_VIDEO_FORMAT_I420), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_colorMatrix,
+		SPA_POD_Id(SPA_VIDEO_COLOR_MATRIX_BT709), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_colorRange,
+		SPA_POD_Id(SPA_VIDEO_COLOR_RANGE_16_235), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_size,
+		SPA_POD_Rectangle(&SPA_RECTANGLE(width, height)),
+		0);
+	// variable framerate
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_framerate,
+		SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_maxFramerate,
+		SPA_POD_CHOICE_RANGE_Fraction(
+			&SPA_FRACTION(framerate, 1),
+			&SPA_FRACTION(1, 1),
+			&SPA_FRACTION(framerate, 1)),
+		0);
+	return spa_pod_builder_pop(b, &f);
+}
+
+/*
+ * Build the EnumFormat params of a stream. If dmabufs can be used, the first
+ * param offers them with all usable modifiers, followed by the shm fallback.
+ * Frames with more than 8 bits per channel are also offered packed to 8 bits.
+ * Formats the frames are converted to come last, so the consumer only picks
+ * them if it can't take the captured format. Downscaled frames are offered
+ * at their scaled size only.
+ */
+static uint32_t build_formats(struct spa_pod_builder *b[static FORMAT_PARAMS_MAX],
+		struct xdpw_screencast_instance *cast,
+		const struct spa_pod *params[static FORMAT_PARAMS_MAX]) {
+	struct xdpw_screencopy_frame_info *shm_info = &cast->screencopy_frame_info[WL_SHM];
+	struct xdpw_screencopy_frame_info *dmabuf_info = &cast->screencopy_frame_info[DMABUF];
+	uint32_t param_count = 0;
+	uint32_t modifier_count;
+	uint64_t *modifiers = NULL;
+	uint32_t width, height, upright_width, upright_height;
+	xdpw_stream_size(cast, shm_info, &width, &height);
+	xdpw_upright_size(cast, shm_info, &upright_width, &upright_height);
+
+	if (!cast->avoid_dmabufs && dmabuf_info->format != 0 &&
+			xdpw_format_pw_from_drm_fourcc(dmabuf_info->format) != SPA_VIDEO_FORMAT_UNKNOWN &&
+			xdpw_query_dmabuf_modifiers(cast->ctx, dmabuf_info->format,
+				&modifier_count, &modifiers)) {
+		params[param_count] = build_format(b[param_count],
+			xdpw_format_pw_from_drm_fourcc(dmabuf_info->format),
+			dmabuf_info->width, dmabuf_info->height, cast->framerate,
+			modifiers, modifier_count);
+		assert(params[param_count] != NULL);
+		param_count++;
+		free(modifiers);
+	}
+
+	const struct xdpw_format_info *info = xdpw_format_info_from_drm_fourcc(shm_info->format);
+	if (!info) {
+		logprint(ERROR, "pipewire: unsupported shm format 0x%08x", shm_info->format);
+		return param_count;
+	}
+
+	// we only scale 8 bit channels
+	bool downscaled = width != upright_width || height != upright_height;
+	if (info->pw_format != SPA_VIDEO_FORMAT_UNKNOWN && (info->depth == 8 || !downscaled)) {
+		params[param_count] = build_format(b[param_count], info->pw_format,
+			width, height, cast->framerate,
+			NULL, 0);
+		assert(params[param_count] != NULL);
+		param_count++;
+	}
+
+	if (info->pack_format != info->drm_format) {
+		params[param_count] = build_format(b[param_count],
+			xdpw_format_pw_from_drm_fourcc(info->pack_format),
+			width, height, cast->framerate,
+			NULL, 0);
+		assert(params[param_count] != NULL);
+		param_count++;
+	}
+
+	if (cast->ctx->state->config->screencast_conf.convert_formats &&
+			xdpw_convert_supported(info->pack_format, DRM_FORMAT_NV12)) {
+		params[param_count] = build_converted_format(b[param_count],
+			width, height, cast->framerate);
+		assert(params[param_count] != NULL);
+		param_count++;
+	}
+
+	return param_count;
+}
+
 static void pwr_handle_stream_process(void *data) {
 	struct xdpw_screencast_instance *cast = data;
 
@@ -60,11 +209,16 @@ static void pwr_handle_stream_state_changed(void *data,
 	logprint(INFO, "pipewire: stream state changed to \"%s\"",
 		pw_stream_state_as_string(state));
 	logprint(INFO, "pipewire: node id is %d", (int)cast->node_id);
+	if (cast->node_id != SPA_ID_INVALID) {
+		xdpw_screencast_streams_ready(cast);
+	}
 
 	switch (state) {
 	case PW_STREAM_STATE_STREAMING:
 		cast->pwr_stream_state = true;
-		if (!cast->wlr_frame) {
+		// a new consumer needs the cursor bitmap
+		cast->cursor_bitmap_dirty = true;
+		if (cast->frame_count == 0) {
 			xdpw_wlr_frame_start(cast);
 		}
 		break;
@@ -79,38 +233,175 @@ static void pwr_handle_stream_param_changed(void *data, uint32_t id,
 	logprint(TRACE, "pipewire: stream parameters changed");
 	struct xdpw_screencast_instance *cast = data;
 	struct pw_stream *stream = cast->stream;
-	uint8_t params_buffer[1024];
-	struct spa_pod_builder b =
-		SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
-	const struct spa_pod *params[2];
+	uint8_t params_buffer[6][1024];
+	struct spa_pod_builder b[6] = {
+		SPA_POD_BUILDER_INIT(params_buffer[0], sizeof(params_buffer[0])),
+		SPA_POD_BUILDER_INIT(params_buffer[1], sizeof(params_buffer[1])),
+		SPA_POD_BUILDER_INIT(params_buffer[2], sizeof(params_buffer[2])),
+		SPA_POD_BUILDER_INIT(params_buffer[3], sizeof(params_buffer[3])),
+		SPA_POD_BUILDER_INIT(params_buffer[4], sizeof(params_buffer[4])),
+		SPA_POD_BUILDER_INIT(params_buffer[5], sizeof(params_buffer[5])),
+	};
+	const struct spa_pod *params[6];
+	uint32_t n_params = 5;
+	uint32_t blocks;
+	uint32_t data_type;
 
 	if (!param || id != SPA_PARAM_Format) {
 		return;
 	}
 
+	// the copy worker reads the formats of the instance
+	xdpw_copy_worker_wait(&cast->ctx->copy_worker, &cast->copy_job);
 	spa_format_video_raw_parse(param, &cast->pwr_format);
 	cast->framerate = (uint32_t)(cast->pwr_format.max_framerate.num / cast->pwr_format.max_framerate.denom);
+	cast->convert_format = xdpw_format_drm_fourcc_from_pw_yuv(cast->pwr_format.format);
+
+	const struct spa_pod_prop *prop_modifier;
+	if ((prop_modifier = spa_pod_find_prop(param, NULL, SPA_FORMAT_VIDEO_modifier)) != NULL) {
+		struct xdpw_screencopy_frame_info *frame_info = &cast->screencopy_frame_info[DMABUF];
+		cast->buffer_type = DMABUF;
+		data_type = 1<<SPA_DATA_DmaBuf;
+
+		if ((prop_modifier->flags & SPA_POD_PROP_FLAG_DONT_FIXATE) > 0) {
+			uint32_t n_modifiers, choice;
+			const struct spa_pod *pod_modifiers =
+				spa_pod_get_values(&prop_modifier->value, &n_modifiers, &choice);
+			const uint64_t *modifiers = SPA_POD_BODY_CONST(pod_modifiers);
+			if (choice == SPA_CHOICE_Enum && n_modifiers > 1) {
+				// skip the default value
+				modifiers++;
+				n_modifiers--;
+			}
+
+			uint64_t modifier;
+			if (!xdpw_fixate_dmabuf_modifier(cast->ctx, frame_info->format,
+					frame_info->width, frame_info->height,
+					modifiers, n_modifiers, &modifier)) {
+				logprint(WARN, "pipewire: unable to fixate a dmabuf modifier, falling back to shm");
+				cast->avoid_dmabufs = true;
+				pwr_update_stream_param(cast);
+				return;
+			}
+			logprint(DEBUG, "pipewire: fixated dmabuf modifier 0x%" PRIx64, modifier);
+
+			params[0] = fixate_format(&b[2], cast->pwr_format.format,
+				frame_info->width, frame_info->height, cast->framerate, modifier);
+			struct spa_pod_builder *builder[FORMAT_PARAMS_MAX] = {&b[0], &b[1], &b[3], &b[4]};
+			uint32_t n_params = build_formats(builder, cast, &params[1]);
+			pw_stream_update_params(stream, params, n_params + 1);
+			return;
+		}
+
+		if (cast->pwr_format.modifier == DRM_FORMAT_MOD_INVALID) {
+			blocks = 1;
+		} else {
+			blocks = xdpw_dmabuf_plane_count(cast->ctx, frame_info->format,
+				cast->pwr_format.modifier);
+		}
+	} else {
+		cast->buffer_type = WL_SHM;
+		blocks = 1;
+		data_type = 1<<SPA_DATA_MemFd;
+	}
 
-	params[0] = spa_pod_builder_add_object(&b,
-		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+	struct xdpw_screencopy_frame_info *shm_info = &cast->screencopy_frame_info[WL_SHM];
+	const struct xdpw_format_info *shm_format = xdpw_format_info_from_drm_fourcc(shm_info->format);
+	cast->pack_format = 0;
+	if (cast->buffer_type == WL_SHM && shm_format &&
+			shm_format->pack_format != shm_format->drm_format) {
+		enum spa_video_format packed = xdpw_format_pw_from_drm_fourcc(shm_format->pack_format);
+		if (cast->convert_format || cast->pwr_format.format == packed ||
+				cast->pwr_format.format == xdpw_format_pw_strip_alpha(packed)) {
+			cast->pack_format = shm_format->pack_format;
+		}
+	}
+	uint32_t size = shm_info->size;
+	uint32_t stride = shm_info->stride;
+	uint32_t upright_width, upright_height, stream_width, stream_height;
+	xdpw_upright_size(cast, shm_info, &upright_width, &upright_height);
+	xdpw_stream_size(cast, shm_info, &stream_width, &stream_height);
+	cast->downscaling = cast->buffer_type == WL_SHM &&
+		(stream_width != upright_width || stream_height != upright_height);
+	if (xdpw_copies_frames(cast)) {
+		struct xdpw_convert_layout layout;
+		xdpw_convert_get_layout(xdpw_copy_format(cast, shm_info->format),
+			cast->pwr_format.size.width, cast->pwr_format.size.height,
+			XDPW_CONVERT_ALIGN, &layout);
+		blocks = layout.plane_count;
+		size = layout.size;
+		stride = layout.stride[0];
+	}
+	if (cast->downscaling) {
+		logprint(DEBUG, "pipewire: downscaling frames from %ux%u to %ux%u with %s kernels",
+			upright_width, upright_height,
+			cast->pwr_format.size.width, cast->pwr_format.size.height,
+			xdpw_scale_impl_name());
+	}
+	if (cast->pack_format || cast->convert_format) {
+		logprint(DEBUG, "pipewire: %s frames with %s kernels",
+			cast->convert_format ? "converting" : "packing", xdpw_convert_impl_name());
+	}
+
+	logprint(DEBUG, "pipewire: negotiated %s buffers",
+		cast->buffer_type == DMABUF ? "dmabuf" : "shm");
+
+	struct spa_pod_frame f;
+	spa_pod_builder_push_object(&b[0], &f, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers);
+	spa_pod_builder_add(&b[0],
 		SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPW_PWR_BUFFERS, 1, 32),
-		SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
-		SPA_PARAM_BUFFERS_size,    SPA_POD_Int(cast->screencopy_frame.size),
-		SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(cast->screencopy_frame.stride),
+		SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(blocks),
 		SPA_PARAM_BUFFERS_align,   SPA_POD_Int(XDPW_PWR_ALIGN),
-		SPA_PARAM_BUFFERS_dataType,SPA_POD_CHOICE_FLAGS_Int(1<<SPA_DATA_MemFd));
+		SPA_PARAM_BUFFERS_dataType,SPA_POD_CHOICE_FLAGS_Int(data_type),
+		0);
+	if (cast->buffer_type == WL_SHM) {
+		spa_pod_builder_add(&b[0],
+			SPA_PARAM_BUFFERS_size,    SPA_POD_Int(size),
+			SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(stride),
+			0);
+	}
+	params[0] = spa_pod_builder_pop(&b[0], &f);
 
-	params[1] = spa_pod_builder_add_object(&b,
+	params[1] = spa_pod_builder_add_object(&b[1],
 		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
 		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
 		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
 
-	pw_stream_update_params(stream, params, 2);
+	params[2] = spa_pod_builder_add_object(&b[2],
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+		SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+			sizeof(struct spa_meta_region) * XDPW_DAMAGE_RECTS_MAX,
+			sizeof(struct spa_meta_region) * 1,
+			sizeof(struct spa_meta_region) * XDPW_DAMAGE_RECTS_MAX));
+
+	params[3] = spa_pod_builder_add_object(&b[3],
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoTransform),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_videotransform)));
+
+	params[4] = spa_pod_builder_add_object(&b[4],
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_region)));
+
+	if (cast->cursor_mode == METADATA) {
+		params[n_params++] = spa_pod_builder_add_object(&b[5],
+			SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+			SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+			SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+				XDPW_CURSOR_META_SIZE(XDPW_CURSOR_MAX_SIZE, XDPW_CURSOR_MAX_SIZE),
+				XDPW_CURSOR_META_SIZE(1, 1),
+				XDPW_CURSOR_META_SIZE(XDPW_CURSOR_MAX_SIZE, XDPW_CURSOR_MAX_SIZE)));
+	}
+
+	pw_stream_update_params(stream, params, n_params);
 }
 
 static void pwr_handle_stream_add_buffer(void *data, struct pw_buffer *buffer) {
 	struct xdpw_screencast_instance *cast = data;
 	struct spa_data *d;
+	enum spa_data_type t;
 
 	logprint(TRACE, "pipewire: add buffer event handle");
 
@@ -118,42 +409,61 @@ static void pwr_handle_stream_add_buffer(void *data, struct pw_buffer *buffer) {
 
 	// Select buffer type from negotiation result
 	if ((d[0].type & (1u << SPA_DATA_MemFd)) > 0) {
-		d[0].type = SPA_DATA_MemFd;
+		assert(cast->buffer_type == WL_SHM);
+		t = SPA_DATA_MemFd;
+	} else if ((d[0].type & (1u << SPA_DATA_DmaBuf)) > 0) {
+		assert(cast->buffer_type == DMABUF);
+		t = SPA_DATA_DmaBuf;
 	} else {
 		logprint(ERROR, "pipewire: unsupported buffer type");
 		cast->err = 1;
 		return;
 	}
 
-	logprint(TRACE, "pipewire: selected buffertype %u", d[0].type);
-	// Prepare buffer for choosen type
-	if (d[0].type == SPA_DATA_MemFd) {
-		d[0].maxsize = cast->screencopy_frame.size;
-		d[0].mapoffset = 0;
-		d[0].chunk->size = cast->screencopy_frame.size;
-		d[0].chunk->stride = cast->screencopy_frame.stride;
-		d[0].chunk->offset = 0;
-		d[0].flags = 0;
-		d[0].fd = anonymous_shm_open();
-		d[0].data = NULL;
-
-		if (d[0].fd == -1) {
-			logprint(ERROR, "pipewire: unable to create anonymous filedescriptor");
-			cast->err = 1;
-			return;
-		}
+	logprint(TRACE, "pipewire: selected buffertype %u", t);
 
-		if (ftruncate(d[0].fd, d[0].maxsize) < 0) {
-			logprint(ERROR, "pipewire: unable to truncate filedescriptor");
-			close(d[0].fd);
-			d[0].fd = -1;
-			cast->err = 1;
+	struct xdpw_screencopy_frame_info *frame_info = &cast->screencopy_frame_info[cast->buffer_type];
+	struct xdpw_buffer *xdpw_buffer;
+	if (xdpw_copies_frames(cast)) {
+		xdpw_buffer = xdpw_buffer_create_converted(cast->pwr_format.size.width,
+			cast->pwr_format.size.height, xdpw_copy_format(cast, frame_info->format));
+	} else {
+		xdpw_buffer = xdpw_buffer_create(cast, cast->buffer_type, frame_info);
+	}
+	if (xdpw_buffer == NULL) {
+		if (cast->buffer_type == DMABUF) {
+			logprint(WARN, "pipewire: failed to allocate dmabuf, falling back to shm");
+			cast->avoid_dmabufs = true;
+			pwr_update_stream_param(cast);
 			return;
 		}
+		logprint(ERROR, "pipewire: failed to create xdpw buffer");
+		cast->err = 1;
+		return;
+	}
 
-		// create wl_buffer
-		buffer->user_data = import_wl_shm_buffer(cast, d[0].fd, cast->screencopy_frame.format,
-			cast->screencopy_frame.width, cast->screencopy_frame.height, cast->screencopy_frame.stride);
+	if (xdpw_buffer->plane_count > (int)buffer->buffer->n_datas) {
+		logprint(ERROR, "pipewire: buffer has %d planes, but only %u blocks were negotiated",
+			xdpw_buffer->plane_count, buffer->buffer->n_datas);
+		xdpw_buffer_destroy(xdpw_buffer);
+		cast->err = 1;
+		return;
+	}
+
+	wl_list_insert(&cast->buffer_list, &xdpw_buffer->link);
+	buffer->user_data = xdpw_buffer;
+
+	// Prepare buffer for choosen type
+	for (int plane = 0; plane < xdpw_buffer->plane_count; plane++) {
+		d[plane].type = t;
+		d[plane].maxsize = xdpw_buffer->size[plane];
+		d[plane].mapoffset = xdpw_buffer->shm_slot ? xdpw_buffer->shm_slot->offset : 0;
+		d[plane].chunk->size = xdpw_buffer->size[plane] - xdpw_buffer->offset[plane];
+		d[plane].chunk->stride = xdpw_buffer->stride[plane];
+		d[plane].chunk->offset = xdpw_buffer->offset[plane];
+		d[plane].flags = 0;
+		d[plane].fd = xdpw_buffer->fd[plane];
+		d[plane].data = NULL;
 	}
 }
 
@@ -162,24 +472,53 @@ static void pwr_handle_stream_remove_buffer(void *data, struct pw_buffer *buffer
 
 	logprint(TRACE, "pipewire: remove buffer event handle");
 
-	struct spa_data *d = buffer->buffer->datas;
-	if (cast->current_frame.current_pw_buffer == buffer) {
-		logprint(TRACE, "pipewire: remove buffer currently in use");
-		cast->current_frame.current_pw_buffer = NULL;
-		cast->current_frame.buffer = NULL;
+	struct xdpw_buffer *xdpw_buffer = buffer->user_data;
+	if (cast->copy_job.pending && cast->copy_frame.pw_buffer == buffer) {
+		logprint(TRACE, "pipewire: remove buffer currently copied into");
+		xdpw_copy_worker_wait(&cast->ctx->copy_worker, &cast->copy_job);
+		cast->copy_frame.pw_buffer = NULL;
+		cast->copy_frame.xdpw_buffer = NULL;
 	}
-	switch (d[0].type) {
-	case SPA_DATA_MemFd:
-		wl_buffer_destroy(buffer->user_data);
-		close(d[0].fd);
-		break;
-	default:
-		break;
+	for (uint32_t i = 0; i < XDPW_MAX_FRAMES_IN_FLIGHT; i++) {
+		struct xdpw_frame *frame = &cast->frames[i];
+		if (frame->pw_buffer == buffer) {
+			logprint(TRACE, "pipewire: remove buffer currently in use");
+			frame->pw_buffer = NULL;
+			frame->xdpw_buffer = NULL;
+		}
+	}
+	for (uint32_t i = 0; i < cast->held_count; i++) {
+		if (cast->held_buffers[i] == buffer) {
+			cast->held_buffers[i] = cast->held_buffers[--cast->held_count];
+			break;
+		}
+	}
+	if (cast->last_buffer == buffer) {
+		cast->last_buffer = NULL;
+	}
+	if (xdpw_buffer) {
+		wl_list_remove(&xdpw_buffer->link);
+		xdpw_buffer_destroy(xdpw_buffer);
+	}
+	for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+		buffer->buffer->datas[plane].fd = -1;
+	}
+	buffer->user_data = NULL;
+}
+
+static void pwr_handle_stream_io_changed(void *data, uint32_t id,
+		void *area, uint32_t size) {
+	struct xdpw_screencast_instance *cast = data;
+
+	if (id == SPA_IO_Position) {
+		logprint(TRACE, "pipewire: position io %s", area ? "set" : "removed");
+		cast->position = area;
 	}
 }
 
 static const struct pw_stream_events pwr_stream_events = {
 	PW_VERSION_STREAM_EVENTS,
+	.io_changed = pwr_handle_stream_io_changed,
 	.state_changed = pwr_handle_stream_state_changed,
 	.param_changed = pwr_handle_stream_param_changed,
 	.add_buffer = pwr_handle_stream_add_buffer,
@@ -195,83 +534,616 @@ bool xdpw_pwr_is_driving(struct xdpw_screencast_instance *cast) {
 	return pw_stream_is_driving(cast->stream);
 }
 
-void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast) {
+void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
 	logprint(TRACE, "pipewire: dequeueing buffer");
 
-	assert(cast->current_frame.current_pw_buffer == NULL);
-	if ((cast->current_frame.current_pw_buffer = pw_stream_dequeue_buffer(cast->stream)) == NULL) {
-		logprint(WARN, "pipewire: out of buffers");
-		cast->current_frame.buffer = NULL;
+	assert(frame->pw_buffer == NULL);
+	if ((frame->pw_buffer = pw_stream_dequeue_buffer(cast->stream)) == NULL) {
+		logprint(TRACE, "pipewire: out of buffers");
+		frame->xdpw_buffer = NULL;
 		return;
 	}
 
-	struct spa_buffer *spa_buf = cast->current_frame.current_pw_buffer->buffer;
-	struct spa_data *d = spa_buf->datas;
-	cast->current_frame.size = d[0].chunk->size;
-	cast->current_frame.stride = d[0].chunk->stride;
-	cast->current_frame.buffer = cast->current_frame.current_pw_buffer->user_data;
+	frame->xdpw_buffer = frame->pw_buffer->user_data;
+	if (frame->pw_buffer == cast->last_buffer) {
+		// it's captured into again
+		cast->last_buffer = NULL;
+	}
 }
 
-void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast) {
-	logprint(TRACE, "pipewire: exporting buffer");
+static void pwr_fill_damage_meta(struct spa_meta *meta, const struct xdpw_damage *frame_damage) {
+	uint32_t max_regions = meta->size / sizeof(struct spa_meta_region);
+	if (max_regions == 0) {
+		return;
+	}
 
-	struct pw_buffer *pw_buf = cast->current_frame.current_pw_buffer;
-	bool buffer_corrupt = cast->frame_state != XDPW_FRAME_STATE_SUCCESS;
+	// the consumer may have negotiated less regions than we track
+	struct xdpw_damage damage = *frame_damage;
+	xdpw_damage_reduce(&damage, max_regions);
+
+	uint32_t n_regions = 0;
+	struct spa_meta_region *region;
+	spa_meta_for_each(region, meta) {
+		if (n_regions >= damage.count) {
+			// an empty region terminates the list
+			region->region = SPA_REGION(0, 0, 0, 0);
+			break;
+		}
+		struct xdpw_frame_damage *rect = &damage.rects[n_regions++];
+		region->region = SPA_REGION(rect->x, rect->y, rect->width, rect->height);
+	}
+}
 
-	assert(pw_buf);
+/*
+ * Buffer age tracking: every buffer of the pool accumulates the damage of all
+ * frames it missed, so the damage reported with a buffer covers everything
+ * that changed since the buffer last held a frame.
+ */
+static void pwr_update_buffer_damage(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, bool buffer_corrupt) {
+	struct xdpw_buffer *buffer;
+	wl_list_for_each(buffer, &cast->buffer_list, link) {
+		if (buffer_corrupt) {
+			// we don't know what the compositor did, resync everything
+			xdpw_damage_set_full(&buffer->damage, buffer->width, buffer->height);
+		} else {
+			xdpw_damage_add_damage(&buffer->damage, &frame->damage);
+		}
+	}
+}
+
+// the transform turning a captured frame upright when we copy it
+static enum xdpw_transform pwr_copy_transform(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	enum xdpw_transform transform = frame->y_invert ?
+		XDPW_TRANSFORM_FLIPPED_180 : XDPW_TRANSFORM_NORMAL;
+	if (cast->apply_transform) {
+		transform = xdpw_transform_compose(transform,
+			xdpw_source_transform(cast));
+	}
+	return transform;
+}
+
+// brings the frame damage into the orientation and size of sent frames
+static void pwr_map_frame_damage(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, enum xdpw_transform transform) {
+	struct xdpw_buffer *src = frame->xdpw_buffer;
+	if (transform != cast->sent_transform) {
+		// everything moved, and copies kept between frames are stale
+		xdpw_damage_set_full(&frame->damage, src->width, src->height);
+		cast->sent_transform = transform;
+	}
+	xdpw_damage_transform(&frame->damage, transform, src->width, src->height);
+	if (cast->downscaling) {
+		bool swap = xdpw_transform_swaps(transform);
+		xdpw_damage_scale(&frame->damage, swap ? src->height : src->width,
+			swap ? src->width : src->height,
+			cast->pwr_format.size.width, cast->pwr_format.size.height);
+	}
+}
 
+/*
+ * A frame that isn't sent still moved the compositor's damage tracking on,
+ * so its damage has to reach the buffers that missed it.
+ */
+void xdpw_pwr_skip_frame(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	if (!frame->pw_buffer || !frame->xdpw_buffer) {
+		// captured elsewhere, we don't know how it relates to our buffers
+		pwr_update_buffer_damage(cast, frame, true);
+		return;
+	}
+
+	struct spa_meta_videotransform *vt = spa_buffer_find_meta_data(frame->pw_buffer->buffer,
+		SPA_META_VideoTransform, sizeof(*vt));
+	enum xdpw_transform transform = XDPW_TRANSFORM_NORMAL;
+	if (xdpw_copies_frames(cast)) {
+		transform = pwr_copy_transform(cast, frame);
+	} else if (frame->y_invert && !vt) {
+		// sent frames are flipped in place
+		transform = XDPW_TRANSFORM_FLIPPED_180;
+	}
+	pwr_map_frame_damage(cast, frame, transform);
+	pwr_update_buffer_damage(cast, frame, false);
+}
+
+void xdpw_pwr_hold_buffer(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *buffer) {
+	assert(cast->held_count < XDPW_MAX_HELD_BUFFERS);
+	if (cast->held_count == XDPW_MAX_HELD_BUFFERS) {
+		// can't happen, but don't lose the buffer: it goes back unused
+		logprint(ERROR, "pipewire: too many held buffers, returning one");
+		struct spa_buffer *spa_buf = buffer->buffer;
+		struct spa_meta_header *h;
+		if ((h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h)))) {
+			h->pts = -1;
+			h->flags = SPA_META_HEADER_FLAG_CORRUPTED;
+		}
+		for (uint32_t plane = 0; plane < spa_buf->n_datas; plane++) {
+			spa_buf->datas[plane].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
+		}
+		pw_stream_queue_buffer(cast->stream, buffer);
+		return;
+	}
+	cast->held_buffers[cast->held_count++] = buffer;
+}
+
+/*
+ * The cursor bitmap is only attached when it changed since the consumer last
+ * received one, all other buffers carry just the position.
+ */
+static void pwr_fill_cursor_meta(struct xdpw_screencast_instance *cast,
+		struct spa_meta *meta, bool buffer_corrupt) {
+	struct spa_meta_cursor *mcs = meta->data;
+	struct xdpw_cursor *cursor = &cast->cursor;
+
+	if (meta->size < XDPW_CURSOR_META_SIZE(0, 0)) {
+		return;
+	}
+	if (buffer_corrupt) {
+		// the consumer drops this buffer, don't lose the update
+		mcs->id = 0;
+		return;
+	}
+
+	mcs->id = 1;
+	mcs->flags = 0;
+	mcs->position.x = cursor->visible ? cursor->x : 0;
+	mcs->position.y = cursor->visible ? cursor->y : 0;
+	mcs->hotspot.x = 0;
+	mcs->hotspot.y = 0;
+	mcs->bitmap_offset = 0;
+
+	if (!cast->cursor_bitmap_dirty) {
+		return;
+	}
+
+	// an empty bitmap hides the cursor
+	uint32_t width = cursor->visible ? cursor->width : 0;
+	uint32_t height = cursor->visible ? cursor->height : 0;
+	if (meta->size < XDPW_CURSOR_META_SIZE(width, height)) {
+		logprint(DEBUG, "pipewire: cursor bitmap %ux%u exceeds the cursor meta", width, height);
+		return;
+	}
+
+	mcs->bitmap_offset = sizeof(struct spa_meta_cursor);
+	struct spa_meta_bitmap *mb = SPA_PTROFF(mcs, mcs->bitmap_offset, struct spa_meta_bitmap);
+	mb->format = cursor->visible ?
+		xdpw_format_pw_from_drm_fourcc(cursor->format) : SPA_VIDEO_FORMAT_BGRA;
+	mb->size.width = width;
+	mb->size.height = height;
+	mb->stride = width * 4;
+	mb->offset = sizeof(struct spa_meta_bitmap);
+	if (cursor->visible) {
+		memcpy(SPA_PTROFF(mb, mb->offset, void), cursor->bitmap, (size_t)width * height * 4);
+	}
+	cast->cursor_bitmap_dirty = false;
+}
+
+/*
+ * While we drive the graph its clock follows the capture timestamps, so
+ * followers see when a frame was captured and how long it took to arrive.
+ */
+static void pwr_update_clock(struct xdpw_screencast_instance *cast, int64_t pts) {
+	struct spa_io_clock *clock = &cast->position->clock;
+
+	uint64_t duration = cast->last_pts > 0 && pts > cast->last_pts ?
+		(uint64_t)(pts - cast->last_pts) : SPA_NSEC_PER_SEC / SPA_MAX(cast->framerate, 1u);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	clock->nsec = pts;
+	clock->rate = SPA_FRACTION(1, SPA_NSEC_PER_SEC);
+	clock->position = pts;
+	clock->duration = duration;
+	clock->delay = SPA_TIMESPEC_TO_NSEC(&now) - pts;
+	clock->rate_diff = 1.0;
+	clock->next_nsec = pts + duration;
+}
+
+// the rows covered by any damage, the end is exclusive
+static void damage_rows(const struct xdpw_damage *damage, uint32_t *y0, uint32_t *y1) {
+	for (uint32_t i = 0; i < damage->count; i++) {
+		const struct xdpw_frame_damage *rect = &damage->rects[i];
+		if (rect->y < *y0) {
+			*y0 = rect->y;
+		}
+		if (rect->y + rect->height > *y1) {
+			*y1 = rect->y + rect->height;
+		}
+	}
+}
+
+/*
+ * Intermediate frames are kept, rows of them which didn't change are read
+ * again by the next stage later.
+ */
+static bool pwr_ensure_buffer(struct xdpw_buffer **buffer,
+		uint32_t format, uint32_t width, uint32_t height) {
+	if (*buffer && ((*buffer)->format != format || (*buffer)->width != width ||
+			(*buffer)->height != height)) {
+		xdpw_buffer_destroy(*buffer);
+		*buffer = NULL;
+	}
+	if (!*buffer) {
+		*buffer = xdpw_buffer_create_converted(width, height, format);
+	}
+	return *buffer != NULL;
+}
+
+// checks the frame fits the buffer and maps its damage to the sent frames
+static bool pwr_copy_prepare(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, struct xdpw_buffer *dst, enum xdpw_transform *transform) {
+	struct xdpw_buffer *src = frame->xdpw_buffer;
+	*transform = pwr_copy_transform(cast, frame);
+	bool swap = xdpw_transform_swaps(*transform);
+	if (!src || !src->data || !dst || !dst->data ||
+			dst->format != xdpw_copy_format(cast, src->format) ||
+			(!cast->downscaling && (dst->width != (swap ? src->height : src->width) ||
+				dst->height != (swap ? src->width : src->height)))) {
+		logprint(WARN, "pipewire: unable to copy frame");
+		return false;
+	}
+	pwr_map_frame_damage(cast, frame, *transform);
+	return true;
+}
+
+/*
+ * Packs, turns, downscales and/or converts the captured frame into the
+ * buffer, in that order. Only the rows the buffer missed since it last held a
+ * frame are written, upright. Touches nothing but the buffers of the instance,
+ * so it runs on the copy worker.
+ */
+static bool pwr_copy_frame(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, struct xdpw_buffer *dst, enum xdpw_transform transform) {
+	struct xdpw_buffer *src = frame->xdpw_buffer;
+	bool swap = xdpw_transform_swaps(transform);
+
+	uint32_t y0 = dst->height, y1 = 0;
+	damage_rows(&dst->damage, &y0, &y1);
+	damage_rows(&frame->damage, &y0, &y1);
+	if (y0 >= y1) {
+		return true;
+	}
+
+	// the upright frame
+	const uint8_t *data = src->data;
+	ptrdiff_t stride = src->stride[0];
+	uint32_t format = src->format;
+	uint32_t width = swap ? src->height : src->width;
+	uint32_t height = swap ? src->width : src->height;
+	bool last_stage = !cast->downscaling && !cast->convert_format;
+
+	// the rows the next stages read, in the captured frame
+	struct xdpw_frame_damage band = { .x = 0, .y = y0, .width = width, .height = y1 - y0 };
+	if (cast->downscaling) {
+		band.y = (uint64_t)y0 * height / dst->height;
+		band.height = ((uint64_t)y1 * height + dst->height - 1) / dst->height - band.y;
+	}
+	xdpw_transform_rect(&band, xdpw_transform_invert(transform), width, height);
+
+	if (cast->pack_format) {
+		struct xdpw_buffer *packed = dst;
+		if (transform != XDPW_TRANSFORM_NORMAL || !last_stage) {
+			if (!pwr_ensure_buffer(&cast->pack_buffer, cast->pack_format,
+					src->width, src->height)) {
+				logprint(WARN, "pipewire: unable to create pack buffer");
+				return false;
+			}
+			packed = cast->pack_buffer;
+		}
+		logprint(TRACE, "pipewire: packing %ux%u pixels at %u,%u", band.width, band.height,
+			band.x, band.y);
+		if (!xdpw_convert_pack(src->format, src->data, src->stride[0],
+				packed->data, packed->stride[0], band.x, band.y, band.width, band.height)) {
+			return false;
+		}
+		if (packed == dst) {
+			return true;
+		}
+		data = packed->data;
+		stride = packed->stride[0];
+		format = cast->pack_format;
+	}
+
+	if (transform == XDPW_TRANSFORM_FLIPPED_180 && !last_stage) {
+		// the next stage reads bottom-up instead
+		data += (size_t)(src->height - 1) * stride;
+		stride = -stride;
+	} else if (transform != XDPW_TRANSFORM_NORMAL || last_stage) {
+		struct xdpw_buffer *upright = dst;
+		if (!last_stage) {
+			if (!pwr_ensure_buffer(&cast->transform_buffer, format, width, height)) {
+				logprint(WARN, "pipewire: unable to create transform buffer");
+				return false;
+			}
+			upright = cast->transform_buffer;
+		}
+		logprint(TRACE, "pipewire: turning %ux%u pixels at %u,%u", band.width, band.height,
+			band.x, band.y);
+		xdpw_transform_image(transform, data, stride, src->width, src->height,
+			&band, upright->data, upright->stride[0]);
+		if (last_stage) {
+			return true;
+		}
+		data = upright->data;
+		stride = upright->stride[0];
+	}
+
+	if (cast->downscaling) {
+		struct xdpw_buffer *scaled = dst;
+		if (cast->convert_format) {
+			if (!pwr_ensure_buffer(&cast->scale_buffer, format, dst->width, dst->height)) {
+				logprint(WARN, "pipewire: unable to create downscaling buffer");
+				return false;
+			}
+			scaled = cast->scale_buffer;
+		}
+		logprint(TRACE, "pipewire: downscaling rows %u to %u", y0, y1);
+		if (!xdpw_scale_box_rows(&cast->scale, data, stride, width, height,
+				scaled->data, scaled->stride[0], dst->width, dst->height, y0, y1)) {
+			return false;
+		}
+		if (!cast->convert_format) {
+			return true;
+		}
+		data = scaled->data;
+		stride = scaled->stride[0];
+	}
+
+	struct xdpw_convert_plane planes[XDPW_CONVERT_MAX_PLANES];
+	for (int plane = 0; plane < dst->plane_count; plane++) {
+		planes[plane] = (struct xdpw_convert_plane) {
+			.data = (uint8_t *)dst->data + dst->offset[plane],
+			.stride = dst->stride[plane],
+		};
+	}
+	logprint(TRACE, "pipewire: converting rows %u to %u", y0, y1);
+	return xdpw_convert(dst->format, planes, format, data, stride,
+		dst->width, dst->height, y0, y1);
+}
+
+/*
+ * Fills the buffer of a failed capture with the last frame that was sent
+ * intact, which stays untouched until it's dequeued again. Consumers get a
+ * repeated frame instead of a corrupted one.
+ */
+static bool pwr_repeat_last_frame(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	struct xdpw_buffer *dst = frame->pw_buffer->user_data;
+	struct xdpw_buffer *src = cast->last_buffer ? cast->last_buffer->user_data : NULL;
+	if (!src || !dst || !src->data || !dst->data || src->format != dst->format ||
+			src->width != dst->width || src->height != dst->height ||
+			src->size[0] != dst->size[0] || src->stride[0] != dst->stride[0]) {
+		return false;
+	}
+
+	// all planes share the mapping
+	memcpy(dst->data, src->data, dst->size[0]);
+	frame->y_invert = cast->last_y_invert;
+	// the capture would have been taken now
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	frame->pts = SPA_TIMESPEC_TO_NSEC(&now);
+	logprint(DEBUG, "pipewire: repeating the last frame");
+	return true;
+}
+
+// fills the metadata of the frame's buffer and queues it
+static void pwr_export_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, bool buffer_corrupt, bool repeated) {
+	struct pw_buffer *pw_buf = frame->pw_buffer;
 	struct spa_buffer *spa_buf = pw_buf->buffer;
 	struct spa_data *d = spa_buf->datas;
-
-	if (cast->current_frame.y_invert) {
-		//TODO: Flip buffer or set stride negative
-		buffer_corrupt = true;
-		cast->err = 1;
+	struct xdpw_buffer *xdpw_buffer = pw_buf->user_data;
+
+	struct spa_meta_region *crop;
+	if ((crop = spa_buffer_find_meta_data(spa_buf, SPA_META_VideoCrop, sizeof(*crop)))) {
+		// the compositor clips regions, the buffer holds exactly what was captured
+		crop->region.position = SPA_POINT(0, 0);
+		crop->region.size = SPA_RECTANGLE(cast->pwr_format.size.width,
+			cast->pwr_format.size.height);
 	}
 
 	struct spa_meta_header *h;
 	if ((h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h)))) {
-		h->pts = -1;
+		h->pts = buffer_corrupt ? -1 : frame->pts;
 		h->flags = buffer_corrupt ? SPA_META_HEADER_FLAG_CORRUPTED : 0;
 		h->seq = cast->seq++;
 		h->dts_offset = 0;
 	}
 
-	if (buffer_corrupt) {
-		d[0].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
-	} else {
-		d[0].chunk->flags = SPA_CHUNK_FLAG_NONE;
+	if (!buffer_corrupt && frame->pts >= 0) {
+		if (cast->position && xdpw_pwr_is_driving(cast)) {
+			pwr_update_clock(cast, frame->pts);
+		}
+		cast->last_pts = frame->pts;
+	}
+
+	// we don't know what the compositor did with the damage of a failed capture
+	pwr_update_buffer_damage(cast, frame, buffer_corrupt || repeated);
+
+	struct spa_meta *damage;
+	if (xdpw_buffer && (damage = spa_buffer_find_meta(spa_buf, SPA_META_VideoDamage))) {
+		pwr_fill_damage_meta(damage, &xdpw_buffer->damage);
+	}
+	if (xdpw_buffer && !buffer_corrupt) {
+		xdpw_damage_clear(&xdpw_buffer->damage);
+	}
+
+	struct spa_meta *cursor;
+	if ((cursor = spa_buffer_find_meta(spa_buf, SPA_META_Cursor))) {
+		pwr_fill_cursor_meta(cast, cursor, buffer_corrupt);
+	}
+
+	for (uint32_t plane = 0; plane < spa_buf->n_datas; plane++) {
+		if (buffer_corrupt) {
+			d[plane].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
+		} else {
+			d[plane].chunk->flags = SPA_CHUNK_FLAG_NONE;
+		}
 	}
 
 	logprint(TRACE, "********************");
+	logprint(TRACE, "pipewire: buffer type %s", cast->buffer_type == DMABUF ? "dmabuf" : "shm");
 	logprint(TRACE, "pipewire: fd %u", d[0].fd);
 	logprint(TRACE, "pipewire: size %d", d[0].maxsize);
 	logprint(TRACE, "pipewire: stride %d", d[0].chunk->stride);
-	logprint(TRACE, "pipewire: width %d", cast->screencopy_frame.width);
-	logprint(TRACE, "pipewire: height %d", cast->screencopy_frame.height);
-	logprint(TRACE, "pipewire: y_invert %d", cast->current_frame.y_invert);
+	logprint(TRACE, "pipewire: width %d", cast->pwr_format.size.width);
+	logprint(TRACE, "pipewire: height %d", cast->pwr_format.size.height);
+	logprint(TRACE, "pipewire: y_invert %d", frame->y_invert);
 	logprint(TRACE, "********************");
 
 	pw_stream_queue_buffer(cast->stream, pw_buf);
+	if (!buffer_corrupt) {
+		cast->last_buffer = pw_buf;
+		cast->last_y_invert = frame->y_invert;
+	}
 
-	cast->current_frame.current_pw_buffer = NULL;
-	cast->current_frame.buffer = NULL;
+	frame->pw_buffer = NULL;
+	frame->xdpw_buffer = NULL;
 }
 
-void pwr_update_stream_param(struct xdpw_screencast_instance *cast) {
-	logprint(TRACE, "pipewire: stream update parameters");
-	struct pw_stream *stream = cast->stream;
-	uint8_t params_buffer[1024];
-	struct spa_pod_builder b =
-		SPA_POD_BUILDER_INIT(params_buffer, sizeof(params_buffer));
-	const struct spa_pod *params[1];
+static void pwr_copy_job_run(struct xdpw_copy_job *job) {
+	struct xdpw_screencast_instance *cast = job->data;
+	struct xdpw_frame *frame = &cast->copy_frame;
+	cast->copy_ok = pwr_copy_frame(cast, frame, frame->pw_buffer->user_data,
+		cast->copy_transform);
+}
+
+// hands the frame to the copy worker, false if it has to be copied right away
+static bool pwr_copy_submit(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame, enum xdpw_transform transform) {
+	struct xdpw_copy_worker *worker = &cast->ctx->copy_worker;
+	if (!worker->running) {
+		return false;
+	}
 
-	enum spa_video_format format = xdpw_format_pw_from_wl_shm(cast->screencopy_frame.format);
+	cast->copy_frame = *frame;
+	cast->copy_transform = transform;
+	cast->copy_job.func = pwr_copy_job_run;
+	cast->copy_job.data = cast;
+	if (!xdpw_copy_worker_submit(worker, &cast->copy_job)) {
+		return false;
+	}
+	logprint(TRACE, "pipewire: frame handed to the copy worker");
+	return true;
+}
 
-	params[0] = build_format(&b, format,
-			cast->screencopy_frame.width, cast->screencopy_frame.height, cast->framerate);
+// sends the frame the copy worker is done with
+static void pwr_copy_complete(struct xdpw_screencast_instance *cast) {
+	struct xdpw_frame *frame = &cast->copy_frame;
+	logprint(TRACE, "pipewire: frame copied by the copy worker");
+
+	if (!frame->pw_buffer) {
+		// the buffer was removed while it was copied into
+	} else if (!cast->pwr_stream_state) {
+		// paused meanwhile, the copy may be incomplete
+		pwr_update_buffer_damage(cast, frame, true);
+		xdpw_pwr_hold_buffer(cast, frame->pw_buffer);
+	} else {
+		pwr_export_buffer(cast, frame, !cast->copy_ok, false);
+	}
+	frame->pw_buffer = NULL;
+	frame->xdpw_buffer = NULL;
 
-	pw_stream_update_params(stream, params, 1);
+	xdpw_wlr_frames_resume(cast);
+}
+
+static int pwr_dispatch_copies(struct xdpw_event_loop *loop,
+		struct xdpw_event_source *source) {
+	struct xdpw_screencast_context *ctx = source->data;
+
+	uint64_t count;
+	if (read(source->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		return -errno;
+	}
+
+	struct xdpw_copy_job *job;
+	while ((job = xdpw_copy_worker_pop_done(&ctx->copy_worker))) {
+		pwr_copy_complete(job->data);
+	}
+	return 0;
+}
+
+// drops a frame at the copy worker, before the buffers it uses are destroyed
+void xdpw_pwr_copy_cancel(struct xdpw_screencast_instance *cast) {
+	xdpw_copy_worker_cancel(&cast->ctx->copy_worker, &cast->copy_job);
+	cast->copy_frame.pw_buffer = NULL;
+	cast->copy_frame.xdpw_buffer = NULL;
+}
+
+void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	logprint(TRACE, "pipewire: exporting buffer");
+
+	struct pw_buffer *pw_buf = frame->pw_buffer;
+	assert(pw_buf);
+
+	bool repeated = frame->state == XDPW_FRAME_STATE_FAILED &&
+		pwr_repeat_last_frame(cast, frame);
+	bool buffer_corrupt = frame->state != XDPW_FRAME_STATE_SUCCESS && !repeated;
+
+	struct spa_buffer *spa_buf = pw_buf->buffer;
+	struct xdpw_buffer *xdpw_buffer = pw_buf->user_data;
+	struct spa_meta_videotransform *vt = spa_buffer_find_meta_data(spa_buf,
+		SPA_META_VideoTransform, sizeof(*vt));
+	if (vt) {
+		// whatever we don't do ourselves is left to the consumer
+		enum xdpw_transform transform = frame->y_invert && !xdpw_copies_frames(cast) ?
+			XDPW_TRANSFORM_FLIPPED_180 : XDPW_TRANSFORM_NORMAL;
+		if (!cast->apply_transform) {
+			transform = xdpw_transform_compose(transform,
+				xdpw_source_transform(cast));
+		}
+		vt->transform = (enum spa_meta_videotransform_value)transform;
+	}
+	if (repeated) {
+		// already in the orientation it was sent in
+	} else if (!buffer_corrupt && xdpw_copies_frames(cast)) {
+		enum xdpw_transform transform;
+		buffer_corrupt = !pwr_copy_prepare(cast, frame, xdpw_buffer, &transform);
+		if (!buffer_corrupt && pwr_copy_submit(cast, frame, transform)) {
+			// sent by pwr_copy_complete()
+			frame->pw_buffer = NULL;
+			frame->xdpw_buffer = NULL;
+			return;
+		}
+		buffer_corrupt = buffer_corrupt ||
+			!pwr_copy_frame(cast, frame, xdpw_buffer, transform);
+	} else if (!buffer_corrupt && frame->y_invert && !vt) {
+		// the consumer can't flip the buffer itself
+		if (xdpw_buffer && xdpw_buffer->data) {
+			xdpw_flip_y(xdpw_buffer->data, xdpw_buffer->stride[0], xdpw_buffer->height);
+			pwr_map_frame_damage(cast, frame, XDPW_TRANSFORM_FLIPPED_180);
+		} else {
+			logprint(WARN, "pipewire: unable to flip dmabuf, falling back to shm");
+			buffer_corrupt = true;
+			cast->avoid_dmabufs = true;
+			frame->state = XDPW_FRAME_STATE_RENEG;
+		}
+	}
+
+	pwr_export_buffer(cast, frame, buffer_corrupt, repeated);
+}
+
+void pwr_update_stream_param(struct xdpw_screencast_instance *cast) {
+	logprint(TRACE, "pipewire: stream update parameters");
+	struct pw_stream *stream = cast->stream;
+	uint8_t params_buffer[FORMAT_PARAMS_MAX][1024];
+	struct spa_pod_builder b[FORMAT_PARAMS_MAX] = {
+		SPA_POD_BUILDER_INIT(params_buffer[0], sizeof(params_buffer[0])),
+		SPA_POD_BUILDER_INIT(params_buffer[1], sizeof(params_buffer[1])),
+		SPA_POD_BUILDER_INIT(params_buffer[2], sizeof(params_buffer[2])),
+		SPA_POD_BUILDER_INIT(params_buffer[3], sizeof(params_buffer[3])),
+	};
+	struct spa_pod_builder *builder[FORMAT_PARAMS_MAX] = {&b[0], &b[1], &b[2], &b[3]};
+	const struct spa_pod *params[FORMAT_PARAMS_MAX];
+
+	uint32_t n_params = build_formats(builder, cast, params);
+
+	pw_stream_update_params(stream, params, n_params);
 }
 
 void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast) {
@@ -280,8 +1152,14 @@ void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast) {
 
 	pw_loop_enter(state->pw_loop);
 
-	uint8_t buffer[1024];
-	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	uint8_t buffer[FORMAT_PARAMS_MAX][1024];
+	struct spa_pod_builder b[FORMAT_PARAMS_MAX] = {
+		SPA_POD_BUILDER_INIT(buffer[0], sizeof(buffer[0])),
+		SPA_POD_BUILDER_INIT(buffer[1], sizeof(buffer[1])),
+		SPA_POD_BUILDER_INIT(buffer[2], sizeof(buffer[2])),
+		SPA_POD_BUILDER_INIT(buffer[3], sizeof(buffer[3])),
+	};
+	struct spa_pod_builder *builder[FORMAT_PARAMS_MAX] = {&b[0], &b[1], &b[2], &b[3]};
 
 	char name[] = "xdpw-stream-XXXXXX";
 	randname(name + strlen(name) - 6);
@@ -296,10 +1174,8 @@ void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast) {
 	}
 	cast->pwr_stream_state = false;
 
-	enum spa_video_format format = xdpw_format_pw_from_wl_shm(cast->screencopy_frame.format);
-
-	const struct spa_pod *param = build_format(&b, format,
-			cast->screencopy_frame.width, cast->screencopy_frame.height, cast->framerate);
+	const struct spa_pod *params[FORMAT_PARAMS_MAX];
+	uint32_t n_params = build_formats(builder, cast, params);
 
 	pw_stream_add_listener(cast->stream, &cast->stream_listener,
 		&pwr_stream_events, cast);
@@ -309,7 +1185,7 @@ void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast) {
 		PW_ID_ANY,
 		(PW_STREAM_FLAG_DRIVER |
 			PW_STREAM_FLAG_ALLOC_BUFFERS),
-		&param, 1);
+		params, n_params);
 }
 
 void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast) {
@@ -322,11 +1198,21 @@ void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast) {
 	pw_stream_disconnect(cast->stream);
 	pw_stream_destroy(cast->stream);
 	cast->stream = NULL;
+	cast->position = NULL;
 }
 
 int xdpw_pwr_context_create(struct xdpw_state *state) {
 	struct xdpw_screencast_context *ctx = &state->screencast;
 
+	if (!ctx->copy_worker.running && xdpw_copy_worker_init(&ctx->copy_worker) &&
+			!xdpw_event_loop_add_fd(state->event_loop, "copy", ctx->copy_worker.done_fd,
+				XDPW_EVENT_PRIORITY_FRAME, pwr_dispatch_copies, ctx)) {
+		xdpw_copy_worker_finish(&ctx->copy_worker);
+	}
+	if (!ctx->copy_worker.running) {
+		logprint(WARN, "pipewire: frames are copied on the main thread");
+	}
+
 	logprint(DEBUG, "pipewire: establishing connection to core");
 
 	if (!ctx->pwr_context) {
@@ -361,4 +1247,6 @@ void xdpw_pwr_context_destroy(struct xdpw_state *state) {
 		pw_context_destroy(ctx->pwr_context);
 		ctx->pwr_context = NULL;
 	}
+
+	xdpw_copy_worker_finish(&ctx->copy_worker);
 }
@@ -0,0 +1,214 @@
+#include "scale.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCALE_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define SCALE_BPP 4
+
+struct scale_kernels {
+	const char *name;
+	// averages the 2x2 blocks of two rows, returns the number of pixels written
+	uint32_t (*halve_row)(const uint8_t *row0, const uint8_t *row1,
+		uint8_t *dst, uint32_t dst_width);
+};
+
+static uint32_t halve_row_scalar(const uint8_t *row0, const uint8_t *row1,
+		uint8_t *dst, uint32_t dst_width) {
+	for (uint32_t x = 0; x < dst_width; x++) {
+		const uint8_t *p0 = row0 + 2 * SCALE_BPP * x;
+		const uint8_t *p1 = row1 + 2 * SCALE_BPP * x;
+		for (uint32_t c = 0; c < SCALE_BPP; c++) {
+			dst[SCALE_BPP * x + c] =
+				(p0[c] + p0[SCALE_BPP + c] + p1[c] + p1[SCALE_BPP + c] + 2) >> 2;
+		}
+	}
+	return dst_width;
+}
+
+static const struct scale_kernels kernels_scalar = {
+	.name = "scalar",
+	.halve_row = halve_row_scalar,
+};
+
+#ifdef SCALE_HAVE_AVX2
+// channel sums of the 2x2 blocks of 8 pixels, in the order 0 1 | 2 3
+__attribute__((target("avx2")))
+static inline __m256i halve_sum_avx2(__m256i row0, __m256i row1) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(row0, zero),
+		_mm256_unpacklo_epi8(row1, zero));
+	__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(row0, zero),
+		_mm256_unpackhi_epi8(row1, zero));
+	lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+	hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+	return _mm256_unpacklo_epi64(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static uint32_t halve_row_avx2(const uint8_t *row0, const uint8_t *row1,
+		uint8_t *dst, uint32_t dst_width) {
+	__m256i round = _mm256_set1_epi16(2);
+	uint32_t x = 0;
+	for (; x + 8 <= dst_width; x += 8) {
+		const uint8_t *p0 = row0 + 2 * SCALE_BPP * x;
+		const uint8_t *p1 = row1 + 2 * SCALE_BPP * x;
+		__m256i a = halve_sum_avx2(_mm256_loadu_si256((const __m256i *)p0),
+			_mm256_loadu_si256((const __m256i *)p1));
+		__m256i b = halve_sum_avx2(_mm256_loadu_si256((const __m256i *)(p0 + 32)),
+			_mm256_loadu_si256((const __m256i *)(p1 + 32)));
+		a = _mm256_srli_epi16(_mm256_add_epi16(a, round), 2);
+		b = _mm256_srli_epi16(_mm256_add_epi16(b, round), 2);
+		// packing interleaves the lanes, 0 1 4 5 | 2 3 6 7
+		__m256i out = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(dst + SCALE_BPP * x), out);
+	}
+	return x;
+}
+
+static const struct scale_kernels kernels_avx2 = {
+	.name = "avx2",
+	.halve_row = halve_row_avx2,
+};
+#endif
+
+static const struct scale_kernels *kernels = NULL;
+
+static const struct scale_kernels *scale_kernels(void) {
+	if (kernels) {
+		return kernels;
+	}
+	kernels = &kernels_scalar;
+#ifdef SCALE_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels = &kernels_avx2;
+	}
+#endif
+	return kernels;
+}
+
+void xdpw_scale_set_simd(bool enabled) {
+	kernels = enabled ? NULL : &kernels_scalar;
+}
+
+const char *xdpw_scale_impl_name(void) {
+	return scale_kernels()->name;
+}
+
+void xdpw_scale_finish(struct xdpw_scale_state *state) {
+	free(state->x_spans);
+	free(state->acc);
+	*state = (struct xdpw_scale_state) {0};
+}
+
+static void span(uint32_t i, uint32_t src_size, uint32_t dst_size,
+		uint32_t *start, uint32_t *end) {
+	*start = (uint64_t)i * src_size / dst_size;
+	*end = (uint64_t)(i + 1) * src_size / dst_size;
+	if (*end <= *start) {
+		// upscaling repeats the nearest pixel
+		*end = *start + 1;
+	}
+}
+
+static bool scale_prepare(struct xdpw_scale_state *state,
+		uint32_t src_width, uint32_t dst_width) {
+	if (state->x_spans && state->src_width == src_width &&
+			state->dst_width == dst_width) {
+		return true;
+	}
+
+	xdpw_scale_finish(state);
+	state->x_spans = calloc(2 * (size_t)dst_width, sizeof(uint32_t));
+	state->acc = calloc(SCALE_BPP * (size_t)dst_width, sizeof(uint32_t));
+	if (!state->x_spans || !state->acc) {
+		xdpw_scale_finish(state);
+		return false;
+	}
+
+	for (uint32_t x = 0; x < dst_width; x++) {
+		span(x, src_width, dst_width, &state->x_spans[2 * x], &state->x_spans[2 * x + 1]);
+	}
+	state->src_width = src_width;
+	state->dst_width = dst_width;
+	return true;
+}
+
+bool xdpw_scale_box(struct xdpw_scale_state *state,
+		const uint8_t *src, ptrdiff_t src_stride, uint32_t src_width, uint32_t src_height,
+		uint8_t *dst, uint32_t dst_stride, uint32_t dst_width, uint32_t dst_height) {
+	return xdpw_scale_box_rows(state, src, src_stride, src_width, src_height,
+		dst, dst_stride, dst_width, dst_height, 0, dst_height);
+}
+
+bool xdpw_scale_box_rows(struct xdpw_scale_state *state,
+		const uint8_t *src, ptrdiff_t src_stride, uint32_t src_width, uint32_t src_height,
+		uint8_t *dst, uint32_t dst_stride, uint32_t dst_width, uint32_t dst_height,
+		uint32_t y0, uint32_t y1) {
+	if (y1 > dst_height) {
+		y1 = dst_height;
+	}
+
+	if (src_width == dst_width && src_height == dst_height) {
+		for (uint32_t y = y0; y < y1; y++) {
+			memcpy(dst + (size_t)y * dst_stride, src + y * src_stride,
+				(size_t)dst_width * SCALE_BPP);
+		}
+		return true;
+	}
+
+	if (src_width == 2 * dst_width && src_height == 2 * dst_height) {
+		// outputs with a scale of 2, every pixel is the mean of a 2x2 block
+		const struct scale_kernels *k = scale_kernels();
+		for (uint32_t y = y0; y < y1; y++) {
+			const uint8_t *row0 = src + (ptrdiff_t)(2 * y) * src_stride;
+			const uint8_t *row1 = row0 + src_stride;
+			uint8_t *out = dst + (size_t)y * dst_stride;
+			uint32_t done = k->halve_row(row0, row1, out, dst_width);
+			halve_row_scalar(row0 + 2 * SCALE_BPP * done, row1 + 2 * SCALE_BPP * done,
+				out + SCALE_BPP * done, dst_width - done);
+		}
+		return true;
+	}
+
+	if (!scale_prepare(state, src_width, dst_width)) {
+		return false;
+	}
+
+	uint32_t *acc = state->acc;
+	for (uint32_t y = y0; y < y1; y++) {
+		uint32_t sy0, sy1;
+		span(y, src_height, dst_height, &sy0, &sy1);
+
+		memset(acc, 0, SCALE_BPP * (size_t)dst_width * sizeof(uint32_t));
+		for (uint32_t sy = sy0; sy < sy1; sy++) {
+			const uint8_t *row = src + sy * src_stride;
+			for (uint32_t x = 0; x < dst_width; x++) {
+				uint32_t *sum = acc + SCALE_BPP * x;
+				const uint8_t *p = row + SCALE_BPP * state->x_spans[2 * x];
+				const uint8_t *end = row + SCALE_BPP * state->x_spans[2 * x + 1];
+				for (; p < end; p += SCALE_BPP) {
+					sum[0] += p[0];
+					sum[1] += p[1];
+					sum[2] += p[2];
+					sum[3] += p[3];
+				}
+			}
+		}
+
+		uint8_t *out = dst + (size_t)y * dst_stride;
+		for (uint32_t x = 0; x < dst_width; x++) {
+			uint32_t n = (state->x_spans[2 * x + 1] - state->x_spans[2 * x]) * (sy1 - sy0);
+			const uint32_t *sum = acc + SCALE_BPP * x;
+			for (uint32_t c = 0; c < SCALE_BPP; c++) {
+				out[SCALE_BPP * x + c] = (sum[c] + n / 2) / n;
+			}
+		}
+	}
+	return true;
+}
@@ -1,65 +1,85 @@
 #include "screencast.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <assert.h>
-#include <sys/wait.h>
 #include <sys/mman.h>
-#include <spa/utils/result.h>
+#include <sys/param.h>
+#include <time.h>
 
 #include "pipewire_screencast.h"
 #include "wlr_screencast.h"
+#include "simulcast.h"
 #include "xdpw.h"
 #include "logger.h"
+#include "subprocess.h"
+#include "timespec_util.h"
 
 static const char object_path[] = "/org/freedesktop/portal/desktop";
 static const char interface_name[] = "org.freedesktop.impl.portal.ScreenCast";
 
-void exec_with_shell(char *command) {
-	pid_t pid1 = fork();
-	if (pid1 < 0) {
-		perror("fork");
+// the command isn't waited for, it's only reaped once it exits
+void exec_with_shell(struct xdpw_state *state, char *command) {
+	struct xdpw_subprocess_options options = {0};
+	if (!xdpw_subprocess_spawn(state, command, &options, NULL, NULL)) {
+		logprint(ERROR, "xdpw: failed to execute %s", command);
+	}
+}
+
+// the config value is either "logical" or a factor up to 1
+static void instance_init_downscale(struct xdpw_screencast_instance *cast,
+		const char *downscale) {
+	if (!downscale) {
+		return;
+	}
+	if (cast->cursor_mode == METADATA) {
+		// the cursor is extracted from and positioned on the captured frame
+		logprint(INFO, "xdpw: metadata cursor mode streams at the captured size");
 		return;
-	} else if (pid1 == 0) {
-		pid_t pid2 = fork();
-		if (pid2 < 0) {
-			perror("fork");
-		} else if (pid2 == 0) {
-			char *const argv[] = {
-				"sh",
-				"-c",
-				command,
-				NULL,
-			};
-			execvp("sh", argv);
-			perror("execvp");
-			_exit(127);
+	}
+	if (strcmp(downscale, "logical") == 0) {
+		if (cast->source_type == WINDOW) {
+			// the window's scale isn't known
+			logprint(INFO, "xdpw: windows stream at their buffer size");
+			return;
 		}
-		_exit(0);
+		cast->downscale_logical = true;
+		return;
 	}
-	int stat;
-	if (waitpid(pid1, &stat, 0) < 0) {
-		perror("waitpid");
+
+	char *end;
+	double factor = strtod(downscale, &end);
+	if (*end != '\0' || !(factor > 0 && factor <= 1)) {
+		logprint(ERROR, "xdpw: invalid downscale %s", downscale);
+		return;
 	}
+	cast->downscale_factor = factor;
 }
 
 void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
-		struct xdpw_screencast_instance *cast, struct xdpw_wlr_output *out, bool with_cursor) {
+		struct xdpw_screencast_instance *cast, struct xdpw_wlr_output *out,
+		struct xdpw_toplevel *toplevel, struct xdpw_region *region,
+		enum cursor_modes cursor_mode) {
 
 	// only run exec_before if there's no other instance running that already ran it
 	if (wl_list_empty(&ctx->screencast_instances)) {
 		char *exec_before = ctx->state->config->screencast_conf.exec_before;
 		if (exec_before) {
 			logprint(INFO, "xdpw: executing %s before screencast", exec_before);
-			exec_with_shell(exec_before);
+			exec_with_shell(ctx->state, exec_before);
 		}
 	}
 
 	cast->ctx = ctx;
+	cast->source_type = toplevel ? WINDOW : MONITOR;
 	cast->target_output = out;
+	cast->target_toplevel = toplevel;
+	cast->region = *region;
 	if (ctx->state->config->screencast_conf.max_fps > 0) {
 		cast->max_framerate = ctx->state->config->screencast_conf.max_fps < (uint32_t)out->framerate ?
 			ctx->state->config->screencast_conf.max_fps : (uint32_t)out->framerate;
@@ -67,9 +87,38 @@ void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
 		cast->max_framerate = (uint32_t)out->framerate;
 	}
 	cast->framerate = cast->max_framerate;
-	cast->with_cursor = with_cursor;
+	cast->cursor_mode = cursor_mode;
+	instance_init_downscale(cast, ctx->state->config->screencast_conf.downscale);
+	cast->apply_transform = cast->source_type == MONITOR &&
+		ctx->state->config->screencast_conf.apply_transform;
+	// the cursor is extracted and frames are scaled or turned on the cpu,
+	// which needs mapped shm buffers
+	cast->avoid_dmabufs = cursor_mode == METADATA ||
+		ctx->state->config->screencast_conf.simulcast ||
+		cast->downscale_logical || cast->downscale_factor > 0 ||
+		cast->apply_transform;
+	int frames_in_flight = ctx->state->config->screencast_conf.frames_in_flight;
+	if (frames_in_flight < 1) {
+		frames_in_flight = 1;
+	} else if (frames_in_flight > XDPW_MAX_FRAMES_IN_FLIGHT) {
+		frames_in_flight = XDPW_MAX_FRAMES_IN_FLIGHT;
+	}
+	cast->frame_depth = frames_in_flight;
+	if (cursor_mode == METADATA && cast->frame_depth > 1) {
+		// the cursor capture has to pair with its frame
+		logprint(INFO, "xdpw: metadata cursor mode captures one frame at a time");
+		cast->frame_depth = 1;
+	}
+	cast->ext_capture = cast->source_type == WINDOW ||
+		xdpw_wlr_ext_capture(ctx, cursor_mode, region);
+	if (cast->ext_capture && cast->frame_depth > 1) {
+		logprint(INFO, "xdpw: capture sessions capture one frame at a time");
+		cast->frame_depth = 1;
+	}
 	cast->refcount = 1;
 	cast->node_id = SPA_ID_INVALID;
+	wl_list_init(&cast->buffer_list);
+	wl_list_init(&cast->simulcast_streams);
 	logprint(INFO, "xdpw: screencast instance %p has %d references", cast, cast->refcount);
 	wl_list_insert(&ctx->screencast_instances, &cast->link);
 	logprint(INFO, "xdpw: %d active screencast instances",
@@ -77,6 +126,7 @@ void xdpw_screencast_instance_init(struct xdpw_screencast_context *ctx,
 }
 
 void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencast_context *ctx = cast->ctx;
 	assert(cast->refcount == 0); // Fails assert if called by screencast_finish
 	logprint(DEBUG, "xdpw: destroying cast instance");
 
@@ -85,38 +135,88 @@ void xdpw_screencast_instance_destroy(struct xdpw_screencast_instance *cast) {
 		char *exec_after = cast->ctx->state->config->screencast_conf.exec_after;
 		if (exec_after) {
 			logprint(INFO, "xdpw: executing %s after screencast", exec_after);
-			exec_with_shell(exec_after);
+			exec_with_shell(cast->ctx->state, exec_after);
 		}
 	}
 
 	wl_list_remove(&cast->link);
+	xdpw_disarm_timer(&cast->end_timer);
+	// the copy worker may still read the capture buffers
+	xdpw_pwr_copy_cancel(cast);
+	struct xdpw_simulcast_stream *sc, *tmp_sc;
+	wl_list_for_each_safe(sc, tmp_sc, &cast->simulcast_streams, link) {
+		xdpw_simulcast_stream_destroy(sc);
+	}
+	xdpw_wlr_frames_destroy(cast);
+	xdpw_wlr_session_destroy(cast);
 	xdpw_pwr_stream_destroy(cast);
+	xdpw_tile_hash_finish(&cast->tile_hash);
+	xdpw_cursor_finish(&cast->cursor);
+	xdpw_scale_finish(&cast->scale);
+	if (cast->scale_buffer) {
+		xdpw_buffer_destroy(cast->scale_buffer);
+	}
+	if (cast->pack_buffer) {
+		xdpw_buffer_destroy(cast->pack_buffer);
+	}
+	if (cast->transform_buffer) {
+		xdpw_buffer_destroy(cast->transform_buffer);
+	}
 	free(cast);
-}
 
-bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *sess, bool with_cursor) {
+	// buffers are kept across renegotiations, but not without any screencast
+	if (wl_list_empty(&ctx->screencast_instances)) {
+		xdpw_shm_pool_trim(&ctx->shm_pool);
+	}
+}
 
-	struct xdpw_wlr_output *output, *tmp_o;
-	wl_list_for_each_reverse_safe(output, tmp_o, &ctx->output_list, link) {
-		logprint(INFO, "wlroots: capturable output: %s model: %s: id: %i name: %s",
-			output->make, output->model, output->id, output->name);
+static const char *cursor_mode_str(enum cursor_modes cursor_mode) {
+	switch (cursor_mode) {
+	case HIDDEN:
+		return "hidden";
+	case EMBEDDED:
+		return "embedded";
+	case METADATA:
+		return "metadata";
 	}
+	return "unknown";
+}
 
-	struct xdpw_wlr_output *out;
-	out = xdpw_wlr_output_chooser(ctx);
+bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *sess,
+		struct xdpw_wlr_output *out, struct xdpw_toplevel *toplevel,
+		struct xdpw_region *region, enum cursor_modes cursor_mode) {
+	if (toplevel) {
+		// windows aren't on one output, the first one gives the frame rate
+		out = xdpw_wlr_output_first(&ctx->output_list);
+		if (cursor_mode == METADATA) {
+			logprint(INFO, "xdpw: windows are captured with an embedded cursor");
+			cursor_mode = EMBEDDED;
+		}
+	}
+	if (cursor_mode == METADATA && !(ctx->state->screencast_cursor_modes & METADATA)) {
+		logprint(INFO, "xdpw: metadata cursors are unavailable, embedding the cursor");
+		cursor_mode = EMBEDDED;
+	}
 	if (!out) {
 		logprint(ERROR, "wlroots: no output found");
 		return false;
 	}
+	if (!xdpw_region_is_empty(region) && !ctx->screencopy_manager) {
+		logprint(ERROR, "wlroots: capturing a region needs the screencopy protocol");
+		return false;
+	}
 
 	struct xdpw_screencast_instance *cast, *tmp_c;
 	wl_list_for_each_reverse_safe(cast, tmp_c, &ctx->screencast_instances, link) {
 		logprint(INFO, "xdpw: existing screencast instance: %d %s cursor",
 			cast->target_output->id,
-			cast->with_cursor ? "with" : "without");
+			cursor_mode_str(cast->cursor_mode));
 
-		if (cast->target_output->id == out->id && cast->with_cursor == with_cursor) {
-			if (cast->refcount == 0) {
+		if (cast->target_output->id == out->id && cast->cursor_mode == cursor_mode &&
+				cast->source_type == (toplevel ? WINDOW : MONITOR) &&
+				cast->target_toplevel == toplevel &&
+				xdpw_region_equal(&cast->region, region)) {
+			if (cast->refcount == 0 || cast->ended) {
 				logprint(DEBUG,
 					"xdpw: matching cast instance found, "
 					"but is already scheduled for destruction, skipping");
@@ -133,28 +233,165 @@ bool setup_outputs(struct xdpw_screencast_context *ctx, struct xdpw_session *ses
 	if (!sess->screencast_instance) {
 		sess->screencast_instance = calloc(1, sizeof(struct xdpw_screencast_instance));
 		xdpw_screencast_instance_init(ctx, sess->screencast_instance,
-			out, with_cursor);
+			out, toplevel, region, cursor_mode);
+	}
+	if (toplevel) {
+		logprint(INFO, "wlroots: window: %s", toplevel->label);
+	} else {
+		logprint(INFO, "wlroots: output: %s",
+			sess->screencast_instance->target_output->name);
+	}
+	if (!xdpw_region_is_empty(region)) {
+		logprint(INFO, "wlroots: region: %d,%d %dx%d",
+			region->x, region->y, region->width, region->height);
 	}
-	logprint(INFO, "wlroots: output: %s",
-		sess->screencast_instance->target_output->name);
 
 	return true;
 
 }
 
+/*
+ * The stream is created once the first frame told the format and size it can
+ * offer, see wlr_frame_constraints_done().
+ */
 static int start_screencast(struct xdpw_screencast_instance *cast) {
-	xdpw_wlr_register_cb(cast);
+	cast->initialized = true;
+	xdpw_wlr_frame_start(cast);
+	return 0;
+}
 
-	// process at least one frame so that we know
-	// some of the metadata required for the pipewire
-	// remote state connected event
-	wl_display_dispatch(cast->ctx->state->wl_display);
-	wl_display_roundtrip(cast->ctx->state->wl_display);
+static void start_update_latency(struct xdpw_screencast_context *ctx,
+		struct xdpw_session *sess, uint32_t response) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t latency_ns = timespec_diff_ns(&now, &sess->start_time);
+
+	ctx->start_count++;
+	ctx->start_total_ns += latency_ns;
+	ctx->start_max_ns = MAX(ctx->start_max_ns, latency_ns);
+	if (response != PORTAL_RESPONSE_SUCCESS) {
+		ctx->start_timeouts++;
+	}
+	logprint(INFO, "dbus: start replied after %.1f ms "
+		"(average %.1f ms, max %.1f ms, %" PRIu64 " of %" PRIu64 " timed out)",
+		latency_ns / 1e6, ctx->start_total_ns / 1e6 / ctx->start_count,
+		ctx->start_max_ns / 1e6, ctx->start_timeouts, ctx->start_count);
+}
 
-	xdpw_pwr_stream_create(cast);
+// answers the pending Start call of the session
+static int start_reply(struct xdpw_session *sess, uint32_t response) {
+	struct xdpw_screencast_instance *cast = sess->screencast_instance;
+	sd_bus_message *msg = sess->start_msg;
+	sess->start_msg = NULL;
+	xdpw_disarm_timer(&sess->start_timer);
+	start_update_latency(cast->ctx, sess, response);
 
-	cast->initialized = true;
-	return 0;
+	sd_bus_message *reply = NULL;
+	int ret = sd_bus_message_new_method_return(msg, &reply);
+	sd_bus_message_unref(msg);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (response != PORTAL_RESPONSE_SUCCESS) {
+		ret = sd_bus_message_append(reply, "ua{sv}", response, 0);
+	} else {
+		uint32_t node_id = sess->simulcast_stream ?
+			sess->simulcast_stream->node_id : cast->node_id;
+		int32_t x = 0, y = 0;
+		uint32_t stream_width, stream_height;
+		xdpw_stream_size(cast, &cast->screencopy_frame_info[WL_SHM],
+			&stream_width, &stream_height);
+		int32_t width = stream_width;
+		int32_t height = stream_height;
+		if (!xdpw_region_is_empty(&cast->region)) {
+			// regions are shared in the compositor's coordinate space
+			x = cast->target_output->x + cast->region.x;
+			y = cast->target_output->y + cast->region.y;
+			width = cast->region.width;
+			height = cast->region.height;
+		}
+
+		logprint(DEBUG, "dbus: start: returning node %d", (int)node_id);
+		ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 1,
+			"streams", "a(ua{sv})", 1,
+			node_id, 3,
+			"position", "(ii)", x, y,
+			"size", "(ii)", width, height,
+			"source_type", "u", (uint32_t)cast->source_type);
+	}
+	if (ret < 0) {
+		sd_bus_message_unref(reply);
+		return ret;
+	}
+
+	ret = sd_bus_send(NULL, reply, NULL);
+	sd_bus_message_unref(reply);
+	return ret < 0 ? ret : 0;
+}
+
+static void start_handle_timeout(void *data) {
+	struct xdpw_session *sess = data;
+
+	logprint(ERROR, "dbus: start: no stream after %.1f s, giving up",
+		XDPW_START_TIMEOUT_NS / 1e9);
+	int ret = start_reply(sess, PORTAL_RESPONSE_ENDED);
+	if (ret < 0) {
+		logprint(ERROR, "dbus: start: failed to reply: %s", strerror(-ret));
+	}
+	// the frontend drops the session, so nothing would stop the capture
+	xdpw_session_close(sess);
+}
+
+void xdpw_screencast_streams_ready(struct xdpw_screencast_instance *cast) {
+	struct xdpw_session *sess, *tmp_s;
+	wl_list_for_each_safe(sess, tmp_s, &cast->ctx->state->xdpw_sessions, link) {
+		if (sess->screencast_instance != cast || !sess->start_msg) {
+			continue;
+		}
+		uint32_t node_id = sess->simulcast_stream ?
+			sess->simulcast_stream->node_id : cast->node_id;
+		if (node_id == SPA_ID_INVALID) {
+			continue;
+		}
+		int ret = start_reply(sess, PORTAL_RESPONSE_SUCCESS);
+		if (ret < 0) {
+			logprint(ERROR, "dbus: start: failed to reply: %s", strerror(-ret));
+		}
+	}
+}
+
+static void instance_handle_end(void *data) {
+	struct xdpw_screencast_instance *cast = data;
+
+	logprint(INFO, "xdpw: screencast instance %p ended, closing its sessions", cast);
+	struct xdpw_session *sess, *tmp_s;
+	wl_list_for_each_safe(sess, tmp_s, &cast->ctx->state->xdpw_sessions, link) {
+		if (sess->screencast_instance != cast) {
+			continue;
+		}
+		if (sess->start_msg) {
+			int ret = start_reply(sess, PORTAL_RESPONSE_ENDED);
+			if (ret < 0) {
+				logprint(ERROR, "dbus: start: failed to reply: %s", strerror(-ret));
+			}
+		}
+		xdpw_session_close(sess);
+	}
+
+	// the last session dropped the last reference
+	assert(cast->refcount == 0);
+	xdpw_screencast_instance_destroy(cast);
+}
+
+void xdpw_screencast_instance_end(struct xdpw_screencast_instance *cast) {
+	if (cast->ended) {
+		return;
+	}
+	cast->ended = true;
+	// no more frames are captured or queued
+	xdpw_disarm_timer(&cast->frame_timer);
+	xdpw_arm_timer(cast->ctx->state, &cast->end_timer, 0, 0, instance_handle_end, cast);
 }
 
 static int method_screencast_create_session(sd_bus_message *msg, void *data,
@@ -241,6 +478,37 @@ static int method_screencast_create_session(sd_bus_message *msg, void *data,
 	return 0;
 }
 
+static int select_sources_reply(sd_bus_message *msg, uint32_t response) {
+	sd_bus_message *reply = NULL;
+	int ret = sd_bus_message_new_method_return(msg, &reply);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_message_append(reply, "ua{sv}", response, 0);
+	if (ret >= 0) {
+		ret = sd_bus_send(NULL, reply, NULL);
+	}
+	sd_bus_message_unref(reply);
+	return ret < 0 ? ret : 0;
+}
+
+static void select_sources_chosen(struct xdpw_screencast_context *ctx,
+		struct xdpw_wlr_output *out, struct xdpw_toplevel *toplevel,
+		struct xdpw_region *region, void *data) {
+	struct xdpw_session *sess = data;
+	sd_bus_message *msg = sess->select_msg;
+	sess->select_msg = NULL;
+	sess->chooser = NULL;
+
+	bool ok = setup_outputs(ctx, sess, out, toplevel, region, sess->select_cursor_mode);
+	int ret = select_sources_reply(msg,
+		ok ? PORTAL_RESPONSE_SUCCESS : PORTAL_RESPONSE_CANCELLED);
+	sd_bus_message_unref(msg);
+	if (ret < 0) {
+		logprint(ERROR, "dbus: select sources: failed to reply: %s", strerror(-ret));
+	}
+}
+
 static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		sd_bus_error *ret_error) {
 	struct xdpw_state *state = data;
@@ -248,12 +516,13 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 
 	int ret = 0;
 	struct xdpw_session *sess, *tmp_s;
-	sd_bus_message *reply = NULL;
 
 	logprint(INFO, "dbus: select sources method invoked");
 
 	// default to embedded cursor mode if not specified
-	bool cursor_embedded = true;
+	enum cursor_modes cursor_mode = EMBEDDED;
+	// and to monitors
+	uint32_t source_types = MONITOR;
 
 	char *request_handle, *session_handle, *app_id;
 	ret = sd_bus_message_read(msg, "oos", &request_handle, &session_handle, &app_id);
@@ -284,22 +553,24 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		} else if (strcmp(key, "types") == 0) {
 			uint32_t mask;
 			sd_bus_message_read(msg, "v", "u", &mask);
-			if (mask & (1<<WINDOW)) {
-				logprint(INFO, "dbus: non-monitor cast requested, not replying");
+			logprint(INFO, "dbus: option types:%x", mask);
+			source_types = mask & state->screencast_source_types;
+			if (source_types == 0) {
+				logprint(INFO, "dbus: unsupported source types requested, not replying");
 				return -1;
 			}
-			logprint(INFO, "dbus: option types:%x", mask);
 		} else if (strcmp(key, "cursor_mode") == 0) {
-			uint32_t cursor_mode;
-			sd_bus_message_read(msg, "v", "u", &cursor_mode);
-			if (cursor_mode & HIDDEN) {
-				cursor_embedded = false;
+			uint32_t mode;
+			sd_bus_message_read(msg, "v", "u", &mode);
+			logprint(INFO, "dbus: option cursor_mode:%x", mode);
+			// modes we don't offer fall back to an embedded cursor
+			mode &= state->screencast_cursor_modes;
+			if (mode & HIDDEN) {
+				cursor_mode = HIDDEN;
 			}
-			if (cursor_mode & METADATA) {
-				logprint(ERROR, "dbus: unsupported cursor mode requested, cancelling");
-				goto error;
+			if (mode & METADATA) {
+				cursor_mode = METADATA;
 			}
-			logprint(INFO, "dbus: option cursor_mode:%x", cursor_mode);
 		} else {
 			logprint(WARN, "dbus: unknown option %s", key);
 			sd_bus_message_skip(msg, "v");
@@ -318,55 +589,34 @@ static int method_screencast_select_sources(sd_bus_message *msg, void *data,
 		return ret;
 	}
 
-	bool output_selection_canceled = 1;
+	struct xdpw_session *session = NULL;
 	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
 		if (strcmp(sess->session_handle, session_handle) == 0) {
 				logprint(DEBUG, "dbus: select sources: found matching session %s", sess->session_handle);
-				output_selection_canceled = !setup_outputs(ctx, sess, cursor_embedded);
+				session = sess;
 		}
 	}
-
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
-	}
-	if (output_selection_canceled) {
-		ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_CANCELLED, 0);
-	} else {
-		ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 0);
+	if (!session) {
+		return select_sources_reply(msg, PORTAL_RESPONSE_CANCELLED);
 	}
-	if (ret < 0) {
-		return ret;
-	}
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
+	if (session->select_msg) {
+		logprint(ERROR, "dbus: select sources: session is already choosing");
+		return -EBUSY;
 	}
-	sd_bus_message_unref(reply);
-	return 0;
 
-error:
-	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
-		if (strcmp(sess->session_handle, session_handle) == 0) {
-				logprint(DEBUG, "dbus: select sources error: destroying matching session %s", sess->session_handle);
-				xdpw_session_destroy(sess);
-		}
+	struct xdpw_wlr_output *output, *tmp_o;
+	wl_list_for_each_reverse_safe(output, tmp_o, &ctx->output_list, link) {
+		logprint(INFO, "wlroots: capturable output: %s model: %s: id: %i name: %s",
+			output->make, output->model, output->id, output->name);
 	}
 
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
-	}
-	ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_CANCELLED, 0);
-	if (ret < 0) {
-		return ret;
-	}
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
-	}
-	sd_bus_message_unref(reply);
-	return -1;
+	// replied to once the user picked a source, meanwhile the other streams
+	// keep running
+	session->select_msg = sd_bus_message_ref(msg);
+	session->select_cursor_mode = cursor_mode;
+	session->chooser = xdpw_wlr_output_chooser(ctx, source_types,
+		select_sources_chosen, session);
+	return 0;
 }
 
 static int method_screencast_start(sd_bus_message *msg, void *data,
@@ -415,51 +665,38 @@ static int method_screencast_start(sd_bus_message *msg, void *data,
 	}
 
 	struct xdpw_screencast_instance *cast = NULL;
+	struct xdpw_session *session = NULL;
 	struct xdpw_session *sess, *tmp_s;
 	wl_list_for_each_reverse_safe(sess, tmp_s, &state->xdpw_sessions, link) {
 		if (strcmp(sess->session_handle, session_handle) == 0) {
 				logprint(DEBUG, "dbus: start: found matching session %s", sess->session_handle);
 				cast = sess->screencast_instance;
+				session = sess;
 		}
 	}
 	if (!cast) {
 		return -1;
 	}
-
-	if (!cast->initialized) {
-		start_screencast(cast);
+	if (session->start_msg) {
+		logprint(ERROR, "dbus: start: session is already starting");
+		return -EBUSY;
 	}
 
-	while (cast->node_id == SPA_ID_INVALID) {
-		int ret = pw_loop_iterate(state->pw_loop, 0);
-		if (ret != 0) {
-			logprint(ERROR, "pipewire_loop_iterate failed: %s", spa_strerror(ret));
-		}
-	}
-
-	sd_bus_message *reply = NULL;
-	ret = sd_bus_message_new_method_return(msg, &reply);
-	if (ret < 0) {
-		return ret;
-	}
-
-	logprint(DEBUG, "dbus: start: returning node %d", (int)cast->node_id);
-	ret = sd_bus_message_append(reply, "ua{sv}", PORTAL_RESPONSE_SUCCESS, 1,
-		"streams", "a(ua{sv})", 1,
-		cast->node_id, 2,
-		"position", "(ii)", 0, 0,
-		"size", "(ii)", cast->screencopy_frame.width, cast->screencopy_frame.height);
-
-	if (ret < 0) {
-		return ret;
-	}
+	// replied to once the node id of the stream is known, meanwhile the
+	// other streams keep running
+	session->start_msg = sd_bus_message_ref(msg);
+	clock_gettime(CLOCK_MONOTONIC, &session->start_time);
+	xdpw_arm_timer(state, &session->start_timer, XDPW_START_TIMEOUT_NS,
+		XDPW_START_TIMEOUT_SLACK_NS, start_handle_timeout, session);
 
-	ret = sd_bus_send(NULL, reply, NULL);
-	if (ret < 0) {
-		return ret;
+	if (!cast->initialized) {
+		start_screencast(cast);
+	} else if (xdpw_simulcast_enabled(cast) && !session->simulcast_stream) {
+		// the main stream is taken, this consumer negotiates its own
+		session->simulcast_stream = xdpw_simulcast_stream_create(cast, session);
 	}
-	sd_bus_message_unref(reply);
 
+	xdpw_screencast_streams_ready(cast);
 	return 0;
 }
 
@@ -1,10 +1,23 @@
+#define _GNU_SOURCE
 #include "screencast_common.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef HAVE_GBM
+#include <gbm.h>
+#include <xf86drm.h>
+#endif
+
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "convert.h"
+#include "fourcc.h"
+#include "logger.h"
 
 void randname(char *buf) {
 	struct timespec ts;
@@ -36,61 +49,455 @@ int anonymous_shm_open(void) {
 	return -1;
 }
 
-struct wl_buffer *import_wl_shm_buffer(struct xdpw_screencast_instance *cast, int fd,
-		enum wl_shm_format fmt, int width, int height, int stride) {
-	struct xdpw_screencast_context *ctx = cast->ctx;
-	int size = stride * height;
+struct gbm_device *xdpw_gbm_device_create(void) {
+#ifdef HAVE_GBM
+	drmDevice *devices[64];
+	int n_devices = drmGetDevices2(0, devices, sizeof(devices) / sizeof(devices[0]));
+	if (n_devices < 0) {
+		logprint(WARN, "gbm: failed to enumerate DRM devices");
+		return NULL;
+	}
+
+	int fd = -1;
+	for (int i = 0; i < n_devices && fd < 0; i++) {
+		if (!(devices[i]->available_nodes & (1 << DRM_NODE_RENDER))) {
+			continue;
+		}
+		const char *name = devices[i]->nodes[DRM_NODE_RENDER];
+		fd = open(name, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			logprint(WARN, "gbm: failed to open render node %s", name);
+		} else {
+			logprint(DEBUG, "gbm: using render node %s", name);
+		}
+	}
+	drmFreeDevices(devices, n_devices);
 
 	if (fd < 0) {
 		return NULL;
 	}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(ctx->shm, fd, size);
-	struct wl_buffer *buffer =
-		wl_shm_pool_create_buffer(pool, 0, width, height, stride, fmt);
-	wl_shm_pool_destroy(pool);
+	struct gbm_device *gbm = gbm_create_device(fd);
+	if (!gbm) {
+		logprint(WARN, "gbm: failed to create device");
+		close(fd);
+		return NULL;
+	}
+	return gbm;
+#else
+	logprint(DEBUG, "gbm: support not built in");
+	return NULL;
+#endif
+}
+
+void xdpw_gbm_device_destroy(struct gbm_device *gbm) {
+#ifdef HAVE_GBM
+	int fd = gbm_device_get_fd(gbm);
+	gbm_device_destroy(gbm);
+	close(fd);
+#endif
+}
+
+bool xdpw_dmabuf_available(struct xdpw_screencast_context *ctx) {
+	return ctx->linux_dmabuf && (ctx->gbm || ctx->udmabuf_fd >= 0);
+}
+
+bool xdpw_query_dmabuf_modifiers(struct xdpw_screencast_context *ctx, uint32_t drm_format,
+		uint32_t *num_modifiers, uint64_t **modifiers) {
+	*num_modifiers = 0;
+	*modifiers = NULL;
+
+	if (!xdpw_dmabuf_available(ctx)) {
+		return false;
+	}
+	// udmabuf buffers are linear and single planar
+	if (!ctx->gbm && xdpw_bpp_from_drm_fourcc(drm_format) == 0) {
+		return false;
+	}
+
+	size_t max_modifiers = ctx->format_modifier_pairs.size / sizeof(struct xdpw_format_modifier_pair);
+	if (max_modifiers == 0) {
+		return false;
+	}
+	uint64_t *list = calloc(max_modifiers, sizeof(uint64_t));
+	if (!list) {
+		return false;
+	}
+
+	uint32_t count = 0;
+	struct xdpw_format_modifier_pair *pair;
+	wl_array_for_each(pair, &ctx->format_modifier_pairs) {
+		if (pair->fourcc != drm_format) {
+			continue;
+		}
+		// implicit modifiers can't be negotiated with pipewire
+		if (pair->modifier == DRM_FORMAT_MOD_INVALID) {
+			continue;
+		}
+		if (!ctx->gbm && pair->modifier != DRM_FORMAT_MOD_LINEAR) {
+			continue;
+		}
+		list[count++] = pair->modifier;
+	}
+
+	if (count == 0) {
+		free(list);
+		return false;
+	}
+
+	*num_modifiers = count;
+	*modifiers = list;
+	return true;
+}
+
+bool xdpw_fixate_dmabuf_modifier(struct xdpw_screencast_context *ctx, uint32_t drm_format,
+		uint32_t width, uint32_t height, const uint64_t *modifiers, uint32_t num_modifiers,
+		uint64_t *modifier) {
+#ifdef HAVE_GBM
+	if (ctx->gbm) {
+		struct gbm_bo *bo = gbm_bo_create_with_modifiers(ctx->gbm,
+			width, height, drm_format, modifiers, num_modifiers);
+		if (!bo) {
+			return false;
+		}
+		*modifier = gbm_bo_get_modifier(bo);
+		gbm_bo_destroy(bo);
+		return true;
+	}
+#endif
+
+	for (uint32_t i = 0; i < num_modifiers; i++) {
+		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR) {
+			*modifier = DRM_FORMAT_MOD_LINEAR;
+			return true;
+		}
+	}
+	return false;
+}
+
+int xdpw_dmabuf_plane_count(struct xdpw_screencast_context *ctx, uint32_t drm_format,
+		uint64_t modifier) {
+#ifdef HAVE_GBM
+	if (ctx->gbm) {
+		return gbm_device_get_format_modifier_plane_count(ctx->gbm, drm_format, modifier);
+	}
+#endif
+	return 1;
+}
+
+static bool buffer_alloc_shm(struct xdpw_screencast_context *ctx,
+		struct xdpw_buffer *buffer, struct xdpw_screencopy_frame_info *frame_info) {
+	struct xdpw_shm_slot *slot = xdpw_shm_pool_alloc(&ctx->shm_pool,
+		frame_info->width, frame_info->height, frame_info->stride, frame_info->format);
+	if (slot == NULL) {
+		logprint(ERROR, "xdpw: unable to allocate shm buffer");
+		return false;
+	}
+
+	// the pool owns the fd, mapping and wl_buffer
+	buffer->shm_slot = slot;
+	buffer->plane_count = 1;
+	buffer->size[0] = frame_info->size;
+	buffer->stride[0] = frame_info->stride;
+	buffer->offset[0] = 0;
+	buffer->fd[0] = ctx->shm_pool.fd;
+	buffer->data = slot->data;
+	buffer->buffer = slot->buffer;
+	return true;
+}
+
+static bool buffer_alloc_gbm(struct xdpw_screencast_context *ctx,
+		struct xdpw_buffer *buffer) {
+#ifdef HAVE_GBM
+	if (buffer->modifier == DRM_FORMAT_MOD_INVALID) {
+		buffer->bo = gbm_bo_create(ctx->gbm, buffer->width, buffer->height,
+			buffer->format, GBM_BO_USE_RENDERING);
+	} else {
+		buffer->bo = gbm_bo_create_with_modifiers(ctx->gbm, buffer->width,
+			buffer->height, buffer->format, &buffer->modifier, 1);
+	}
+	if (buffer->bo == NULL) {
+		logprint(ERROR, "xdpw: failed to create gbm_bo");
+		return false;
+	}
+
+	buffer->plane_count = gbm_bo_get_plane_count(buffer->bo);
+	for (int plane = 0; plane < buffer->plane_count; plane++) {
+		buffer->fd[plane] = gbm_bo_get_fd_for_plane(buffer->bo, plane);
+		if (buffer->fd[plane] < 0) {
+			logprint(ERROR, "xdpw: failed to export gbm_bo plane %d", plane);
+			return false;
+		}
+		buffer->stride[plane] = gbm_bo_get_stride_for_plane(buffer->bo, plane);
+		buffer->offset[plane] = gbm_bo_get_offset(buffer->bo, plane);
+		off_t size = lseek(buffer->fd[plane], 0, SEEK_END);
+		buffer->size[plane] = size > 0 ? size : 0;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool buffer_alloc_udmabuf(struct xdpw_screencast_context *ctx,
+		struct xdpw_buffer *buffer) {
+	uint32_t bpp = xdpw_bpp_from_drm_fourcc(buffer->format);
+	if (bpp == 0 || buffer->modifier != DRM_FORMAT_MOD_LINEAR) {
+		logprint(ERROR, "xdpw: format or modifier not supported by udmabuf");
+		return false;
+	}
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint32_t stride = SPA_ROUND_UP_N(buffer->width * bpp, 64);
+	uint64_t size = SPA_ROUND_UP_N((uint64_t)stride * buffer->height, (uint64_t)page_size);
+
+	buffer->fd[0] = xdpw_udmabuf_create(ctx->udmabuf_fd, size);
+	if (buffer->fd[0] < 0) {
+		return false;
+	}
+
+	buffer->plane_count = 1;
+	buffer->stride[0] = stride;
+	buffer->offset[0] = 0;
+	buffer->size[0] = size;
+	return true;
+}
+
+static bool buffer_alloc_dmabuf(struct xdpw_screencast_context *ctx,
+		struct xdpw_buffer *buffer) {
+	bool ok = ctx->gbm ? buffer_alloc_gbm(ctx, buffer) : buffer_alloc_udmabuf(ctx, buffer);
+	if (!ok) {
+		return false;
+	}
+
+	struct zwp_linux_buffer_params_v1 *params =
+		zwp_linux_dmabuf_v1_create_params(ctx->linux_dmabuf);
+	for (int plane = 0; plane < buffer->plane_count; plane++) {
+		zwp_linux_buffer_params_v1_add(params, buffer->fd[plane], plane,
+			buffer->offset[plane], buffer->stride[plane],
+			buffer->modifier >> 32, buffer->modifier & 0xffffffff);
+	}
+	buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params,
+		buffer->width, buffer->height, buffer->format, 0);
+	zwp_linux_buffer_params_v1_destroy(params);
+
+	if (buffer->buffer == NULL) {
+		logprint(ERROR, "xdpw: failed to import dmabuf");
+		return false;
+	}
+	return true;
+}
+
+struct xdpw_buffer *xdpw_buffer_create(struct xdpw_screencast_instance *cast,
+		enum buffer_type buffer_type, struct xdpw_screencopy_frame_info *frame_info) {
+	struct xdpw_screencast_context *ctx = cast->ctx;
+	struct xdpw_buffer *buffer = calloc(1, sizeof(struct xdpw_buffer));
+	if (buffer == NULL) {
+		return NULL;
+	}
+
+	buffer->buffer_type = buffer_type;
+	buffer->width = frame_info->width;
+	buffer->height = frame_info->height;
+	buffer->format = frame_info->format;
+	buffer->modifier = buffer_type == DMABUF ? cast->pwr_format.modifier : DRM_FORMAT_MOD_LINEAR;
+	for (int plane = 0; plane < 4; plane++) {
+		buffer->fd[plane] = -1;
+	}
+
+	bool ok = false;
+	switch (buffer_type) {
+	case WL_SHM:
+		ok = buffer_alloc_shm(ctx, buffer, frame_info);
+		break;
+	case DMABUF:
+		ok = xdpw_dmabuf_available(ctx) && buffer_alloc_dmabuf(ctx, buffer);
+		break;
+	}
+
+	if (!ok) {
+		xdpw_buffer_destroy(buffer);
+		return NULL;
+	}
+
+	// a new buffer has no content yet
+	xdpw_damage_set_full(&buffer->damage, buffer->width, buffer->height);
+	return buffer;
+}
+
+/*
+ * Converted frames are only written by us and never reach the compositor, so
+ * their buffers are plain memfds without a wl_buffer. All planes share the fd.
+ */
+struct xdpw_buffer *xdpw_buffer_create_converted(uint32_t width, uint32_t height,
+		uint32_t format) {
+	struct xdpw_convert_layout layout;
+	if (!xdpw_convert_get_layout(format, width, height, XDPW_CONVERT_ALIGN, &layout)) {
+		logprint(ERROR, "xdpw: no layout for converted buffer");
+		return NULL;
+	}
+
+	struct xdpw_buffer *buffer = calloc(1, sizeof(struct xdpw_buffer));
+	if (buffer == NULL) {
+		return NULL;
+	}
+	buffer->buffer_type = WL_SHM;
+	buffer->width = width;
+	buffer->height = height;
+	buffer->format = format;
+	buffer->modifier = DRM_FORMAT_MOD_LINEAR;
+	for (int plane = 0; plane < 4; plane++) {
+		buffer->fd[plane] = -1;
+	}
+
+	int fd = memfd_create("xdpw-convert", MFD_CLOEXEC);
+	if (fd < 0) {
+		logprint(ERROR, "xdpw: memfd_create failed: %s", strerror(errno));
+		goto error;
+	}
+	if (ftruncate(fd, layout.size) < 0) {
+		logprint(ERROR, "xdpw: unable to size converted buffer: %s", strerror(errno));
+		close(fd);
+		goto error;
+	}
+	buffer->data = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buffer->data == MAP_FAILED) {
+		logprint(ERROR, "xdpw: unable to map converted buffer: %s", strerror(errno));
+		buffer->data = NULL;
+		close(fd);
+		goto error;
+	}
+
+	buffer->plane_count = layout.plane_count;
+	for (uint32_t plane = 0; plane < layout.plane_count; plane++) {
+		buffer->fd[plane] = plane == 0 ? fd : dup(fd);
+		if (buffer->fd[plane] < 0) {
+			logprint(ERROR, "xdpw: unable to duplicate fd: %s", strerror(errno));
+			goto error;
+		}
+		buffer->size[plane] = layout.size;
+		buffer->stride[plane] = layout.stride[plane];
+		buffer->offset[plane] = layout.offset[plane];
+	}
 
+	xdpw_damage_set_full(&buffer->damage, buffer->width, buffer->height);
 	return buffer;
+
+error:
+	xdpw_buffer_destroy(buffer);
+	return NULL;
+}
+
+void xdpw_buffer_destroy(struct xdpw_buffer *buffer) {
+	if (buffer->shm_slot) {
+		xdpw_shm_slot_release(buffer->shm_slot);
+		free(buffer);
+		return;
+	}
+	if (buffer->data) {
+		munmap(buffer->data, buffer->size[0]);
+	}
+	if (buffer->buffer) {
+		wl_buffer_destroy(buffer->buffer);
+	}
+#ifdef HAVE_GBM
+	if (buffer->bo) {
+		gbm_bo_destroy(buffer->bo);
+	}
+#endif
+	for (int plane = 0; plane < 4; plane++) {
+		if (buffer->fd[plane] >= 0) {
+			close(buffer->fd[plane]);
+		}
+	}
+	free(buffer);
+}
+
+// frames are packed, turned, downscaled or converted into the buffers by us
+bool xdpw_copies_frames(struct xdpw_screencast_instance *cast) {
+	return cast->convert_format || cast->pack_format || cast->downscaling ||
+		cast->apply_transform;
+}
+
+// the format of the buffers frames are copied into
+uint32_t xdpw_copy_format(struct xdpw_screencast_instance *cast, uint32_t capture_format) {
+	if (cast->convert_format) {
+		return cast->convert_format;
+	}
+	return cast->pack_format ? cast->pack_format : capture_format;
+}
+
+// the transform the compositor shows the captured source with, windows are upright
+enum xdpw_transform xdpw_source_transform(struct xdpw_screencast_instance *cast) {
+	if (cast->source_type == WINDOW) {
+		return XDPW_TRANSFORM_NORMAL;
+	}
+	return (enum xdpw_transform)cast->target_output->transform;
+}
+
+// the size of captured frames after the transforms we apply on the cpu
+void xdpw_upright_size(struct xdpw_screencast_instance *cast,
+		const struct xdpw_screencopy_frame_info *frame_info, uint32_t *width, uint32_t *height) {
+	bool swap = cast->apply_transform &&
+		xdpw_transform_swaps(xdpw_source_transform(cast));
+	*width = swap ? frame_info->height : frame_info->width;
+	*height = swap ? frame_info->width : frame_info->height;
+}
+
+/*
+ * The size frames captured at the size of frame_info are streamed at. Frames
+ * are only ever scaled down, either to the logical size of the captured area
+ * or by the configured factor.
+ */
+void xdpw_stream_size(struct xdpw_screencast_instance *cast,
+		const struct xdpw_screencopy_frame_info *frame_info, uint32_t *width, uint32_t *height) {
+	xdpw_upright_size(cast, frame_info, width, height);
+
+	int64_t scaled_width = 0, scaled_height = 0;
+	if (cast->downscale_logical) {
+		bool whole_output = xdpw_region_is_empty(&cast->region);
+		scaled_width = whole_output ? cast->target_output->width : cast->region.width;
+		scaled_height = whole_output ? cast->target_output->height : cast->region.height;
+		if ((scaled_width > scaled_height) != (*width > *height)) {
+			// the logical size of rotated outputs is rotated, their buffers aren't
+			int64_t tmp = scaled_width;
+			scaled_width = scaled_height;
+			scaled_height = tmp;
+		}
+	} else if (cast->downscale_factor > 0) {
+		scaled_width = (int64_t)(*width * cast->downscale_factor + 0.5);
+		scaled_height = (int64_t)(*height * cast->downscale_factor + 0.5);
+	}
+
+	if (scaled_width > 0 && scaled_height > 0 &&
+			scaled_width <= *width && scaled_height <= *height) {
+		*width = scaled_width;
+		*height = scaled_height;
+	}
+}
+
+// parses the "x,y wxh" format slurp prints by default
+bool xdpw_region_parse(const char *str, struct xdpw_region *region) {
+	struct xdpw_region r;
+	int end = 0;
+	if (sscanf(str, " %d,%d %dx%d %n", &r.x, &r.y, &r.width, &r.height, &end) != 4 ||
+			str[end] != '\0' || r.width <= 0 || r.height <= 0) {
+		return false;
+	}
+	*region = r;
+	return true;
+}
+
+bool xdpw_region_is_empty(const struct xdpw_region *region) {
+	return region->width <= 0 || region->height <= 0;
 }
 
-enum spa_video_format xdpw_format_pw_from_wl_shm(enum wl_shm_format format) {
-	switch (format) {
-	case WL_SHM_FORMAT_ARGB8888:
-		return SPA_VIDEO_FORMAT_BGRA;
-	case WL_SHM_FORMAT_XRGB8888:
-		return SPA_VIDEO_FORMAT_BGRx;
-	case WL_SHM_FORMAT_RGBA8888:
-		return SPA_VIDEO_FORMAT_ABGR;
-	case WL_SHM_FORMAT_RGBX8888:
-		return SPA_VIDEO_FORMAT_xBGR;
-	case WL_SHM_FORMAT_ABGR8888:
-		return SPA_VIDEO_FORMAT_RGBA;
-	case WL_SHM_FORMAT_XBGR8888:
-		return SPA_VIDEO_FORMAT_RGBx;
-	case WL_SHM_FORMAT_BGRA8888:
-		return SPA_VIDEO_FORMAT_ARGB;
-	case WL_SHM_FORMAT_BGRX8888:
-		return SPA_VIDEO_FORMAT_xRGB;
-	case WL_SHM_FORMAT_NV12:
-		return SPA_VIDEO_FORMAT_NV12;
-	default:
-		abort();
-	}
-}
-
-enum spa_video_format xdpw_format_pw_strip_alpha(enum spa_video_format format) {
-	switch (format) {
-	case SPA_VIDEO_FORMAT_BGRA:
-		return SPA_VIDEO_FORMAT_BGRx;
-	case SPA_VIDEO_FORMAT_ABGR:
-		return SPA_VIDEO_FORMAT_xBGR;
-	case SPA_VIDEO_FORMAT_RGBA:
-		return SPA_VIDEO_FORMAT_RGBx;
-	case SPA_VIDEO_FORMAT_ARGB:
-		return SPA_VIDEO_FORMAT_xRGB;
-	default:
-		return SPA_VIDEO_FORMAT_UNKNOWN;
+bool xdpw_region_equal(const struct xdpw_region *a, const struct xdpw_region *b) {
+	if (xdpw_region_is_empty(a) || xdpw_region_is_empty(b)) {
+		return xdpw_region_is_empty(a) && xdpw_region_is_empty(b);
 	}
+	return a->x == b->x && a->y == b->y &&
+		a->width == b->width && a->height == b->height;
 }
 
 enum xdpw_chooser_types get_chooser_type(const char *chooser_type) {
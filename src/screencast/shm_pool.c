@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include "shm_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "screencast_common.h"
+#include "logger.h"
+
+static size_t align_up(size_t value, size_t align) {
+	return (value + align - 1) / align * align;
+}
+
+static void slot_clear_cache(struct xdpw_shm_slot *slot) {
+	if (slot->buffer) {
+		wl_buffer_destroy(slot->buffer);
+		slot->buffer = NULL;
+	}
+	if (slot->data) {
+		munmap(slot->data, slot->size);
+		slot->data = NULL;
+	}
+	slot->width = 0;
+	slot->height = 0;
+	slot->stride = 0;
+	slot->format = 0;
+}
+
+static void slot_destroy(struct xdpw_shm_slot *slot) {
+	slot_clear_cache(slot);
+	wl_list_remove(&slot->link);
+	free(slot);
+}
+
+static bool pool_create(struct xdpw_shm_pool *pool, bool hugetlb) {
+	unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+	if (hugetlb) {
+		flags |= MFD_HUGETLB;
+	}
+
+	pool->fd = memfd_create("xdpw-shm", flags);
+	if (pool->fd < 0 && hugetlb) {
+		logprint(WARN, "xdpw: unable to create huge page memfd: %s", strerror(errno));
+		return pool_create(pool, false);
+	}
+	if (pool->fd < 0) {
+		logprint(DEBUG, "xdpw: memfd_create failed, falling back to shm_open: %s",
+			strerror(errno));
+		pool->fd = anonymous_shm_open();
+		if (pool->fd < 0) {
+			logprint(ERROR, "xdpw: unable to create anonymous filedescriptor");
+			return false;
+		}
+	} else if (fcntl(pool->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+		// the pool only grows, nobody must shrink it under the compositor's mapping
+		logprint(DEBUG, "xdpw: unable to seal memfd: %s", strerror(errno));
+	}
+
+	pool->hugetlb = hugetlb;
+	pool->align = (size_t)sysconf(_SC_PAGESIZE);
+	struct stat st;
+	if (hugetlb && fstat(pool->fd, &st) == 0 && st.st_blksize > 0) {
+		// hugetlbfs reports the huge page size as block size
+		pool->align = st.st_blksize;
+	}
+	pool->size = 0;
+	logprint(DEBUG, "xdpw: created shm pool (%s pages of %zu bytes)",
+		hugetlb ? "huge" : "regular", pool->align);
+	return true;
+}
+
+static void pool_destroy(struct xdpw_shm_pool *pool) {
+	struct xdpw_shm_slot *slot, *tmp;
+	wl_list_for_each_safe(slot, tmp, &pool->slots, link) {
+		slot_destroy(slot);
+	}
+	if (pool->wl_pool) {
+		wl_shm_pool_destroy(pool->wl_pool);
+		pool->wl_pool = NULL;
+	}
+	if (pool->fd >= 0) {
+		close(pool->fd);
+		pool->fd = -1;
+	}
+	pool->size = 0;
+	pool->hugetlb = false;
+}
+
+static bool pool_grow(struct xdpw_shm_pool *pool, size_t size) {
+	if (size > INT32_MAX) {
+		logprint(ERROR, "xdpw: shm pool can't grow to %zu bytes", size);
+		return false;
+	}
+	if (ftruncate(pool->fd, size) < 0) {
+		logprint(ERROR, "xdpw: unable to grow shm pool to %zu bytes: %s", size, strerror(errno));
+		return false;
+	}
+
+	if (pool->wl_pool) {
+		wl_shm_pool_resize(pool->wl_pool, size);
+	} else {
+		pool->wl_pool = wl_shm_create_pool(pool->shm, pool->fd, size);
+	}
+	pool->size = size;
+	logprint(DEBUG, "xdpw: shm pool grown to %zu bytes", size);
+	return true;
+}
+
+/*
+ * Prefers a free slot that already holds an identical buffer, otherwise the
+ * smallest free slot that fits.
+ */
+static struct xdpw_shm_slot *pool_find_free(struct xdpw_shm_pool *pool, size_t size,
+		uint32_t width, uint32_t height, uint32_t stride, uint32_t format) {
+	struct xdpw_shm_slot *slot, *best = NULL;
+	wl_list_for_each(slot, &pool->slots, link) {
+		if (slot->used || slot->size < size) {
+			continue;
+		}
+		if (slot->buffer && slot->width == width && slot->height == height &&
+				slot->stride == stride && slot->format == format) {
+			return slot;
+		}
+		if (!best || slot->size < best->size) {
+			best = slot;
+		}
+	}
+	return best;
+}
+
+// merges runs of adjacent free slots until one of them fits
+static struct xdpw_shm_slot *pool_merge_free(struct xdpw_shm_pool *pool, size_t size) {
+	struct xdpw_shm_slot *slot, *tmp, *run = NULL;
+	wl_list_for_each_safe(slot, tmp, &pool->slots, link) {
+		if (slot->used) {
+			run = NULL;
+			continue;
+		}
+		if (!run) {
+			run = slot;
+		} else {
+			slot_clear_cache(run);
+			run->size += slot->size;
+			slot_destroy(slot);
+		}
+		if (run->size >= size) {
+			return run;
+		}
+	}
+	return NULL;
+}
+
+static struct xdpw_shm_slot *pool_append(struct xdpw_shm_pool *pool, size_t size) {
+	if (!wl_list_empty(&pool->slots)) {
+		struct xdpw_shm_slot *last = wl_container_of(pool->slots.prev, last, link);
+		if (!last->used) {
+			// a free slot at the end just grows with the pool
+			slot_clear_cache(last);
+			if (!pool_grow(pool, last->offset + size)) {
+				return NULL;
+			}
+			last->size = size;
+			return last;
+		}
+	}
+
+	struct xdpw_shm_slot *slot = calloc(1, sizeof(struct xdpw_shm_slot));
+	if (!slot) {
+		return NULL;
+	}
+	slot->pool = pool;
+	slot->offset = pool->size;
+	slot->size = size;
+	if (!pool_grow(pool, pool->size + size)) {
+		free(slot);
+		return NULL;
+	}
+	wl_list_insert(pool->slots.prev, &slot->link);
+	return slot;
+}
+
+static bool slot_prepare(struct xdpw_shm_slot *slot, uint32_t width, uint32_t height,
+		uint32_t stride, uint32_t format) {
+	struct xdpw_shm_pool *pool = slot->pool;
+
+	if (!slot->data) {
+		// prefault now instead of on the first frames
+		slot->data = mmap(NULL, slot->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, pool->fd, slot->offset);
+		if (slot->data == MAP_FAILED) {
+			logprint(ERROR, "xdpw: unable to map shm slot: %s", strerror(errno));
+			slot->data = NULL;
+			return false;
+		}
+	}
+
+	if (slot->buffer && (slot->width != width || slot->height != height ||
+			slot->stride != stride || slot->format != format)) {
+		wl_buffer_destroy(slot->buffer);
+		slot->buffer = NULL;
+	}
+	if (!slot->buffer) {
+		slot->buffer = wl_shm_pool_create_buffer(pool->wl_pool, slot->offset,
+			width, height, stride, xdpw_format_wl_shm_from_drm_fourcc(format));
+		if (!slot->buffer) {
+			logprint(ERROR, "xdpw: unable to create wl_buffer");
+			return false;
+		}
+		slot->width = width;
+		slot->height = height;
+		slot->stride = stride;
+		slot->format = format;
+	} else {
+		logprint(TRACE, "xdpw: reusing shm slot at offset %zu", slot->offset);
+	}
+
+	slot->used = true;
+	return true;
+}
+
+static struct xdpw_shm_slot *pool_alloc(struct xdpw_shm_pool *pool, size_t size,
+		uint32_t width, uint32_t height, uint32_t stride, uint32_t format) {
+	size_t slot_size = align_up(size, pool->align);
+
+	struct xdpw_shm_slot *slot = pool_find_free(pool, slot_size, width, height, stride, format);
+	if (!slot) {
+		slot = pool_merge_free(pool, slot_size);
+	}
+	if (!slot) {
+		slot = pool_append(pool, slot_size);
+	}
+	if (!slot || !slot_prepare(slot, width, height, stride, format)) {
+		return NULL;
+	}
+	return slot;
+}
+
+void xdpw_shm_pool_init(struct xdpw_shm_pool *pool, struct wl_shm *shm, bool hugepages) {
+	*pool = (struct xdpw_shm_pool) {
+		.shm = shm,
+		.hugepages = hugepages,
+		.fd = -1,
+	};
+	wl_list_init(&pool->slots);
+}
+
+void xdpw_shm_pool_finish(struct xdpw_shm_pool *pool) {
+	xdpw_shm_pool_trim(pool);
+	if (pool->fd >= 0) {
+		logprint(WARN, "xdpw: shm pool still in use");
+	}
+}
+
+struct xdpw_shm_slot *xdpw_shm_pool_alloc(struct xdpw_shm_pool *pool,
+		uint32_t width, uint32_t height, uint32_t stride, uint32_t format) {
+	size_t size = (size_t)stride * height;
+	if (pool->fd >= 0) {
+		return pool_alloc(pool, size, width, height, stride, format);
+	}
+
+	bool hugetlb = pool->hugepages && size >= XDPW_SHM_HUGETLB_MIN_SIZE;
+	if (!pool_create(pool, hugetlb)) {
+		return NULL;
+	}
+	struct xdpw_shm_slot *slot = pool_alloc(pool, size, width, height, stride, format);
+	if (!slot && pool->hugetlb) {
+		// huge pages are reserved on mmap, there might not be enough of them
+		logprint(WARN, "xdpw: unable to allocate huge pages, falling back to regular pages");
+		pool_destroy(pool);
+		if (!pool_create(pool, false)) {
+			return NULL;
+		}
+		slot = pool_alloc(pool, size, width, height, stride, format);
+	}
+	return slot;
+}
+
+void xdpw_shm_slot_release(struct xdpw_shm_slot *slot) {
+	slot->used = false;
+}
+
+void xdpw_shm_pool_trim(struct xdpw_shm_pool *pool) {
+	if (pool->fd < 0) {
+		return;
+	}
+
+	struct xdpw_shm_slot *slot;
+	bool in_use = false;
+	wl_list_for_each(slot, &pool->slots, link) {
+		in_use |= slot->used;
+	}
+	if (!in_use) {
+		logprint(DEBUG, "xdpw: destroying unused shm pool");
+		pool_destroy(pool);
+		return;
+	}
+
+	wl_list_for_each(slot, &pool->slots, link) {
+		if (slot->used) {
+			continue;
+		}
+		slot_clear_cache(slot);
+		// keep the slot, but give its memory back
+		if (fallocate(pool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				slot->offset, slot->size) < 0) {
+			logprint(DEBUG, "xdpw: unable to release shm slot memory: %s", strerror(errno));
+		}
+	}
+}
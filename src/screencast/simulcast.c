@@ -0,0 +1,321 @@
+#include "simulcast.h"
+
+#include <pipewire/pipewire.h>
+#include <spa/param/video/format-utils.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "pipewire_screencast.h"
+#include "screencast.h"
+#include "wlr_screencast.h"
+#include "xdpw.h"
+#include "logger.h"
+
+static uint32_t simulcast_stride(uint32_t width) {
+	return SPA_ROUND_UP_N(width * 4, XDPW_PWR_ALIGN);
+}
+
+static const struct spa_pod *build_format(struct spa_pod_builder *b,
+		struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencopy_frame_info *info = &cast->screencopy_frame_info[WL_SHM];
+	// deeper frames are packed to 8 bit before they are scaled
+	const struct xdpw_format_info *format_info = xdpw_format_info_from_drm_fourcc(info->format);
+	enum spa_video_format format = format_info ?
+		xdpw_format_pw_from_drm_fourcc(format_info->pack_format) : SPA_VIDEO_FORMAT_UNKNOWN;
+	enum spa_video_format format_without_alpha = xdpw_format_pw_strip_alpha(format);
+	struct spa_pod_frame f;
+
+	spa_pod_builder_push_object(b, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+	if (format_without_alpha == SPA_VIDEO_FORMAT_UNKNOWN) {
+		spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format, SPA_POD_Id(format), 0);
+	} else {
+		spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format,
+			SPA_POD_CHOICE_ENUM_Id(3, format, format, format_without_alpha), 0);
+	}
+	// any size up to the captured one, the consumer fixates it
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_size,
+		SPA_POD_CHOICE_RANGE_Rectangle(
+			&SPA_RECTANGLE(info->width, info->height),
+			&SPA_RECTANGLE(SPA_MIN(XDPW_SIMULCAST_MIN_SIZE, info->width),
+				SPA_MIN(XDPW_SIMULCAST_MIN_SIZE, info->height)),
+			&SPA_RECTANGLE(info->width, info->height)),
+		0);
+	// variable framerate
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_framerate,
+		SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
+	spa_pod_builder_add(b, SPA_FORMAT_VIDEO_maxFramerate,
+		SPA_POD_CHOICE_RANGE_Fraction(
+			&SPA_FRACTION(cast->max_framerate, 1),
+			&SPA_FRACTION(1, 1),
+			&SPA_FRACTION(cast->max_framerate, 1)),
+		0);
+	return spa_pod_builder_pop(b, &f);
+}
+
+static void simulcast_handle_state_changed(void *data,
+		enum pw_stream_state old, enum pw_stream_state state, const char *error) {
+	struct xdpw_simulcast_stream *sc = data;
+	sc->node_id = pw_stream_get_node_id(sc->stream);
+
+	logprint(INFO, "pipewire: simulcast stream state changed to \"%s\"",
+		pw_stream_state_as_string(state));
+	logprint(INFO, "pipewire: simulcast node id is %d", (int)sc->node_id);
+	if (error) {
+		logprint(ERROR, "pipewire: simulcast stream error: %s", error);
+	}
+	if (sc->node_id != SPA_ID_INVALID) {
+		xdpw_screencast_streams_ready(sc->cast);
+	}
+
+	switch (state) {
+	case PW_STREAM_STATE_STREAMING:
+		sc->streaming = true;
+		sc->decimate = (struct fps_decimate_state) {0};
+		if (sc->cast->frame_count == 0) {
+			xdpw_wlr_frame_start(sc->cast);
+		}
+		break;
+	default:
+		sc->streaming = false;
+		break;
+	}
+}
+
+static void simulcast_handle_param_changed(void *data, uint32_t id,
+		const struct spa_pod *param) {
+	struct xdpw_simulcast_stream *sc = data;
+	uint8_t params_buffer[2][1024];
+	struct spa_pod_builder b[2] = {
+		SPA_POD_BUILDER_INIT(params_buffer[0], sizeof(params_buffer[0])),
+		SPA_POD_BUILDER_INIT(params_buffer[1], sizeof(params_buffer[1])),
+	};
+	const struct spa_pod *params[2];
+
+	if (!param || id != SPA_PARAM_Format) {
+		return;
+	}
+
+	spa_format_video_raw_parse(param, &sc->format);
+	sc->framerate = sc->format.max_framerate.denom > 0 ?
+		sc->format.max_framerate.num / sc->format.max_framerate.denom : 0;
+	logprint(DEBUG, "pipewire: simulcast stream negotiated %ux%u at %u fps",
+		sc->format.size.width, sc->format.size.height, sc->framerate);
+
+	uint32_t stride = simulcast_stride(sc->format.size.width);
+	params[0] = spa_pod_builder_add_object(&b[0],
+		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+		SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPW_PWR_BUFFERS, 1, 32),
+		SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+		SPA_PARAM_BUFFERS_size,    SPA_POD_Int(stride * sc->format.size.height),
+		SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(stride),
+		SPA_PARAM_BUFFERS_align,   SPA_POD_Int(XDPW_PWR_ALIGN),
+		SPA_PARAM_BUFFERS_dataType,SPA_POD_CHOICE_FLAGS_Int(
+			(1<<SPA_DATA_MemFd) | (1<<SPA_DATA_MemPtr)));
+
+	params[1] = spa_pod_builder_add_object(&b[1],
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+		SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+
+	pw_stream_update_params(sc->stream, params, 2);
+}
+
+static void simulcast_handle_process(void *data) {
+	// frames are pushed when the capture completes
+}
+
+static const struct pw_stream_events simulcast_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = simulcast_handle_state_changed,
+	.param_changed = simulcast_handle_param_changed,
+	.process = simulcast_handle_process,
+};
+
+bool xdpw_simulcast_enabled(struct xdpw_screencast_instance *cast) {
+	// the cursor metadata is only tracked for the main stream
+	return cast->ctx->state->config->screencast_conf.simulcast &&
+		cast->cursor_mode != METADATA;
+}
+
+struct xdpw_simulcast_stream *xdpw_simulcast_stream_create(
+		struct xdpw_screencast_instance *cast, struct xdpw_session *sess) {
+	struct xdpw_simulcast_stream *sc = calloc(1, sizeof(struct xdpw_simulcast_stream));
+	if (!sc) {
+		return NULL;
+	}
+	sc->cast = cast;
+	sc->sess = sess;
+	sc->node_id = SPA_ID_INVALID;
+
+	char name[] = "xdpw-stream-XXXXXX";
+	randname(name + strlen(name) - 6);
+	sc->stream = pw_stream_new(cast->ctx->core, name,
+		pw_properties_new(
+			PW_KEY_MEDIA_CLASS, "Video/Source",
+			NULL));
+	if (!sc->stream) {
+		logprint(ERROR, "pipewire: failed to create simulcast stream");
+		free(sc);
+		return NULL;
+	}
+
+	uint8_t buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	const struct spa_pod *params[1] = { build_format(&b, cast) };
+
+	wl_list_insert(&cast->simulcast_streams, &sc->link);
+	pw_stream_add_listener(sc->stream, &sc->stream_listener,
+		&simulcast_stream_events, sc);
+
+	// pipewire allocates the buffers, they are only written by the cpu
+	if (pw_stream_connect(sc->stream,
+			PW_DIRECTION_OUTPUT,
+			PW_ID_ANY,
+			(PW_STREAM_FLAG_DRIVER |
+				PW_STREAM_FLAG_MAP_BUFFERS),
+			params, 1) < 0) {
+		logprint(ERROR, "pipewire: failed to connect simulcast stream");
+		sc->sess = NULL;
+		xdpw_simulcast_stream_destroy(sc);
+		return NULL;
+	}
+
+	logprint(INFO, "pipewire: simulcast stream %s added to screencast instance %p",
+		name, cast);
+	return sc;
+}
+
+void xdpw_simulcast_stream_destroy(struct xdpw_simulcast_stream *sc) {
+	logprint(DEBUG, "pipewire: destroying simulcast stream");
+
+	wl_list_remove(&sc->link);
+	if (sc->sess) {
+		sc->sess->simulcast_stream = NULL;
+	}
+	pw_stream_flush(sc->stream, false);
+	pw_stream_disconnect(sc->stream);
+	pw_stream_destroy(sc->stream);
+	xdpw_scale_finish(&sc->scale);
+	if (sc->pack_buffer) {
+		xdpw_buffer_destroy(sc->pack_buffer);
+	}
+	free(sc);
+}
+
+bool xdpw_simulcast_is_streaming(struct xdpw_screencast_instance *cast) {
+	struct xdpw_simulcast_stream *sc;
+	wl_list_for_each(sc, &cast->simulcast_streams, link) {
+		if (sc->streaming) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint32_t xdpw_simulcast_max_framerate(struct xdpw_screencast_instance *cast) {
+	uint32_t framerate = 0;
+	struct xdpw_simulcast_stream *sc;
+	wl_list_for_each(sc, &cast->simulcast_streams, link) {
+		if (sc->streaming && sc->framerate > framerate) {
+			framerate = sc->framerate;
+		}
+	}
+	return framerate;
+}
+
+void xdpw_simulcast_update_params(struct xdpw_screencast_instance *cast) {
+	struct xdpw_simulcast_stream *sc;
+	wl_list_for_each(sc, &cast->simulcast_streams, link) {
+		uint8_t buffer[1024];
+		struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+		const struct spa_pod *params[1] = { build_format(&b, cast) };
+		pw_stream_update_params(sc->stream, params, 1);
+	}
+}
+
+static void simulcast_stream_export(struct xdpw_simulcast_stream *sc,
+		struct xdpw_frame *frame) {
+	struct xdpw_buffer *src = frame->xdpw_buffer;
+
+	struct pw_buffer *pw_buf = pw_stream_dequeue_buffer(sc->stream);
+	if (!pw_buf) {
+		logprint(TRACE, "pipewire: simulcast stream out of buffers");
+		return;
+	}
+
+	struct spa_buffer *spa_buf = pw_buf->buffer;
+	struct spa_data *d = &spa_buf->datas[0];
+	uint32_t width = sc->format.size.width;
+	uint32_t height = sc->format.size.height;
+	uint32_t stride = simulcast_stride(width);
+
+	bool buffer_corrupt = !d->data || d->maxsize < stride * height;
+	const struct xdpw_format_info *info = xdpw_format_info_from_drm_fourcc(src->format);
+	if (!buffer_corrupt && info->pack_format != src->format) {
+		if (sc->pack_buffer && (sc->pack_buffer->format != info->pack_format ||
+				sc->pack_buffer->width != src->width ||
+				sc->pack_buffer->height != src->height)) {
+			xdpw_buffer_destroy(sc->pack_buffer);
+			sc->pack_buffer = NULL;
+		}
+		if (!sc->pack_buffer) {
+			sc->pack_buffer = xdpw_buffer_create_converted(src->width, src->height,
+				info->pack_format);
+		}
+		buffer_corrupt = !sc->pack_buffer ||
+			!xdpw_convert_pack(src->format, src->data, src->stride[0], sc->pack_buffer->data,
+				sc->pack_buffer->stride[0], 0, 0, src->width, src->height);
+		if (!buffer_corrupt) {
+			src = sc->pack_buffer;
+		}
+	}
+	if (!buffer_corrupt) {
+		const uint8_t *data = src->data;
+		ptrdiff_t src_stride = src->stride[0];
+		if (frame->y_invert) {
+			// read bottom-up, the stream has no transform meta
+			data += (size_t)(src->height - 1) * src->stride[0];
+			src_stride = -src_stride;
+		}
+		buffer_corrupt = !xdpw_scale_box(&sc->scale, data, src_stride,
+			src->width, src->height, d->data, stride, width, height);
+	}
+
+	struct spa_meta_header *h;
+	if ((h = spa_buffer_find_meta_data(spa_buf, SPA_META_Header, sizeof(*h)))) {
+		h->pts = buffer_corrupt ? -1 : frame->pts;
+		h->flags = buffer_corrupt ? SPA_META_HEADER_FLAG_CORRUPTED : 0;
+		h->seq = sc->seq++;
+		h->dts_offset = 0;
+	}
+
+	d->chunk->offset = 0;
+	d->chunk->size = buffer_corrupt ? 0 : stride * height;
+	d->chunk->stride = stride;
+	d->chunk->flags = buffer_corrupt ? SPA_CHUNK_FLAG_CORRUPTED : SPA_CHUNK_FLAG_NONE;
+
+	pw_stream_queue_buffer(sc->stream, pw_buf);
+	if (pw_stream_is_driving(sc->stream)) {
+		pw_stream_trigger_process(sc->stream);
+	}
+}
+
+void xdpw_simulcast_export(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	struct xdpw_buffer *src = frame->xdpw_buffer;
+	if (!src || src->buffer_type != WL_SHM || !src->data ||
+			xdpw_bpp_from_drm_fourcc(src->format) == 0) {
+		return;
+	}
+
+	struct xdpw_simulcast_stream *sc;
+	wl_list_for_each(sc, &cast->simulcast_streams, link) {
+		if (!sc->streaming || !fps_decimate(&sc->decimate, frame->pts, sc->framerate)) {
+			continue;
+		}
+		simulcast_stream_export(sc, frame);
+	}
+}
@@ -0,0 +1,218 @@
+#include "tile_hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * The tile hash runs four independent 32 bit lanes over the tile, each lane
+ * consuming every fourth 32 bit word. Per word a lane computes
+ *
+ *   acc = rotl((acc ^ word) * 129, 11)
+ *
+ * which is a bijection of acc for a fixed word, so two tiles that differ in a
+ * single word never collide. The lanes map directly to SIMD registers, the
+ * vector paths produce exactly the same hash as the scalar one.
+ */
+
+static const uint32_t lane_seed[4] = {
+	0x9e3779b9, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f,
+};
+
+static inline uint32_t lane_step(uint32_t acc, uint32_t word) {
+	acc ^= word;
+	acc += acc << 7;
+	return (acc << 11) | (acc >> 21);
+}
+
+static inline uint32_t load_u32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void hash_row_tail(uint32_t acc[static 4], const uint8_t *p, uint32_t bytes) {
+	uint32_t lane = 0;
+	while (bytes >= 4) {
+		acc[lane] = lane_step(acc[lane], load_u32(p));
+		lane = (lane + 1) & 3;
+		p += 4;
+		bytes -= 4;
+	}
+	if (bytes > 0) {
+		uint32_t word = 0;
+		memcpy(&word, p, bytes);
+		acc[lane] = lane_step(acc[lane], word);
+	}
+}
+
+static uint64_t hash_finish(const uint32_t acc[static 4]) {
+	uint64_t h = ((uint64_t)acc[0] << 32 | acc[1]) ^
+		(((uint64_t)acc[2] << 32 | acc[3]) * 0x9e3779b97f4a7c15ull);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t xdpw_tile_hash_scalar(const uint8_t *data, uint32_t stride,
+		uint32_t row_bytes, uint32_t rows) {
+	uint32_t acc[4];
+	memcpy(acc, lane_seed, sizeof(acc));
+
+	for (uint32_t y = 0; y < rows; y++) {
+		const uint8_t *p = data + (size_t)y * stride;
+		uint32_t x = 0;
+		for (; x + 16 <= row_bytes; x += 16) {
+			for (int lane = 0; lane < 4; lane++) {
+				acc[lane] = lane_step(acc[lane], load_u32(p + x + 4 * lane));
+			}
+		}
+		hash_row_tail(acc, p + x, row_bytes - x);
+	}
+	return hash_finish(acc);
+}
+
+#if defined(__SSE2__)
+uint64_t xdpw_tile_hash(const uint8_t *data, uint32_t stride,
+		uint32_t row_bytes, uint32_t rows) {
+	uint32_t acc[4];
+	__m128i vacc = _mm_loadu_si128((const __m128i *)lane_seed);
+
+	for (uint32_t y = 0; y < rows; y++) {
+		const uint8_t *p = data + (size_t)y * stride;
+		uint32_t x = 0;
+		for (; x + 16 <= row_bytes; x += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+			vacc = _mm_xor_si128(vacc, v);
+			vacc = _mm_add_epi32(vacc, _mm_slli_epi32(vacc, 7));
+			vacc = _mm_or_si128(_mm_slli_epi32(vacc, 11), _mm_srli_epi32(vacc, 21));
+		}
+		if (x < row_bytes) {
+			_mm_storeu_si128((__m128i *)acc, vacc);
+			hash_row_tail(acc, p + x, row_bytes - x);
+			vacc = _mm_loadu_si128((const __m128i *)acc);
+		}
+	}
+	_mm_storeu_si128((__m128i *)acc, vacc);
+	return hash_finish(acc);
+}
+#elif defined(__ARM_NEON)
+uint64_t xdpw_tile_hash(const uint8_t *data, uint32_t stride,
+		uint32_t row_bytes, uint32_t rows) {
+	uint32_t acc[4];
+	uint32x4_t vacc = vld1q_u32(lane_seed);
+
+	for (uint32_t y = 0; y < rows; y++) {
+		const uint8_t *p = data + (size_t)y * stride;
+		uint32_t x = 0;
+		for (; x + 16 <= row_bytes; x += 16) {
+			uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(p + x));
+			vacc = veorq_u32(vacc, v);
+			vacc = vaddq_u32(vacc, vshlq_n_u32(vacc, 7));
+			vacc = vorrq_u32(vshlq_n_u32(vacc, 11), vshrq_n_u32(vacc, 21));
+		}
+		if (x < row_bytes) {
+			vst1q_u32(acc, vacc);
+			hash_row_tail(acc, p + x, row_bytes - x);
+			vacc = vld1q_u32(acc);
+		}
+	}
+	vst1q_u32(acc, vacc);
+	return hash_finish(acc);
+}
+#else
+uint64_t xdpw_tile_hash(const uint8_t *data, uint32_t stride,
+		uint32_t row_bytes, uint32_t rows) {
+	return xdpw_tile_hash_scalar(data, stride, row_bytes, rows);
+}
+#endif
+
+void xdpw_tile_hash_finish(struct xdpw_tile_hash_state *state) {
+	free(state->hashes);
+	*state = (struct xdpw_tile_hash_state) { 0 };
+}
+
+void xdpw_tile_hash_reset(struct xdpw_tile_hash_state *state) {
+	state->width = 0;
+	state->height = 0;
+}
+
+static bool tile_hash_resize(struct xdpw_tile_hash_state *state,
+		uint32_t width, uint32_t height) {
+	uint32_t tiles_x = (width + XDPW_TILE_SIZE - 1) / XDPW_TILE_SIZE;
+	uint32_t tiles_y = (height + XDPW_TILE_SIZE - 1) / XDPW_TILE_SIZE;
+
+	if (tiles_x * tiles_y != state->tiles_x * state->tiles_y || !state->hashes) {
+		uint64_t *hashes = realloc(state->hashes, (size_t)tiles_x * tiles_y * sizeof(uint64_t));
+		if (!hashes) {
+			return false;
+		}
+		state->hashes = hashes;
+	}
+	state->width = width;
+	state->height = height;
+	state->tiles_x = tiles_x;
+	state->tiles_y = tiles_y;
+	return true;
+}
+
+bool xdpw_tile_hash_damage(struct xdpw_tile_hash_state *state, const uint8_t *data,
+		uint32_t width, uint32_t height, uint32_t stride, uint32_t bpp,
+		struct xdpw_damage *damage) {
+	bool full = state->width != width || state->height != height;
+	if (full && !tile_hash_resize(state, width, height)) {
+		xdpw_tile_hash_reset(state);
+		return false;
+	}
+
+	for (uint32_t ty = 0; ty < state->tiles_y; ty++) {
+		uint32_t y = ty * XDPW_TILE_SIZE;
+		uint32_t rows = height - y < XDPW_TILE_SIZE ? height - y : XDPW_TILE_SIZE;
+		// start of the current run of changed tiles in this tile row
+		int64_t run_start = -1;
+
+		for (uint32_t tx = 0; tx <= state->tiles_x; tx++) {
+			bool changed = false;
+			if (tx < state->tiles_x) {
+				uint32_t x = tx * XDPW_TILE_SIZE;
+				uint32_t cols = width - x < XDPW_TILE_SIZE ? width - x : XDPW_TILE_SIZE;
+				uint64_t hash = xdpw_tile_hash(data + (size_t)y * stride + (size_t)x * bpp,
+					stride, cols * bpp, rows);
+				uint64_t *prev = &state->hashes[ty * state->tiles_x + tx];
+				changed = !full && *prev != hash;
+				*prev = hash;
+			}
+
+			if (changed && run_start < 0) {
+				run_start = tx;
+			} else if (!changed && run_start >= 0) {
+				uint32_t x0 = run_start * XDPW_TILE_SIZE;
+				uint32_t x1 = tx * XDPW_TILE_SIZE < width ? tx * XDPW_TILE_SIZE : width;
+				struct xdpw_frame_damage rect = {
+					.x = x0,
+					.y = y,
+					.width = x1 - x0,
+					.height = rows,
+				};
+				xdpw_damage_add(damage, &rect);
+				run_start = -1;
+			}
+		}
+	}
+	if (full) {
+		struct xdpw_frame_damage rect = {
+			.x = 0,
+			.y = 0,
+			.width = width,
+			.height = height,
+		};
+		xdpw_damage_add(damage, &rect);
+	}
+	return true;
+}
@@ -0,0 +1,185 @@
+#include "transform.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define FLIP_CHUNK_SIZE 4096
+#define TRANSFORM_BPP 4
+// 32x32 pixels of 4 bytes fill 4 KiB, one tile of each image stays in L1
+#define TRANSFORM_TILE 32
+
+/*
+ * Swap the rows of an image in place. Rows are exchanged through a small
+ * chunk on the stack, so wide rows don't need an allocation.
+ */
+void xdpw_flip_y(void *data, uint32_t stride, uint32_t height) {
+	uint8_t tmp[FLIP_CHUNK_SIZE];
+	uint8_t *top = data;
+	uint8_t *bottom = top + (size_t)(height - 1) * stride;
+
+	if (height < 2) {
+		return;
+	}
+
+	while (top < bottom) {
+		for (uint32_t x = 0; x < stride; x += FLIP_CHUNK_SIZE) {
+			uint32_t n = stride - x < FLIP_CHUNK_SIZE ? stride - x : FLIP_CHUNK_SIZE;
+			memcpy(tmp, top + x, n);
+			memcpy(top + x, bottom + x, n);
+			memcpy(bottom + x, tmp, n);
+		}
+		top += stride;
+		bottom -= stride;
+	}
+}
+
+static uint32_t scale_floor(uint32_t value, uint32_t from, uint32_t to) {
+	return (uint64_t)value * to / from;
+}
+
+static uint32_t scale_ceil(uint32_t value, uint32_t from, uint32_t to) {
+	return ((uint64_t)value * to + from - 1) / from;
+}
+
+/*
+ * Maps damage onto a scaled frame. Rectangles grow to every destination pixel
+ * whose source pixels they touch.
+ */
+void xdpw_damage_scale(struct xdpw_damage *damage, uint32_t src_width, uint32_t src_height,
+		uint32_t dst_width, uint32_t dst_height) {
+	for (uint32_t i = 0; i < damage->count; i++) {
+		struct xdpw_frame_damage *rect = &damage->rects[i];
+		uint32_t x0 = scale_floor(rect->x, src_width, dst_width);
+		uint32_t y0 = scale_floor(rect->y, src_height, dst_height);
+		uint32_t x1 = scale_ceil(rect->x + rect->width, src_width, dst_width);
+		uint32_t y1 = scale_ceil(rect->y + rect->height, src_height, dst_height);
+		rect->x = x0;
+		rect->y = y0;
+		rect->width = x1 - x0;
+		rect->height = y1 - y0;
+	}
+}
+
+enum xdpw_transform xdpw_transform_compose(enum xdpw_transform first,
+		enum xdpw_transform second) {
+	uint32_t flipped = (first ^ second) & XDPW_TRANSFORM_FLIPPED;
+	uint32_t rotation = second & XDPW_TRANSFORM_FLIPPED ?
+		second - first : second + first;
+	return flipped | (rotation & 3);
+}
+
+enum xdpw_transform xdpw_transform_invert(enum xdpw_transform transform) {
+	if (transform & XDPW_TRANSFORM_FLIPPED) {
+		return transform;
+	}
+	return (4 - transform) & 3;
+}
+
+bool xdpw_transform_swaps(enum xdpw_transform transform) {
+	return transform & XDPW_TRANSFORM_90;
+}
+
+static void transform_point(enum xdpw_transform transform, int64_t width, int64_t height,
+		int64_t x, int64_t y, int64_t *out_x, int64_t *out_y) {
+	if (transform & XDPW_TRANSFORM_FLIPPED) {
+		x = width - 1 - x;
+	}
+	switch (transform & 3) {
+	case XDPW_TRANSFORM_NORMAL:
+		*out_x = x;
+		*out_y = y;
+		break;
+	case XDPW_TRANSFORM_90:
+		*out_x = y;
+		*out_y = width - 1 - x;
+		break;
+	case XDPW_TRANSFORM_180:
+		*out_x = width - 1 - x;
+		*out_y = height - 1 - y;
+		break;
+	case XDPW_TRANSFORM_270:
+		*out_x = height - 1 - y;
+		*out_y = x;
+		break;
+	}
+}
+
+void xdpw_transform_rect(struct xdpw_frame_damage *rect, enum xdpw_transform transform,
+		uint32_t width, uint32_t height) {
+	if (rect->x >= width || rect->y >= height) {
+		rect->width = 0;
+		rect->height = 0;
+	}
+	if (rect->width == 0 || rect->height == 0) {
+		return;
+	}
+	if (rect->width > width - rect->x) {
+		rect->width = width - rect->x;
+	}
+	if (rect->height > height - rect->y) {
+		rect->height = height - rect->y;
+	}
+	int64_t x0, y0, x1, y1;
+	transform_point(transform, width, height, rect->x, rect->y, &x0, &y0);
+	transform_point(transform, width, height, rect->x + rect->width - 1,
+		rect->y + rect->height - 1, &x1, &y1);
+	rect->x = x0 < x1 ? x0 : x1;
+	rect->y = y0 < y1 ? y0 : y1;
+	rect->width = (x0 < x1 ? x1 - x0 : x0 - x1) + 1;
+	rect->height = (y0 < y1 ? y1 - y0 : y0 - y1) + 1;
+}
+
+void xdpw_damage_transform(struct xdpw_damage *damage, enum xdpw_transform transform,
+		uint32_t width, uint32_t height) {
+	for (uint32_t i = 0; i < damage->count; i++) {
+		xdpw_transform_rect(&damage->rects[i], transform, width, height);
+	}
+}
+
+static void transform_tile(const uint8_t *src, uint32_t src_stride,
+		uint8_t *origin, ptrdiff_t step_x, ptrdiff_t step_y,
+		uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+	for (uint32_t y = y0; y < y1; y++) {
+		const uint8_t *in = src + (size_t)y * src_stride + x0 * TRANSFORM_BPP;
+		uint8_t *out = origin + y * step_y + x0 * step_x;
+		for (uint32_t x = x0; x < x1; x++) {
+			memcpy(out, in, TRANSFORM_BPP);
+			in += TRANSFORM_BPP;
+			out += step_x;
+		}
+	}
+}
+
+void xdpw_transform_image(enum xdpw_transform transform,
+		const uint8_t *src, uint32_t src_stride, uint32_t src_width, uint32_t src_height,
+		const struct xdpw_frame_damage *rect, uint8_t *dst, uint32_t dst_stride) {
+	// the transform is affine, a step in the source is a fixed step in dst
+	int64_t x0, y0, x1, y1, x2, y2;
+	transform_point(transform, src_width, src_height, 0, 0, &x0, &y0);
+	transform_point(transform, src_width, src_height, 1, 0, &x1, &y1);
+	transform_point(transform, src_width, src_height, 0, 1, &x2, &y2);
+	uint8_t *origin = dst + y0 * (int64_t)dst_stride + x0 * TRANSFORM_BPP;
+	ptrdiff_t step_x = (y1 - y0) * (int64_t)dst_stride + (x1 - x0) * TRANSFORM_BPP;
+	ptrdiff_t step_y = (y2 - y0) * (int64_t)dst_stride + (x2 - x0) * TRANSFORM_BPP;
+
+	uint32_t end_x = rect->x + rect->width;
+	uint32_t end_y = rect->y + rect->height;
+	if (step_x == TRANSFORM_BPP) {
+		// rows stay rows
+		for (uint32_t y = rect->y; y < end_y; y++) {
+			memcpy(origin + y * step_y + rect->x * TRANSFORM_BPP,
+				src + (size_t)y * src_stride + rect->x * TRANSFORM_BPP,
+				(size_t)rect->width * TRANSFORM_BPP);
+		}
+		return;
+	}
+
+	for (uint32_t tile_y = rect->y; tile_y < end_y; tile_y += TRANSFORM_TILE) {
+		uint32_t tile_end_y = end_y - tile_y < TRANSFORM_TILE ? end_y : tile_y + TRANSFORM_TILE;
+		for (uint32_t tile_x = rect->x; tile_x < end_x; tile_x += TRANSFORM_TILE) {
+			uint32_t tile_end_x = end_x - tile_x < TRANSFORM_TILE ? end_x : tile_x + TRANSFORM_TILE;
+			transform_tile(src, src_stride, origin, step_x, step_y,
+				tile_x, tile_y, tile_end_x, tile_end_y);
+		}
+	}
+}
@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+#include "udmabuf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef HAVE_UDMABUF
+#include <linux/udmabuf.h>
+#endif
+
+#include "logger.h"
+
+int xdpw_udmabuf_open(void) {
+#ifdef HAVE_UDMABUF
+	int fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		logprint(DEBUG, "udmabuf: /dev/udmabuf not available");
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+int xdpw_udmabuf_create(int udmabuf_fd, size_t size) {
+#ifdef HAVE_UDMABUF
+	int memfd = memfd_create("xdpw-udmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		logprint(ERROR, "udmabuf: memfd_create failed: %s", strerror(errno));
+		return -1;
+	}
+	// udmabuf refuses memfds that could shrink under the mapping
+	if (ftruncate(memfd, size) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+		logprint(ERROR, "udmabuf: unable to prepare memfd: %s", strerror(errno));
+		close(memfd);
+		return -1;
+	}
+
+	struct udmabuf_create create = {
+		.memfd = memfd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = 0,
+		.size = size,
+	};
+	int fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+	close(memfd);
+	if (fd < 0) {
+		logprint(ERROR, "udmabuf: UDMABUF_CREATE failed: %s", strerror(errno));
+		return -1;
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
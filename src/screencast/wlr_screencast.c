@@ -1,16 +1,22 @@
 #include "wlr_screencast.h"
 
+#include "ext-foreign-toplevel-list-v1-client-protocol.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <assert.h>
 #include <wayland-client-protocol.h>
@@ -20,189 +26,724 @@
 #include "xdpw.h"
 #include "logger.h"
 #include "fps_limit.h"
+#include "convert.h"
+#include "simulcast.h"
+#include "subprocess.h"
+#include "timespec_util.h"
 
-void wlr_frame_free(struct xdpw_screencast_instance *cast) {
-	zwlr_screencopy_frame_v1_destroy(cast->wlr_frame);
-	cast->wlr_frame = NULL;
-	logprint(TRACE, "wlroots: frame destroyed");
+static void noop() {
+	// This space intentionally left blank
 }
 
-void xdpw_wlr_frame_finish(struct xdpw_screencast_instance *cast) {
-	logprint(TRACE, "wlroots: finish screencopy");
+static struct xdpw_frame *wlr_frame_at(struct xdpw_screencast_instance *cast, uint32_t index) {
+	return &cast->frames[(cast->frame_head + index) % XDPW_MAX_FRAMES_IN_FLIGHT];
+}
 
-	wlr_frame_free(cast);
+static bool wlr_frame_is_done(struct xdpw_frame *frame) {
+	return !frame->wlr_frame && !frame->ext_frame && !frame->cursor_frame;
+}
 
-	if (!cast->pwr_stream_state) {
+// the fastest rate any consumer of the capture negotiated
+static uint32_t wlr_capture_framerate(struct xdpw_screencast_instance *cast) {
+	uint32_t framerate = xdpw_simulcast_max_framerate(cast);
+	if (cast->pwr_stream_state && cast->framerate > framerate) {
+		framerate = cast->framerate;
+	}
+	return framerate;
+}
+
+static void wlr_frame_tick(struct xdpw_screencast_instance *cast) {
+	if (cast->pwr_stream_state) {
+		xdpw_pwr_trigger_process(cast);
+	} else {
+		// only simulcast streams are left, they don't drive the captures
+		xdpw_wlr_frame_start(cast);
+	}
+}
+
+static void wlr_frame_timer_handler(void *data) {
+	struct xdpw_screencast_instance *cast = data;
+
+	wlr_frame_tick(cast);
+}
+
+/*
+ * Captures are started by a frame clock: every start arms a timer for the
+ * next one. A tick that finds all frames in flight is dropped, the next frame
+ * that completes starts the capture instead. With a single frame in flight
+ * this waits for the compositor like a serial capture loop, with more frames
+ * a new capture is outstanding while the previous one is still copied.
+ */
+static void wlr_frame_schedule(struct xdpw_screencast_instance *cast) {
+	if (cast->ended || xdpw_timer_is_armed(&cast->frame_timer)) {
+		return;
+	}
+	if (cast->pwr_stream_state ? !xdpw_pwr_is_driving(cast) :
+			!xdpw_simulcast_is_streaming(cast)) {
+		return;
+	}
+
+	struct config_screencast *conf = &cast->ctx->state->config->screencast_conf;
+	double framerate = fps_idle_framerate(&cast->fps_idle,
+		wlr_capture_framerate(cast), conf->idle_fps);
+	uint64_t delay_ns = fps_limit_frame_delay(&cast->fps_limit, framerate);
+	if (cast->capture_failures > 0) {
+		// give the compositor time to recover
+		uint64_t backoff_ns = XDPW_CAPTURE_BACKOFF_NS << MIN(cast->capture_failures - 1, 16u);
+		delay_ns = MAX(delay_ns, MIN(backoff_ns, XDPW_CAPTURE_BACKOFF_MAX_NS));
+	}
+	if (delay_ns > 0) {
+		xdpw_arm_timer(cast->ctx->state, &cast->frame_timer, delay_ns,
+			XDPW_FRAME_TIMER_SLACK_NS, wlr_frame_timer_handler, cast);
+	} else {
+		wlr_frame_tick(cast);
+	}
+}
+
+/*
+ * Without a buffer to capture into, capturing pauses until pipewire hands one
+ * out again. Frames in flight and process events start the next capture as
+ * usual, otherwise the frame clock retries a frame interval later.
+ */
+static void wlr_frame_stall(struct xdpw_screencast_instance *cast) {
+	if (!cast->buffer_stalled) {
+		cast->buffer_stalled = true;
+		cast->buffer_stalls++;
+		logprint(DEBUG, "wlroots: out of buffers, pausing capture (%" PRIu64 " stalls)",
+			cast->buffer_stalls);
+	}
+	if (cast->frame_count > 0 || xdpw_timer_is_armed(&cast->frame_timer) ||
+			!xdpw_pwr_is_driving(cast)) {
+		return;
+	}
+	uint32_t framerate = MAX(wlr_capture_framerate(cast), 1u);
+	xdpw_arm_timer(cast->ctx->state, &cast->frame_timer, SPA_NSEC_PER_SEC / framerate,
+		XDPW_FRAME_TIMER_SLACK_NS, wlr_frame_timer_handler, cast);
+}
+
+static bool damage_is_full(struct xdpw_damage *damage, uint32_t width, uint32_t height) {
+	for (uint32_t i = 0; i < damage->count; i++) {
+		struct xdpw_frame_damage *rect = &damage->rects[i];
+		if (rect->x == 0 && rect->y == 0 && rect->width >= width && rect->height >= height) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Replace missing or full frame damage by the tiles which actually changed
+ * since the last frame. Only mapped shm buffers can be inspected.
+ */
+static void wlr_frame_detect_damage(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	struct xdpw_buffer *buffer = frame->xdpw_buffer;
+	if (!buffer || buffer->buffer_type != WL_SHM || !buffer->data) {
+		xdpw_tile_hash_reset(&cast->tile_hash);
+		return;
+	}
+
+	struct xdpw_damage *damage = &frame->damage;
+	if (!xdpw_damage_is_empty(damage) && !damage_is_full(damage, buffer->width, buffer->height)) {
+		// the compositor told us what changed, but the tile hashes are stale now
+		xdpw_tile_hash_reset(&cast->tile_hash);
+		return;
+	}
+
+	uint32_t bpp = xdpw_bpp_from_drm_fourcc(buffer->format);
+	if (bpp == 0) {
+		return;
+	}
+
+	struct xdpw_damage detected = {0};
+	if (!xdpw_tile_hash_damage(&cast->tile_hash, buffer->data, buffer->width,
+			buffer->height, buffer->stride[0], bpp, &detected)) {
+		logprint(ERROR, "wlroots: failed to allocate tile hashes");
+		return;
+	}
+
+	*damage = detected;
+	frame->unchanged = xdpw_damage_is_empty(damage);
+	logprint(TRACE, "wlroots: detected %u damaged regions", damage->count);
+}
+
+static void wlr_frame_update_cursor(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	struct xdpw_buffer *buffer = frame->xdpw_buffer;
+	struct xdpw_buffer *cursor_buffer = frame->cursor_buffer;
+	if (frame->cursor_state != XDPW_FRAME_STATE_SUCCESS ||
+			!buffer || !buffer->data || !cursor_buffer ||
+			cursor_buffer->width != buffer->width ||
+			cursor_buffer->height != buffer->height ||
+			cursor_buffer->stride[0] != buffer->stride[0] ||
+			cursor_buffer->format != buffer->format) {
+		return;
+	}
+
+	struct xdpw_cursor *cursor = &cast->cursor;
+	bool visible = cursor->visible;
+	uint64_t hash = cursor->hash;
+	if (!xdpw_cursor_extract(cursor, cursor_buffer->data, buffer->data,
+			buffer->width, buffer->height, buffer->stride[0], buffer->format,
+			frame->y_invert)) {
+		return;
+	}
+
+	frame->cursor_changed = true;
+	if (cursor->visible != visible || (cursor->visible && cursor->hash != hash)) {
+		cast->cursor_bitmap_dirty = true;
+	}
+	logprint(TRACE, "wlroots: cursor %s at %d,%d (%ux%u)",
+		cursor->visible ? "visible" : "hidden", cursor->x, cursor->y,
+		cursor->width, cursor->height);
+}
+
+/*
+ * Failed captures are retried with a backoff, see wlr_frame_schedule(). The
+ * instance gives up if too many of them fail in a row.
+ */
+static void wlr_frame_count_failure(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	if (frame->state == XDPW_FRAME_STATE_SUCCESS) {
+		cast->capture_failures = 0;
+	}
+	if (frame->state != XDPW_FRAME_STATE_FAILED) {
+		return;
+	}
+
+	cast->capture_failures++;
+	cast->failed_frames++;
+	if (cast->capture_failures >= XDPW_CAPTURE_MAX_FAILURES) {
+		logprint(ERROR, "wlroots: %u captures failed in a row, giving up",
+			cast->capture_failures);
+		xdpw_screencast_instance_end(cast);
 		return;
 	}
+	logprint(WARN, "wlroots: capture failed (%u in a row, %" PRIu64 " in total), retrying",
+		cast->capture_failures, cast->failed_frames);
+	// armed without the backoff, the flush arms it again
+	xdpw_disarm_timer(&cast->frame_timer);
+}
 
-	// Check if we have a buffer
-	if (cast->current_frame.current_pw_buffer) {
-		xdpw_pwr_enqueue_buffer(cast);
+/*
+ * Exports a frame that left the pipeline. Returns false if the instance was
+ * destroyed.
+ */
+static bool wlr_frame_complete(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	logprint(TRACE, "wlroots: complete frame");
+
+	if (!cast->pwr_stream_state && !xdpw_simulcast_is_streaming(cast)) {
+		if (frame->pw_buffer) {
+			xdpw_pwr_hold_buffer(cast, frame->pw_buffer);
+		}
+		return true;
+	}
+
+	wlr_frame_count_failure(cast, frame);
+
+	struct config_screencast *conf = &cast->ctx->state->config->screencast_conf;
+	if (frame->state == XDPW_FRAME_STATE_SUCCESS) {
+		if (cast->cursor_mode == METADATA) {
+			// copied without damage tracking
+			xdpw_damage_set_full(&frame->damage, cast->pwr_format.size.width,
+				cast->pwr_format.size.height);
+		}
+		if (conf->damage_detection || cast->cursor_mode == METADATA) {
+			wlr_frame_detect_damage(cast, frame);
+		}
+		if (cast->cursor_mode == METADATA) {
+			wlr_frame_update_cursor(cast, frame);
+		}
+		if (!frame->unchanged || frame->cursor_changed) {
+			xdpw_simulcast_export(cast, frame);
+		}
 	}
 
-	if (cast->frame_state == XDPW_FRAME_STATE_RENEG) {
+	// Check if we have a buffer, unchanged frames keep it for the next capture
+	if (frame->pw_buffer) {
+		if (frame->state == XDPW_FRAME_STATE_SUCCESS &&
+				frame->unchanged && !frame->cursor_changed) {
+			xdpw_pwr_hold_buffer(cast, frame->pw_buffer);
+		} else if (frame->state == XDPW_FRAME_STATE_SUCCESS && (!cast->pwr_stream_state ||
+				(wlr_capture_framerate(cast) > cast->framerate &&
+				!fps_decimate(&cast->decimate, frame->pts, cast->framerate)))) {
+			// paused, or a simulcast stream runs faster than the main stream
+			xdpw_pwr_skip_frame(cast, frame);
+			xdpw_pwr_hold_buffer(cast, frame->pw_buffer);
+		} else if (!cast->pwr_stream_state) {
+			xdpw_pwr_hold_buffer(cast, frame->pw_buffer);
+		} else {
+			xdpw_pwr_enqueue_buffer(cast, frame);
+		}
+	} else if (frame->state == XDPW_FRAME_STATE_SUCCESS) {
+		// captured for simulcast streams only
+		xdpw_pwr_skip_frame(cast, frame);
+	}
+
+	if (frame->state == XDPW_FRAME_STATE_RENEG) {
 		pwr_update_stream_param(cast);
+		xdpw_simulcast_update_params(cast);
 	}
 
-	if (cast->quit || cast->err) {
-		// TODO: revisit the exit condition (remove quit?)
-		// and clean up sessions that still exist if err
-		// is the cause of the instance_destroy call
+	if (cast->quit) {
+		// the Wayland connection is torn down
 		xdpw_screencast_instance_destroy(cast);
-		return ;
+		return false;
+	}
+	if (cast->err) {
+		// sessions still hold references, they are closed first
+		xdpw_screencast_instance_end(cast);
 	}
 
-	if (cast->pwr_stream_state && xdpw_pwr_is_driving(cast)) {
-		if (cast->frame_state == XDPW_FRAME_STATE_SUCCESS) {
-			uint64_t delay_ns = fps_limit_measure_end(&cast->fps_limit, cast->framerate);
-			if (delay_ns > 0) {
-				xdpw_add_timer(cast->ctx->state, delay_ns,
-					(xdpw_event_loop_timer_func_t) xdpw_pwr_trigger_process, cast);
-			} else {
-				xdpw_pwr_trigger_process(cast);
-			}
-		} else {
-			xdpw_pwr_trigger_process(cast);
+	if (frame->state == XDPW_FRAME_STATE_SUCCESS) {
+		bool idle = cast->fps_idle.idle;
+		bool damaged = !xdpw_damage_is_empty(&frame->damage) || frame->cursor_changed;
+		fps_idle_update(&cast->fps_idle, damaged, wlr_capture_framerate(cast),
+			conf->idle_fps, conf->idle_frames > 0 ? conf->idle_frames : 1);
+		if (idle && !cast->fps_idle.idle) {
+			// don't wait for the idle frame clock
+			xdpw_disarm_timer(&cast->frame_timer);
+		}
+	}
+	return true;
+}
+
+// frames are exported in capture order, no matter in which order they finish
+static void wlr_frames_flush(struct xdpw_screencast_instance *cast) {
+	while (cast->frame_count > 0) {
+		struct xdpw_frame *frame = wlr_frame_at(cast, 0);
+		if (!wlr_frame_is_done(frame) || cast->copy_job.pending) {
+			// the frame at the copy worker is sent first
+			break;
+		}
+
+		cast->frame_head = (cast->frame_head + 1) % XDPW_MAX_FRAMES_IN_FLIGHT;
+		cast->frame_count--;
+		if (!wlr_frame_complete(cast, frame)) {
+			return;
 		}
 	}
+
+	wlr_frame_schedule(cast);
+}
+
+void xdpw_wlr_frames_resume(struct xdpw_screencast_instance *cast) {
+	wlr_frames_flush(cast);
+}
+
+static void xdpw_wlr_frame_finish(struct xdpw_frame *frame) {
+	logprint(TRACE, "wlroots: finish screencopy");
+
+	if (frame->wlr_frame) {
+		zwlr_screencopy_frame_v1_destroy(frame->wlr_frame);
+		frame->wlr_frame = NULL;
+	}
+	if (frame->ext_frame) {
+		ext_image_copy_capture_frame_v1_destroy(frame->ext_frame);
+		frame->ext_frame = NULL;
+	}
+	logprint(TRACE, "wlroots: frame destroyed");
+
+	wlr_frames_flush(frame->cast);
+}
+
+void xdpw_wlr_frames_destroy(struct xdpw_screencast_instance *cast) {
+	for (uint32_t i = 0; i < XDPW_MAX_FRAMES_IN_FLIGHT; i++) {
+		struct xdpw_frame *frame = &cast->frames[i];
+		if (frame->wlr_frame) {
+			zwlr_screencopy_frame_v1_destroy(frame->wlr_frame);
+			frame->wlr_frame = NULL;
+		}
+		if (frame->ext_frame) {
+			ext_image_copy_capture_frame_v1_destroy(frame->ext_frame);
+			frame->ext_frame = NULL;
+		}
+		if (frame->cursor_frame) {
+			zwlr_screencopy_frame_v1_destroy(frame->cursor_frame);
+			frame->cursor_frame = NULL;
+		}
+		if (frame->cursor_buffer) {
+			xdpw_buffer_destroy(frame->cursor_buffer);
+			frame->cursor_buffer = NULL;
+		}
+		if (frame->capture_buffer) {
+			xdpw_buffer_destroy(frame->capture_buffer);
+			frame->capture_buffer = NULL;
+		}
+	}
+	cast->frame_count = 0;
+
+	xdpw_disarm_timer(&cast->frame_timer);
+}
+
+void xdpw_wlr_session_destroy(struct xdpw_screencast_instance *cast) {
+	if (cast->ext_session) {
+		ext_image_copy_capture_session_v1_destroy(cast->ext_session);
+		cast->ext_session = NULL;
+	}
+	if (cast->ext_source) {
+		ext_image_capture_source_v1_destroy(cast->ext_source);
+		cast->ext_source = NULL;
+	}
+	cast->ext_constraints_done = false;
+}
+
+/*
+ * ext-image-copy-capture keeps one session for the whole capture, so the
+ * buffer constraints are sent once instead of with every frame. It can't
+ * capture a region of an output, and the metadata cursor mode needs two
+ * captures of the same output frame. Both stay with screencopy. Without it,
+ * regions are refused and the metadata cursor mode isn't offered, see
+ * setup_outputs().
+ */
+bool xdpw_wlr_ext_capture(struct xdpw_screencast_context *ctx,
+		enum cursor_modes cursor_mode, const struct xdpw_region *region) {
+	if (!ctx->ext_copy_manager || !ctx->ext_output_source_manager) {
+		return false;
+	}
+	return !ctx->screencopy_manager ||
+		(cursor_mode != METADATA && xdpw_region_is_empty(region));
 }
 
+static void wlr_register_cb(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame);
+static void wlr_register_cursor_cb(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame);
+static void ext_register_cb(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame);
+
 void xdpw_wlr_frame_start(struct xdpw_screencast_instance *cast) {
 	logprint(TRACE, "wlroots: start screencopy");
-	if (cast->err) {
+	if (cast->err && !cast->ended) {
 		logprint(ERROR, "wlroots: nonrecoverable error has happened. shutting down instance");
-		xdpw_screencast_instance_destroy(cast);
-		return ;
+		xdpw_screencast_instance_end(cast);
+	}
+	if (cast->ended) {
+		return;
 	}
 
+	if (cast->frame_count >= cast->frame_depth) {
+		logprint(TRACE, "wlroots: %u frames in flight", cast->frame_count);
+		return;
+	}
+
+	struct xdpw_frame *frame = wlr_frame_at(cast, cast->frame_count);
+	if (cast->copy_job.pending && frame->capture_buffer &&
+			frame->capture_buffer == cast->copy_frame.xdpw_buffer) {
+		logprint(TRACE, "wlroots: capture buffer is still being copied");
+		return;
+	}
+	*frame = (struct xdpw_frame) {
+		.cast = cast,
+		.state = XDPW_FRAME_STATE_NONE,
+		.pts = -1,
+		.cursor_buffer = frame->cursor_buffer,
+		.capture_buffer = frame->capture_buffer,
+	};
+
 	if (cast->pwr_stream_state) {
-		xdpw_pwr_dequeue_buffer(cast);
+		if (cast->held_count > 0) {
+			frame->pw_buffer = cast->held_buffers[--cast->held_count];
+			frame->xdpw_buffer = frame->pw_buffer->user_data;
+		} else {
+			xdpw_pwr_dequeue_buffer(cast, frame);
+		}
 
-		if (!cast->current_frame.current_pw_buffer) {
-			logprint(WARN, "wlroots: failed to dequeue buffer");
-			// TODO: wait for next frame
+		if (!frame->pw_buffer) {
+			wlr_frame_stall(cast);
+			return;
+		}
+		if (cast->buffer_stalled) {
+			logprint(DEBUG, "wlroots: buffer available, resuming capture");
+			cast->buffer_stalled = false;
 		}
+		if (!frame->xdpw_buffer) {
+			logprint(WARN, "wlroots: dequeued buffer has no xdpw buffer");
+		}
+	}
+
+	cast->frame_count++;
+	fps_limit_frame_start(&cast->fps_limit);
+	if (cast->ext_capture) {
+		// the session may finish the frame right away, which can end the instance
+		wlr_frame_schedule(cast);
+		ext_register_cb(cast, frame);
+		return;
+	}
+	wlr_register_cb(cast, frame);
+
+	if (cast->cursor_mode == METADATA && frame->xdpw_buffer) {
+		wlr_register_cursor_cb(cast, frame);
 	}
 
-	cast->frame_state = XDPW_FRAME_STATE_NONE;
-	xdpw_wlr_register_cb(cast);
+	wlr_frame_schedule(cast);
 }
 
 static void wlr_frame_buffer_done(void *data,
-		struct zwlr_screencopy_frame_v1 *frame);
+		struct zwlr_screencopy_frame_v1 *wlr_frame);
 
-static void wlr_frame_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame,
+static void wlr_frame_buffer(void *data, struct zwlr_screencopy_frame_v1 *wlr_frame,
 		uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_frame *frame = data;
+	struct xdpw_screencast_instance *cast = frame->cast;
 
 	logprint(TRACE, "wlroots: buffer event handler");
-	cast->wlr_frame = frame;
 
-	cast->screencopy_frame.width = width;
-	cast->screencopy_frame.height = height;
-	cast->screencopy_frame.stride = stride;
-	cast->screencopy_frame.size = stride * height;
-	cast->screencopy_frame.format = format;
+	cast->screencopy_frame_info[WL_SHM].width = width;
+	cast->screencopy_frame_info[WL_SHM].height = height;
+	cast->screencopy_frame_info[WL_SHM].stride = stride;
+	cast->screencopy_frame_info[WL_SHM].size = stride * height;
+	cast->screencopy_frame_info[WL_SHM].format = xdpw_format_drm_fourcc_from_wl_shm(format);
+
+	// the linux_dmabuf event follows if the compositor supports it for this frame
+	cast->screencopy_frame_info[DMABUF] = (struct xdpw_screencopy_frame_info) { 0 };
 
 	if (zwlr_screencopy_manager_v1_get_version(cast->ctx->screencopy_manager) < 3) {
-		wlr_frame_buffer_done(cast, frame);
+		wlr_frame_buffer_done(frame, wlr_frame);
 	}
 }
 
 static void wlr_frame_linux_dmabuf(void *data,
-		struct zwlr_screencopy_frame_v1 *frame,
+		struct zwlr_screencopy_frame_v1 *wlr_frame,
 		uint32_t format, uint32_t width, uint32_t height) {
+	struct xdpw_frame *frame = data;
+	struct xdpw_screencast_instance *cast = frame->cast;
+
 	logprint(TRACE, "wlroots: linux_dmabuf event handler");
+
+	cast->screencopy_frame_info[DMABUF].width = width;
+	cast->screencopy_frame_info[DMABUF].height = height;
+	cast->screencopy_frame_info[DMABUF].format = format;
 }
 
-static void wlr_frame_buffer_done(void *data,
-		struct zwlr_screencopy_frame_v1 *frame) {
-	struct xdpw_screencast_instance *cast = data;
+// (re)creates a private shm buffer unless it already matches the frame info
+static bool wlr_buffer_ensure(struct xdpw_screencast_instance *cast,
+		struct xdpw_buffer **buffer, struct xdpw_screencopy_frame_info *frame_info) {
+	if (*buffer && ((*buffer)->width != frame_info->width ||
+			(*buffer)->height != frame_info->height ||
+			(*buffer)->size[0] != frame_info->size ||
+			(*buffer)->stride[0] != frame_info->stride ||
+			(*buffer)->format != frame_info->format)) {
+		xdpw_buffer_destroy(*buffer);
+		*buffer = NULL;
+	}
+	if (!*buffer) {
+		*buffer = xdpw_buffer_create(cast, WL_SHM, frame_info);
+	}
+	return *buffer != NULL;
+}
+
+static void ext_frame_capture(struct xdpw_frame *frame, struct xdpw_buffer *buffer,
+		const struct xdpw_damage *buffer_damage);
+
+/*
+ * Starts the copy into buffer, buffer_damage is what changed since the buffer
+ * last held a frame. Screencopy tracks that on its own.
+ */
+static void wlr_frame_copy(struct xdpw_frame *frame, struct xdpw_buffer *buffer,
+		const struct xdpw_damage *buffer_damage) {
+	if (frame->ext_frame) {
+		ext_frame_capture(frame, buffer, buffer_damage);
+	} else if (frame->cast->cursor_mode == METADATA) {
+		// the cursor capture must come from the same output frame
+		zwlr_screencopy_frame_v1_copy(frame->wlr_frame, buffer->buffer);
+	} else {
+		zwlr_screencopy_frame_v1_copy_with_damage(frame->wlr_frame, buffer->buffer);
+	}
+}
+
+/*
+ * Captures the frame into a private buffer, either because nobody consumes
+ * the main stream and the frame is only for the simulcast streams, or because
+ * the main stream gets it turned, downscaled or converted.
+ */
+static void wlr_frame_copy_private(struct xdpw_frame *frame) {
+	struct xdpw_screencast_instance *cast = frame->cast;
+
+	if (!wlr_buffer_ensure(cast, &frame->capture_buffer,
+			&cast->screencopy_frame_info[WL_SHM])) {
+		logprint(ERROR, "wlroots: failed to create capture buffer");
+		frame->xdpw_buffer = NULL;
+		frame->state = XDPW_FRAME_STATE_FAILED;
+		xdpw_wlr_frame_finish(frame);
+		return;
+	}
+
+	frame->xdpw_buffer = frame->capture_buffer;
+	wlr_frame_copy(frame, frame->xdpw_buffer, &frame->xdpw_buffer->damage);
+	logprint(TRACE, "wlroots: frame copied into private buffer");
+}
+
+// the buffer constraints of the frame are known, start copying it
+static void wlr_frame_constraints_done(struct xdpw_frame *frame) {
+	struct xdpw_screencast_instance *cast = frame->cast;
+
+	if (!cast->stream) {
+		// the first frame tells which formats the stream can offer
+		xdpw_pwr_stream_create(cast);
+		xdpw_simulcast_update_params(cast);
+	}
 
-	logprint(TRACE, "wlroots: buffer_done event handler");
 	if (!cast->pwr_stream_state) {
-		xdpw_wlr_frame_finish(cast);
+		if (xdpw_simulcast_is_streaming(cast)) {
+			if (frame->pw_buffer) {
+				xdpw_pwr_hold_buffer(cast, frame->pw_buffer);
+				frame->pw_buffer = NULL;
+			}
+			wlr_frame_copy_private(frame);
+		} else {
+			xdpw_wlr_frame_finish(frame);
+		}
 		return;
 	}
 
-	if (!cast->current_frame.current_pw_buffer) {
+	if (!frame->xdpw_buffer) {
 		logprint(WARN, "wlroots: no current buffer");
-		xdpw_wlr_frame_finish(cast);
+		xdpw_wlr_frame_finish(frame);
 		return;
 	}
 
+	struct xdpw_screencopy_frame_info *frame_info = &cast->screencopy_frame_info[cast->buffer_type];
+	const struct xdpw_format_info *info = xdpw_format_info_from_drm_fourcc(frame_info->format);
+	// the format of the frames before they are converted
+	uint32_t format = cast->pack_format ? cast->pack_format : frame_info->format;
+	enum spa_video_format frame_format = xdpw_format_pw_from_drm_fourcc(format);
+	uint32_t width, height;
+	xdpw_stream_size(cast, frame_info, &width, &height);
+
 	// Check if announced screencopy information is compatible with pipewire meta
-	if ((cast->pwr_format.format != xdpw_format_pw_from_wl_shm(cast->screencopy_frame.format) &&
-			cast->pwr_format.format != xdpw_format_pw_strip_alpha(xdpw_format_pw_from_wl_shm(cast->screencopy_frame.format))) ||
-			cast->pwr_format.size.width != cast->screencopy_frame.width ||
-			cast->pwr_format.size.height != cast->screencopy_frame.height) {
+	bool format_compatible = info != NULL &&
+		(!cast->pack_format || info->pack_format == cast->pack_format);
+	if (format_compatible && cast->convert_format) {
+		format_compatible = xdpw_convert_supported(format, cast->convert_format);
+	} else if (format_compatible) {
+		format_compatible = frame_format != SPA_VIDEO_FORMAT_UNKNOWN &&
+			(cast->pwr_format.format == frame_format ||
+				cast->pwr_format.format == xdpw_format_pw_strip_alpha(frame_format));
+	}
+	if (!format_compatible ||
+			cast->pwr_format.size.width != width ||
+			cast->pwr_format.size.height != height) {
 		logprint(DEBUG, "wlroots: pipewire and wlroots metadata are incompatible. Renegotiate stream");
-		cast->frame_state = XDPW_FRAME_STATE_RENEG;
-		xdpw_wlr_frame_finish(cast);
+		frame->state = XDPW_FRAME_STATE_RENEG;
+		xdpw_wlr_frame_finish(frame);
+		return;
+	}
+
+	struct xdpw_buffer *buffer = frame->xdpw_buffer;
+	if (xdpw_copies_frames(cast)) {
+		if (buffer->format != xdpw_copy_format(cast, frame_info->format) ||
+				buffer->width != width || buffer->height != height) {
+			logprint(DEBUG, "wlroots: pipewire buffer has wrong dimensions");
+			frame->state = XDPW_FRAME_STATE_FAILED;
+			xdpw_wlr_frame_finish(frame);
+			return;
+		}
+		// packed, turned, downscaled or converted when the frame is sent
+		wlr_frame_copy_private(frame);
 		return;
 	}
 
 	// Check if dequeued buffer is compatible with announced buffer
-	if (cast->current_frame.size != cast->screencopy_frame.size ||
-			cast->current_frame.stride != cast->screencopy_frame.stride) {
+	if (buffer->buffer_type != cast->buffer_type ||
+			buffer->width != frame_info->width ||
+			buffer->height != frame_info->height ||
+			(buffer->buffer_type == WL_SHM &&
+				(buffer->size[0] != frame_info->size ||
+				buffer->stride[0] != frame_info->stride))) {
 		logprint(DEBUG, "wlroots: pipewire buffer has wrong dimensions");
-		cast->frame_state = XDPW_FRAME_STATE_FAILED;
-		xdpw_wlr_frame_finish(cast);
+		frame->state = XDPW_FRAME_STATE_FAILED;
+		xdpw_wlr_frame_finish(frame);
 		return;
 	}
 
-	assert(cast->current_frame.buffer);
+	assert(buffer->buffer);
 
-	zwlr_screencopy_frame_v1_copy_with_damage(frame, cast->current_frame.buffer);
+	struct xdpw_damage buffer_damage = buffer->damage;
+	if (cast->sent_transform != XDPW_TRANSFORM_NORMAL) {
+		// sent frames were flipped in place, nothing is where it was captured
+		xdpw_damage_set_full(&buffer_damage, buffer->width, buffer->height);
+	}
+	wlr_frame_copy(frame, buffer, &buffer_damage);
 	logprint(TRACE, "wlroots: frame copied");
+}
 
-	fps_limit_measure_start(&cast->fps_limit, cast->framerate);
+static void wlr_frame_buffer_done(void *data,
+		struct zwlr_screencopy_frame_v1 *wlr_frame) {
+	logprint(TRACE, "wlroots: buffer_done event handler");
+	wlr_frame_constraints_done(data);
 }
 
-static void wlr_frame_flags(void *data, struct zwlr_screencopy_frame_v1 *frame,
+static void wlr_frame_flags(void *data, struct zwlr_screencopy_frame_v1 *wlr_frame,
 		uint32_t flags) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_frame *frame = data;
 
 	logprint(TRACE, "wlroots: flags event handler");
-	cast->current_frame.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+	frame->y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
 }
 
-static void wlr_frame_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+static void wlr_frame_damage(void *data, struct zwlr_screencopy_frame_v1 *wlr_frame,
 		uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_frame *frame = data;
 
 	logprint(TRACE, "wlroots: damage event handler");
 
-	cast->current_frame.damage.x = x;
-	cast->current_frame.damage.y = y;
-	cast->current_frame.damage.width = width;
-	cast->current_frame.damage.height = height;
+	struct xdpw_frame_damage damage = {
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+	};
+	xdpw_damage_add(&frame->damage, &damage);
+}
+
+/*
+ * Screencopy doesn't name the clock of its timestamps. wlroots uses the
+ * presentation clock, which is CLOCK_MONOTONIC; a CLOCK_REALTIME timestamp is
+ * recognized by being closer to the realtime clock and converted.
+ */
+static int64_t wlr_frame_timestamp_ns(uint64_t tv_sec, uint32_t tv_nsec) {
+	struct timespec ts = { .tv_sec = tv_sec, .tv_nsec = tv_nsec };
+	struct timespec mono, real;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	if (timespec_is_zero(&ts)) {
+		return timespec_to_ns(&mono);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	int64_t to_mono = llabs(timespec_diff_ns(&mono, &ts));
+	int64_t to_real = llabs(timespec_diff_ns(&real, &ts));
+	if (to_real < to_mono) {
+		return timespec_to_ns(&ts) + timespec_diff_ns(&mono, &real);
+	}
+	return timespec_to_ns(&ts);
 }
 
-static void wlr_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
+static void wlr_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *wlr_frame,
 		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_frame *frame = data;
 
 	logprint(TRACE, "wlroots: ready event handler");
 
-	cast->current_frame.tv_sec = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo);
-	cast->current_frame.tv_nsec = tv_nsec;
+	frame->tv_sec = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo);
+	frame->tv_nsec = tv_nsec;
+	frame->pts = wlr_frame_timestamp_ns(frame->tv_sec, frame->tv_nsec);
 
-	cast->frame_state = XDPW_FRAME_STATE_SUCCESS;
+	frame->state = XDPW_FRAME_STATE_SUCCESS;
 
-	xdpw_wlr_frame_finish(cast);
+	xdpw_wlr_frame_finish(frame);
 }
 
 static void wlr_frame_failed(void *data,
-		struct zwlr_screencopy_frame_v1 *frame) {
-	struct xdpw_screencast_instance *cast = data;
+		struct zwlr_screencopy_frame_v1 *wlr_frame) {
+	struct xdpw_frame *frame = data;
 
 	logprint(TRACE, "wlroots: failed event handler");
 
-	cast->frame_state = XDPW_FRAME_STATE_FAILED;
+	frame->state = XDPW_FRAME_STATE_FAILED;
 
-	xdpw_wlr_frame_finish(cast);
+	xdpw_wlr_frame_finish(frame);
 }
 
 static const struct zwlr_screencopy_frame_v1_listener wlr_frame_listener = {
@@ -215,21 +756,390 @@ static const struct zwlr_screencopy_frame_v1_listener wlr_frame_listener = {
 	.damage = wlr_frame_damage,
 };
 
-void xdpw_wlr_register_cb(struct xdpw_screencast_instance *cast) {
-	cast->frame_callback = zwlr_screencopy_manager_v1_capture_output(
-		cast->ctx->screencopy_manager, cast->with_cursor, cast->target_output->output);
+static struct zwlr_screencopy_frame_v1 *wlr_capture(struct xdpw_screencast_instance *cast,
+		bool overlay_cursor) {
+	struct xdpw_region *region = &cast->region;
+	if (xdpw_region_is_empty(region)) {
+		return zwlr_screencopy_manager_v1_capture_output(cast->ctx->screencopy_manager,
+			overlay_cursor, cast->target_output->output);
+	}
+	// only the region is copied, the frame size follows from it
+	return zwlr_screencopy_manager_v1_capture_output_region(cast->ctx->screencopy_manager,
+		overlay_cursor, cast->target_output->output,
+		region->x, region->y, region->width, region->height);
+}
+
+static void wlr_register_cb(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	frame->wlr_frame = wlr_capture(cast, cast->cursor_mode == EMBEDDED);
 
-	zwlr_screencopy_frame_v1_add_listener(cast->frame_callback,
-		&wlr_frame_listener, cast);
+	zwlr_screencopy_frame_v1_add_listener(frame->wlr_frame,
+		&wlr_frame_listener, frame);
 	logprint(TRACE, "wlroots: callbacks registered");
 }
 
+/*
+ * Screencopy has no way to capture the cursor on its own. In metadata mode
+ * every frame is captured a second time with the cursor composited. Neither
+ * capture waits for damage, so both are served from the same output frame.
+ * Comparing them yields the cursor position and image, see
+ * xdpw_cursor_extract().
+ */
+static void wlr_cursor_frame_finish(struct xdpw_frame *frame) {
+	zwlr_screencopy_frame_v1_destroy(frame->cursor_frame);
+	frame->cursor_frame = NULL;
+	logprint(TRACE, "wlroots: cursor frame destroyed");
+
+	wlr_frames_flush(frame->cast);
+}
+
+static void wlr_cursor_frame_buffer_done(void *data,
+		struct zwlr_screencopy_frame_v1 *wlr_frame);
+
+static void wlr_cursor_frame_buffer(void *data, struct zwlr_screencopy_frame_v1 *wlr_frame,
+		uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+	struct xdpw_frame *frame = data;
+	struct xdpw_screencast_instance *cast = frame->cast;
+
+	logprint(TRACE, "wlroots: cursor buffer event handler");
+
+	frame->cursor_frame_info.width = width;
+	frame->cursor_frame_info.height = height;
+	frame->cursor_frame_info.stride = stride;
+	frame->cursor_frame_info.size = stride * height;
+	frame->cursor_frame_info.format = xdpw_format_drm_fourcc_from_wl_shm(format);
+
+	if (zwlr_screencopy_manager_v1_get_version(cast->ctx->screencopy_manager) < 3) {
+		wlr_cursor_frame_buffer_done(frame, wlr_frame);
+	}
+}
+
+static void wlr_cursor_frame_buffer_done(void *data,
+		struct zwlr_screencopy_frame_v1 *wlr_frame) {
+	struct xdpw_frame *frame = data;
+
+	logprint(TRACE, "wlroots: cursor buffer_done event handler");
+
+	if (!wlr_buffer_ensure(frame->cast, &frame->cursor_buffer, &frame->cursor_frame_info)) {
+		logprint(ERROR, "wlroots: failed to create cursor buffer");
+		frame->cursor_state = XDPW_FRAME_STATE_FAILED;
+		wlr_cursor_frame_finish(frame);
+		return;
+	}
+
+	zwlr_screencopy_frame_v1_copy(wlr_frame, frame->cursor_buffer->buffer);
+}
+
+static void wlr_cursor_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *wlr_frame,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	struct xdpw_frame *frame = data;
+
+	logprint(TRACE, "wlroots: cursor ready event handler");
+
+	frame->cursor_state = XDPW_FRAME_STATE_SUCCESS;
+	wlr_cursor_frame_finish(frame);
+}
+
+static void wlr_cursor_frame_failed(void *data,
+		struct zwlr_screencopy_frame_v1 *wlr_frame) {
+	struct xdpw_frame *frame = data;
+
+	logprint(TRACE, "wlroots: cursor failed event handler");
+
+	frame->cursor_state = XDPW_FRAME_STATE_FAILED;
+	wlr_cursor_frame_finish(frame);
+}
+
+static const struct zwlr_screencopy_frame_v1_listener wlr_cursor_frame_listener = {
+	.buffer = wlr_cursor_frame_buffer,
+	.buffer_done = wlr_cursor_frame_buffer_done,
+	.linux_dmabuf = noop,
+	.flags = noop,
+	.ready = wlr_cursor_frame_ready,
+	.failed = wlr_cursor_frame_failed,
+	.damage = noop,
+};
+
+static void wlr_register_cursor_cb(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	frame->cursor_state = XDPW_FRAME_STATE_NONE;
+	frame->cursor_frame = wlr_capture(cast, true);
+
+	zwlr_screencopy_frame_v1_add_listener(frame->cursor_frame,
+		&wlr_cursor_frame_listener, frame);
+	logprint(TRACE, "wlroots: cursor callbacks registered");
+}
+
+/*
+ * ext-image-copy-capture only copies what changed since the previous frame
+ * and the damage we name. The private capture buffers of the frame slots
+ * track what they missed like pipewire buffers do.
+ */
+static void ext_frame_update_capture_damage(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	for (uint32_t i = 0; i < XDPW_MAX_FRAMES_IN_FLIGHT; i++) {
+		struct xdpw_buffer *buffer = cast->frames[i].capture_buffer;
+		if (!buffer) {
+			continue;
+		}
+		if (frame->state != XDPW_FRAME_STATE_SUCCESS) {
+			// we don't know what the compositor did, resync everything
+			xdpw_damage_set_full(&buffer->damage, buffer->width, buffer->height);
+		} else if (buffer == frame->xdpw_buffer) {
+			xdpw_damage_clear(&buffer->damage);
+		} else {
+			xdpw_damage_add_damage(&buffer->damage, &frame->damage);
+		}
+	}
+}
+
+static void ext_frame_capture(struct xdpw_frame *frame, struct xdpw_buffer *buffer,
+		const struct xdpw_damage *buffer_damage) {
+	ext_image_copy_capture_frame_v1_attach_buffer(frame->ext_frame, buffer->buffer);
+	for (uint32_t i = 0; i < buffer_damage->count; i++) {
+		const struct xdpw_frame_damage *rect = &buffer_damage->rects[i];
+		ext_image_copy_capture_frame_v1_damage_buffer(frame->ext_frame,
+			rect->x, rect->y, rect->width, rect->height);
+	}
+	ext_image_copy_capture_frame_v1_capture(frame->ext_frame);
+	frame->ext_captured = true;
+}
+
+static void ext_frame_transform(void *data,
+		struct ext_image_copy_capture_frame_v1 *ext_frame, uint32_t transform) {
+	struct xdpw_frame *frame = data;
+
+	logprint(TRACE, "wlroots: ext transform event handler");
+	// whatever goes beyond the source transform is the screencopy y_invert flag
+	frame->y_invert = xdpw_transform_compose((enum xdpw_transform)transform,
+		xdpw_transform_invert(xdpw_source_transform(frame->cast))) ==
+		XDPW_TRANSFORM_FLIPPED_180;
+}
+
+static void ext_frame_damage(void *data, struct ext_image_copy_capture_frame_v1 *ext_frame,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct xdpw_frame *frame = data;
+
+	logprint(TRACE, "wlroots: ext damage event handler");
+
+	struct xdpw_frame_damage damage = {
+		.x = MAX(x, 0),
+		.y = MAX(y, 0),
+		.width = MAX(width, 0),
+		.height = MAX(height, 0),
+	};
+	xdpw_damage_add(&frame->damage, &damage);
+}
+
+static void ext_frame_presentation_time(void *data,
+		struct ext_image_copy_capture_frame_v1 *ext_frame,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	struct xdpw_frame *frame = data;
+
+	logprint(TRACE, "wlroots: ext presentation_time event handler");
+
+	frame->tv_sec = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo);
+	frame->tv_nsec = tv_nsec;
+	frame->pts = wlr_frame_timestamp_ns(frame->tv_sec, frame->tv_nsec);
+}
+
+static void ext_frame_ready(void *data, struct ext_image_copy_capture_frame_v1 *ext_frame) {
+	struct xdpw_frame *frame = data;
+
+	logprint(TRACE, "wlroots: ext ready event handler");
+
+	if (frame->pts < 0) {
+		// the presentation time is optional
+		frame->pts = wlr_frame_timestamp_ns(0, 0);
+	}
+	frame->state = XDPW_FRAME_STATE_SUCCESS;
+	ext_frame_update_capture_damage(frame->cast, frame);
+
+	xdpw_wlr_frame_finish(frame);
+}
+
+static void ext_frame_failed(void *data, struct ext_image_copy_capture_frame_v1 *ext_frame,
+		uint32_t reason) {
+	struct xdpw_frame *frame = data;
+	struct xdpw_screencast_instance *cast = frame->cast;
+
+	logprint(TRACE, "wlroots: ext failed event handler (reason %u)", reason);
+
+	switch (reason) {
+	case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS:
+		// the session sends the new constraints
+		frame->state = XDPW_FRAME_STATE_RENEG;
+		break;
+	case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED:
+		logprint(INFO, "wlroots: capture session stopped");
+		frame->state = XDPW_FRAME_STATE_FAILED;
+		xdpw_screencast_instance_end(cast);
+		break;
+	default:
+		frame->state = XDPW_FRAME_STATE_FAILED;
+		break;
+	}
+	ext_frame_update_capture_damage(cast, frame);
+
+	xdpw_wlr_frame_finish(frame);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener ext_frame_listener = {
+	.transform = ext_frame_transform,
+	.damage = ext_frame_damage,
+	.presentation_time = ext_frame_presentation_time,
+	.ready = ext_frame_ready,
+	.failed = ext_frame_failed,
+};
+
+/*
+ * The session sends its buffer constraints once, and again whenever they
+ * change. Frames started before they are known wait for the done event.
+ */
+static struct xdpw_screencopy_frame_info *ext_session_constraints(
+		struct xdpw_screencast_instance *cast, enum buffer_type type) {
+	if (cast->ext_constraints_done) {
+		cast->ext_constraints_done = false;
+		memset(cast->screencopy_frame_info, 0, sizeof(cast->screencopy_frame_info));
+	}
+	return &cast->screencopy_frame_info[type];
+}
+
+static void ext_session_buffer_size(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t width, uint32_t height) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_screencopy_frame_info *shm_info = ext_session_constraints(cast, WL_SHM);
+
+	logprint(TRACE, "wlroots: ext buffer_size event handler");
+	shm_info->width = width;
+	shm_info->height = height;
+}
+
+static void ext_session_shm_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_screencopy_frame_info *shm_info = ext_session_constraints(cast, WL_SHM);
+	uint32_t drm_format = xdpw_format_drm_fourcc_from_wl_shm(format);
+
+	logprint(TRACE, "wlroots: ext shm_format event handler");
+	// the compositor lists its preferred format first
+	if (shm_info->format == 0 && xdpw_bpp_from_drm_fourcc(drm_format) > 0) {
+		shm_info->format = drm_format;
+	}
+}
+
+static void ext_session_dmabuf_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format,
+		struct wl_array *modifiers) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_screencopy_frame_info *dmabuf_info = ext_session_constraints(cast, DMABUF);
+
+	logprint(TRACE, "wlroots: ext dmabuf_format event handler");
+	// modifiers are negotiated with the linux-dmabuf ones, like for screencopy
+	if (dmabuf_info->format == 0 &&
+			xdpw_format_pw_from_drm_fourcc(format) != SPA_VIDEO_FORMAT_UNKNOWN) {
+		dmabuf_info->format = format;
+	}
+}
+
+static void ext_session_done(void *data, struct ext_image_copy_capture_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+	struct xdpw_screencopy_frame_info *shm_info = &cast->screencopy_frame_info[WL_SHM];
+	struct xdpw_screencopy_frame_info *dmabuf_info = &cast->screencopy_frame_info[DMABUF];
+
+	logprint(TRACE, "wlroots: ext done event handler");
+
+	shm_info->stride = shm_info->width * xdpw_bpp_from_drm_fourcc(shm_info->format);
+	shm_info->size = shm_info->stride * shm_info->height;
+	if (dmabuf_info->format != 0) {
+		dmabuf_info->width = shm_info->width;
+		dmabuf_info->height = shm_info->height;
+	}
+	cast->ext_constraints_done = true;
+	logprint(DEBUG, "wlroots: session constraints %ux%u, shm format 0x%08x, dmabuf format 0x%08x",
+		shm_info->width, shm_info->height, shm_info->format, dmabuf_info->format);
+
+	if (cast->frame_count > 0) {
+		struct xdpw_frame *frame = wlr_frame_at(cast, 0);
+		if (frame->ext_frame && !frame->ext_captured) {
+			wlr_frame_constraints_done(frame);
+		}
+	}
+}
+
+static void ext_session_stopped(void *data, struct ext_image_copy_capture_session_v1 *session) {
+	struct xdpw_screencast_instance *cast = data;
+
+	// the source is gone, frames in flight fail
+	logprint(INFO, "wlroots: capture session stopped");
+	xdpw_screencast_instance_end(cast);
+}
+
+static const struct ext_image_copy_capture_session_v1_listener ext_session_listener = {
+	.buffer_size = ext_session_buffer_size,
+	.shm_format = ext_session_shm_format,
+	.dmabuf_device = noop,
+	.dmabuf_format = ext_session_dmabuf_format,
+	.done = ext_session_done,
+	.stopped = ext_session_stopped,
+};
+
+static void ext_session_create(struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencast_context *ctx = cast->ctx;
+	uint32_t options = cast->cursor_mode == EMBEDDED ?
+		EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS : 0;
+
+	if (cast->source_type == WINDOW) {
+		cast->ext_source = ext_foreign_toplevel_image_capture_source_manager_v1_create_source(
+			ctx->ext_toplevel_source_manager, cast->target_toplevel->handle);
+	} else {
+		cast->ext_source = ext_output_image_capture_source_manager_v1_create_source(
+			ctx->ext_output_source_manager, cast->target_output->output);
+	}
+	cast->ext_session = ext_image_copy_capture_manager_v1_create_session(
+		ctx->ext_copy_manager, cast->ext_source, options);
+	ext_image_copy_capture_session_v1_add_listener(cast->ext_session,
+		&ext_session_listener, cast);
+	logprint(DEBUG, "wlroots: capture session created");
+}
+
+/*
+ * Sessions allow one frame at a time. The constraints of the session hold
+ * for every frame, so the copy starts without waiting for the compositor.
+ */
+static void ext_register_cb(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	if (!cast->ext_session) {
+		if (cast->source_type == WINDOW && !cast->target_toplevel) {
+			logprint(ERROR, "wlroots: the captured window was closed");
+			xdpw_screencast_instance_end(cast);
+			frame->state = XDPW_FRAME_STATE_FAILED;
+			xdpw_wlr_frame_finish(frame);
+			return;
+		}
+		ext_session_create(cast);
+	}
+
+	frame->ext_frame = ext_image_copy_capture_session_v1_create_frame(cast->ext_session);
+	ext_image_copy_capture_frame_v1_add_listener(frame->ext_frame,
+		&ext_frame_listener, frame);
+	logprint(TRACE, "wlroots: ext callbacks registered");
+
+	if (cast->ext_constraints_done) {
+		wlr_frame_constraints_done(frame);
+	}
+}
+
 static void wlr_output_handle_geometry(void *data, struct wl_output *wl_output,
 		int32_t x, int32_t y, int32_t phys_width, int32_t phys_height,
 		int32_t subpixel, const char *make, const char *model, int32_t transform) {
 	struct xdpw_wlr_output *output = data;
+	// sent again whenever the transform changes
+	free(output->make);
+	free(output->model);
 	output->make = strdup(make);
 	output->model = strdup(model);
+	output->transform = transform;
 }
 
 static void wlr_output_handle_mode(void *data, struct wl_output *wl_output,
@@ -263,13 +1173,25 @@ static void wlr_xdg_output_name(void *data, struct zxdg_output_v1 *xdg_output,
 	output->name = strdup(name);
 };
 
-static void noop() {
-	// This space intentionally left blank
+static void wlr_xdg_output_logical_position(void *data, struct zxdg_output_v1 *xdg_output,
+		int32_t x, int32_t y) {
+	struct xdpw_wlr_output *output = data;
+
+	output->x = x;
+	output->y = y;
+}
+
+static void wlr_xdg_output_logical_size(void *data, struct zxdg_output_v1 *xdg_output,
+		int32_t width, int32_t height) {
+	struct xdpw_wlr_output *output = data;
+
+	output->width = width;
+	output->height = height;
 }
 
 static const struct zxdg_output_v1_listener wlr_xdg_output_listener = {
-	.logical_position = noop,
-	.logical_size = noop,
+	.logical_position = wlr_xdg_output_logical_position,
+	.logical_size = wlr_xdg_output_logical_size,
 	.done = NULL, /* Deprecated */
 	.description = noop,
 	.name = wlr_xdg_output_name,
@@ -300,108 +1222,101 @@ static void wlr_init_xdg_outputs(struct xdpw_screencast_context *ctx) {
 	}
 }
 
-static pid_t spawn_chooser(char *cmd, int chooser_in[2], int chooser_out[2]) {
-	logprint(TRACE,
-			"exec chooser called: cmd %s, pipe chooser_in (%d,%d), pipe chooser_out (%d,%d)",
-			cmd, chooser_in[0], chooser_in[1], chooser_out[0], chooser_out[1]);
-	pid_t pid = fork();
-
-	if (pid < 0) {
-		perror("fork");
-		return pid;
-	} else if (pid == 0) {
-		close(chooser_in[1]);
-		close(chooser_out[0]);
-
-		dup2(chooser_in[0], STDIN_FILENO);
-		dup2(chooser_out[1], STDOUT_FILENO);
-		close(chooser_in[0]);
-		close(chooser_out[1]);
+static const struct xdpw_output_chooser default_choosers[] = {
+	{XDPW_CHOOSER_SIMPLE, "slurp -f %o -or"},
+	{XDPW_CHOOSER_DMENU, "wofi -d -n --prompt='Select the monitor to share:'"},
+	{XDPW_CHOOSER_DMENU, "bemenu --prompt='Select the monitor to share:'"},
+};
 
-		execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+/*
+ * Runs the choosers in order until one of them is found. They run while the
+ * streams keep going, the choice is passed to func once the chooser exited.
+ */
+struct xdpw_wlr_chooser {
+	struct xdpw_screencast_context *ctx;
+	uint32_t source_types;
+	const struct xdpw_output_chooser *choosers;
+	size_t chooser_count;
+	size_t index;
+	struct xdpw_output_chooser configured;
+	bool fallback_first; // pick the first source if no chooser was found
+	struct xdpw_subprocess *proc;
+	struct xdpw_region region;
+
+	xdpw_wlr_chooser_func_t func;
+	void *data;
+};
 
-		perror("execl");
-		_exit(127);
+static void wlr_chooser_log_choice(struct xdpw_wlr_output *output,
+		struct xdpw_toplevel *toplevel) {
+	if (toplevel) {
+		logprint(DEBUG, "wlroots: output chooser selects window %s", toplevel->label);
+	} else if (output) {
+		logprint(DEBUG, "wlroots: output chooser selects %s", output->name);
+	} else {
+		logprint(DEBUG, "wlroots: output chooser canceled");
 	}
-
-	close(chooser_in[0]);
-	close(chooser_out[1]);
-
-	return pid;
 }
 
-static bool wait_chooser(pid_t pid) {
-	int status;
-	if (waitpid(pid ,&status, 0) != -1 && WIFEXITED(status)) {
-		return WEXITSTATUS(status) != 127;
+// without a chooser, windows are only picked if outputs weren't requested
+static struct xdpw_wlr_output *wlr_chooser_first(struct xdpw_screencast_context *ctx,
+		uint32_t source_types, struct xdpw_toplevel **toplevel) {
+	if (source_types & MONITOR) {
+		return xdpw_wlr_output_first(&ctx->output_list);
 	}
-	return false;
+	if (!wl_list_empty(&ctx->toplevel_list)) {
+		*toplevel = wl_container_of(ctx->toplevel_list.next, *toplevel, link);
+	}
+	return NULL;
 }
 
-static bool wlr_output_chooser(struct xdpw_output_chooser *chooser,
-		struct wl_list *output_list, struct xdpw_wlr_output **output) {
-	logprint(DEBUG, "wlroots: output chooser called");
-	struct xdpw_wlr_output *out;
-	size_t name_size = 0;
-	char *name = NULL;
-	*output = NULL;
-
-	int chooser_in[2]; //p -> c
-	int chooser_out[2]; //c -> p
+static void wlr_chooser_done(struct xdpw_wlr_chooser *chooser,
+		struct xdpw_wlr_output *output, struct xdpw_toplevel *toplevel) {
+	chooser->func(chooser->ctx, output, toplevel, &chooser->region, chooser->data);
+	free(chooser);
+}
 
-	if (pipe(chooser_in) == -1) {
-		perror("pipe chooser_in");
-		logprint(ERROR, "Failed to open pipe chooser_in");
-		goto error_chooser_in;
-	}
-	if (pipe(chooser_out) == -1) {
-		perror("pipe chooser_out");
-		logprint(ERROR, "Failed to open pipe chooser_out");
-		goto error_chooser_out;
+static void wlr_chooser_fail(struct xdpw_wlr_chooser *chooser) {
+	struct xdpw_wlr_output *output = NULL;
+	struct xdpw_toplevel *toplevel = NULL;
+	if (chooser->fallback_first) {
+		output = wlr_chooser_first(chooser->ctx, chooser->source_types, &toplevel);
+	} else {
+		logprint(ERROR, "wlroots: output chooser %s failed", chooser->configured.cmd);
 	}
+	wlr_chooser_done(chooser, output, toplevel);
+}
 
-	pid_t pid = spawn_chooser(chooser->cmd, chooser_in, chooser_out);
-	if (pid < 0) {
-		logprint(ERROR, "Failed to fork chooser");
-		goto error_fork;
+/*
+ * dmenu choosers list the outputs and windows of the requested source types,
+ * one per line. Simple choosers print an output name or a region.
+ */
+static char *wlr_chooser_list(struct xdpw_wlr_chooser *chooser, size_t *len) {
+	char *list = NULL;
+	FILE *f = open_memstream(&list, len);
+	if (f == NULL) {
+		logprint(ERROR, "wlroots: failed to list the chooser's entries");
+		return NULL;
 	}
-
-	switch (chooser->type) {
-	case XDPW_CHOOSER_DMENU:;
-		FILE *f = fdopen(chooser_in[1], "w");
-		if (f == NULL) {
-			perror("fdopen pipe chooser_in");
-			logprint(ERROR, "Failed to create stream writing to pipe chooser_in");
-			goto error_fork;
-		}
-		wl_list_for_each(out, output_list, link) {
+	if (chooser->source_types & MONITOR) {
+		struct xdpw_wlr_output *out;
+		wl_list_for_each(out, &chooser->ctx->output_list, link) {
 			fprintf(f, "%s\n", out->name);
 		}
-		fclose(f);
-		break;
-	default:
-		close(chooser_in[1]);
 	}
-
-	if (!wait_chooser(pid)) {
-		close(chooser_out[0]);
-		return false;
-	}
-
-	FILE *f = fdopen(chooser_out[0], "r");
-	if (f == NULL) {
-		perror("fdopen pipe chooser_out");
-		logprint(ERROR, "Failed to create stream reading from pipe chooser_out");
-		close(chooser_out[0]);
-		goto end;
+	if (chooser->source_types & WINDOW) {
+		struct xdpw_toplevel *top;
+		wl_list_for_each(top, &chooser->ctx->toplevel_list, link) {
+			fprintf(f, "%s\n", top->label);
+		}
 	}
-
-	ssize_t nread = getline(&name, &name_size, f);
 	fclose(f);
-	if (nread < 0) {
-		perror("getline failed");
-		goto end;
-	}
+	return list;
+}
+
+static void wlr_chooser_parse(struct xdpw_wlr_chooser *chooser, char *name,
+		struct xdpw_wlr_output **output, struct xdpw_toplevel **toplevel) {
+	struct xdpw_screencast_context *ctx = chooser->ctx;
 
 	//Strip newline
 	char *p = strchr(name, '\n');
@@ -409,93 +1324,164 @@ static bool wlr_output_chooser(struct xdpw_output_chooser *chooser,
 		*p = '\0';
 	}
 
-	logprint(TRACE, "wlroots: output chooser %s selects output %s", chooser->cmd, name);
-	wl_list_for_each(out, output_list, link) {
-		if (strcmp(out->name, name) == 0) {
-			*output = out;
-			break;
+	if (chooser->source_types & WINDOW) {
+		struct xdpw_toplevel *top;
+		wl_list_for_each(top, &ctx->toplevel_list, link) {
+			if (strcmp(top->label, name) == 0) {
+				*toplevel = top;
+				break;
+			}
+		}
+	}
+	if (!*toplevel && (chooser->source_types & MONITOR)) {
+		struct xdpw_wlr_output *out;
+		wl_list_for_each(out, &ctx->output_list, link) {
+			if (strcmp(out->name, name) == 0) {
+				*output = out;
+				break;
+			}
+		}
+		if (!*output && xdpw_region_parse(name, &chooser->region)) {
+			*output = xdpw_wlr_output_find_by_region(&ctx->output_list, &chooser->region);
 		}
 	}
-	free(name);
+}
 
-end:
-	return true;
+static bool wlr_chooser_spawn(struct xdpw_wlr_chooser *chooser);
 
-error_fork:
-	close(chooser_out[0]);
-	close(chooser_out[1]);
-error_chooser_out:
-	close(chooser_in[0]);
-	close(chooser_in[1]);
-error_chooser_in:
-	*output = NULL;
-	return false;
-}
+static void wlr_chooser_handle_exit(struct xdpw_subprocess *proc, void *data) {
+	struct xdpw_wlr_chooser *chooser = data;
+	const struct xdpw_output_chooser *current = &chooser->choosers[chooser->index];
+	chooser->proc = NULL;
 
-static struct xdpw_wlr_output *wlr_output_chooser_default(struct wl_list *output_list) {
-	logprint(DEBUG, "wlroots: output chooser called");
-	struct xdpw_output_chooser default_chooser[] = {
-		{XDPW_CHOOSER_SIMPLE, "slurp -f %o -or"},
-		{XDPW_CHOOSER_DMENU, "wofi -d -n --prompt='Select the monitor to share:'"},
-		{XDPW_CHOOSER_DMENU, "bemenu --prompt='Select the monitor to share:'"},
-	};
+	if (proc->timed_out) {
+		logprint(ERROR, "wlroots: output chooser %s timed out", current->cmd);
+		wlr_chooser_done(chooser, NULL, NULL);
+		return;
+	}
+	if (proc->exit_code < 0 || proc->exit_code == 127) {
+		logprint(DEBUG, "wlroots: output chooser %s not found", current->cmd);
+		chooser->index++;
+		if (!wlr_chooser_spawn(chooser)) {
+			wlr_chooser_fail(chooser);
+		}
+		return;
+	}
 
-	size_t N = sizeof(default_chooser)/sizeof(default_chooser[0]);
 	struct xdpw_wlr_output *output = NULL;
-	bool ret;
-	for (size_t i = 0; i<N; i++) {
-		ret = wlr_output_chooser(&default_chooser[i], output_list, &output);
-		if (!ret) {
-			logprint(DEBUG, "wlroots: output chooser %s not found. Trying next one.",
-					default_chooser[i].cmd);
+	struct xdpw_toplevel *toplevel = NULL;
+	if (proc->output) {
+		logprint(TRACE, "wlroots: output chooser %s selects %s", current->cmd, proc->output);
+		wlr_chooser_parse(chooser, proc->output, &output, &toplevel);
+	}
+	wlr_chooser_log_choice(output, toplevel);
+	wlr_chooser_done(chooser, output, toplevel);
+}
+
+// starts the next chooser, false once none is left
+static bool wlr_chooser_spawn(struct xdpw_wlr_chooser *chooser) {
+	for (; chooser->index < chooser->chooser_count; chooser->index++) {
+		const struct xdpw_output_chooser *current = &chooser->choosers[chooser->index];
+		if (current->type == XDPW_CHOOSER_SIMPLE && !(chooser->source_types & MONITOR)) {
+			// slurp only selects outputs and regions
 			continue;
 		}
-		if (output != NULL) {
-			logprint(DEBUG, "wlroots: output chooser selects %s", output->name);
-		} else {
-			logprint(DEBUG, "wlroots: output chooser canceled");
+
+		struct xdpw_subprocess_options options = {
+			.pipe_stdio = true,
+			.timeout_ns = XDPW_CHOOSER_TIMEOUT_NS,
+		};
+		char *list = NULL;
+		if (current->type == XDPW_CHOOSER_DMENU) {
+			list = wlr_chooser_list(chooser, &options.input_len);
+			options.input = list;
 		}
-		return output;
+		chooser->proc = xdpw_subprocess_spawn(chooser->ctx->state, current->cmd,
+			&options, wlr_chooser_handle_exit, chooser);
+		free(list);
+		if (chooser->proc) {
+			return true;
+		}
+		logprint(DEBUG, "wlroots: output chooser %s failed to start", current->cmd);
 	}
-	return xdpw_wlr_output_first(output_list);
+	return false;
 }
 
-struct xdpw_wlr_output *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx) {
-	switch (ctx->state->config->screencast_conf.chooser_type) {
-	case XDPW_CHOOSER_DEFAULT:
-		return wlr_output_chooser_default(&ctx->output_list);
-	case XDPW_CHOOSER_NONE:
-		if (ctx->state->config->screencast_conf.output_name) {
-			return xdpw_wlr_output_find_by_name(&ctx->output_list, ctx->state->config->screencast_conf.output_name);
-		} else {
-			return xdpw_wlr_output_first(&ctx->output_list);
-		}
-	case XDPW_CHOOSER_DMENU:
-	case XDPW_CHOOSER_SIMPLE:;
-		struct xdpw_wlr_output *output = NULL;
-		if (!ctx->state->config->screencast_conf.chooser_cmd) {
-			logprint(ERROR, "wlroots: no output chooser given");
-			goto end;
-		}
-		struct xdpw_output_chooser chooser = {
-			ctx->state->config->screencast_conf.chooser_type,
-			ctx->state->config->screencast_conf.chooser_cmd
-		};
-		logprint(DEBUG, "wlroots: output chooser %s (%d)", chooser.cmd, chooser.type);
-		bool ret = wlr_output_chooser(&chooser, &ctx->output_list, &output);
-		if (!ret) {
-			logprint(ERROR, "wlroots: output chooser %s failed", chooser.cmd);
-			goto end;
-		}
-		if (output) {
-			logprint(DEBUG, "wlroots: output chooser selects %s", output->name);
-		} else {
-			logprint(DEBUG, "wlroots: output chooser canceled");
+static struct xdpw_wlr_output *wlr_output_chooser_none(struct xdpw_screencast_context *ctx,
+		uint32_t source_types, struct xdpw_region *region, struct xdpw_toplevel **toplevel) {
+	struct config_screencast *conf = &ctx->state->config->screencast_conf;
+	if (!(source_types & MONITOR)) {
+		return wlr_chooser_first(ctx, source_types, toplevel);
+	} else if (conf->region) {
+		if (!xdpw_region_parse(conf->region, region)) {
+			logprint(ERROR, "wlroots: invalid region %s", conf->region);
+			return NULL;
 		}
-		return output;
+		return xdpw_wlr_output_find_by_region(&ctx->output_list, region);
+	} else if (conf->output_name) {
+		return xdpw_wlr_output_find_by_name(&ctx->output_list, conf->output_name);
+	} else {
+		return xdpw_wlr_output_first(&ctx->output_list);
 	}
-end:
-	return NULL;
+}
+
+struct xdpw_wlr_chooser *xdpw_wlr_output_chooser(struct xdpw_screencast_context *ctx,
+		uint32_t source_types, xdpw_wlr_chooser_func_t func, void *data) {
+	struct config_screencast *conf = &ctx->state->config->screencast_conf;
+	struct xdpw_region region = {0};
+	struct xdpw_toplevel *toplevel = NULL;
+	enum xdpw_chooser_types chooser_type = conf->chooser_type;
+	if (chooser_type == XDPW_CHOOSER_SIMPLE && !(source_types & MONITOR)) {
+		logprint(DEBUG, "wlroots: simple choosers can't select windows, using the default ones");
+		chooser_type = XDPW_CHOOSER_DEFAULT;
+	}
+
+	if (chooser_type == XDPW_CHOOSER_NONE) {
+		struct xdpw_wlr_output *output =
+			wlr_output_chooser_none(ctx, source_types, &region, &toplevel);
+		func(ctx, output, toplevel, &region, data);
+		return NULL;
+	}
+	if (chooser_type != XDPW_CHOOSER_DEFAULT && !conf->chooser_cmd) {
+		logprint(ERROR, "wlroots: no output chooser given");
+		func(ctx, NULL, NULL, &region, data);
+		return NULL;
+	}
+
+	struct xdpw_wlr_chooser *chooser = calloc(1, sizeof(*chooser));
+	if (chooser == NULL) {
+		logprint(ERROR, "wlroots: output chooser allocation failed");
+		func(ctx, NULL, NULL, &region, data);
+		return NULL;
+	}
+	chooser->ctx = ctx;
+	chooser->source_types = source_types;
+	chooser->func = func;
+	chooser->data = data;
+	if (chooser_type == XDPW_CHOOSER_DEFAULT) {
+		logprint(DEBUG, "wlroots: output chooser called");
+		chooser->choosers = default_choosers;
+		chooser->chooser_count = sizeof(default_choosers) / sizeof(default_choosers[0]);
+		chooser->fallback_first = true;
+	} else {
+		chooser->configured = (struct xdpw_output_chooser){chooser_type, conf->chooser_cmd};
+		logprint(DEBUG, "wlroots: output chooser %s (%d)",
+			chooser->configured.cmd, chooser->configured.type);
+		chooser->choosers = &chooser->configured;
+		chooser->chooser_count = 1;
+	}
+
+	if (!wlr_chooser_spawn(chooser)) {
+		wlr_chooser_fail(chooser);
+		return NULL;
+	}
+	return chooser;
+}
+
+void xdpw_wlr_chooser_cancel(struct xdpw_wlr_chooser *chooser) {
+	logprint(DEBUG, "wlroots: output chooser canceled");
+	xdpw_subprocess_cancel(chooser->proc);
+	free(chooser);
 }
 
 struct xdpw_wlr_output *xdpw_wlr_output_first(struct wl_list *output_list) {
@@ -517,6 +1503,52 @@ struct xdpw_wlr_output *xdpw_wlr_output_find_by_name(struct wl_list *output_list
 	return NULL;
 }
 
+/*
+ * Finds the output covering most of a region given in global coordinates.
+ * The region is clipped to that output and made relative to it, a region
+ * covering the whole output becomes empty.
+ */
+struct xdpw_wlr_output *xdpw_wlr_output_find_by_region(struct wl_list *output_list,
+		struct xdpw_region *region) {
+	struct xdpw_wlr_output *output, *best = NULL;
+	struct xdpw_region clipped = {0};
+	int64_t best_area = 0;
+	wl_list_for_each(output, output_list, link) {
+		int32_t x0 = MAX(region->x, output->x);
+		int32_t y0 = MAX(region->y, output->y);
+		int32_t x1 = MIN(region->x + region->width, output->x + output->width);
+		int32_t y1 = MIN(region->y + region->height, output->y + output->height);
+		if (x1 <= x0 || y1 <= y0) {
+			continue;
+		}
+		int64_t area = (int64_t)(x1 - x0) * (y1 - y0);
+		if (area > best_area) {
+			best = output;
+			best_area = area;
+			clipped = (struct xdpw_region) {
+				.x = x0 - output->x,
+				.y = y0 - output->y,
+				.width = x1 - x0,
+				.height = y1 - y0,
+			};
+		}
+	}
+	if (!best) {
+		logprint(ERROR, "wlroots: region %d,%d %dx%d is outside of all outputs",
+			region->x, region->y, region->width, region->height);
+		return NULL;
+	}
+
+	if (clipped.x == 0 && clipped.y == 0 &&
+			clipped.width == best->width && clipped.height == best->height) {
+		clipped = (struct xdpw_region) {0};
+	}
+	*region = clipped;
+	logprint(DEBUG, "wlroots: region %d,%d %dx%d on output %s", region->x, region->y,
+		region->width, region->height, best->name);
+	return best;
+}
+
 struct xdpw_wlr_output *xdpw_wlr_output_find(struct xdpw_screencast_context *ctx,
 		struct wl_output *out, uint32_t id) {
 	struct xdpw_wlr_output *output, *tmp;
@@ -538,6 +1570,140 @@ static void wlr_remove_output(struct xdpw_wlr_output *out) {
 	free(out);
 }
 
+static void linux_dmabuf_handle_format(void *data,
+		struct zwp_linux_dmabuf_v1 *linux_dmabuf, uint32_t format) {
+	/* Deprecated, only modifier events are used */
+}
+
+static void linux_dmabuf_handle_modifier(void *data,
+		struct zwp_linux_dmabuf_v1 *linux_dmabuf, uint32_t format,
+		uint32_t modifier_hi, uint32_t modifier_lo) {
+	struct xdpw_screencast_context *ctx = data;
+
+	struct xdpw_format_modifier_pair *pair =
+		wl_array_add(&ctx->format_modifier_pairs, sizeof(struct xdpw_format_modifier_pair));
+	if (pair == NULL) {
+		logprint(ERROR, "wlroots: failed to store dmabuf format modifier pair");
+		return;
+	}
+	pair->fourcc = format;
+	pair->modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+}
+
+static const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_listener = {
+	.format = linux_dmabuf_handle_format,
+	.modifier = linux_dmabuf_handle_modifier,
+};
+
+static void toplevel_destroy(struct xdpw_toplevel *toplevel) {
+	ext_foreign_toplevel_handle_v1_destroy(toplevel->handle);
+	wl_list_remove(&toplevel->link);
+	free(toplevel->title);
+	free(toplevel->app_id);
+	free(toplevel->identifier);
+	free(toplevel->label);
+	free(toplevel);
+}
+
+static void toplevel_handle_closed(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct xdpw_toplevel *toplevel = data;
+
+	logprint(DEBUG, "wlroots: window %s closed", toplevel->label);
+	// sessions sharing the window are closed, the instance goes with them
+	struct xdpw_screencast_instance *cast;
+	wl_list_for_each(cast, &toplevel->ctx->screencast_instances, link) {
+		if (cast->target_toplevel == toplevel) {
+			cast->target_toplevel = NULL;
+			xdpw_screencast_instance_end(cast);
+		}
+	}
+	toplevel_destroy(toplevel);
+}
+
+// title and app id are applied together, choosers show them on one line
+static void toplevel_handle_done(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct xdpw_toplevel *toplevel = data;
+	const char *title = toplevel->title ? toplevel->title : "";
+	const char *app_id = toplevel->app_id ? toplevel->app_id : "";
+
+	size_t size = strlen(title) + strlen(app_id) + 4;
+	char *label = calloc(size, sizeof(char));
+	if (!label) {
+		logprint(ERROR, "wlroots: failed to allocate window label");
+		return;
+	}
+	snprintf(label, size, "%s (%s)", title, app_id);
+	for (char *c = label; *c; c++) {
+		if (*c == '\n') {
+			*c = ' ';
+		}
+	}
+	free(toplevel->label);
+	toplevel->label = label;
+}
+
+static void toplevel_handle_title(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *title) {
+	struct xdpw_toplevel *toplevel = data;
+
+	free(toplevel->title);
+	toplevel->title = strdup(title);
+}
+
+static void toplevel_handle_app_id(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *app_id) {
+	struct xdpw_toplevel *toplevel = data;
+
+	free(toplevel->app_id);
+	toplevel->app_id = strdup(app_id);
+}
+
+static void toplevel_handle_identifier(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *identifier) {
+	struct xdpw_toplevel *toplevel = data;
+
+	free(toplevel->identifier);
+	toplevel->identifier = strdup(identifier);
+}
+
+static const struct ext_foreign_toplevel_handle_v1_listener toplevel_listener = {
+	.closed = toplevel_handle_closed,
+	.done = toplevel_handle_done,
+	.title = toplevel_handle_title,
+	.app_id = toplevel_handle_app_id,
+	.identifier = toplevel_handle_identifier,
+};
+
+static void toplevel_list_handle_toplevel(void *data,
+		struct ext_foreign_toplevel_list_v1 *list,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct xdpw_screencast_context *ctx = data;
+
+	struct xdpw_toplevel *toplevel = calloc(1, sizeof(*toplevel));
+	if (!toplevel) {
+		logprint(ERROR, "wlroots: failed to allocate window");
+		ext_foreign_toplevel_handle_v1_destroy(handle);
+		return;
+	}
+	toplevel->ctx = ctx;
+	toplevel->handle = handle;
+	toplevel->label = strdup("");
+	ext_foreign_toplevel_handle_v1_add_listener(handle, &toplevel_listener, toplevel);
+	wl_list_insert(ctx->toplevel_list.prev, &toplevel->link);
+}
+
+static void toplevel_list_handle_finished(void *data,
+		struct ext_foreign_toplevel_list_v1 *list) {
+	logprint(DEBUG, "wlroots: window list finished");
+}
+
+static const struct ext_foreign_toplevel_list_v1_listener toplevel_list_listener = {
+	.toplevel = toplevel_list_handle_toplevel,
+	.finished = toplevel_list_handle_finished,
+};
+
 static void wlr_registry_handle_add(void *data, struct wl_registry *reg,
 		uint32_t id, const char *interface, uint32_t ver) {
 	struct xdpw_screencast_context *ctx = data;
@@ -569,6 +1735,33 @@ static void wlr_registry_handle_add(void *data, struct wl_registry *reg,
 			reg, id, &zwlr_screencopy_manager_v1_interface, version);
 	}
 
+	if (strcmp(interface, ext_image_copy_capture_manager_v1_interface.name) == 0) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, EXT_COPY_MANAGER_VERSION);
+		ctx->ext_copy_manager = wl_registry_bind(reg, id,
+			&ext_image_copy_capture_manager_v1_interface, EXT_COPY_MANAGER_VERSION);
+	}
+
+	if (strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name) == 0) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, EXT_OUTPUT_SOURCE_MANAGER_VERSION);
+		ctx->ext_output_source_manager = wl_registry_bind(reg, id,
+			&ext_output_image_capture_source_manager_v1_interface, EXT_OUTPUT_SOURCE_MANAGER_VERSION);
+	}
+
+	if (strcmp(interface, ext_foreign_toplevel_image_capture_source_manager_v1_interface.name) == 0) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, EXT_TOPLEVEL_SOURCE_MANAGER_VERSION);
+		ctx->ext_toplevel_source_manager = wl_registry_bind(reg, id,
+			&ext_foreign_toplevel_image_capture_source_manager_v1_interface,
+			EXT_TOPLEVEL_SOURCE_MANAGER_VERSION);
+	}
+
+	if (strcmp(interface, ext_foreign_toplevel_list_v1_interface.name) == 0) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, FOREIGN_TOPLEVEL_LIST_VERSION);
+		ctx->foreign_toplevel_list = wl_registry_bind(reg, id,
+			&ext_foreign_toplevel_list_v1_interface, FOREIGN_TOPLEVEL_LIST_VERSION);
+		ext_foreign_toplevel_list_v1_add_listener(ctx->foreign_toplevel_list,
+			&toplevel_list_listener, ctx);
+	}
+
 	if (strcmp(interface, wl_shm_interface.name) == 0) {
 		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, WL_SHM_VERSION);
 		ctx->shm = wl_registry_bind(reg, id, &wl_shm_interface, WL_SHM_VERSION);
@@ -579,6 +1772,13 @@ static void wlr_registry_handle_add(void *data, struct wl_registry *reg,
 		ctx->xdg_output_manager =
 			wl_registry_bind(reg, id, &zxdg_output_manager_v1_interface, XDG_OUTPUT_MANAGER_VERSION);
 	}
+
+	if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0 && ver >= LINUX_DMABUF_VERSION) {
+		logprint(DEBUG, "wlroots: |-- registered to interface %s (Version %u)", interface, LINUX_DMABUF_VERSION);
+		ctx->linux_dmabuf =
+			wl_registry_bind(reg, id, &zwp_linux_dmabuf_v1_interface, LINUX_DMABUF_VERSION);
+		zwp_linux_dmabuf_v1_add_listener(ctx->linux_dmabuf, &linux_dmabuf_listener, ctx);
+	}
 }
 
 static void wlr_registry_handle_remove(void *data, struct wl_registry *reg,
@@ -604,6 +1804,13 @@ int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
 	// initialize a list of active screencast instances
 	wl_list_init(&ctx->screencast_instances);
 
+	// initialize a list of windows
+	wl_list_init(&ctx->toplevel_list);
+
+	// initialize the list of dmabuf formats supported by the compositor
+	wl_array_init(&ctx->format_modifier_pairs);
+	ctx->udmabuf_fd = -1;
+
 	// retrieve registry
 	ctx->registry = wl_display_get_registry(state->wl_display);
 	wl_registry_add_listener(ctx->registry, &wlr_registry_listener, ctx);
@@ -630,12 +1837,43 @@ int xdpw_wlr_screencopy_init(struct xdpw_state *state) {
 		logprint(ERROR, "Compositor doesn't support %s!", "wl_shm");
 		return -1;
 	}
-
-	// make sure our wlroots supports screencopy protocol
+	xdpw_shm_pool_init(&ctx->shm_pool, ctx->shm,
+		state->config->screencast_conf.shm_hugepages);
+
+	// make sure our wlroots supports one of the capture protocols
+	bool ext_capture = ctx->ext_copy_manager && ctx->ext_output_source_manager;
+	if (!ctx->screencopy_manager && !ext_capture) {
+		logprint(ERROR, "Compositor doesn't support %s or %s!",
+			zwlr_screencopy_manager_v1_interface.name,
+			ext_image_copy_capture_manager_v1_interface.name);
+		return -1;
+	}
+	if (ext_capture) {
+		logprint(DEBUG, "wlroots: capturing via %s",
+			ext_image_copy_capture_manager_v1_interface.name);
+	}
 	if (!ctx->screencopy_manager) {
-		logprint(ERROR, "Compositor doesn't support %s!",
+		// see xdpw_wlr_ext_capture()
+		logprint(INFO, "wlroots: no %s, the metadata cursor mode is not available",
 			zwlr_screencopy_manager_v1_interface.name);
-		return -1;
+		state->screencast_cursor_modes &= ~METADATA;
+	}
+	if (ext_capture && ctx->foreign_toplevel_list && ctx->ext_toplevel_source_manager) {
+		logprint(DEBUG, "wlroots: windows can be captured");
+		state->screencast_source_types |= WINDOW;
+	}
+
+	// dmabufs are optional, streams fall back to shm without them
+	if (ctx->linux_dmabuf) {
+		ctx->gbm = xdpw_gbm_device_create();
+		if (!ctx->gbm) {
+			ctx->udmabuf_fd = xdpw_udmabuf_open();
+		}
+	}
+	if (xdpw_dmabuf_available(ctx)) {
+		logprint(DEBUG, "wlroots: dmabuf allocation via %s", ctx->gbm ? "gbm" : "udmabuf");
+	} else {
+		logprint(INFO, "wlroots: dmabufs not available, using shm buffers");
 	}
 
 	return 0;
@@ -657,12 +1895,40 @@ void xdpw_wlr_screencopy_finish(struct xdpw_screencast_context *ctx) {
 	if (ctx->screencopy_manager) {
 		zwlr_screencopy_manager_v1_destroy(ctx->screencopy_manager);
 	}
+	if (ctx->ext_copy_manager) {
+		ext_image_copy_capture_manager_v1_destroy(ctx->ext_copy_manager);
+	}
+	if (ctx->ext_output_source_manager) {
+		ext_output_image_capture_source_manager_v1_destroy(ctx->ext_output_source_manager);
+	}
+	struct xdpw_toplevel *toplevel, *tmp_t;
+	wl_list_for_each_safe(toplevel, tmp_t, &ctx->toplevel_list, link) {
+		toplevel_destroy(toplevel);
+	}
+	if (ctx->foreign_toplevel_list) {
+		ext_foreign_toplevel_list_v1_destroy(ctx->foreign_toplevel_list);
+	}
+	if (ctx->ext_toplevel_source_manager) {
+		ext_foreign_toplevel_image_capture_source_manager_v1_destroy(
+			ctx->ext_toplevel_source_manager);
+	}
 	if (ctx->shm) {
+		xdpw_shm_pool_finish(&ctx->shm_pool);
 		wl_shm_destroy(ctx->shm);
 	}
 	if (ctx->xdg_output_manager) {
 		zxdg_output_manager_v1_destroy(ctx->xdg_output_manager);
 	}
+	if (ctx->linux_dmabuf) {
+		zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf);
+	}
+	wl_array_release(&ctx->format_modifier_pairs);
+	if (ctx->gbm) {
+		xdpw_gbm_device_destroy(ctx->gbm);
+	}
+	if (ctx->udmabuf_fd >= 0) {
+		close(ctx->udmabuf_fd);
+	}
 	if (ctx->registry) {
 		wl_registry_destroy(ctx->registry);
 	}
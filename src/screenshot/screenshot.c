@@ -5,6 +5,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include "xdpw.h"
+#include "event_loop.h"
 #include "screenshot.h"
 
 static const char object_path[] = "/org/freedesktop/portal/desktop";
@@ -16,6 +17,7 @@ static bool exec_screenshooter(const char *path) {
 		perror("fork");
 		return false;
 	} else if (pid == 0) {
+		xdpw_event_loop_restore_signals();
 		char *const argv[] = {
 			"grim",
 			"--",
@@ -42,6 +44,7 @@ static bool exec_screenshooter_interactive(const char *path) {
 		perror("fork");
 		return false;
 	} else if (pid == 0) {
+		xdpw_event_loop_restore_signals();
 		char cmd[strlen(path) + 25];
 		snprintf(cmd, sizeof(cmd), "grim -g \"$(slurp)\" -- %s", path);
 		execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
@@ -155,6 +158,7 @@ static bool spawn_chooser(int chooser_out[2]) {
 		perror("fork");
 		return false;
 	} else if (pid == 0) {
+		xdpw_event_loop_restore_signals();
 		close(chooser_out[0]);
 
 		dup2(chooser_out[1], STDOUT_FILENO);
@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "fourcc.h"
+
+static const uint32_t rgb_formats[] = {
+	DRM_FORMAT_XRGB8888, DRM_FORMAT_ABGR8888, DRM_FORMAT_RGBX8888, DRM_FORMAT_BGRA8888,
+};
+static const uint32_t pack_formats[] = {
+	DRM_FORMAT_XRGB2101010, DRM_FORMAT_ABGR2101010, DRM_FORMAT_RGBA1010102,
+	DRM_FORMAT_BGRX1010102, DRM_FORMAT_XRGB16161616, DRM_FORMAT_ABGR16161616,
+};
+// odd sizes, sizes around the vector widths and a frame size
+static const uint32_t sizes[][2] = {
+	{ 1, 1 }, { 2, 2 }, { 3, 5 }, { 15, 3 }, { 16, 2 }, { 17, 5 }, { 31, 9 },
+	{ 33, 7 }, { 64, 64 }, { 101, 33 }, { 1921, 37 },
+};
+// extra bytes after each row of the source
+static const uint32_t paddings[] = { 0, 4, 60 };
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint32_t rng_state = 0x2545f491;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static uint8_t *random_frame(size_t size) {
+	uint8_t *data = malloc(size);
+	assert(data);
+	for (size_t i = 0; i < size; i++) {
+		data[i] = rng();
+	}
+	return data;
+}
+
+struct yuv_frame {
+	struct xdpw_convert_layout layout;
+	struct xdpw_convert_plane planes[XDPW_CONVERT_MAX_PLANES];
+	uint8_t *data;
+};
+
+static void yuv_frame_init(struct yuv_frame *frame, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t align) {
+	bool ok = xdpw_convert_get_layout(format, width, height, align, &frame->layout);
+	assert(ok);
+	// the padding is filled, kernels must not write past a row
+	frame->data = malloc(frame->layout.size);
+	assert(frame->data);
+	memset(frame->data, 0xa5, frame->layout.size);
+	for (uint32_t i = 0; i < frame->layout.plane_count; i++) {
+		frame->planes[i].data = frame->data + frame->layout.offset[i];
+		frame->planes[i].stride = frame->layout.stride[i];
+	}
+}
+
+static void convert(struct yuv_frame *frame, uint32_t dst_format, uint32_t src_format,
+		const uint8_t *src, uint32_t src_stride, bool flip,
+		uint32_t width, uint32_t height, bool simd) {
+	xdpw_convert_set_simd(simd);
+	ptrdiff_t stride = src_stride;
+	if (flip) {
+		src += (size_t)(height - 1) * src_stride;
+		stride = -stride;
+	}
+	// in two parts, like the copy worker does, the middle chroma row is written twice
+	uint32_t split = height / 2 | 1;
+	bool ok = xdpw_convert(dst_format, frame->planes, src_format, src, stride,
+		width, height, 0, split < height ? split : height);
+	ok = ok && xdpw_convert(dst_format, frame->planes, src_format, src, stride,
+		width, height, split < height ? split : height, height);
+	assert(ok);
+}
+
+static void test_yuv(uint32_t dst_format) {
+	for (size_t f = 0; f < ARRAY_LEN(rgb_formats); f++) {
+		for (size_t s = 0; s < ARRAY_LEN(sizes); s++) {
+			for (size_t p = 0; p < ARRAY_LEN(paddings); p++) {
+				uint32_t width = sizes[s][0], height = sizes[s][1];
+				uint32_t src_stride = width * 4 + paddings[p];
+				uint8_t *src = random_frame((size_t)src_stride * height);
+				// padded destination rows on every other run
+				uint32_t align = p % 2 ? 64 : 1;
+
+				for (int flip = 0; flip < 2; flip++) {
+					struct yuv_frame scalar, simd;
+					yuv_frame_init(&scalar, dst_format, width, height, align);
+					yuv_frame_init(&simd, dst_format, width, height, align);
+					convert(&scalar, dst_format, rgb_formats[f], src, src_stride, flip,
+						width, height, false);
+					convert(&simd, dst_format, rgb_formats[f], src, src_stride, flip,
+						width, height, true);
+					if (memcmp(scalar.data, simd.data, scalar.layout.size) != 0) {
+						fprintf(stderr, "%s differs from scalar: %.4s to %.4s, %ux%u, "
+							"%u bytes padding%s\n", xdpw_convert_impl_name(),
+							(const char *)&rgb_formats[f], (const char *)&dst_format,
+							width, height, paddings[p], flip ? ", flipped" : "");
+						abort();
+					}
+					free(scalar.data);
+					free(simd.data);
+				}
+				free(src);
+			}
+		}
+	}
+}
+
+// BT.709 limited range references
+static void test_known_colors(void) {
+	static const struct {
+		uint8_t r, g, b;
+		uint8_t y, u, v;
+	} colors[] = {
+		{ 0, 0, 0, 16, 128, 128 },
+		{ 255, 255, 255, 235, 128, 128 },
+		{ 255, 0, 0, 63, 102, 240 },
+	};
+
+	for (int simd = 0; simd < 2; simd++) {
+		for (size_t c = 0; c < ARRAY_LEN(colors); c++) {
+			const uint32_t width = 34, height = 2;
+			uint8_t src[34 * 2 * 4];
+			for (uint32_t i = 0; i < width * height; i++) {
+				// XRGB8888 is B, G, R, X in memory
+				src[4 * i] = colors[c].b;
+				src[4 * i + 1] = colors[c].g;
+				src[4 * i + 2] = colors[c].r;
+				src[4 * i + 3] = 0;
+			}
+			struct yuv_frame frame;
+			yuv_frame_init(&frame, DRM_FORMAT_NV12, width, height, 1);
+			convert(&frame, DRM_FORMAT_NV12, DRM_FORMAT_XRGB8888, src, width * 4, false,
+				width, height, simd);
+			for (uint32_t x = 0; x < width; x++) {
+				assert(abs(frame.planes[0].data[x] - colors[c].y) <= 1);
+			}
+			for (uint32_t x = 0; x < width / 2; x++) {
+				assert(abs(frame.planes[1].data[2 * x] - colors[c].u) <= 1);
+				assert(abs(frame.planes[1].data[2 * x + 1] - colors[c].v) <= 1);
+			}
+			free(frame.data);
+		}
+	}
+}
+
+static void test_pack(void) {
+	for (size_t f = 0; f < ARRAY_LEN(pack_formats); f++) {
+		uint32_t src_bpp = pack_formats[f] == DRM_FORMAT_XRGB16161616 ||
+			pack_formats[f] == DRM_FORMAT_ABGR16161616 ? 8 : 4;
+		for (size_t s = 0; s < ARRAY_LEN(sizes); s++) {
+			for (size_t p = 0; p < ARRAY_LEN(paddings); p++) {
+				uint32_t width = sizes[s][0], height = sizes[s][1];
+				uint32_t src_stride = width * src_bpp + paddings[p];
+				uint32_t dst_stride = width * 4 + paddings[p];
+				size_t dst_size = (size_t)dst_stride * height;
+				uint8_t *src = random_frame((size_t)src_stride * height);
+				uint8_t *scalar = malloc(dst_size), *simd = malloc(dst_size);
+				assert(scalar && simd);
+				memset(scalar, 0xa5, dst_size);
+				memset(simd, 0xa5, dst_size);
+
+				// a rectangle off the origin, as damaged regions are packed
+				uint32_t x = width / 3, y = height / 3;
+				xdpw_convert_set_simd(false);
+				bool ok = xdpw_convert_pack(pack_formats[f], src, src_stride, scalar, dst_stride,
+					x, y, width - x, height - y);
+				xdpw_convert_set_simd(true);
+				ok = ok && xdpw_convert_pack(pack_formats[f], src, src_stride, simd, dst_stride,
+					x, y, width - x, height - y);
+				assert(ok);
+				if (memcmp(scalar, simd, dst_size) != 0) {
+					fprintf(stderr, "%s pack differs from scalar: %.4s, %ux%u, "
+						"%u bytes padding\n", xdpw_convert_impl_name(),
+						(const char *)&pack_formats[f], width, height, paddings[p]);
+					abort();
+				}
+				free(src);
+				free(scalar);
+				free(simd);
+			}
+		}
+	}
+}
+
+int main(void) {
+	xdpw_convert_set_simd(true);
+	printf("testing %s against scalar\n", xdpw_convert_impl_name());
+
+	test_yuv(DRM_FORMAT_NV12);
+	test_yuv(DRM_FORMAT_YUV420);
+	test_known_colors();
+	test_pack();
+	return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * Captures an output of the fake compositor through ext-image-copy-capture,
+ * over a real Wayland connection. PipeWire is replaced by the stand-ins
+ * below: the stream negotiates whatever the session offers and hands out two
+ * shm buffers in turn.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <wayland-client.h>
+
+#include "fake_compositor.h"
+#include "logger.h"
+#include "pipewire_screencast.h"
+#include "screencast.h"
+#include "simulcast.h"
+#include "wlr_screencast.h"
+#include "xdpw.h"
+
+#define TEST_BUFFERS 2
+
+struct test {
+	struct xdpw_state state;
+	struct xdpw_config config;
+	struct fake_compositor *comp;
+
+	// the negotiated stream
+	struct xdpw_screencopy_frame_info frame_info;
+	struct pw_buffer buffers[TEST_BUFFERS];
+	bool dequeued[TEST_BUFFERS];
+	int next_buffer;
+
+	int streams;
+	int renegotiations;
+	int frames_sent;
+	int frames_failed;
+	struct xdpw_damage last_damage; // of the last frame sent
+};
+
+static struct test test;
+
+static void test_drop_buffers(struct xdpw_screencast_instance *cast) {
+	for (int i = 0; i < TEST_BUFFERS; i++) {
+		assert(!test.dequeued[i]);
+		struct xdpw_buffer *buffer = test.buffers[i].user_data;
+		if (buffer) {
+			wl_list_remove(&buffer->link);
+			xdpw_buffer_destroy(buffer);
+			test.buffers[i].user_data = NULL;
+		}
+	}
+}
+
+// takes the constraints of the session as they are, buffers are recreated
+static void test_negotiate(struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencopy_frame_info *frame_info = &cast->screencopy_frame_info[WL_SHM];
+	uint32_t width, height;
+	xdpw_stream_size(cast, frame_info, &width, &height);
+	cast->buffer_type = WL_SHM;
+	cast->pwr_format.format = xdpw_format_pw_from_drm_fourcc(frame_info->format);
+	cast->pwr_format.size = SPA_RECTANGLE(width, height);
+	test.frame_info = *frame_info;
+	test_drop_buffers(cast);
+}
+
+// the PipeWire stand-ins, captures are started by the test only
+
+void xdpw_pwr_trigger_process(struct xdpw_screencast_instance *cast) {
+}
+
+bool xdpw_pwr_is_driving(struct xdpw_screencast_instance *cast) {
+	return false;
+}
+
+void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	frame->pw_buffer = NULL;
+	frame->xdpw_buffer = NULL;
+	for (int n = 0; n < TEST_BUFFERS; n++) {
+		int i = (test.next_buffer + n) % TEST_BUFFERS;
+		if (test.dequeued[i]) {
+			continue;
+		}
+		if (!test.buffers[i].user_data) {
+			struct xdpw_buffer *buffer = xdpw_buffer_create(cast, WL_SHM, &test.frame_info);
+			assert(buffer);
+			wl_list_insert(&cast->buffer_list, &buffer->link);
+			test.buffers[i].user_data = buffer;
+		}
+		test.dequeued[i] = true;
+		test.next_buffer = (i + 1) % TEST_BUFFERS;
+		frame->pw_buffer = &test.buffers[i];
+		frame->xdpw_buffer = test.buffers[i].user_data;
+		return;
+	}
+}
+
+// keeps the buffer age tracking of pwr_update_buffer_damage()
+void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	struct xdpw_buffer *buffer;
+	if (frame->state == XDPW_FRAME_STATE_SUCCESS) {
+		test.frames_sent++;
+		test.last_damage = frame->damage;
+		wl_list_for_each(buffer, &cast->buffer_list, link) {
+			xdpw_damage_add_damage(&buffer->damage, &frame->damage);
+		}
+		xdpw_damage_clear(&frame->xdpw_buffer->damage);
+	} else {
+		test.frames_failed++;
+		wl_list_for_each(buffer, &cast->buffer_list, link) {
+			xdpw_damage_set_full(&buffer->damage, buffer->width, buffer->height);
+		}
+	}
+	test.dequeued[frame->pw_buffer - test.buffers] = false;
+	frame->pw_buffer = NULL;
+}
+
+void xdpw_pwr_copy_cancel(struct xdpw_screencast_instance *cast) {
+}
+
+void xdpw_pwr_skip_frame(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+}
+
+void xdpw_pwr_hold_buffer(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *buffer) {
+	assert(cast->held_count < XDPW_MAX_HELD_BUFFERS);
+	cast->held_buffers[cast->held_count++] = buffer;
+}
+
+void pwr_update_stream_param(struct xdpw_screencast_instance *cast) {
+	test.renegotiations++;
+	test_negotiate(cast);
+}
+
+void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast) {
+	static char stream;
+	test.streams++;
+	cast->stream = (struct pw_stream *)&stream;
+	test_negotiate(cast);
+}
+
+void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast) {
+	for (int i = 0; i < TEST_BUFFERS; i++) {
+		test.dequeued[i] = false;
+	}
+	cast->held_count = 0;
+	test_drop_buffers(cast);
+	cast->stream = NULL;
+}
+
+int xdpw_pwr_context_create(struct xdpw_state *state) {
+	return 0;
+}
+
+void xdpw_pwr_context_destroy(struct xdpw_state *state) {
+}
+
+bool xdpw_simulcast_enabled(struct xdpw_screencast_instance *cast) {
+	return false;
+}
+
+struct xdpw_simulcast_stream *xdpw_simulcast_stream_create(
+		struct xdpw_screencast_instance *cast, struct xdpw_session *sess) {
+	return NULL;
+}
+
+void xdpw_simulcast_stream_destroy(struct xdpw_simulcast_stream *sc) {
+}
+
+bool xdpw_simulcast_is_streaming(struct xdpw_screencast_instance *cast) {
+	return false;
+}
+
+uint32_t xdpw_simulcast_max_framerate(struct xdpw_screencast_instance *cast) {
+	return 0;
+}
+
+void xdpw_simulcast_update_params(struct xdpw_screencast_instance *cast) {
+}
+
+void xdpw_simulcast_export(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+}
+
+// the compositor answered everything sent so far, and saw the replies
+static void test_sync(void) {
+	for (int i = 0; i < 2; i++) {
+		int ret = wl_display_roundtrip(test.state.wl_display);
+		assert(ret >= 0);
+	}
+}
+
+static void test_capture(struct xdpw_screencast_instance *cast,
+		struct fake_compositor_rect damage) {
+	fake_compositor_set_damage(test.comp, damage);
+	int frames_sent = test.frames_sent;
+
+	xdpw_wlr_frame_start(cast);
+	assert(cast->frame_count == 1);
+	test_sync();
+	assert(cast->frame_count == 0);
+
+	assert(test.frames_sent == frames_sent + 1);
+	assert(test.last_damage.count == 1);
+	struct xdpw_frame_damage *rect = &test.last_damage.rects[0];
+	assert(rect->x == (uint32_t)damage.x && rect->y == (uint32_t)damage.y);
+	assert(rect->width == (uint32_t)damage.width && rect->height == (uint32_t)damage.height);
+}
+
+static bool rect_equal(struct fake_compositor_rect a, struct fake_compositor_rect b) {
+	return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+int main(void) {
+	init_logger(stderr, DEBUG);
+
+	int fds[2];
+	int ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
+	assert(ret == 0);
+	test.comp = fake_compositor_create(fds[0], 640, 480);
+
+	struct xdpw_state *state = &test.state;
+	state->wl_display = wl_display_connect_to_fd(fds[1]);
+	assert(state->wl_display);
+	state->config = &test.config;
+	state->timer_poll_fd = -1;
+	state->subprocess_epoll_fd = -1;
+	state->subprocess_sigchld_fd = -1;
+	state->screencast_cursor_modes = HIDDEN | EMBEDDED | METADATA;
+	wl_list_init(&state->xdpw_sessions);
+	wl_list_init(&state->subprocesses);
+	struct xdpw_screencast_context *ctx = &state->screencast;
+	ctx->state = state;
+	ret = xdpw_wlr_screencopy_init(state);
+	assert(ret == 0);
+
+	// without screencopy everything goes through the capture session
+	assert(ctx->ext_copy_manager && ctx->ext_output_source_manager);
+	assert(!ctx->screencopy_manager);
+	assert(!(state->screencast_cursor_modes & METADATA));
+	struct xdpw_wlr_output *out = xdpw_wlr_output_first(&ctx->output_list);
+	assert(out && strcmp(out->name, FAKE_COMPOSITOR_OUTPUT_NAME) == 0);
+	assert(out->width == 640 && out->height == 480);
+	assert(out->framerate == FAKE_COMPOSITOR_REFRESH / 1000);
+
+	struct xdpw_screencast_instance *cast = calloc(1, sizeof(*cast));
+	assert(cast);
+	struct xdpw_region region = {0};
+	xdpw_screencast_instance_init(ctx, cast, out, NULL, &region, EMBEDDED);
+	assert(cast->ext_capture);
+
+	// the first frame only tells the stream what to offer
+	xdpw_wlr_frame_start(cast);
+	test_sync();
+	assert(test.streams == 1);
+	assert(cast->pwr_format.size.width == 640 && cast->pwr_format.size.height == 480);
+	struct fake_compositor_stats stats = fake_compositor_get_stats(test.comp);
+	assert(stats.sessions == 1 && stats.constraints_sent == 1);
+	assert(stats.captures == 0 && stats.live_frames == 0);
+
+	// the compositor's damage reaches the stream, buffers name what they missed
+	cast->pwr_stream_state = true;
+	struct fake_compositor_rect damage[] = {
+		{ 0, 0, 640, 480 },
+		{ 10, 20, 30, 40 },
+		{ 100, 200, 50, 60 },
+	};
+	struct fake_compositor_rect full = { 0, 0, 640, 480 };
+	for (size_t i = 0; i < sizeof(damage) / sizeof(damage[0]); i++) {
+		test_capture(cast, damage[i]);
+		stats = fake_compositor_get_stats(test.comp);
+		assert(stats.buffer_damage_count == 1);
+		// each buffer is new to the first two frames
+		assert(rect_equal(stats.buffer_damage, i < 2 ? full : damage[i - 1]));
+	}
+	stats = fake_compositor_get_stats(test.comp);
+	assert(stats.sessions == 1 && stats.constraints_sent == 1);
+	assert(stats.captures == 3 && stats.failed_captures == 0);
+	assert(stats.buffer_mismatches == 0);
+	assert(test.renegotiations == 0);
+
+	// new constraints fail the capture and renegotiate the stream
+	fake_compositor_resize(test.comp, 800, 600);
+	xdpw_wlr_frame_start(cast);
+	test_sync();
+	assert(cast->frame_count == 0);
+	assert(test.frames_failed == 1 && test.renegotiations == 1);
+	assert(cast->pwr_format.size.width == 800 && cast->pwr_format.size.height == 600);
+	stats = fake_compositor_get_stats(test.comp);
+	assert(stats.sessions == 1 && stats.constraints_sent == 2);
+
+	struct fake_compositor_rect resized = { 0, 0, 800, 600 };
+	test_capture(cast, resized);
+	stats = fake_compositor_get_stats(test.comp);
+	assert(stats.captures == 4 && stats.buffer_mismatches == 0);
+	assert(stats.buffer_width == 800 && stats.buffer_height == 600);
+	assert(stats.buffer_damage_count == 1 && rect_equal(stats.buffer_damage, resized));
+	assert(stats.sessions == 1 && stats.constraints_sent == 2);
+
+	// no session holds the instance
+	cast->refcount = 0;
+	xdpw_screencast_instance_destroy(cast);
+	test_sync();
+	stats = fake_compositor_get_stats(test.comp);
+	assert(stats.live_sessions == 0 && stats.live_frames == 0);
+
+	xdpw_wlr_screencopy_finish(ctx);
+	xdpw_timers_finish(state);
+	wl_display_disconnect(state->wl_display);
+	fake_compositor_destroy(test.comp);
+	return 0;
+}
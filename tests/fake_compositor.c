@@ -0,0 +1,375 @@
+#define _POSIX_C_SOURCE 200809L
+#include "fake_compositor.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+
+#include "ext-image-capture-source-v1-server-protocol.h"
+#include "ext-image-copy-capture-v1-server-protocol.h"
+#include "xdg-output-unstable-v1-server-protocol.h"
+
+struct fake_compositor {
+	struct wl_display *display;
+	pthread_t thread;
+
+	// everything below is shared with the test
+	pthread_mutex_t lock;
+	struct wl_list sessions; // fake_session::link
+	uint32_t width;
+	uint32_t height;
+	bool resize_pending;
+	uint32_t next_width;
+	uint32_t next_height;
+	struct fake_compositor_rect damage;
+	struct fake_compositor_stats stats;
+};
+
+struct fake_session {
+	struct fake_compositor *comp;
+	struct wl_resource *resource;
+	struct wl_list link;
+};
+
+struct fake_frame {
+	struct fake_compositor *comp;
+	struct wl_resource *resource;
+	struct wl_resource *buffer;
+	int damage_count;
+	struct fake_compositor_rect damage; // the first damage_buffer request
+	bool captured;
+};
+
+static void handle_destroy(struct wl_client *client, struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+// called with the lock held
+static void session_send_constraints(struct fake_session *session) {
+	struct fake_compositor *comp = session->comp;
+	ext_image_copy_capture_session_v1_send_buffer_size(session->resource,
+		comp->width, comp->height);
+	ext_image_copy_capture_session_v1_send_shm_format(session->resource,
+		WL_SHM_FORMAT_XRGB8888);
+	ext_image_copy_capture_session_v1_send_done(session->resource);
+	comp->stats.constraints_sent++;
+}
+
+static void frame_handle_attach_buffer(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *buffer) {
+	struct fake_frame *frame = wl_resource_get_user_data(resource);
+	frame->buffer = buffer;
+}
+
+static void frame_handle_damage_buffer(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct fake_frame *frame = wl_resource_get_user_data(resource);
+	if (frame->damage_count++ == 0) {
+		frame->damage = (struct fake_compositor_rect) { x, y, width, height };
+	}
+}
+
+static bool frame_buffer_matches(struct fake_compositor *comp, struct wl_shm_buffer *buffer) {
+	return buffer &&
+		wl_shm_buffer_get_width(buffer) == (int32_t)comp->width &&
+		wl_shm_buffer_get_height(buffer) == (int32_t)comp->height &&
+		wl_shm_buffer_get_format(buffer) == WL_SHM_FORMAT_XRGB8888 &&
+		wl_shm_buffer_get_stride(buffer) >= (int32_t)comp->width * 4;
+}
+
+// frames are copied right away, the content doesn't matter
+static void frame_handle_capture(struct wl_client *client, struct wl_resource *resource) {
+	struct fake_frame *frame = wl_resource_get_user_data(resource);
+	struct fake_compositor *comp = frame->comp;
+
+	if (frame->captured) {
+		wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_ALREADY_CAPTURED,
+			"frame was captured already");
+		return;
+	}
+	if (!frame->buffer) {
+		wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_NO_BUFFER,
+			"no buffer attached");
+		return;
+	}
+	frame->captured = true;
+
+	pthread_mutex_lock(&comp->lock);
+	if (comp->resize_pending) {
+		comp->resize_pending = false;
+		comp->width = comp->next_width;
+		comp->height = comp->next_height;
+		struct fake_session *session;
+		wl_list_for_each(session, &comp->sessions, link) {
+			session_send_constraints(session);
+		}
+		comp->stats.failed_captures++;
+		pthread_mutex_unlock(&comp->lock);
+		ext_image_copy_capture_frame_v1_send_failed(resource,
+			EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS);
+		return;
+	}
+
+	struct wl_shm_buffer *buffer = wl_shm_buffer_get(frame->buffer);
+	if (buffer) {
+		comp->stats.buffer_width = wl_shm_buffer_get_width(buffer);
+		comp->stats.buffer_height = wl_shm_buffer_get_height(buffer);
+	}
+	comp->stats.buffer_damage_count = frame->damage_count;
+	comp->stats.buffer_damage = frame->damage;
+	if (!frame_buffer_matches(comp, buffer)) {
+		comp->stats.buffer_mismatches++;
+		comp->stats.failed_captures++;
+		pthread_mutex_unlock(&comp->lock);
+		ext_image_copy_capture_frame_v1_send_failed(resource,
+			EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS);
+		return;
+	}
+	comp->stats.captures++;
+	struct fake_compositor_rect damage = comp->damage;
+	pthread_mutex_unlock(&comp->lock);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t sec = now.tv_sec;
+	ext_image_copy_capture_frame_v1_send_transform(resource, WL_OUTPUT_TRANSFORM_NORMAL);
+	ext_image_copy_capture_frame_v1_send_damage(resource,
+		damage.x, damage.y, damage.width, damage.height);
+	ext_image_copy_capture_frame_v1_send_presentation_time(resource,
+		sec >> 32, sec & 0xffffffff, now.tv_nsec);
+	ext_image_copy_capture_frame_v1_send_ready(resource);
+}
+
+static const struct ext_image_copy_capture_frame_v1_interface frame_impl = {
+	.destroy = handle_destroy,
+	.attach_buffer = frame_handle_attach_buffer,
+	.damage_buffer = frame_handle_damage_buffer,
+	.capture = frame_handle_capture,
+};
+
+static void frame_handle_resource_destroy(struct wl_resource *resource) {
+	struct fake_frame *frame = wl_resource_get_user_data(resource);
+	pthread_mutex_lock(&frame->comp->lock);
+	frame->comp->stats.live_frames--;
+	pthread_mutex_unlock(&frame->comp->lock);
+	free(frame);
+}
+
+static void session_handle_create_frame(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct fake_session *session = wl_resource_get_user_data(resource);
+	struct fake_frame *frame = calloc(1, sizeof(*frame));
+	assert(frame);
+	frame->comp = session->comp;
+	frame->resource = wl_resource_create(client, &ext_image_copy_capture_frame_v1_interface,
+		wl_resource_get_version(resource), id);
+	assert(frame->resource);
+	wl_resource_set_implementation(frame->resource, &frame_impl, frame,
+		frame_handle_resource_destroy);
+
+	pthread_mutex_lock(&frame->comp->lock);
+	frame->comp->stats.live_frames++;
+	pthread_mutex_unlock(&frame->comp->lock);
+}
+
+static const struct ext_image_copy_capture_session_v1_interface session_impl = {
+	.create_frame = session_handle_create_frame,
+	.destroy = handle_destroy,
+};
+
+static void session_handle_resource_destroy(struct wl_resource *resource) {
+	struct fake_session *session = wl_resource_get_user_data(resource);
+	pthread_mutex_lock(&session->comp->lock);
+	wl_list_remove(&session->link);
+	session->comp->stats.live_sessions--;
+	pthread_mutex_unlock(&session->comp->lock);
+	free(session);
+}
+
+static void manager_handle_create_session(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *source,
+		uint32_t options) {
+	struct fake_compositor *comp = wl_resource_get_user_data(resource);
+	struct fake_session *session = calloc(1, sizeof(*session));
+	assert(session);
+	session->comp = comp;
+	session->resource = wl_resource_create(client, &ext_image_copy_capture_session_v1_interface,
+		wl_resource_get_version(resource), id);
+	assert(session->resource);
+	wl_resource_set_implementation(session->resource, &session_impl, session,
+		session_handle_resource_destroy);
+
+	pthread_mutex_lock(&comp->lock);
+	wl_list_insert(&comp->sessions, &session->link);
+	comp->stats.sessions++;
+	comp->stats.live_sessions++;
+	session_send_constraints(session);
+	pthread_mutex_unlock(&comp->lock);
+}
+
+static void manager_handle_create_pointer_cursor_session(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *source,
+		struct wl_resource *pointer) {
+	wl_client_post_implementation_error(client, "cursor sessions aren't faked");
+}
+
+static const struct ext_image_copy_capture_manager_v1_interface manager_impl = {
+	.create_session = manager_handle_create_session,
+	.create_pointer_cursor_session = manager_handle_create_pointer_cursor_session,
+	.destroy = handle_destroy,
+};
+
+static void manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&ext_image_copy_capture_manager_v1_interface, version, id);
+	assert(resource);
+	wl_resource_set_implementation(resource, &manager_impl, data, NULL);
+}
+
+static const struct ext_image_capture_source_v1_interface source_impl = {
+	.destroy = handle_destroy,
+};
+
+static void source_manager_handle_create_source(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *output) {
+	struct wl_resource *source = wl_resource_create(client,
+		&ext_image_capture_source_v1_interface, wl_resource_get_version(resource), id);
+	assert(source);
+	wl_resource_set_implementation(source, &source_impl, NULL, NULL);
+}
+
+static const struct ext_output_image_capture_source_manager_v1_interface source_manager_impl = {
+	.create_source = source_manager_handle_create_source,
+	.destroy = handle_destroy,
+};
+
+static void source_manager_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&ext_output_image_capture_source_manager_v1_interface, version, id);
+	assert(resource);
+	wl_resource_set_implementation(resource, &source_manager_impl, data, NULL);
+}
+
+static void output_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+	struct fake_compositor *comp = data;
+	struct wl_resource *resource = wl_resource_create(client, &wl_output_interface,
+		version, id);
+	assert(resource);
+	wl_resource_set_implementation(resource, NULL, comp, NULL);
+
+	pthread_mutex_lock(&comp->lock);
+	wl_output_send_geometry(resource, 0, 0, 300, 200, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+		"fake", "fake", WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT, comp->width, comp->height,
+		FAKE_COMPOSITOR_REFRESH);
+	pthread_mutex_unlock(&comp->lock);
+}
+
+static const struct zxdg_output_v1_interface xdg_output_impl = {
+	.destroy = handle_destroy,
+};
+
+static void xdg_output_manager_handle_get_xdg_output(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *output) {
+	struct fake_compositor *comp = wl_resource_get_user_data(resource);
+	int version = wl_resource_get_version(resource);
+	struct wl_resource *xdg_output = wl_resource_create(client, &zxdg_output_v1_interface,
+		version, id);
+	assert(xdg_output);
+	wl_resource_set_implementation(xdg_output, &xdg_output_impl, NULL, NULL);
+
+	pthread_mutex_lock(&comp->lock);
+	zxdg_output_v1_send_logical_position(xdg_output, 0, 0);
+	zxdg_output_v1_send_logical_size(xdg_output, comp->width, comp->height);
+	pthread_mutex_unlock(&comp->lock);
+	if (version >= ZXDG_OUTPUT_V1_NAME_SINCE_VERSION) {
+		zxdg_output_v1_send_name(xdg_output, FAKE_COMPOSITOR_OUTPUT_NAME);
+	}
+	if (version < 3) {
+		zxdg_output_v1_send_done(xdg_output);
+	}
+}
+
+static const struct zxdg_output_manager_v1_interface xdg_output_manager_impl = {
+	.destroy = handle_destroy,
+	.get_xdg_output = xdg_output_manager_handle_get_xdg_output,
+};
+
+static void xdg_output_manager_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&zxdg_output_manager_v1_interface, version, id);
+	assert(resource);
+	wl_resource_set_implementation(resource, &xdg_output_manager_impl, data, NULL);
+}
+
+static void *compositor_run(void *data) {
+	struct fake_compositor *comp = data;
+	wl_display_run(comp->display);
+	return NULL;
+}
+
+struct fake_compositor *fake_compositor_create(int fd, uint32_t width, uint32_t height) {
+	struct fake_compositor *comp = calloc(1, sizeof(*comp));
+	assert(comp);
+	pthread_mutex_init(&comp->lock, NULL);
+	wl_list_init(&comp->sessions);
+	comp->width = width;
+	comp->height = height;
+	comp->damage = (struct fake_compositor_rect) { 0, 0, width, height };
+
+	comp->display = wl_display_create();
+	assert(comp->display);
+	int ret = wl_display_init_shm(comp->display);
+	assert(ret == 0);
+	bool ok = wl_global_create(comp->display, &wl_output_interface, 1, comp, output_bind) &&
+		wl_global_create(comp->display, &zxdg_output_manager_v1_interface, 3, comp,
+			xdg_output_manager_bind) &&
+		wl_global_create(comp->display, &ext_image_copy_capture_manager_v1_interface, 1,
+			comp, manager_bind) &&
+		wl_global_create(comp->display, &ext_output_image_capture_source_manager_v1_interface,
+			1, comp, source_manager_bind);
+	assert(ok);
+
+	struct wl_client *client = wl_client_create(comp->display, fd);
+	assert(client);
+	ret = pthread_create(&comp->thread, NULL, compositor_run, comp);
+	assert(ret == 0);
+	return comp;
+}
+
+void fake_compositor_destroy(struct fake_compositor *comp) {
+	wl_display_terminate(comp->display);
+	pthread_join(comp->thread, NULL);
+	wl_display_destroy_clients(comp->display);
+	wl_display_destroy(comp->display);
+	pthread_mutex_destroy(&comp->lock);
+	free(comp);
+}
+
+void fake_compositor_resize(struct fake_compositor *comp, uint32_t width, uint32_t height) {
+	pthread_mutex_lock(&comp->lock);
+	comp->resize_pending = true;
+	comp->next_width = width;
+	comp->next_height = height;
+	pthread_mutex_unlock(&comp->lock);
+}
+
+void fake_compositor_set_damage(struct fake_compositor *comp,
+		struct fake_compositor_rect damage) {
+	pthread_mutex_lock(&comp->lock);
+	comp->damage = damage;
+	pthread_mutex_unlock(&comp->lock);
+}
+
+struct fake_compositor_stats fake_compositor_get_stats(struct fake_compositor *comp) {
+	pthread_mutex_lock(&comp->lock);
+	struct fake_compositor_stats stats = comp->stats;
+	pthread_mutex_unlock(&comp->lock);
+	return stats;
+}
@@ -0,0 +1,50 @@
+#ifndef FAKE_COMPOSITOR_H
+#define FAKE_COMPOSITOR_H
+
+#include <stdint.h>
+
+/*
+ * A compositor with one output, captured through ext-image-copy-capture. It
+ * serves a single client on its own thread, so the client can make blocking
+ * roundtrips.
+ */
+
+#define FAKE_COMPOSITOR_OUTPUT_NAME "FAKE-1"
+#define FAKE_COMPOSITOR_REFRESH 60000 // mHz
+
+struct fake_compositor;
+
+struct fake_compositor_rect {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+struct fake_compositor_stats {
+	int sessions; // created so far
+	int live_sessions;
+	int live_frames;
+	int constraints_sent; // buffer_size, shm_format and done
+	int captures; // ready
+	int failed_captures;
+	int buffer_mismatches; // attached buffers which broke the constraints
+	// the buffer of the last capture, and the damage_buffer requests for it
+	int32_t buffer_width;
+	int32_t buffer_height;
+	int buffer_damage_count;
+	struct fake_compositor_rect buffer_damage; // the first one
+};
+
+// serves the client connected to fd, which is taken over
+struct fake_compositor *fake_compositor_create(int fd, uint32_t width, uint32_t height);
+void fake_compositor_destroy(struct fake_compositor *comp);
+
+// the next capture sends new buffer constraints and fails
+void fake_compositor_resize(struct fake_compositor *comp, uint32_t width, uint32_t height);
+// the damage of the following frames, the whole output by default
+void fake_compositor_set_damage(struct fake_compositor *comp,
+	struct fake_compositor_rect damage);
+struct fake_compositor_stats fake_compositor_get_stats(struct fake_compositor *comp);
+
+#endif
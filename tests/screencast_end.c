@@ -0,0 +1,320 @@
+/*
+ * Drives the compositor events which end a capture and checks that the
+ * sessions sharing the instance are closed before it is destroyed. The
+ * listeners are static, so the Wayland backend is compiled into the test.
+ * Protocol objects stay NULL, the events are called directly. PipeWire is
+ * replaced by the stand-ins below, the portal's bus is a peer-to-peer
+ * connection to the test.
+ */
+#include "../src/screencast/wlr_screencast.c"
+
+#include <sys/socket.h>
+
+struct test {
+	struct xdpw_state state;
+	struct xdpw_config config;
+	struct xdpw_wlr_output output;
+	sd_bus *portal_bus;
+	sd_bus *frontend_bus;
+	int closed_signals;
+	int destroyed_streams;
+};
+
+// the PipeWire stand-ins, the stream runs but never asks for a frame
+
+void xdpw_pwr_trigger_process(struct xdpw_screencast_instance *cast) {
+}
+
+bool xdpw_pwr_is_driving(struct xdpw_screencast_instance *cast) {
+	return true;
+}
+
+void xdpw_pwr_dequeue_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	frame->pw_buffer = NULL;
+	frame->xdpw_buffer = NULL;
+}
+
+void xdpw_pwr_enqueue_buffer(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+	frame->pw_buffer = NULL;
+}
+
+void xdpw_pwr_copy_cancel(struct xdpw_screencast_instance *cast) {
+}
+
+void xdpw_pwr_skip_frame(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+}
+
+void xdpw_pwr_hold_buffer(struct xdpw_screencast_instance *cast,
+		struct pw_buffer *buffer) {
+	assert(cast->held_count < XDPW_MAX_HELD_BUFFERS);
+	cast->held_buffers[cast->held_count++] = buffer;
+}
+
+void pwr_update_stream_param(struct xdpw_screencast_instance *cast) {
+}
+
+void xdpw_pwr_stream_create(struct xdpw_screencast_instance *cast) {
+}
+
+void xdpw_pwr_stream_destroy(struct xdpw_screencast_instance *cast) {
+	struct test *test = wl_container_of(cast->ctx->state, test, state);
+	test->destroyed_streams++;
+}
+
+int xdpw_pwr_context_create(struct xdpw_state *state) {
+	return 0;
+}
+
+void xdpw_pwr_context_destroy(struct xdpw_state *state) {
+}
+
+bool xdpw_simulcast_enabled(struct xdpw_screencast_instance *cast) {
+	return false;
+}
+
+struct xdpw_simulcast_stream *xdpw_simulcast_stream_create(
+		struct xdpw_screencast_instance *cast, struct xdpw_session *sess) {
+	return NULL;
+}
+
+void xdpw_simulcast_stream_destroy(struct xdpw_simulcast_stream *sc) {
+}
+
+bool xdpw_simulcast_is_streaming(struct xdpw_screencast_instance *cast) {
+	return false;
+}
+
+uint32_t xdpw_simulcast_max_framerate(struct xdpw_screencast_instance *cast) {
+	return 0;
+}
+
+void xdpw_simulcast_update_params(struct xdpw_screencast_instance *cast) {
+}
+
+void xdpw_simulcast_export(struct xdpw_screencast_instance *cast,
+		struct xdpw_frame *frame) {
+}
+
+static int handle_closed(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+	struct test *test = data;
+	test->closed_signals++;
+	return 0;
+}
+
+static sd_bus *bus_open_peer(int fd, bool server) {
+	sd_bus *bus = NULL;
+	int ret = sd_bus_new(&bus);
+	assert(ret >= 0);
+	ret = sd_bus_set_fd(bus, fd, fd);
+	assert(ret >= 0);
+	if (server) {
+		sd_id128_t id = { .qwords = { 1, 1 } };
+		ret = sd_bus_set_server(bus, 1, id);
+		assert(ret >= 0);
+	}
+	ret = sd_bus_set_anonymous(bus, 1);
+	assert(ret >= 0);
+	ret = sd_bus_start(bus);
+	assert(ret >= 0);
+	return bus;
+}
+
+static void test_init(struct test *test) {
+	*test = (struct test) {
+		.state = {
+			.timer_poll_fd = -1,
+			.subprocess_epoll_fd = -1,
+			.subprocess_sigchld_fd = -1,
+		},
+		.output = {
+			.id = 1,
+			.name = "TEST-1",
+			.width = 640,
+			.height = 480,
+			.framerate = 60,
+		},
+	};
+	struct xdpw_state *state = &test->state;
+	state->config = &test->config;
+	wl_list_init(&state->xdpw_sessions);
+	wl_list_init(&state->subprocesses);
+
+	struct xdpw_screencast_context *ctx = &state->screencast;
+	ctx->state = state;
+	ctx->udmabuf_fd = -1;
+	wl_list_init(&ctx->output_list);
+	wl_list_init(&ctx->toplevel_list);
+	wl_list_init(&ctx->screencast_instances);
+	wl_array_init(&ctx->format_modifier_pairs);
+	xdpw_shm_pool_init(&ctx->shm_pool, NULL, false);
+	wl_list_insert(&ctx->output_list, &test->output.link);
+
+	int fds[2];
+	int ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, fds);
+	assert(ret == 0);
+	test->portal_bus = bus_open_peer(fds[0], true);
+	test->frontend_bus = bus_open_peer(fds[1], false);
+	ret = sd_bus_add_match(test->frontend_bus, NULL,
+		"type='signal',interface='org.freedesktop.impl.portal.Session',member='Closed'",
+		handle_closed, test);
+	assert(ret >= 0);
+	state->bus = test->portal_bus;
+}
+
+static void test_finish(struct test *test) {
+	xdpw_shm_pool_finish(&test->state.screencast.shm_pool);
+	wl_array_release(&test->state.screencast.format_modifier_pairs);
+	xdpw_timers_finish(&test->state);
+	sd_bus_flush_close_unref(test->frontend_bus);
+	sd_bus_flush_close_unref(test->portal_bus);
+}
+
+// exchanges messages until the frontend saw the expected signals
+static void test_flush_bus(struct test *test, int closed_signals) {
+	for (int i = 0; i < 100 && test->closed_signals < closed_signals; i++) {
+		while (sd_bus_process(test->portal_bus, NULL) > 0) {
+		}
+		while (sd_bus_process(test->frontend_bus, NULL) > 0) {
+		}
+		sd_bus_wait(test->frontend_bus, 10 * 1000);
+	}
+}
+
+// two sessions share the capture of the output, or of the window if given
+static struct xdpw_screencast_instance *test_share(struct test *test,
+		struct xdpw_toplevel *toplevel) {
+	struct xdpw_screencast_context *ctx = &test->state.screencast;
+	struct xdpw_region region = {0};
+	struct xdpw_session *sess[2];
+	const char *paths[] = {
+		"/org/freedesktop/portal/desktop/session/test/a",
+		"/org/freedesktop/portal/desktop/session/test/b",
+	};
+
+	for (int i = 0; i < 2; i++) {
+		sess[i] = xdpw_session_create(&test->state, test->portal_bus, strdup(paths[i]));
+		assert(sess[i]);
+		bool ok = setup_outputs(ctx, sess[i], &test->output, toplevel, &region, EMBEDDED);
+		assert(ok);
+	}
+	struct xdpw_screencast_instance *cast = sess[0]->screencast_instance;
+	assert(cast && cast == sess[1]->screencast_instance);
+	assert(cast->refcount == 2);
+
+	cast->initialized = true;
+	cast->pwr_stream_state = true;
+	return cast;
+}
+
+static struct xdpw_frame *test_frame_in_flight(struct xdpw_screencast_instance *cast) {
+	assert(cast->frame_count < XDPW_MAX_FRAMES_IN_FLIGHT);
+	struct xdpw_frame *frame = wlr_frame_at(cast, cast->frame_count++);
+	frame->cast = cast;
+	frame->state = XDPW_FRAME_STATE_NONE;
+	xdpw_damage_clear(&frame->damage);
+	return frame;
+}
+
+/*
+ * The instance has to outlive the event which ended it, the sessions are
+ * closed and the instance destroyed once the event loop runs the timers.
+ */
+static void test_expect_end(struct test *test, struct xdpw_screencast_instance *cast) {
+	struct xdpw_screencast_context *ctx = &test->state.screencast;
+	assert(cast->ended);
+	assert(cast->refcount == 2);
+	assert(wl_list_length(&ctx->screencast_instances) == 1);
+	assert(wl_list_length(&test->state.xdpw_sessions) == 2);
+
+	// nothing is captured anymore
+	xdpw_wlr_frame_start(cast);
+	assert(cast->frame_count == 0);
+
+	xdpw_timers_dispatch(&test->state);
+	assert(wl_list_empty(&test->state.xdpw_sessions));
+	assert(wl_list_empty(&ctx->screencast_instances));
+	assert(test->destroyed_streams == 1);
+
+	test_flush_bus(test, 2);
+	assert(test->closed_signals == 2);
+}
+
+static void test_session_stopped(void) {
+	struct test test;
+	test_init(&test);
+	struct xdpw_screencast_instance *cast = test_share(&test, NULL);
+
+	ext_session_stopped(cast, NULL);
+	test_expect_end(&test, cast);
+	test_finish(&test);
+}
+
+static void test_frame_stopped(void) {
+	struct test test;
+	test_init(&test);
+	struct xdpw_screencast_instance *cast = test_share(&test, NULL);
+
+	struct xdpw_frame *frame = test_frame_in_flight(cast);
+	ext_frame_failed(frame, NULL, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED);
+	test_expect_end(&test, cast);
+	test_finish(&test);
+}
+
+static void test_capture_failures(void) {
+	struct test test;
+	test_init(&test);
+	struct xdpw_screencast_instance *cast = test_share(&test, NULL);
+
+	for (int i = 0; i < XDPW_CAPTURE_MAX_FAILURES; i++) {
+		assert(!cast->ended);
+		struct xdpw_frame *frame = test_frame_in_flight(cast);
+		ext_frame_failed(frame, NULL, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_UNKNOWN);
+	}
+	test_expect_end(&test, cast);
+	test_finish(&test);
+}
+
+static void test_window_closed(void) {
+	struct test test;
+	test_init(&test);
+
+	// the handle is destroyed with the window, so it has to be a real proxy
+	int fds[2];
+	int ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
+	assert(ret == 0);
+	struct wl_display *display = wl_display_connect_to_fd(fds[0]);
+	assert(display);
+
+	struct xdpw_toplevel *toplevel = calloc(1, sizeof(*toplevel));
+	assert(toplevel);
+	toplevel->ctx = &test.state.screencast;
+	toplevel->label = strdup("window - test");
+	toplevel->handle = (struct ext_foreign_toplevel_handle_v1 *)wl_proxy_create(
+		(struct wl_proxy *)display, &ext_foreign_toplevel_handle_v1_interface);
+	assert(toplevel->handle);
+	wl_list_insert(&test.state.screencast.toplevel_list, &toplevel->link);
+	struct xdpw_screencast_instance *cast = test_share(&test, toplevel);
+	assert(cast->source_type == WINDOW);
+
+	toplevel_handle_closed(toplevel, NULL);
+	assert(!cast->target_toplevel);
+	assert(wl_list_empty(&test.state.screencast.toplevel_list));
+	test_expect_end(&test, cast);
+
+	test_finish(&test);
+	wl_display_disconnect(display);
+	close(fds[1]);
+}
+
+int main(void) {
+	init_logger(stderr, DEBUG);
+
+	test_session_stopped();
+	test_frame_stopped();
+	test_capture_failures();
+	test_window_closed();
+	return 0;
+}
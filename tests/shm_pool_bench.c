@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client-protocol.h>
+
+#include "fourcc.h"
+#include "logger.h"
+#include "shm_pool.h"
+
+/*
+ * Compares the shm pool with the previous allocation, which created, sized
+ * and mapped a new shm file per buffer. There is no compositor, requests to
+ * it are swallowed by the stubs below, which take precedence over the ones of
+ * libwayland-client.
+ */
+
+#define BUFFERS 4
+#define ROUNDS 3
+
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy, uint32_t opcode,
+		const struct wl_interface *interface, uint32_t version, uint32_t flags, ...) {
+	if (flags & WL_MARSHAL_FLAG_DESTROY) {
+		free(proxy);
+	}
+	// requests creating an object get a dummy proxy
+	return interface ? calloc(1, 1) : NULL;
+}
+
+uint32_t wl_proxy_get_version(struct wl_proxy *proxy) {
+	return 1;
+}
+
+// the shm_open fallback of screencast_common.c, which the old path used
+int anonymous_shm_open(void) {
+	char name[] = "/xdpw-bench-XXXXXX";
+	int retries = 100;
+
+	do {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		long r = ts.tv_nsec;
+		for (int i = 0; i < 6; i++) {
+			name[strlen(name) - 6 + i] = 'A' + (r & 15) + (r & 16) * 2;
+			r >>= 5;
+		}
+		--retries;
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			shm_unlink(name);
+			return fd;
+		}
+	} while (retries > 0 && errno == EEXIST);
+
+	return -1;
+}
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+struct cycle {
+	double alloc;
+	double frames; // writing the first frame into every buffer
+};
+
+static struct cycle old_cycle(uint32_t width, uint32_t height) {
+	size_t size = (size_t)width * 4 * height;
+	int fds[BUFFERS];
+	uint8_t *data[BUFFERS];
+
+	double start = now_ms();
+	for (int i = 0; i < BUFFERS; i++) {
+		fds[i] = anonymous_shm_open();
+		assert(fds[i] >= 0);
+		int ret = ftruncate(fds[i], size);
+		assert(ret == 0);
+		data[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+		assert(data[i] != MAP_FAILED);
+	}
+	double allocated = now_ms();
+	for (int i = 0; i < BUFFERS; i++) {
+		memset(data[i], i, size);
+	}
+	struct cycle cycle = { allocated - start, now_ms() - allocated };
+
+	for (int i = 0; i < BUFFERS; i++) {
+		munmap(data[i], size);
+		close(fds[i]);
+	}
+	return cycle;
+}
+
+static struct cycle pool_cycle(struct xdpw_shm_pool *pool, uint32_t width, uint32_t height) {
+	size_t size = (size_t)width * 4 * height;
+	struct xdpw_shm_slot *slots[BUFFERS];
+
+	double start = now_ms();
+	for (int i = 0; i < BUFFERS; i++) {
+		slots[i] = xdpw_shm_pool_alloc(pool, width, height, width * 4, DRM_FORMAT_XRGB8888);
+		assert(slots[i]);
+	}
+	double allocated = now_ms();
+	for (int i = 0; i < BUFFERS; i++) {
+		memset(slots[i]->data, i, size);
+	}
+	struct cycle cycle = { allocated - start, now_ms() - allocated };
+
+	for (int i = 0; i < BUFFERS; i++) {
+		xdpw_shm_slot_release(slots[i]);
+	}
+	return cycle;
+}
+
+static void print_cycle(const char *name, struct cycle start, struct cycle renegotiation) {
+	printf("%-8s start %7.2f ms alloc + %7.2f ms first frames, "
+		"renegotiation %7.2f ms alloc + %7.2f ms first frames\n", name,
+		start.alloc, start.frames, renegotiation.alloc, renegotiation.frames);
+}
+
+int main(void) {
+	// huge pages failing to map is expected, the pool falls back silently
+	init_logger(stderr, QUIET);
+
+	const uint32_t width = 3840, height = 2160;
+	printf("%d buffers of %ux%u\n", BUFFERS, width, height);
+	for (int round = 0; round < ROUNDS; round++) {
+		struct cycle start = old_cycle(width, height);
+		struct cycle renegotiation = old_cycle(width, height);
+		print_cycle("old", start, renegotiation);
+
+		for (int hugepages = 0; hugepages < 2; hugepages++) {
+			struct xdpw_shm_pool pool;
+			xdpw_shm_pool_init(&pool, NULL, hugepages);
+			start = pool_cycle(&pool, width, height);
+			renegotiation = pool_cycle(&pool, width, height);
+			if (!hugepages || pool.hugetlb) {
+				print_cycle(hugepages ? "hugetlb" : "pool", start, renegotiation);
+			}
+			xdpw_shm_pool_finish(&pool);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tile_hash.h"
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void fill(uint8_t *data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		data[i] = rng();
+	}
+}
+
+// the vector hash must match the scalar one for every row length and stride
+static void test_vector_matches_scalar(void) {
+	const uint32_t max_bytes = XDPW_TILE_SIZE * 4 + 15;
+	const uint32_t max_rows = XDPW_TILE_SIZE + 3;
+	uint32_t stride = max_bytes + 13;
+	uint8_t *data = malloc((size_t)stride * max_rows + 16);
+	assert(data);
+	fill(data, (size_t)stride * max_rows + 16);
+
+	for (uint32_t offset = 0; offset < 4; offset++) {
+		for (uint32_t row_bytes = 0; row_bytes <= max_bytes; row_bytes++) {
+			for (uint32_t rows = 1; rows <= max_rows; rows += 7) {
+				uint64_t scalar = xdpw_tile_hash_scalar(data + offset, stride, row_bytes, rows);
+				uint64_t vector = xdpw_tile_hash(data + offset, stride, row_bytes, rows);
+				if (scalar != vector) {
+					fprintf(stderr, "hash mismatch: offset %u, %u bytes, %u rows\n",
+						offset, row_bytes, rows);
+					abort();
+				}
+			}
+		}
+	}
+	free(data);
+}
+
+// a single changed word must change the hash of its tile
+static void test_single_word_change(void) {
+	uint32_t stride = XDPW_TILE_SIZE * 4;
+	uint8_t *data = calloc(XDPW_TILE_SIZE, stride);
+	assert(data);
+	uint64_t base = xdpw_tile_hash(data, stride, stride, XDPW_TILE_SIZE);
+	for (uint32_t i = 0; i < 64; i++) {
+		size_t pos = (size_t)(rng() % (stride * XDPW_TILE_SIZE / 4)) * 4;
+		data[pos] ^= 1 + rng() % 255;
+		assert(xdpw_tile_hash(data, stride, stride, XDPW_TILE_SIZE) != base);
+		memset(data + pos, 0, 4);
+	}
+	free(data);
+}
+
+// the damage pass reports the full frame first, then only changed tiles
+static void test_damage(void) {
+	const uint32_t width = 333, height = 201, bpp = 4;
+	uint32_t stride = width * bpp + 12;
+	uint8_t *data = malloc((size_t)stride * height);
+	assert(data);
+	fill(data, (size_t)stride * height);
+
+	struct xdpw_tile_hash_state state = { 0 };
+	struct xdpw_damage damage = { 0 };
+	assert(xdpw_tile_hash_damage(&state, data, width, height, stride, bpp, &damage));
+	assert(damage.count == 1);
+	assert(damage.rects[0].width == width && damage.rects[0].height == height);
+
+	xdpw_damage_clear(&damage);
+	assert(xdpw_tile_hash_damage(&state, data, width, height, stride, bpp, &damage));
+	assert(xdpw_damage_is_empty(&damage));
+
+	// the padding after each row isn't part of the frame
+	data[width * bpp] ^= 0xff;
+	assert(xdpw_tile_hash_damage(&state, data, width, height, stride, bpp, &damage));
+	assert(xdpw_damage_is_empty(&damage));
+
+	// the last, partial tile
+	data[(size_t)(height - 1) * stride + (width - 1) * bpp] ^= 0xff;
+	assert(xdpw_tile_hash_damage(&state, data, width, height, stride, bpp, &damage));
+	assert(damage.count == 1);
+	struct xdpw_frame_damage *rect = &damage.rects[0];
+	assert(rect->x == 5 * XDPW_TILE_SIZE && rect->y == 3 * XDPW_TILE_SIZE);
+	assert(rect->x + rect->width == width && rect->y + rect->height == height);
+
+	xdpw_tile_hash_finish(&state);
+	free(data);
+}
+
+int main(void) {
+	test_vector_matches_scalar();
+	test_single_word_change();
+	test_damage();
+	return 0;
+}
@@ -0,0 +1,60 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tile_hash.h"
+
+#define ITERATIONS 50
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// times the damage pass over an unchanged and over a fully changed frame
+static void bench(uint32_t width, uint32_t height) {
+	const uint32_t bpp = 4;
+	uint32_t stride = width * bpp;
+	size_t size = (size_t)stride * height;
+	uint8_t *frames[2] = { malloc(size), malloc(size) };
+	assert(frames[0] && frames[1]);
+	memset(frames[0], 0x40, size);
+	memset(frames[1], 0x80, size);
+
+	struct xdpw_tile_hash_state state = { 0 };
+	struct xdpw_damage damage = { 0 };
+	xdpw_tile_hash_damage(&state, frames[0], width, height, stride, bpp, &damage);
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < ITERATIONS; i++) {
+		xdpw_damage_clear(&damage);
+		xdpw_tile_hash_damage(&state, frames[0], width, height, stride, bpp, &damage);
+	}
+	uint64_t still = now_ns() - start;
+
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS; i++) {
+		xdpw_damage_clear(&damage);
+		xdpw_tile_hash_damage(&state, frames[(i + 1) & 1], width, height, stride, bpp, &damage);
+	}
+	uint64_t changing = now_ns() - start;
+
+	printf("%ux%u: %.3f ms unchanged, %.3f ms changed, %.2f GB/s\n", width, height,
+		still / 1e6 / ITERATIONS, changing / 1e6 / ITERATIONS,
+		(double)size * ITERATIONS / still);
+
+	xdpw_tile_hash_finish(&state);
+	free(frames[0]);
+	free(frames[1]);
+}
+
+int main(void) {
+	bench(1920, 1080);
+	bench(2560, 1440);
+	bench(3840, 2160);
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transform.h"
+
+#define BPP 4
+#define PADDING 0xa5
+
+// odd sizes, and sizes around the tile size of the rotations
+static const uint32_t sizes[][2] = {
+	{ 1, 1 }, { 1, 7 }, { 5, 1 }, { 3, 5 }, { 37, 23 }, { 64, 64 }, { 65, 63 }, { 130, 67 },
+};
+// extra bytes after each row
+static const uint32_t paddings[] = { 0, 4, 28 };
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+struct image {
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint8_t *data;
+};
+
+static uint32_t rng_state = 0x6b8b4567;
+
+static uint32_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static struct image image_create(uint32_t width, uint32_t height, uint32_t padding) {
+	struct image image = {
+		.width = width,
+		.height = height,
+		.stride = width * BPP + padding,
+	};
+	image.data = malloc((size_t)image.stride * height);
+	assert(image.data);
+	memset(image.data, PADDING, (size_t)image.stride * height);
+	return image;
+}
+
+static struct image image_random(uint32_t width, uint32_t height, uint32_t padding) {
+	struct image image = image_create(width, height, padding);
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width * BPP; x++) {
+			image.data[(size_t)y * image.stride + x] = rng();
+		}
+	}
+	return image;
+}
+
+static struct image transform_image(const struct image *src, enum xdpw_transform transform,
+		uint32_t padding) {
+	bool swap = xdpw_transform_swaps(transform);
+	struct image dst = image_create(swap ? src->height : src->width,
+		swap ? src->width : src->height, padding);
+	struct xdpw_frame_damage rect = { 0, 0, src->width, src->height };
+	xdpw_transform_image(transform, src->data, src->stride, src->width, src->height,
+		&rect, dst.data, dst.stride);
+	return dst;
+}
+
+// compares the pixels and requires the padding to be untouched
+static bool image_equal(const struct image *a, const struct image *b) {
+	if (a->width != b->width || a->height != b->height || a->stride != b->stride) {
+		return false;
+	}
+	for (uint32_t y = 0; y < a->height; y++) {
+		const uint8_t *row_a = a->data + (size_t)y * a->stride;
+		const uint8_t *row_b = b->data + (size_t)y * b->stride;
+		if (memcmp(row_a, row_b, a->width * BPP) != 0) {
+			return false;
+		}
+		for (uint32_t x = a->width * BPP; x < a->stride; x++) {
+			if (row_a[x] != PADDING || row_b[x] != PADDING) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void test_compose_invert(void) {
+	for (int t = 0; t < 8; t++) {
+		enum xdpw_transform inverse = xdpw_transform_invert(t);
+		assert(xdpw_transform_compose(t, inverse) == XDPW_TRANSFORM_NORMAL);
+		assert(xdpw_transform_compose(inverse, t) == XDPW_TRANSFORM_NORMAL);
+		assert(xdpw_transform_swaps(t) == xdpw_transform_swaps(inverse));
+	}
+}
+
+// every transform composed with its inverse restores the image
+static void test_round_trip(void) {
+	for (size_t s = 0; s < ARRAY_LEN(sizes); s++) {
+		for (size_t p = 0; p < ARRAY_LEN(paddings); p++) {
+			struct image src = image_random(sizes[s][0], sizes[s][1], paddings[p]);
+			for (int t = 0; t < 8; t++) {
+				// the intermediate image gets another stride
+				struct image turned = transform_image(&src, t, paddings[(p + 1) % 3]);
+				struct image back = transform_image(&turned, xdpw_transform_invert(t),
+					paddings[p]);
+				if (!image_equal(&src, &back)) {
+					fprintf(stderr, "transform %d doesn't round-trip at %ux%u, "
+						"%u bytes padding\n", t, src.width, src.height, paddings[p]);
+					abort();
+				}
+				free(turned.data);
+				free(back.data);
+			}
+			free(src.data);
+		}
+	}
+}
+
+// applying two transforms in a row equals applying their composition
+static void test_compose_image(void) {
+	struct image src = image_random(37, 23, 12);
+	for (int a = 0; a < 8; a++) {
+		for (int b = 0; b < 8; b++) {
+			struct image first = transform_image(&src, a, 0);
+			struct image both = transform_image(&first, b, 8);
+			struct image composed = transform_image(&src, xdpw_transform_compose(a, b), 8);
+			if (!image_equal(&both, &composed)) {
+				fprintf(stderr, "transform %d then %d isn't their composition\n", a, b);
+				abort();
+			}
+			free(first.data);
+			free(both.data);
+			free(composed.data);
+		}
+	}
+	free(src.data);
+}
+
+/*
+ * Transforming a rectangle only writes the transformed rectangle, with the
+ * same pixels a full transform puts there.
+ */
+static void test_rect(void) {
+	struct image src = image_random(130, 67, 4);
+	const struct xdpw_frame_damage rects[] = {
+		{ 0, 0, 1, 1 }, { 129, 66, 1, 1 }, { 3, 5, 70, 40 }, { 64, 0, 66, 67 },
+	};
+	for (int t = 0; t < 8; t++) {
+		struct image full = transform_image(&src, t, 4);
+		for (size_t r = 0; r < ARRAY_LEN(rects); r++) {
+			struct image part = image_create(full.width, full.height, 4);
+			xdpw_transform_image(t, src.data, src.stride, src.width, src.height,
+				&rects[r], part.data, part.stride);
+
+			struct xdpw_frame_damage rect = rects[r];
+			xdpw_transform_rect(&rect, t, src.width, src.height);
+			for (uint32_t y = 0; y < part.height; y++) {
+				for (uint32_t x = 0; x < part.width; x++) {
+					const uint8_t *pixel = part.data + (size_t)y * part.stride + x * BPP;
+					bool inside = x >= rect.x && x < rect.x + rect.width &&
+						y >= rect.y && y < rect.y + rect.height;
+					if (inside) {
+						assert(memcmp(pixel, full.data + (size_t)y * full.stride + x * BPP,
+							BPP) == 0);
+					} else {
+						static const uint8_t untouched[BPP] = {
+							PADDING, PADDING, PADDING, PADDING,
+						};
+						assert(memcmp(pixel, untouched, BPP) == 0);
+					}
+				}
+			}
+			free(part.data);
+		}
+		free(full.data);
+	}
+	free(src.data);
+}
+
+int main(void) {
+	test_compose_invert();
+	test_round_trip();
+	test_compose_image();
+	test_rect();
+	return 0;
+}
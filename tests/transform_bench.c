@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "transform.h"
+
+#define ITERATIONS 20
+
+static const char *names[] = {
+	"normal", "90", "180", "270", "flipped", "flipped-90", "flipped-180", "flipped-270",
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench(uint32_t width, uint32_t height) {
+	uint32_t stride = width * 4;
+	size_t size = (size_t)stride * height;
+	uint8_t *src = malloc(size), *dst = malloc(size);
+	assert(src && dst);
+	memset(src, 0x40, size);
+	memset(dst, 0, size);
+
+	struct xdpw_frame_damage rect = { 0, 0, width, height };
+	for (int t = 0; t < 8; t++) {
+		uint32_t dst_stride = xdpw_transform_swaps(t) ? height * 4 : stride;
+		xdpw_transform_image(t, src, stride, width, height, &rect, dst, dst_stride);
+
+		uint64_t start = now_ns();
+		for (int i = 0; i < ITERATIONS; i++) {
+			xdpw_transform_image(t, src, stride, width, height, &rect, dst, dst_stride);
+		}
+		uint64_t elapsed = now_ns() - start;
+		printf("%ux%u %-11s %6.2f ms, %5.2f GB/s\n", width, height, names[t],
+			elapsed / 1e6 / ITERATIONS, (double)size * ITERATIONS / elapsed);
+	}
+	free(src);
+	free(dst);
+}
+
+int main(void) {
+	bench(1920, 1080);
+	bench(3840, 2160);
+	return 0;
+}
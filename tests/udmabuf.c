@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "udmabuf.h"
+
+// exit code meson treats as a skipped test
+#define SKIP 77
+
+int main(void) {
+	init_logger(stderr, DEBUG);
+
+	int udmabuf_fd = xdpw_udmabuf_open();
+	if (udmabuf_fd < 0) {
+		fprintf(stderr, "udmabuf not available, skipping\n");
+		return SKIP;
+	}
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	// frames are rounded up to whole pages, udmabuf refuses anything else
+	assert(xdpw_udmabuf_create(udmabuf_fd, page_size + 1) < 0);
+
+	size_t size = 4 * page_size;
+	int fd = xdpw_udmabuf_create(udmabuf_fd, size);
+	assert(fd >= 0);
+
+	uint8_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(data != MAP_FAILED);
+	for (size_t i = 0; i < size; i++) {
+		data[i] = i * 31;
+	}
+	munmap(data, size);
+
+	// the content lives in the memfd, a second mapping sees it
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	assert(data != MAP_FAILED);
+	for (size_t i = 0; i < size; i++) {
+		assert(data[i] == (uint8_t)(i * 31));
+	}
+	munmap(data, size);
+
+	close(fd);
+	close(udmabuf_fd);
+	return 0;
+}